@@ -0,0 +1,256 @@
+//! Throughput and latency of the public conversion entry points
+//!
+//! The corpus is not shipped with the crate. Point `RAW_PREVIEW_BENCH_CORPUS`
+//! at a directory holding sample files; the first file of each format found
+//! there (the largest one for JPEG) is benchmarked, and missing formats are
+//! skipped:
+//!
+//! ```text
+//! RAW_PREVIEW_BENCH_CORPUS=~/samples cargo bench --bench pipeline
+//! RAW_PREVIEW_BENCH_CORPUS=~/samples cargo bench --bench pipeline --no-default-features   # SIMD off
+//! RAW_PREVIEW_BENCH_CORPUS=~/samples cargo bench --bench pipeline -- 'bytes_to_vec/nef'   # one case
+//! ```
+//!
+//! Every group reports the peak buffer of one conversion per sample (from
+//! `PipelineStats`) followed by the peak RSS of the process so far. The
+//! RSS high-water mark only grows, so filter to a single case to measure it
+//! in isolation.
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::time::Duration;
+
+use criterion::{BatchSize, BenchmarkId, Criterion, Throughput, criterion_group, criterion_main};
+use raw_preview_rs::{
+    BatchInput, BatchOptions, convert_raw_bytes_to_vec, convert_raw_to_jpeg, last_pipeline_stats,
+    process_batch, process_image_bytes_to_vec, process_image_file, simd_enabled,
+};
+
+/// Formats looked up in the corpus: (label, extensions, RAW)
+const FORMATS: &[(&str, &[&str], bool)] = &[
+    ("cr3", &["cr3"], true),
+    ("nef", &["nef"], true),
+    ("arw", &["arw"], true),
+    ("raf", &["raf"], true),
+    ("dng", &["dng"], true),
+    ("jpeg", &["jpg", "jpeg"], false),
+    ("png", &["png"], false),
+    ("tiff", &["tif", "tiff"], false),
+];
+
+struct Sample {
+    label: &'static str,
+    path: PathBuf,
+    bytes: Vec<u8>,
+    is_raw: bool,
+}
+
+fn has_extension(path: &Path, extensions: &[&str]) -> bool {
+    path.extension()
+        .and_then(|ext| ext.to_str())
+        .is_some_and(|ext| extensions.iter().any(|e| ext.eq_ignore_ascii_case(e)))
+}
+
+fn load_corpus() -> Vec<Sample> {
+    let Some(dir) = std::env::var_os("RAW_PREVIEW_BENCH_CORPUS") else {
+        eprintln!("RAW_PREVIEW_BENCH_CORPUS is not set, nothing to benchmark");
+        return Vec::new();
+    };
+    let mut files: Vec<PathBuf> = match fs::read_dir(&dir) {
+        Ok(entries) => entries.filter_map(|e| e.ok()).map(|e| e.path()).collect(),
+        Err(e) => {
+            eprintln!("Cannot read {}: {}", PathBuf::from(&dir).display(), e);
+            return Vec::new();
+        }
+    };
+    files.sort();
+
+    let mut samples = Vec::new();
+    for &(label, extensions, is_raw) in FORMATS {
+        let candidates = files.iter().filter(|p| has_extension(p, extensions));
+        // "Large JPEG": take the biggest one, otherwise the first
+        let path = if label == "jpeg" {
+            candidates.max_by_key(|p| fs::metadata(p).map(|m| m.len()).unwrap_or(0))
+        } else {
+            candidates.min()
+        };
+        let Some(path) = path else {
+            eprintln!("No {} file in the corpus, skipping", label);
+            continue;
+        };
+        match fs::read(path) {
+            Ok(bytes) => samples.push(Sample {
+                label,
+                path: path.clone(),
+                bytes,
+                is_raw,
+            }),
+            Err(e) => eprintln!("Cannot read {}: {}", path.display(), e),
+        }
+    }
+    samples
+}
+
+fn convert_bytes(sample: &Sample) -> Result<Vec<u8>, String> {
+    let (jpeg, _) = if sample.is_raw {
+        convert_raw_bytes_to_vec(&sample.bytes)?
+    } else {
+        process_image_bytes_to_vec(&sample.bytes)?
+    };
+    Ok(jpeg)
+}
+
+/// Peak resident set size of the process in KiB (Linux only)
+fn peak_rss_kib() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|l| l.starts_with("VmHWM:"))?;
+    line.split_whitespace().nth(1)?.parse().ok()
+}
+
+fn report_memory(group: &str, samples: &[Sample]) {
+    for sample in samples {
+        if convert_bytes(sample).is_ok() {
+            let stats = last_pipeline_stats();
+            eprintln!(
+                "{}/{}: peak buffer {} KiB, {} KiB allocated per conversion",
+                group,
+                sample.label,
+                stats.peak_buffer_bytes / 1024,
+                stats.bytes_allocated / 1024
+            );
+        }
+    }
+    match peak_rss_kib() {
+        Some(kib) => eprintln!("{}: peak RSS so far {} KiB", group, kib),
+        None => eprintln!("{}: peak RSS not available on this platform", group),
+    }
+}
+
+// In-memory entry points: convert_raw_bytes_to_vec / process_image_bytes_to_vec
+fn bench_bytes_to_vec(c: &mut Criterion) {
+    let samples = load_corpus();
+    if samples.is_empty() {
+        return;
+    }
+
+    eprintln!(
+        "Native libraries built with SIMD {}",
+        if simd_enabled() { "on" } else { "off" }
+    );
+    let mut group = c.benchmark_group("bytes_to_vec");
+    group.measurement_time(Duration::from_secs(10));
+    for sample in &samples {
+        if let Err(e) = convert_bytes(sample) {
+            eprintln!(
+                "{} fails to convert, skipping: {}",
+                sample.path.display(),
+                e
+            );
+            continue;
+        }
+        group.throughput(Throughput::Bytes(sample.bytes.len() as u64));
+        group.bench_with_input(
+            BenchmarkId::from_parameter(sample.label),
+            sample,
+            |b, sample| b.iter(|| convert_bytes(sample).unwrap()),
+        );
+    }
+    group.finish();
+    report_memory("bytes_to_vec", &samples);
+}
+
+// File-path entry points: convert_raw_to_jpeg / process_image_file
+fn bench_file_paths(c: &mut Criterion) {
+    let samples = load_corpus();
+    if samples.is_empty() {
+        return;
+    }
+
+    let output = std::env::temp_dir().join(format!("raw_preview_bench_{}.jpg", std::process::id()));
+    let output_path = output.to_string_lossy().into_owned();
+    let mut group = c.benchmark_group("file_path");
+    group.measurement_time(Duration::from_secs(10));
+    for sample in &samples {
+        let input = sample.path.to_string_lossy().into_owned();
+        let convert = |input: &str| {
+            if sample.is_raw {
+                convert_raw_to_jpeg(input, &output_path)
+            } else {
+                process_image_file(input, &output_path)
+            }
+        };
+        if let Err(e) = convert(&input) {
+            eprintln!(
+                "{} fails to convert, skipping: {}",
+                sample.path.display(),
+                e
+            );
+            continue;
+        }
+        group.throughput(Throughput::Bytes(sample.bytes.len() as u64));
+        group.bench_with_input(
+            BenchmarkId::from_parameter(sample.label),
+            &input,
+            |b, input| b.iter(|| convert(input).unwrap()),
+        );
+    }
+    group.finish();
+    let _ = fs::remove_file(&output);
+}
+
+// Whole corpus through process_batch on 1 and N worker threads
+fn bench_threads(c: &mut Criterion) {
+    let samples = load_corpus();
+    if samples.is_empty() {
+        return;
+    }
+
+    let max_workers = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let mut worker_counts = vec![1];
+    if max_workers > 1 {
+        worker_counts.push(max_workers);
+    }
+
+    // Several copies of every sample so N workers all have work
+    let copies = 2 * max_workers;
+    let inputs: Vec<BatchInput> = samples
+        .iter()
+        .flat_map(|sample| {
+            (0..copies).map(move |_| {
+                if sample.is_raw {
+                    BatchInput::RawBytes(sample.bytes.clone())
+                } else {
+                    BatchInput::ImageBytes(sample.bytes.clone())
+                }
+            })
+        })
+        .collect();
+
+    let mut group = c.benchmark_group("threads");
+    group.sample_size(10);
+    group.throughput(Throughput::Elements(inputs.len() as u64));
+    for &workers in &worker_counts {
+        group.bench_with_input(
+            BenchmarkId::from_parameter(workers),
+            &workers,
+            |b, &workers| {
+                // The workers take ownership of the inputs; copy them outside the timing
+                b.iter_batched(
+                    || inputs.clone(),
+                    |inputs| {
+                        let options = BatchOptions {
+                            num_workers: workers,
+                            ..Default::default()
+                        };
+                        process_batch(inputs, options).count()
+                    },
+                    BatchSize::LargeInput,
+                )
+            },
+        );
+    }
+    group.finish();
+    report_memory("threads", &samples);
+}
+
+criterion_group!(benches, bench_bytes_to_vec, bench_file_paths, bench_threads);
+criterion_main!(benches);
@@ -0,0 +1,289 @@
+#include "buffer_pool.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#if !defined(_WIN32)
+#define BUFFER_POOL_MMAP 1
+#include <sys/mman.h>
+#endif
+
+struct ThreadCache;
+
+// Every buffer starts with a header recording how to release it. Its size
+// keeps the returned pointer 64-byte aligned.
+struct BlockHeader {
+    size_t block_size;  // Bytes of the whole block, header included
+    int size_class;     // Index in ThreadCache::free_lists, or -1 for small malloc() blocks
+    int mapped;         // Block comes from mmap() instead of malloc()
+    ThreadCache* owner; // Cache of the allocating thread, which the block returns to
+};
+static const size_t kHeaderSize = 64;
+static_assert(sizeof(BlockHeader) <= kHeaderSize, "BlockHeader must fit in kHeaderSize");
+
+// Blocks of 2^kMinClassShift bytes and more are pooled
+static const int kMinClassShift = 16;
+static const int kClassCount = 48 - kMinClassShift;
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+static const size_t kDefaultMaxCachedBytes = 64 * 1024 * 1024;
+
+static std::atomic<size_t> max_cached_bytes(kDefaultMaxCachedBytes);
+static std::atomic<int> use_hugepages(0);
+
+static BlockHeader* header_of(void* buffer) {
+    return reinterpret_cast<BlockHeader*>(static_cast<unsigned char*>(buffer) - kHeaderSize);
+}
+
+// Smallest class whose block holds size bytes, or -1 below the pooled sizes
+static int size_class_of(size_t size) {
+    if (size < ((size_t)1 << kMinClassShift)) return -1;
+    int shift = kMinClassShift;
+    while (shift < kMinClassShift + kClassCount && ((size_t)1 << shift) < size) shift++;
+    return shift < kMinClassShift + kClassCount ? shift - kMinClassShift : -2;
+}
+
+static BlockHeader* map_block(size_t block_size, int size_class) {
+#ifdef BUFFER_POOL_MMAP
+    // Pages are only backed once touched, so the power-of-two rounding costs
+    // address space rather than memory
+    void* block = mmap(nullptr, block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+    if (use_hugepages.load(std::memory_order_relaxed) && block_size >= kHugePageSize) {
+        madvise(block, block_size, MADV_HUGEPAGE);
+    }
+#endif
+    const int mapped = 1;
+#else
+    void* block = malloc(block_size);
+    if (!block) return nullptr;
+    const int mapped = 0;
+#endif
+    BlockHeader* header = static_cast<BlockHeader*>(block);
+    header->block_size = block_size;
+    header->size_class = size_class;
+    header->mapped = mapped;
+    return header;
+}
+
+static void release_block(BlockHeader* header) {
+#ifdef BUFFER_POOL_MMAP
+    if (header->mapped) {
+        munmap(header, header->block_size);
+        return;
+    }
+#endif
+    free(header);
+}
+
+// Free blocks of one thread, per size class. Blocks released on other
+// threads go to the remote list of the thread that allocated them, which
+// takes them back when its own lists run out, so a producer thread reuses
+// the buffers its consumers release instead of mapping new ones.
+struct ThreadCache {
+    // Owner thread only
+    std::vector<BlockHeader*> free_lists[kClassCount];
+    // Bytes on free_lists; written by the owner, read by releasing threads
+    std::atomic<size_t> cached_bytes;
+    // Blocks released by other threads, under remote_mutex
+    std::mutex remote_mutex;
+    std::vector<BlockHeader*> remote;
+    std::atomic<size_t> remote_bytes;
+    // False once the owner thread has exited, under remote_mutex
+    bool alive = true;
+    // The owner thread plus every block handed out from this cache
+    std::atomic<size_t> references;
+
+    ThreadCache() : cached_bytes(0), remote_bytes(0), references(1) {}
+
+    void release() {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+
+    void trim(size_t limit) {
+        // Largest blocks first: they are the rarest to be reused
+        size_t bytes = cached_bytes.load(std::memory_order_relaxed);
+        for (int c = kClassCount - 1; c >= 0 && bytes > limit; c--) {
+            while (!free_lists[c].empty() && bytes > limit) {
+                BlockHeader* header = free_lists[c].back();
+                free_lists[c].pop_back();
+                bytes -= header->block_size;
+                release_block(header);
+            }
+        }
+        cached_bytes.store(bytes, std::memory_order_relaxed);
+    }
+
+    // Moves the blocks other threads released onto the free lists
+    void collect_remote() {
+        if (remote_bytes.load(std::memory_order_relaxed) == 0) return;
+        std::vector<BlockHeader*> blocks;
+        {
+            std::lock_guard<std::mutex> lock(remote_mutex);
+            blocks.swap(remote);
+            remote_bytes.store(0, std::memory_order_relaxed);
+        }
+        size_t bytes = cached_bytes.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            BlockHeader* header = blocks[i];
+            try {
+                free_lists[header->size_class].push_back(header);
+                bytes += header->block_size;
+            } catch (const std::bad_alloc&) {
+                release_block(header);
+            }
+        }
+        cached_bytes.store(bytes, std::memory_order_relaxed);
+    }
+
+    // Called by the owner thread as it exits
+    void retire() {
+        std::vector<BlockHeader*> blocks;
+        {
+            std::lock_guard<std::mutex> lock(remote_mutex);
+            alive = false;
+            blocks.swap(remote);
+            remote_bytes.store(0, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < blocks.size(); i++) release_block(blocks[i]);
+        trim(0);
+        release();
+    }
+
+    // Takes a block released by another thread; false if it must be
+    // returned to the system instead
+    bool push_remote(BlockHeader* header, size_t limit) {
+        std::lock_guard<std::mutex> lock(remote_mutex);
+        const size_t bytes = remote_bytes.load(std::memory_order_relaxed);
+        if (!alive || cached_bytes.load(std::memory_order_relaxed) + bytes + header->block_size > limit) return false;
+        try {
+            remote.push_back(header);
+        } catch (const std::bad_alloc&) {
+            return false;
+        }
+        remote_bytes.store(bytes + header->block_size, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// The cache of the calling thread, or null while the thread exits (buffers
+// released by later thread_local destructors are returned to the system).
+// The cache outlives its thread while blocks it handed out are in use.
+static ThreadCache* thread_cache() {
+    static thread_local bool destroyed = false;
+    struct Owner {
+        ThreadCache* cache = new ThreadCache();
+        ~Owner() {
+            destroyed = true;
+            cache->retire();
+        }
+    };
+    if (destroyed) return nullptr;
+    static thread_local Owner owner;
+    return owner.cache;
+}
+
+void* pool_alloc(size_t size) {
+    if (size == 0 || size > (size_t)-1 - kHeaderSize) return nullptr;
+    const size_t total = size + kHeaderSize;
+    const int size_class = size_class_of(total);
+
+    BlockHeader* header = nullptr;
+    if (size_class == -1) {
+        header = static_cast<BlockHeader*>(malloc(total));
+        if (!header) return nullptr;
+        header->block_size = total;
+        header->size_class = -1;
+        header->mapped = 0;
+        header->owner = nullptr;
+    } else if (size_class >= 0) {
+        ThreadCache* cache = thread_cache();
+        if (cache && cache->free_lists[size_class].empty()) cache->collect_remote();
+        if (cache && !cache->free_lists[size_class].empty()) {
+            header = cache->free_lists[size_class].back();
+            cache->free_lists[size_class].pop_back();
+            cache->cached_bytes.fetch_sub(header->block_size, std::memory_order_relaxed);
+        } else {
+            header = map_block((size_t)1 << (size_class + kMinClassShift), size_class);
+        }
+        if (header) {
+            header->owner = cache;
+            if (cache) cache->references.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return header ? reinterpret_cast<unsigned char*>(header) + kHeaderSize : nullptr;
+}
+
+void pool_free(void* buffer) {
+    if (!buffer) return;
+    BlockHeader* header = header_of(buffer);
+    if (header->size_class < 0) {
+        free(header);
+        return;
+    }
+
+    const size_t limit = max_cached_bytes.load(std::memory_order_relaxed);
+    ThreadCache* owner = header->owner;
+    header->owner = nullptr;
+    if (!owner) {
+        release_block(header);
+        return;
+    }
+    if (owner != thread_cache()) {
+        // Released on another thread: back to the allocating thread
+        if (header->block_size > limit || !owner->push_remote(header, limit)) release_block(header);
+        owner->release();
+        return;
+    }
+
+    owner->release(); // Never the last reference: the calling thread holds one
+    if (header->block_size > limit) {
+        release_block(header);
+        return;
+    }
+    try {
+        owner->free_lists[header->size_class].push_back(header);
+    } catch (const std::bad_alloc&) {
+        release_block(header);
+        return;
+    }
+    owner->cached_bytes.fetch_add(header->block_size, std::memory_order_relaxed);
+    owner->trim(limit);
+}
+
+void* pool_realloc(void* buffer, size_t size) {
+    if (!buffer) return pool_alloc(size);
+    if (size == 0) {
+        pool_free(buffer);
+        return nullptr;
+    }
+    BlockHeader* header = header_of(buffer);
+    const size_t capacity = header->block_size - kHeaderSize;
+    if (size <= capacity) return buffer; // Still fits its block
+
+    void* grown = pool_alloc(size);
+    if (!grown) return nullptr;
+    memcpy(grown, buffer, size < capacity ? size : capacity);
+    pool_free(buffer);
+    return grown;
+}
+
+extern "C" void raw_preview_configure_buffer_pool(const BufferPoolOptions* options) {
+    max_cached_bytes.store(options ? options->max_cached_bytes : kDefaultMaxCachedBytes, std::memory_order_relaxed);
+    use_hugepages.store(options ? options->use_hugepages : 0, std::memory_order_relaxed);
+}
+
+extern "C" void raw_preview_trim_buffer_pool(void) {
+    if (ThreadCache* cache = thread_cache()) {
+        cache->collect_remote();
+        cache->trim(0);
+    }
+}
+
+extern "C" size_t raw_preview_buffer_pool_cached_bytes(void) {
+    ThreadCache* cache = thread_cache();
+    if (!cache) return 0;
+    return cache->cached_bytes.load(std::memory_order_relaxed) + cache->remote_bytes.load(std::memory_order_relaxed);
+}
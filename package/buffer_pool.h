@@ -0,0 +1,105 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+// Per-thread pool of the large, short-lived buffers of a conversion (decoded
+// pixels, resized and rotated copies, JPEG output) shared by the RAW and
+// image wrappers. Buffers of 64 KiB and more are rounded up to a power of
+// two and, once released on any thread, kept on a free list of the thread
+// that allocated them, so the next conversion on that thread reuses them
+// instead of going back to malloc.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Limits of the pool, applied to every thread
+typedef struct BufferPoolOptions {
+    // Bytes of free buffers a thread keeps for reuse, including those other
+    // threads released; buffers released past it are returned to the system
+    // (0 disables caching)
+    size_t max_cached_bytes;
+    // Non-zero to back new buffers of 2 MiB and more with transparent huge
+    // pages where supported (Linux madvise(MADV_HUGEPAGE))
+    int use_hugepages;
+} BufferPoolOptions;
+
+// Replaces the pool limits; a null pointer restores the defaults (64 MiB
+// per thread, no huge pages). Threads trim their cache on their next release.
+void raw_preview_configure_buffer_pool(const BufferPoolOptions* options);
+
+// Returns every free buffer cached by the calling thread to the system
+void raw_preview_trim_buffer_pool(void);
+
+// Returns the bytes of free buffers cached for the calling thread, including
+// those other threads have released but it has not reused yet
+size_t raw_preview_buffer_pool_cached_bytes(void);
+
+#ifdef __cplusplus
+}
+
+#include <new>
+#include <vector>
+
+// Internal C++ interface, not exported to Rust
+
+/**
+ * Allocates size bytes, 64-byte aligned and uninitialized
+ * @return The buffer, or null on failure (also for size 0)
+ */
+void* pool_alloc(size_t size);
+
+/**
+ * Releases a buffer from pool_alloc() or pool_realloc(); null is ignored
+ * May be called on any thread: the buffer returns to the free list of the
+ * thread that allocated it, or to the system once that thread has exited.
+ */
+void pool_free(void* buffer);
+
+/**
+ * realloc() for pool buffers, for stb_image
+ */
+void* pool_realloc(void* buffer, size_t size);
+
+/**
+ * std::allocator replacement drawing from the pool
+ * Elements are default-initialized, so resize() on a PixelBuffer does not
+ * zero memory that the decoder or resizer is about to overwrite.
+ */
+template <class T>
+struct PoolAllocator {
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template <class U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n > (size_t)-1 / sizeof(T)) throw std::bad_alloc();
+        void* p = pool_alloc(n * sizeof(T));
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { pool_free(p); }
+
+    template <class U>
+    void construct(U* p) { ::new ((void*)p) U; }
+    template <class U, class... Args>
+    void construct(U* p, Args&&... args) { ::new ((void*)p) U(static_cast<Args&&>(args)...); }
+
+    template <class U>
+    struct rebind { typedef PoolAllocator<U> other; };
+};
+
+template <class T, class U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+// Tightly packed 8-bit pixels (or any large byte buffer) from the pool
+typedef std::vector<unsigned char, PoolAllocator<unsigned char> > PixelBuffer;
+
+#endif
+
+#endif // BUFFER_POOL_H
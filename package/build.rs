@@ -48,6 +48,24 @@ const DEPENDENCIES: &[Dependency] = &[
         extract_dir: "tinyxml2-11.0.0",
         target_dir: "tinyxml2",
     },
+    Dependency {
+        name: "libspng",
+        url: "https://github.com/randy408/libspng/archive/refs/tags/v0.7.4.tar.gz",
+        extract_dir: "libspng-0.7.4",
+        target_dir: "libspng",
+    },
+    Dependency {
+        name: "libwebp",
+        url: "https://storage.googleapis.com/downloads.webmproject.org/releases/webp/libwebp-1.4.0.tar.gz",
+        extract_dir: "libwebp-1.4.0",
+        target_dir: "libwebp",
+    },
+    Dependency {
+        name: "libtiff",
+        url: "https://download.osgeo.org/libtiff/tiff-4.6.0.tar.gz",
+        extract_dir: "tiff-4.6.0",
+        target_dir: "libtiff",
+    },
 ];
 
 struct BuildPaths {
@@ -58,6 +76,21 @@ struct BuildPaths {
     tinyxml2_src: String,
     tinyxml2_build: String,
     stb_dir: String,
+    // Optional image decoders (spng, webp and tiff features)
+    spng_src: Option<String>,
+    webp_src: Option<String>,
+    tiff_src: Option<String>,
+    // Installed CUDA toolkit (cuda feature)
+    cuda_root: Option<String>,
+    simd_enabled: bool,
+    openmp_enabled: bool,
+}
+
+// Native image decoders selected through Cargo features
+struct DecoderFeatures {
+    spng: bool,
+    webp: bool,
+    tiff: bool,
 }
 
 fn main() {
@@ -71,6 +104,7 @@ fn main() {
 
     // Detect SIMD feature for native builds. Default: enabled via Cargo feature.
     let simd_enabled = detect_simd_enabled();
+    println!("cargo:rustc-check-cfg=cfg(raw_preview_rs_simd)");
     if simd_enabled {
         println!("cargo:warning=SIMD enabled for native builds");
         // expose a cfg to rust source if needed
@@ -79,11 +113,35 @@ fn main() {
         println!("cargo:warning=SIMD disabled for native builds");
     }
 
+    // OpenMP-parallel LibRaw processing is opt-in via the `openmp` Cargo feature
+    let openmp_enabled = env::var("CARGO_FEATURE_OPENMP").is_ok();
+    println!("cargo:rustc-check-cfg=cfg(raw_preview_rs_openmp)");
+    if openmp_enabled {
+        println!("cargo:warning=OpenMP enabled for LibRaw processing");
+        println!("cargo:rustc-cfg=raw_preview_rs_openmp");
+    }
+
+    // Faster decoders for PNG, WebP and TIFF are opt-in; stb_image stays the fallback
+    let decoders = DecoderFeatures {
+        spng: env::var("CARGO_FEATURE_SPNG").is_ok(),
+        webp: env::var("CARGO_FEATURE_WEBP").is_ok(),
+        tiff: env::var("CARGO_FEATURE_TIFF").is_ok(),
+    };
+
+    // GPU development is opt-in and needs an installed CUDA toolkit
+    let cuda_enabled = env::var("CARGO_FEATURE_CUDA").is_ok();
+
     // Check for required build tools
     check_build_tools();
 
     // Build all dependencies
-    let paths = build_all_dependencies(&out_dir, simd_enabled);
+    let paths = build_all_dependencies(
+        &out_dir,
+        simd_enabled,
+        openmp_enabled,
+        &decoders,
+        cuda_enabled,
+    );
 
     // Configure linking
     configure_linking(&paths);
@@ -96,6 +154,25 @@ fn main() {
     println!("cargo:rerun-if-changed=libraw_wrapper.h");
     println!("cargo:rerun-if-changed=libjpeg_wrapper.cpp");
     println!("cargo:rerun-if-changed=libjpeg_wrapper.h");
+    println!("cargo:rerun-if-changed=preview_options.h");
+    println!("cargo:rerun-if-changed=image_ops.cpp");
+    println!("cargo:rerun-if-changed=image_ops.h");
+    println!("cargo:rerun-if-changed=image_decoders.cpp");
+    println!("cargo:rerun-if-changed=image_decoders.h");
+    println!("cargo:rerun-if-changed=draft_demosaic.cpp");
+    println!("cargo:rerun-if-changed=draft_demosaic.h");
+    println!("cargo:rerun-if-changed=gpu_develop.cu");
+    println!("cargo:rerun-if-changed=gpu_develop.h");
+    println!("cargo:rerun-if-changed=buffer_pool.cpp");
+    println!("cargo:rerun-if-changed=buffer_pool.h");
+    println!("cargo:rerun-if-changed=mapped_file.cpp");
+    println!("cargo:rerun-if-changed=mapped_file.h");
+    println!("cargo:rerun-if-changed=preview_log.cpp");
+    println!("cargo:rerun-if-changed=preview_log.h");
+    println!("cargo:rerun-if-changed=pipeline_stats.cpp");
+    println!("cargo:rerun-if-changed=pipeline_stats.h");
+    println!("cargo:rerun-if-changed=raw_stream.cpp");
+    println!("cargo:rerun-if-changed=raw_stream.h");
     println!("cargo:rerun-if-changed=build.rs");
 }
 
@@ -204,7 +281,13 @@ fn probe_flag_for_language(flag: &str, is_cxx: bool) -> bool {
     ok
 }
 
-fn build_all_dependencies(out_dir: &str, simd_enabled: bool) -> BuildPaths {
+fn build_all_dependencies(
+    out_dir: &str,
+    simd_enabled: bool,
+    openmp_enabled: bool,
+    decoders: &DecoderFeatures,
+    cuda_enabled: bool,
+) -> BuildPaths {
     // --- ZLIB ---
     let zlib_dir = Path::new(out_dir).join("zlib");
     let zlib_src_dir = zlib_dir.join("zlib-1.3");
@@ -217,17 +300,26 @@ fn build_all_dependencies(out_dir: &str, simd_enabled: bool) -> BuildPaths {
     }
 
     // --- LIBRAW ---
-    let libraw_dir = Path::new(out_dir).join("LibRaw");
-    let libraw_lib = libraw_dir.join("lib").join("libraw.a");
+    // The thread-safe library (libraw_r) is always built so that contexts can
+    // run on several threads at once. OpenMP builds live in their own
+    // directory so toggling the feature never reuses a stale library.
+    let libraw_dir_name = if openmp_enabled {
+        "LibRaw-openmp"
+    } else {
+        "LibRaw"
+    };
+    let libraw_dir = Path::new(out_dir).join(libraw_dir_name);
+    let libraw_lib = libraw_dir.join("lib").join("libraw_r.a");
     let libraw_configure = libraw_dir.join("configure");
 
     if !libraw_lib.exists() || !libraw_configure.exists() {
         println!("cargo:warning=Downloading and building LibRaw...");
         download_and_extract_libraw(
             out_dir,
+            libraw_dir_name,
             "https://github.com/LibRaw/LibRaw/archive/refs/tags/0.21.4.tar.gz",
         );
-        build_libraw_with_zlib(&libraw_dir, &zlib_src_dir);
+        build_libraw_with_zlib(&libraw_dir, &zlib_src_dir, openmp_enabled);
     }
 
     // --- LIBJPEG-TURBO ---
@@ -284,6 +376,54 @@ fn build_all_dependencies(out_dir: &str, simd_enabled: bool) -> BuildPaths {
         download_stb_image(&stb_dir);
     }
 
+    // --- LIBSPNG (spng feature) ---
+    // A single C file, compiled with the wrappers against the zlib above
+    let spng_src_dir = Path::new(out_dir).join("libspng").join("libspng-0.7.4");
+    if decoders.spng && !spng_src_dir.join("spng").join("spng.c").exists() {
+        println!("cargo:warning=Downloading libspng...");
+        download_and_extract_spng(
+            &Path::new(out_dir).join("libspng"),
+            "https://github.com/randy408/libspng/archive/refs/tags/v0.7.4.tar.gz",
+        );
+    }
+
+    // --- LIBWEBP (webp feature) ---
+    // SIMD builds live in their own directory, as for LibRaw and OpenMP
+    let webp_dir_name = if simd_enabled {
+        "libwebp"
+    } else {
+        "libwebp-nosimd"
+    };
+    let webp_src_dir = Path::new(out_dir).join(webp_dir_name).join("libwebp-1.4.0");
+    if decoders.webp && !webp_src_dir.join("build").join("libwebpdecoder.a").exists() {
+        println!("cargo:warning=Downloading and building libwebp...");
+        download_and_extract_libwebp(
+            &Path::new(out_dir).join(webp_dir_name),
+            "https://storage.googleapis.com/downloads.webmproject.org/releases/webp/libwebp-1.4.0.tar.gz",
+        );
+        build_libwebp(&webp_src_dir, simd_enabled);
+    }
+
+    // --- LIBTIFF (tiff feature) ---
+    // Built against the zlib and libjpeg-turbo above for Deflate and JPEG compression
+    let tiff_src_dir = Path::new(out_dir).join("libtiff").join("tiff-4.6.0");
+    if decoders.tiff
+        && !tiff_src_dir
+            .join("build")
+            .join("libtiff")
+            .join("libtiff.a")
+            .exists()
+    {
+        println!("cargo:warning=Downloading and building libtiff...");
+        download_and_extract_libtiff(
+            &Path::new(out_dir).join("libtiff"),
+            "https://download.osgeo.org/libtiff/tiff-4.6.0.tar.gz",
+        );
+        build_libtiff(&tiff_src_dir, &zlib_src_dir, &libjpeg_src_dir);
+    }
+
+    let enabled = |on: bool, dir: &Path| on.then(|| dir.display().to_string());
+
     BuildPaths {
         zlib_src: zlib_src_dir.display().to_string(),
         libraw_src: libraw_dir.display().to_string(),
@@ -292,6 +432,12 @@ fn build_all_dependencies(out_dir: &str, simd_enabled: bool) -> BuildPaths {
         tinyxml2_src: tinyxml2_src_dir.display().to_string(),
         tinyxml2_build: tinyxml2_build_dir.display().to_string(),
         stb_dir: stb_dir.display().to_string(),
+        spng_src: enabled(decoders.spng, &spng_src_dir),
+        webp_src: enabled(decoders.webp, &webp_src_dir),
+        tiff_src: enabled(decoders.tiff, &tiff_src_dir),
+        cuda_root: cuda_enabled.then(find_cuda_toolkit),
+        simd_enabled,
+        openmp_enabled,
     }
 }
 
@@ -304,42 +450,182 @@ fn configure_linking(paths: &BuildPaths) {
     println!("cargo:rustc-link-search=native={}", paths.tinyxml2_build);
 
     // Link statically against libraries
-    println!("cargo:rustc-link-lib=static=raw");
+    println!("cargo:rustc-link-lib=static=raw_r"); // thread-safe LibRaw
     println!("cargo:rustc-link-lib=static=z");
     println!("cargo:rustc-link-lib=static=jpeg");
     println!("cargo:rustc-link-lib=static=turbojpeg");
     println!("cargo:rustc-link-lib=static=TinyEXIF");
     println!("cargo:rustc-link-lib=static=tinyxml2");
+    if let Some(webp_src) = &paths.webp_src {
+        println!("cargo:rustc-link-search=native={}/build", webp_src);
+        println!("cargo:rustc-link-lib=static=webpdecoder");
+    }
+    if let Some(tiff_src) = &paths.tiff_src {
+        println!("cargo:rustc-link-search=native={}/build/libtiff", tiff_src);
+        println!("cargo:rustc-link-lib=static=tiff");
+    }
     println!("cargo:rustc-link-lib=m"); // math library
     println!("cargo:rustc-link-lib=c++"); // C++ standard library (macOS)
+
+    if paths.openmp_enabled {
+        // OpenMP runtime: libgomp for GCC, libomp for clang/macOS, MSVC links vcomp itself.
+        // RAW_PREVIEW_RS_OPENMP_LIB overrides the runtime library name.
+        let target_os = env::var("CARGO_CFG_TARGET_OS").unwrap_or_default();
+        let target_env = env::var("CARGO_CFG_TARGET_ENV").unwrap_or_default();
+        let runtime = match env::var("RAW_PREVIEW_RS_OPENMP_LIB") {
+            Ok(lib) => Some(lib),
+            Err(_) if target_env == "msvc" => None,
+            Err(_) if target_os == "macos" => Some("omp".to_string()),
+            Err(_) => Some("gomp".to_string()),
+        };
+        if let Some(runtime) = runtime {
+            println!("cargo:rustc-link-lib={}", runtime);
+        }
+        println!("cargo:rerun-if-env-changed=RAW_PREVIEW_RS_OPENMP_LIB");
+    }
+}
+
+// Compiler flag enabling OpenMP for the configured compiler family
+fn openmp_flag() -> &'static str {
+    if env::var("CARGO_CFG_TARGET_ENV").unwrap_or_default() == "msvc" {
+        "/openmp"
+    } else {
+        "-fopenmp"
+    }
 }
 
 fn compile_wrappers(paths: &BuildPaths) {
-    // Compile LibRaw wrapper
-    cc::Build::new()
+    // Compile LibRaw wrapper (against the thread-safe LibRaw, so no LIBRAW_NOTHREADS)
+    let mut raw_wrapper = cc::Build::new();
+    raw_wrapper
         .cpp(true)
         .file("libraw_wrapper.cpp")
+        .file("raw_stream.cpp")
         .include(&paths.libraw_src)
         .include(&paths.zlib_src)
         .include(&paths.libjpeg_src)
         .flag("-std=c++11")
         .flag("-O3")
-        .flag("-DLIBRAW_NOTHREADS")
-        .flag("-DUSE_ZLIB")
-        .compile("raw_wrapper");
+        .flag("-DUSE_ZLIB");
+    if paths.openmp_enabled {
+        raw_wrapper.flag(openmp_flag());
+    }
+    if paths.cuda_root.is_some() {
+        raw_wrapper.define("RAW_PREVIEW_HAVE_CUDA", None);
+    }
+    raw_wrapper.compile("raw_wrapper");
 
-    // Compile libjpeg wrapper
-    cc::Build::new()
+    // Compile libjpeg wrapper and the image decoder backends
+    let mut jpeg_wrapper = cc::Build::new();
+    jpeg_wrapper
         .cpp(true)
         .file("libjpeg_wrapper.cpp")
+        .file("image_decoders.cpp")
         .include(&paths.libjpeg_src)
         .include(&paths.tinyexif_src)
         .include(&paths.tinyxml2_src)
         .include(&paths.stb_dir)
         .file(format!("{}/TinyEXIF.cpp", paths.tinyexif_src))
         .flag("-std=c++11")
-        .flag("-O3")
-        .compile("jpeg_wrapper");
+        .flag("-O3");
+    if let Some(spng_src) = &paths.spng_src {
+        jpeg_wrapper
+            .include(format!("{}/spng", spng_src))
+            .define("SPNG_STATIC", None)
+            .define("RAW_PREVIEW_HAVE_SPNG", None);
+    }
+    if let Some(webp_src) = &paths.webp_src {
+        jpeg_wrapper
+            .include(format!("{}/src", webp_src))
+            .define("RAW_PREVIEW_HAVE_WEBP", None);
+    }
+    if let Some(tiff_src) = &paths.tiff_src {
+        jpeg_wrapper
+            .include(format!("{}/libtiff", tiff_src))
+            .include(format!("{}/build/libtiff", tiff_src)) // tiffconf.h
+            .define("RAW_PREVIEW_HAVE_TIFF", None);
+    }
+    jpeg_wrapper.compile("jpeg_wrapper");
+
+    // libspng is C, so it gets its own build; it follows the wrapper on the link line
+    if let Some(spng_src) = &paths.spng_src {
+        let mut spng = cc::Build::new();
+        spng.file(format!("{}/spng/spng.c", spng_src))
+            .include(&paths.zlib_src)
+            .define("SPNG_STATIC", None)
+            .flag("-O3");
+        if !paths.simd_enabled {
+            spng.define("SPNG_DISABLE_OPT", None);
+        }
+        spng.compile("spng");
+    }
+
+    // The GPU backend is compiled by nvcc and follows the RAW wrapper on the link line.
+    // RAW_PREVIEW_RS_CUDA_ARCH selects the GPU architecture (e.g. sm_80 or native);
+    // by default nvcc embeds PTX for its default architecture, compiled by the driver at load time.
+    if let Some(cuda_root) = &paths.cuda_root {
+        let mut gpu = cc::Build::new();
+        gpu.cuda(true)
+            .cudart("static")
+            .file("gpu_develop.cu")
+            .include(format!("{}/include", cuda_root))
+            .flag("-std=c++14")
+            .flag("-O3");
+        let nvcc = Path::new(cuda_root).join("bin").join("nvcc");
+        if nvcc.exists() {
+            gpu.compiler(nvcc);
+        }
+        if let Ok(arch) = env::var("RAW_PREVIEW_RS_CUDA_ARCH") {
+            gpu.flag(format!("-arch={}", arch));
+        }
+        println!("cargo:rerun-if-env-changed=RAW_PREVIEW_RS_CUDA_ARCH");
+        gpu.compile("gpu_develop");
+
+        // nvJPEG ships with the toolkit as a shared library
+        let lib_dir = if env::var("CARGO_CFG_TARGET_OS").unwrap_or_default() == "windows" {
+            "lib/x64"
+        } else {
+            "lib64"
+        };
+        println!("cargo:rustc-link-search=native={}/{}", cuda_root, lib_dir);
+        println!("cargo:rustc-link-lib=nvjpeg");
+    }
+
+    // Compile the pixel operations, draft demosaic, buffer pool, file mapping, log sink and statistics shared by both wrappers.
+    // Compiled last so it follows the wrappers that use it on the static link line.
+    let mut image_ops = cc::Build::new();
+    image_ops
+        .cpp(true)
+        .file("image_ops.cpp")
+        .file("draft_demosaic.cpp")
+        .file("buffer_pool.cpp")
+        .file("mapped_file.cpp")
+        .file("preview_log.cpp")
+        .file("pipeline_stats.cpp")
+        .include(&paths.libjpeg_src)
+        .include(format!("{}/build", paths.libjpeg_src)) // jconfig.h for jpeglib.h
+        .flag("-std=c++11")
+        .flag("-O3");
+    if !paths.simd_enabled {
+        image_ops.define("RAW_PREVIEW_NO_SIMD", None);
+    }
+    image_ops.compile("image_ops");
+}
+
+// Root of the CUDA toolkit: CUDA_PATH, CUDA_HOME or /usr/local/cuda
+fn find_cuda_toolkit() -> String {
+    println!("cargo:rerun-if-env-changed=CUDA_PATH");
+    println!("cargo:rerun-if-env-changed=CUDA_HOME");
+    let root = env::var("CUDA_PATH")
+        .or_else(|_| env::var("CUDA_HOME"))
+        .unwrap_or_else(|_| "/usr/local/cuda".to_string());
+    if !Path::new(&root).join("include").join("nvjpeg.h").exists() {
+        panic!(
+            "The cuda feature needs the CUDA toolkit with nvJPEG; none found in {} (set CUDA_PATH)",
+            root
+        );
+    }
+    root
 }
 
 // Download and extraction functions
@@ -408,8 +694,8 @@ fn build_zlib(zlib_src_dir: &Path) {
     }
 }
 
-fn download_and_extract_libraw(out_dir: &str, url: &str) {
-    let target_dir = Path::new(out_dir).join("LibRaw");
+fn download_and_extract_libraw(out_dir: &str, target_name: &str, url: &str) {
+    let target_dir = Path::new(out_dir).join(target_name);
 
     if target_dir.exists() {
         fs::remove_dir_all(&target_dir).expect("Failed to remove existing LibRaw directory");
@@ -443,7 +729,7 @@ fn download_and_extract_libraw(out_dir: &str, url: &str) {
     }
 }
 
-fn build_libraw_with_zlib(libraw_dir: &Path, zlib_src_dir: &Path) {
+fn build_libraw_with_zlib(libraw_dir: &Path, zlib_src_dir: &Path, openmp_enabled: bool) {
     let lib_dir = libraw_dir.join("lib");
     fs::create_dir_all(&lib_dir).expect("Failed to create lib directory");
 
@@ -473,7 +759,11 @@ fn build_libraw_with_zlib(libraw_dir: &Path, zlib_src_dir: &Path) {
         .arg("--disable-shared")
         .arg("--enable-static")
         .arg("--disable-examples")
-        .arg("--disable-openmp")
+        .arg(if openmp_enabled {
+            "--enable-openmp"
+        } else {
+            "--disable-openmp"
+        })
         .arg("--disable-lcms")
         .arg("--disable-jasper")
         .arg("--disable-jpeg")
@@ -494,9 +784,9 @@ fn build_libraw_with_zlib(libraw_dir: &Path, zlib_src_dir: &Path) {
         );
     }
 
-    // Build LibRaw using make
+    // Build the thread-safe LibRaw library using make
     let output = Command::new("make")
-        .arg("lib/libraw.la")
+        .arg("lib/libraw_r.la")
         .current_dir(libraw_dir)
         .output()
         .expect("Failed to execute make command");
@@ -509,23 +799,25 @@ fn build_libraw_with_zlib(libraw_dir: &Path, zlib_src_dir: &Path) {
 
     // Copy the built library to lib directory
     let possible_sources = vec![
-        libraw_dir.join("lib").join(".libs").join("libraw.a"),
-        libraw_dir.join("lib").join("libraw.a"),
-        libraw_dir.join(".libs").join("libraw.a"),
-        libraw_dir.join("libraw.a"),
-        libraw_dir.join("object").join("libraw.a"),
+        libraw_dir.join("lib").join(".libs").join("libraw_r.a"),
+        libraw_dir.join("lib").join("libraw_r.a"),
+        libraw_dir.join(".libs").join("libraw_r.a"),
+        libraw_dir.join("libraw_r.a"),
+        libraw_dir.join("object").join("libraw_r.a"),
     ];
-    let dst_lib = lib_dir.join("libraw.a");
+    let dst_lib = lib_dir.join("libraw_r.a");
     let mut found = false;
     for src in possible_sources {
         if src.exists() {
-            fs::copy(&src, &dst_lib).expect("Failed to copy libraw.a");
+            if src != dst_lib {
+                fs::copy(&src, &dst_lib).expect("Failed to copy libraw_r.a");
+            }
             found = true;
             break;
         }
     }
     if !found {
-        panic!("Could not find built libraw.a library");
+        panic!("Could not find built libraw_r.a library");
     }
 }
 
@@ -754,6 +1046,174 @@ fn build_tinyexif(src_dir: &Path, tinyxml2_build_dir: &Path) {
     }
 }
 
+fn download_and_extract_spng(out_dir: &Path, url: &str) {
+    let spng_extract_dir = out_dir.join("libspng-0.7.4");
+
+    if spng_extract_dir.exists() {
+        fs::remove_dir_all(&spng_extract_dir).expect("Failed to remove existing libspng directory");
+    }
+
+    fs::create_dir_all(out_dir).expect("Failed to create libspng dir");
+    let resp = reqwest::blocking::get(url).expect("Failed to download libspng");
+    if !resp.status().is_success() {
+        panic!("Failed to download libspng: HTTP {}", resp.status());
+    }
+    let response = resp
+        .bytes()
+        .expect("Failed to read libspng download")
+        .to_vec();
+    let tar = flate2::read::GzDecoder::new(std::io::Cursor::new(response));
+    let mut archive = tar::Archive::new(tar);
+    archive.unpack(out_dir).expect("Failed to extract libspng");
+}
+
+fn download_and_extract_libwebp(out_dir: &Path, url: &str) {
+    let webp_extract_dir = out_dir.join("libwebp-1.4.0");
+
+    if webp_extract_dir.exists() {
+        fs::remove_dir_all(&webp_extract_dir).expect("Failed to remove existing libwebp directory");
+    }
+
+    fs::create_dir_all(out_dir).expect("Failed to create libwebp dir");
+    let resp = reqwest::blocking::get(url).expect("Failed to download libwebp");
+    if !resp.status().is_success() {
+        panic!("Failed to download libwebp: HTTP {}", resp.status());
+    }
+    let response = resp
+        .bytes()
+        .expect("Failed to read libwebp download")
+        .to_vec();
+    let tar = flate2::read::GzDecoder::new(std::io::Cursor::new(response));
+    let mut archive = tar::Archive::new(tar);
+    archive.unpack(out_dir).expect("Failed to extract libwebp");
+}
+
+fn build_libwebp(webp_src_dir: &Path, simd_enabled: bool) {
+    let build_dir = webp_src_dir.join("build");
+    fs::create_dir_all(&build_dir).expect("Failed to create build directory for libwebp");
+
+    let output = Command::new("cmake")
+        .arg("..")
+        .arg("-DBUILD_SHARED_LIBS=OFF")
+        .arg("-DCMAKE_POSITION_INDEPENDENT_CODE=ON")
+        .arg(format!(
+            "-DWEBP_ENABLE_SIMD={}",
+            if simd_enabled { "ON" } else { "OFF" }
+        ))
+        .arg("-DWEBP_BUILD_ANIM_UTILS=OFF")
+        .arg("-DWEBP_BUILD_CWEBP=OFF")
+        .arg("-DWEBP_BUILD_DWEBP=OFF")
+        .arg("-DWEBP_BUILD_GIF2WEBP=OFF")
+        .arg("-DWEBP_BUILD_IMG2WEBP=OFF")
+        .arg("-DWEBP_BUILD_VWEBP=OFF")
+        .arg("-DWEBP_BUILD_WEBPINFO=OFF")
+        .arg("-DWEBP_BUILD_WEBPMUX=OFF")
+        .arg("-DWEBP_BUILD_EXTRAS=OFF")
+        .current_dir(&build_dir)
+        .output()
+        .expect("Failed to configure libwebp");
+    if !output.status.success() {
+        panic!(
+            "Failed to configure libwebp: {}",
+            String::from_utf8_lossy(&output.stderr)
+        );
+    }
+
+    // Only the decoder library is needed
+    let output = Command::new("make")
+        .arg("webpdecoder")
+        .current_dir(&build_dir)
+        .output()
+        .expect("Failed to build libwebp");
+    if !output.status.success() {
+        panic!(
+            "Failed to build libwebp: {}",
+            String::from_utf8_lossy(&output.stderr)
+        );
+    }
+}
+
+fn download_and_extract_libtiff(out_dir: &Path, url: &str) {
+    let tiff_extract_dir = out_dir.join("tiff-4.6.0");
+
+    if tiff_extract_dir.exists() {
+        fs::remove_dir_all(&tiff_extract_dir).expect("Failed to remove existing libtiff directory");
+    }
+
+    fs::create_dir_all(out_dir).expect("Failed to create libtiff dir");
+    let resp = reqwest::blocking::get(url).expect("Failed to download libtiff");
+    if !resp.status().is_success() {
+        panic!("Failed to download libtiff: HTTP {}", resp.status());
+    }
+    let response = resp
+        .bytes()
+        .expect("Failed to read libtiff download")
+        .to_vec();
+    let tar = flate2::read::GzDecoder::new(std::io::Cursor::new(response));
+    let mut archive = tar::Archive::new(tar);
+    archive.unpack(out_dir).expect("Failed to extract libtiff");
+}
+
+fn build_libtiff(tiff_src_dir: &Path, zlib_src_dir: &Path, libjpeg_src_dir: &Path) {
+    let build_dir = tiff_src_dir.join("build");
+    fs::create_dir_all(&build_dir).expect("Failed to create build directory for libtiff");
+
+    // Codecs without a bundled library are disabled rather than picked up
+    // from the system, so the static link stays self-contained
+    let output = Command::new("cmake")
+        .arg("..")
+        .arg("-DBUILD_SHARED_LIBS=OFF")
+        .arg("-DCMAKE_POSITION_INDEPENDENT_CODE=ON")
+        .arg("-Dtiff-tools=OFF")
+        .arg("-Dtiff-tests=OFF")
+        .arg("-Dtiff-contrib=OFF")
+        .arg("-Dtiff-docs=OFF")
+        .arg("-Dcxx=OFF")
+        .arg("-Dlibdeflate=OFF")
+        .arg("-Djbig=OFF")
+        .arg("-Dlerc=OFF")
+        .arg("-Dlzma=OFF")
+        .arg("-Dzstd=OFF")
+        .arg("-Dwebp=OFF")
+        .arg("-Dold-jpeg=OFF")
+        .arg(format!("-DZLIB_INCLUDE_DIR={}", zlib_src_dir.display()))
+        .arg(format!(
+            "-DZLIB_LIBRARY={}",
+            zlib_src_dir.join("libz.a").display()
+        ))
+        .arg(format!("-DJPEG_INCLUDE_DIR={}", libjpeg_src_dir.display()))
+        .arg(format!(
+            "-DJPEG_LIBRARY={}",
+            libjpeg_src_dir.join("build").join("libjpeg.a").display()
+        ))
+        // jconfig.h is generated in the libjpeg-turbo build directory
+        .arg(format!(
+            "-DCMAKE_C_FLAGS=-I{}",
+            libjpeg_src_dir.join("build").display()
+        ))
+        .current_dir(&build_dir)
+        .output()
+        .expect("Failed to configure libtiff");
+    if !output.status.success() {
+        panic!(
+            "Failed to configure libtiff: {}",
+            String::from_utf8_lossy(&output.stderr)
+        );
+    }
+
+    let output = Command::new("make")
+        .arg("tiff")
+        .current_dir(&build_dir)
+        .output()
+        .expect("Failed to build libtiff");
+    if !output.status.success() {
+        panic!(
+            "Failed to build libtiff: {}",
+            String::from_utf8_lossy(&output.stderr)
+        );
+    }
+}
+
 fn download_stb_image(stb_dir: &Path) {
     fs::create_dir_all(stb_dir).expect("Failed to create stb dir");
 
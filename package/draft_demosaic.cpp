@@ -0,0 +1,290 @@
+#include "draft_demosaic.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// Vector unit used to sum Bayer rows, chosen as in image_ops.cpp.
+// RAW_PREVIEW_NO_SIMD is set by build.rs when SIMD is disabled.
+#if !defined(RAW_PREVIEW_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DRAFT_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DRAFT_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DRAFT_NEON 1
+#endif
+#endif
+
+static const int kPattern = DRAFT_PATTERN_SIZE;
+
+// Returns true if every bin x bin block of the pattern holds all three colors
+static bool holds_every_color(const DraftRawImage& image, int bin) {
+    for (int by = 0; by < kPattern; by += bin) {
+        for (int bx = 0; bx < kPattern; bx += bin) {
+            int colors = 0;
+            for (int y = by; y < by + bin; y++) {
+                for (int x = bx; x < bx + bin; x++) colors |= 1 << image.color[y][x];
+            }
+            if (colors != 7) return false;
+        }
+    }
+    return true;
+}
+
+bool is_bayer_2x2(const DraftRawImage& image) {
+    for (int y = 0; y < kPattern; y++) {
+        for (int x = 0; x < kPattern; x++) {
+            if (image.color[y][x] != image.color[y & 1][x & 1] || image.black[y][x] != image.black[y & 1][x & 1]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int select_draft_bin(const DraftRawImage& image, int min_width, int min_height) {
+    if (!image.raw || image.width <= 0 || image.height <= 0 || image.pitch < (size_t)image.width) return 0;
+    for (int y = 0; y < kPattern; y++) {
+        for (int x = 0; x < kPattern; x++) {
+            if (image.color[y][x] > 2) return 0;
+        }
+    }
+
+    static const int kCells[] = { 2, 3, 4, 6, 8 };
+    int cell = 0;
+    for (int candidate : kCells) {
+        if (holds_every_color(image, candidate)) {
+            cell = candidate;
+            break;
+        }
+    }
+    if (!cell) return 0;
+
+    // Every cell size divides the pattern size, so a bin of 2 or 4 cells is
+    // made of whole cells and holds every color too. The bin itself need not
+    // divide it (8 doubled twice is 32): samples look up the pattern modulo
+    // its size.
+    int bin = 0;
+    for (int size = cell; size <= cell * 4; size *= 2) {
+        if (image.width / size < std::max(min_width, 1) || image.height / size < std::max(min_height, 1)) break;
+        bin = size;
+        if (min_width <= 0 && min_height <= 0) break;
+    }
+    return bin;
+}
+
+static const int kCurveShift = DRAFT_CURVE_SHIFT;
+static const int kCurveSize = DRAFT_CURVE_SIZE;
+
+const unsigned char* draft_output_curve(double power, double slope) {
+    struct Curve {
+        double power = -1;
+        double slope = -1;
+        unsigned char values[kCurveSize];
+    };
+    static thread_local std::unique_ptr<Curve> curve;
+    if (!curve) curve.reset(new Curve());
+    if (curve->power == power && curve->slope == slope) return curve->values;
+
+    double g[6] = { power, slope, 0, 0, 0, 0 };
+    double bnd[2] = { 0, 0 };
+    bnd[g[1] >= 1] = 1;
+    if (g[1] && (g[1] - 1) * (g[0] - 1) <= 0) {
+        for (int i = 0; i < 48; i++) {
+            g[2] = (bnd[0] + bnd[1]) / 2;
+            if (g[0]) {
+                bnd[(std::pow(g[2] / g[1], -g[0]) - 1) / g[0] - 1 / g[2] > -1] = g[2];
+            } else {
+                bnd[g[2] / std::exp(1 - 1 / g[2]) < g[1]] = g[2];
+            }
+        }
+        g[3] = g[2] / g[1];
+        if (g[0]) g[4] = g[2] * (1 / g[0] - 1);
+    }
+
+    for (int i = 0; i < kCurveSize; i++) {
+        const double r = (double)((i << kCurveShift) + (1 << kCurveShift) / 2) / 0x10000; // Middle of the entry
+        const double v = r < g[3] ? r * g[1] : (g[0] ? std::pow(r, g[0]) * (1 + g[4]) - g[4] : std::log(r) * g[2] + 1);
+        const int value = std::min(0xffff, std::max(0, (int)(0x10000 * v)));
+        curve->values[i] = (unsigned char)(value >> 8);
+    }
+    curve->power = power;
+    curve->slope = slope;
+    return curve->values;
+}
+
+void draft_color_scale(const DraftRawImage& image, float scale[3]) {
+    unsigned short min_black = 0xffff;
+    for (int y = 0; y < kPattern; y++) {
+        for (int x = 0; x < kPattern; x++) min_black = std::min(min_black, image.black[y][x]);
+    }
+    const float range = image.maximum > min_black ? (float)(image.maximum - min_black) : 1.0f;
+
+    // Normalize on the smallest multiplier, like LibRaw without highlight recovery
+    float multipliers[3];
+    bool valid = true;
+    for (int c = 0; c < 3; c++) {
+        multipliers[c] = image.multipliers[c];
+        valid = valid && multipliers[c] > 0;
+    }
+    if (!valid) std::fill(multipliers, multipliers + 3, 1.0f);
+    const float min_multiplier = *std::min_element(multipliers, multipliers + 3);
+    for (int c = 0; c < 3; c++) scale[c] = multipliers[c] / min_multiplier * 65535.0f / range;
+}
+
+// White balance, camera matrix and output curve applied to each binned cell
+struct DraftColor {
+    float scale[3]; // Multiplier and white level normalization, per color
+    float matrix[3][3];
+    const unsigned char* curve;
+
+    explicit DraftColor(const DraftRawImage& image) {
+        draft_color_scale(image, scale);
+        for (int i = 0; i < 3; i++) {
+            for (int c = 0; c < 3; c++) matrix[i][c] = image.rgb_cam[i][c];
+        }
+        curve = draft_output_curve(image.gamma_power, image.gamma_slope);
+    }
+
+    // Renders black-subtracted sums, weight[c] being scale[c] over the
+    // number of samples summed for color c
+    void render(const unsigned sum[3], const float weight[3], unsigned char* out) const {
+        float cam[3];
+        for (int c = 0; c < 3; c++) cam[c] = std::min(65535.0f, sum[c] * weight[c]);
+        for (int i = 0; i < 3; i++) {
+            const float v = matrix[i][0] * cam[0] + matrix[i][1] * cam[1] + matrix[i][2] * cam[2];
+            out[i] = curve[(int)std::min(std::max(v, 0.0f), 65535.0f) >> kCurveShift];
+        }
+    }
+};
+
+/**
+ * Adds count samples to 32-bit column sums
+ */
+static void add_row(unsigned* sums, const unsigned short* src, int count) {
+    int x = 0;
+#if defined(DRAFT_AVX2)
+    for (; x + 16 <= count; x += 16) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+        __m256i* out = reinterpret_cast<__m256i*>(sums + x);
+        _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), lo));
+        _mm256_storeu_si256(out + 1, _mm256_add_epi32(_mm256_loadu_si256(out + 1), hi));
+    }
+#elif defined(DRAFT_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= count; x += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i* out = reinterpret_cast<__m128i*>(sums + x);
+        _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(v, zero)));
+    }
+#elif defined(DRAFT_NEON)
+    for (; x + 8 <= count; x += 8) {
+        uint16x8_t v = vld1q_u16(src + x);
+        vst1q_u32(sums + x, vaddw_u16(vld1q_u32(sums + x), vget_low_u16(v)));
+        vst1q_u32(sums + x + 4, vaddw_u16(vld1q_u32(sums + x + 4), vget_high_u16(v)));
+    }
+#endif
+    for (; x < count; x++) sums[x] += src[x];
+}
+
+/**
+ * Bins a 2x2 Bayer layout: rows of the same parity are summed column-wise
+ * with add_row(), then each cell adds up its columns per phase
+ */
+static void develop_bayer(const DraftRawImage& image, int bin, const DraftColor& color, unsigned char* out,
+                          int width, int height) {
+    const int columns = width * bin;
+    const unsigned samples = (unsigned)(bin / 2) * (bin / 2); // Per phase and cell
+    std::vector<unsigned> sums((size_t)columns * 2);
+    unsigned* even = sums.data();
+    unsigned* odd = even + columns;
+
+    // Every cell sums the same phases
+    int colors[4];
+    unsigned blacks[4];
+    unsigned count[3] = { 0, 0, 0 };
+    for (int p = 0; p < 4; p++) {
+        colors[p] = image.color[p >> 1][p & 1];
+        blacks[p] = image.black[p >> 1][p & 1] * samples;
+        count[colors[p]] += samples;
+    }
+    float weight[3];
+    for (int c = 0; c < 3; c++) weight[c] = color.scale[c] / count[c];
+
+    for (int y = 0; y < height; y++) {
+        std::fill(sums.begin(), sums.end(), 0u);
+        for (int r = 0; r < bin; r++) {
+            add_row(r & 1 ? odd : even, image.raw + (size_t)(y * bin + r) * image.pitch, columns);
+        }
+
+        for (int x = 0; x < width; x++) {
+            unsigned phase[4] = { 0, 0, 0, 0 };
+            for (int k = x * bin; k < (x + 1) * bin; k += 2) {
+                phase[0] += even[k];
+                phase[1] += even[k + 1];
+                phase[2] += odd[k];
+                phase[3] += odd[k + 1];
+            }
+
+            unsigned sum[3] = { 0, 0, 0 };
+            for (int p = 0; p < 4; p++) sum[colors[p]] += phase[p] > blacks[p] ? phase[p] - blacks[p] : 0;
+            color.render(sum, weight, out);
+            out += 3;
+        }
+    }
+}
+
+/**
+ * Bins any other layout sample by sample through the pattern tables
+ */
+static void develop_pattern(const DraftRawImage& image, int bin, const DraftColor& color, unsigned char* out,
+                            int width, int height) {
+    std::vector<unsigned> sums((size_t)width * 6); // Sum and count of each color per cell
+
+    for (int y = 0; y < height; y++) {
+        std::fill(sums.begin(), sums.end(), 0u);
+        for (int r = 0; r < bin; r++) {
+            const int row = y * bin + r;
+            const unsigned char* colors = image.color[row % kPattern];
+            const unsigned short* blacks = image.black[row % kPattern];
+            const unsigned short* src = image.raw + (size_t)row * image.pitch;
+            for (int x = 0; x < width; x++) {
+                unsigned* cell = &sums[(size_t)x * 6];
+                int p = (x * bin) % kPattern;
+                for (int k = x * bin; k < (x + 1) * bin; k++) {
+                    const unsigned short v = src[k];
+                    cell[colors[p]] += v > blacks[p] ? v - blacks[p] : 0;
+                    cell[3 + colors[p]]++;
+                    if (++p == kPattern) p = 0;
+                }
+            }
+        }
+
+        for (int x = 0; x < width; x++) {
+            const unsigned* cell = &sums[(size_t)x * 6];
+            const float weight[3] = { color.scale[0] / cell[3], color.scale[1] / cell[4], color.scale[2] / cell[5] };
+            color.render(cell, weight, out);
+            out += 3;
+        }
+    }
+}
+
+void develop_draft(const DraftRawImage& image, int bin, PixelBuffer& rgb, int* width, int* height) {
+    *width = image.width / bin;
+    *height = image.height / bin;
+    rgb.resize((size_t)*width * *height * 3);
+
+    DraftColor color(image);
+    if (bin % 2 == 0 && is_bayer_2x2(image)) {
+        develop_bayer(image, bin, color, rgb.data(), *width, *height);
+    } else {
+        develop_pattern(image, bin, color, rgb.data(), *width, *height);
+    }
+}
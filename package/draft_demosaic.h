@@ -0,0 +1,94 @@
+#ifndef DRAFT_DEMOSAIC_H
+#define DRAFT_DEMOSAIC_H
+
+// Fast, approximate development of color filter array sensor data for
+// thumbnails (PreviewOptions::draft_demosaic). Internal C++ interface, not
+// exported to Rust. Independent of LibRaw, which fills DraftRawImage from
+// imgdata after unpack().
+
+#include <stddef.h>
+#include "buffer_pool.h"
+
+// Rows and columns of DraftRawImage's pattern tables; a multiple of the
+// 2x2 Bayer, 6x6 X-Trans and 16x16 Leaf layouts
+#define DRAFT_PATTERN_SIZE 48
+
+/**
+ * Undeveloped sensor data and the color parameters needed to render it
+ */
+struct DraftRawImage {
+    // First visible sample
+    const unsigned short* raw;
+    // Samples between the starts of two rows
+    size_t pitch;
+    // Visible area in samples
+    int width;
+    int height;
+    // Filter color (0 red, 1 green, 2 blue) and black level of the sample at
+    // (row % DRAFT_PATTERN_SIZE, col % DRAFT_PATTERN_SIZE) of the visible area
+    unsigned char color[DRAFT_PATTERN_SIZE][DRAFT_PATTERN_SIZE];
+    unsigned short black[DRAFT_PATTERN_SIZE][DRAFT_PATTERN_SIZE];
+    // White level, black included
+    unsigned maximum;
+    // White balance multipliers of the three colors
+    float multipliers[3];
+    // Camera to sRGB matrix
+    float rgb_cam[3][3];
+    // Power and toe slope of the output curve (LibRaw's gamm[0] and gamm[1])
+    double gamma_power;
+    double gamma_slope;
+};
+
+/**
+ * Picks the cell size developed into one output pixel
+ * Cells are the smallest square block holding every filter color (2 for
+ * Bayer, 3 for X-Trans) doubled up to twice; the largest one whose output
+ * is still at least min_width x min_height wins. Without a target
+ * (min_width and min_height both 0) the smallest cell is used, which for
+ * Bayer sensors matches LibRaw's half-size output.
+ * @return The bin size in samples, or 0 if the layout cannot be binned or
+ *         no bin covers the target
+ */
+int select_draft_bin(const DraftRawImage& image, int min_width, int min_height);
+
+/**
+ * Develops the image at 1/bin scale
+ * Every bin x bin cell is averaged per color after black subtraction,
+ * scaled by the white balance (clipping at the white level, as LibRaw's
+ * highlight mode 0), converted to sRGB and mapped through the output curve
+ * into 8 bits. 2x2 Bayer layouts are summed with SSE2/AVX2/NEON when
+ * available. No orientation is applied.
+ * @param bin Value returned by select_draft_bin()
+ * @param rgb Receives the tightly packed RGB pixels
+ * @param width Receives image.width / bin
+ * @param height Receives image.height / bin
+ */
+void develop_draft(const DraftRawImage& image, int bin, PixelBuffer& rgb, int* width, int* height);
+
+// 16-bit values per entry of the output curve; 8-bit output does not need
+// more resolution, and a 16 KiB table stays in the L1 cache
+#define DRAFT_CURVE_SHIFT 2
+#define DRAFT_CURVE_SIZE (0x10000 >> DRAFT_CURVE_SHIFT)
+
+/**
+ * Returns true if colors and black levels repeat every 2 samples both ways
+ */
+bool is_bayer_2x2(const DraftRawImage& image);
+
+/**
+ * Computes the per-color factors taking black-subtracted samples to white
+ * balanced 16-bit values, where 65535 is the white level of the color with
+ * the smallest multiplier (LibRaw's scale_colors() without highlight
+ * recovery)
+ */
+void draft_color_scale(const DraftRawImage& image, float scale[3]);
+
+/**
+ * Returns dcraw's gamma_curve() (mode 2, white at 0x10000) reduced to 8
+ * bits: DRAFT_CURVE_SIZE entries, entry i covering the 16-bit values from
+ * i << DRAFT_CURVE_SHIFT. The table is built once per thread for the
+ * parameters in use and stays valid until the thread asks for others.
+ */
+const unsigned char* draft_output_curve(double power, double slope);
+
+#endif // DRAFT_DEMOSAIC_H
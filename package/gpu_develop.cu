@@ -0,0 +1,591 @@
+#include "gpu_develop.h"
+#include "preview_log.h"
+#include <cuda_runtime.h>
+#include <nvjpeg.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+static const int kDefaultMaxBatchImages = 16;
+// Threads per block of the per-pixel kernels: one warp wide
+static const int kBlockWidth = 32;
+static const int kBlockHeight = 8;
+// Alignment of every array in the batch arena
+static const size_t kArenaAlignment = 256;
+
+/**
+ * One image of a batch as the kernels see it. Offsets are in bytes from
+ * the start of the batch arena.
+ */
+struct GpuImage {
+    // width x height 16-bit samples, scaled in place by scale_samples()
+    size_t samples;
+    // width x height developed RGB pixels
+    size_t rgb;
+    // out_width x out_height resized RGB pixels, oriented
+    size_t out;
+    // DRAFT_CURVE_SIZE entries of the output curve
+    size_t curve;
+    int width;
+    int height;
+    // Output size before orientation
+    int out_width;
+    int out_height;
+    int orientation;
+    unsigned char color[2][2];
+    unsigned short black[2][2];
+    float scale[3];
+    float matrix[3][3];
+};
+
+// Subtracts the black level, applies the white balance and clips at white
+__global__ void scale_samples(const GpuImage* images, unsigned char* arena) {
+    const GpuImage& image = images[blockIdx.z];
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= image.width || y >= image.height) return;
+
+    unsigned short* sample = (unsigned short*)(arena + image.samples) + (size_t)y * image.width + x;
+    const int value = max((int)*sample - (int)image.black[y & 1][x & 1], 0);
+    *sample = (unsigned short)fminf(value * image.scale[image.color[y & 1][x & 1]], 65535.0f);
+}
+
+// Mirrors coordinates outside the image on its first or last sample, which
+// keeps their position in the 2x2 pattern
+__device__ static inline int reflect(int i, int size) {
+    return i < 0 ? -i : i >= size ? 2 * (size - 1) - i : i;
+}
+
+__device__ static inline float cfa_at(const unsigned short* cfa, int width, int height, int x, int y) {
+    return cfa[(size_t)reflect(y, height) * width + reflect(x, width)];
+}
+
+// Malvar-He-Cutler interpolation, camera matrix and output curve
+__global__ void demosaic(const GpuImage* images, unsigned char* arena) {
+    const GpuImage& image = images[blockIdx.z];
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    const int w = image.width;
+    const int h = image.height;
+    if (x >= w || y >= h) return;
+
+    const unsigned short* cfa = (const unsigned short*)(arena + image.samples);
+    const float center = cfa_at(cfa, w, h, x, y);
+    const float near_h = cfa_at(cfa, w, h, x - 1, y) + cfa_at(cfa, w, h, x + 1, y);
+    const float near_v = cfa_at(cfa, w, h, x, y - 1) + cfa_at(cfa, w, h, x, y + 1);
+    const float far_h = cfa_at(cfa, w, h, x - 2, y) + cfa_at(cfa, w, h, x + 2, y);
+    const float far_v = cfa_at(cfa, w, h, x, y - 2) + cfa_at(cfa, w, h, x, y + 2);
+    const float diagonal = cfa_at(cfa, w, h, x - 1, y - 1) + cfa_at(cfa, w, h, x + 1, y - 1)
+                         + cfa_at(cfa, w, h, x - 1, y + 1) + cfa_at(cfa, w, h, x + 1, y + 1);
+
+    float cam[3];
+    const int color = image.color[y & 1][x & 1];
+    if (color == 1) {
+        // Green: the row and the column each hold one of red and blue
+        cam[1] = center;
+        cam[image.color[y & 1][(x + 1) & 1]] = (5 * center + 4 * near_h - diagonal - far_h + 0.5f * far_v) / 8;
+        cam[image.color[(y + 1) & 1][x & 1]] = (5 * center + 4 * near_v - diagonal - far_v + 0.5f * far_h) / 8;
+    } else {
+        cam[color] = center;
+        cam[1] = (4 * center + 2 * (near_h + near_v) - (far_h + far_v)) / 8;
+        cam[2 - color] = (6 * center + 2 * diagonal - 1.5f * (far_h + far_v)) / 8;
+    }
+    for (int c = 0; c < 3; c++) cam[c] = fminf(fmaxf(cam[c], 0.0f), 65535.0f);
+
+    const unsigned char* curve = arena + image.curve;
+    unsigned char* out = arena + image.rgb + ((size_t)y * w + x) * 3;
+    for (int i = 0; i < 3; i++) {
+        const float v = image.matrix[i][0] * cam[0] + image.matrix[i][1] * cam[1] + image.matrix[i][2] * cam[2];
+        out[i] = curve[(int)fminf(fmaxf(v, 0.0f), 65535.0f) >> DRAFT_CURVE_SHIFT];
+    }
+}
+
+// Area-average resize, as resize_area(), written at the oriented position
+// of each output pixel
+__global__ void resize_orient(const GpuImage* images, unsigned char* arena) {
+    const GpuImage& image = images[blockIdx.z];
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    const int w = image.out_width;
+    const int h = image.out_height;
+    if (x >= w || y >= h) return;
+
+    const float ratio_x = (float)image.width / w;
+    const float ratio_y = (float)image.height / h;
+    const float x0 = x * ratio_x, x1 = (x + 1) * ratio_x;
+    const float y0 = y * ratio_y, y1 = (y + 1) * ratio_y;
+    const int first_x = (int)x0, last_x = min((int)ceilf(x1), image.width);
+    const int first_y = (int)y0, last_y = min((int)ceilf(y1), image.height);
+
+    const unsigned char* rgb = arena + image.rgb;
+    float sum[3] = { 0, 0, 0 };
+    for (int sy = first_y; sy < last_y; sy++) {
+        const float weight_y = fminf(sy + 1.0f, y1) - fmaxf((float)sy, y0);
+        const unsigned char* row = rgb + (size_t)sy * image.width * 3;
+        float row_sum[3] = { 0, 0, 0 };
+        for (int sx = first_x; sx < last_x; sx++) {
+            const float weight_x = fminf(sx + 1.0f, x1) - fmaxf((float)sx, x0);
+            for (int c = 0; c < 3; c++) row_sum[c] += weight_x * row[sx * 3 + c];
+        }
+        for (int c = 0; c < 3; c++) sum[c] += weight_y * row_sum[c];
+    }
+
+    // Destination of (x, y) under each EXIF orientation, as apply_exif_orientation()
+    int dst_x, dst_y, dst_width = w;
+    switch (image.orientation) {
+    case 2: dst_x = w - 1 - x; dst_y = y; break;
+    case 3: dst_x = w - 1 - x; dst_y = h - 1 - y; break;
+    case 4: dst_x = x; dst_y = h - 1 - y; break;
+    case 5: dst_x = y; dst_y = x; dst_width = h; break;
+    case 6: dst_x = h - 1 - y; dst_y = x; dst_width = h; break;
+    case 7: dst_x = h - 1 - y; dst_y = w - 1 - x; dst_width = h; break;
+    case 8: dst_x = y; dst_y = w - 1 - x; dst_width = h; break;
+    default: dst_x = x; dst_y = y; break;
+    }
+
+    const float norm = 1.0f / (ratio_x * ratio_y);
+    unsigned char* out = arena + image.out + ((size_t)dst_y * dst_width + dst_x) * 3;
+    for (int c = 0; c < 3; c++) out[c] = (unsigned char)fminf(sum[c] * norm + 0.5f, 255.0f);
+}
+
+static bool cuda_ok(cudaError_t status, const char* what, std::string* error) {
+    if (status == cudaSuccess) return true;
+    *error = std::string(what) + ": " + cudaGetErrorString(status);
+    return false;
+}
+
+static bool nvjpeg_ok(nvjpegStatus_t status, const char* what, std::string* error) {
+    if (status == NVJPEG_STATUS_SUCCESS) return true;
+    *error = std::string(what) + " failed with nvJPEG status " + std::to_string((int)status);
+    return false;
+}
+
+// Maps JpegEncodeOptions::subsampling (TJSAMP_*) to nvJPEG; grayscale output
+// needs a YUV input, so it stays with TurboJPEG
+static bool nvjpeg_subsampling(int subsampling, nvjpegChromaSubsampling_t* css) {
+    switch (subsampling) {
+    case 0: *css = NVJPEG_CSS_444; return true;
+    case 1: *css = NVJPEG_CSS_422; return true;
+    case 2: *css = NVJPEG_CSS_420; return true;
+    case 4: *css = NVJPEG_CSS_440; return true;
+    case 5: *css = NVJPEG_CSS_411; return true;
+    default: return false;
+    }
+}
+
+static size_t align_arena(size_t size) {
+    return (size + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+}
+
+// nvJPEG encoder state and parameters of one image of a batch
+struct GpuEncoder {
+    nvjpegEncoderState_t state;
+    nvjpegEncoderParams_t params;
+};
+
+/**
+ * An initialized device. Its stream, nvJPEG handle, encoders and arena are
+ * only used by the thread developing the current batch.
+ */
+struct GpuDevice {
+    int index = 0;
+    cudaStream_t stream = nullptr;
+    nvjpegHandle_t nvjpeg = nullptr;
+    // Free device memory when the device was opened
+    size_t free_memory = 0;
+    std::vector<GpuEncoder> encoders;
+    // Grow-only allocation holding every array of a batch
+    unsigned char* arena = nullptr;
+    size_t arena_capacity = 0;
+};
+
+static GpuDevice* open_device(int index, std::string* error) {
+    int count = 0;
+    if (!cuda_ok(cudaGetDeviceCount(&count), "No CUDA device", error)) return nullptr;
+    if (index < 0 || index >= count) {
+        *error = "CUDA device " + std::to_string(index) + " does not exist";
+        return nullptr;
+    }
+    std::unique_ptr<GpuDevice> device(new GpuDevice());
+    device->index = index;
+    size_t total_memory = 0;
+    if (!cuda_ok(cudaSetDevice(index), "Failed to select the CUDA device", error)
+        || !cuda_ok(cudaStreamCreateWithFlags(&device->stream, cudaStreamNonBlocking), "Failed to create a CUDA stream", error)
+        || !nvjpeg_ok(nvjpegCreateSimple(&device->nvjpeg), "nvjpegCreateSimple", error)
+        || !cuda_ok(cudaMemGetInfo(&device->free_memory, &total_memory), "Failed to query the device memory", error)) {
+        return nullptr;
+    }
+    return device.release();
+}
+
+static bool reserve_arena(GpuDevice& device, size_t size, std::string* error) {
+    if (size <= device.arena_capacity) return true;
+    cudaFree(device.arena);
+    device.arena = nullptr;
+    device.arena_capacity = 0;
+    if (!cuda_ok(cudaMalloc((void**)&device.arena, size), "Failed to allocate device memory", error)) return false;
+    device.arena_capacity = size;
+    return true;
+}
+
+static bool reserve_encoders(GpuDevice& device, size_t count, std::string* error) {
+    while (device.encoders.size() < count) {
+        GpuEncoder encoder;
+        if (!nvjpeg_ok(nvjpegEncoderStateCreate(device.nvjpeg, &encoder.state, device.stream),
+                       "nvjpegEncoderStateCreate", error)) {
+            return false;
+        }
+        if (!nvjpeg_ok(nvjpegEncoderParamsCreate(device.nvjpeg, &encoder.params, device.stream),
+                       "nvjpegEncoderParamsCreate", error)) {
+            nvjpegEncoderStateDestroy(encoder.state);
+            return false;
+        }
+        device.encoders.push_back(encoder);
+    }
+    return true;
+}
+
+static bool configure_encoder(const GpuEncoder& encoder, const JpegEncodeOptions& encode, cudaStream_t stream,
+                              std::string* error) {
+    nvjpegChromaSubsampling_t css;
+    if (!nvjpeg_subsampling(encode.subsampling, &css)) {
+        *error = "Chroma subsampling not supported by nvJPEG";
+        return false;
+    }
+    const int quality = encode.quality > 0 ? std::min(encode.quality, 100) : 75;
+    const nvjpegJpegEncoding_t encoding =
+        encode.progressive ? NVJPEG_ENCODING_PROGRESSIVE_DCT_HUFFMAN : NVJPEG_ENCODING_BASELINE_DCT;
+    return nvjpeg_ok(nvjpegEncoderParamsSetQuality(encoder.params, quality, stream), "nvjpegEncoderParamsSetQuality", error)
+        && nvjpeg_ok(nvjpegEncoderParamsSetSamplingFactors(encoder.params, css, stream),
+                     "nvjpegEncoderParamsSetSamplingFactors", error)
+        && nvjpeg_ok(nvjpegEncoderParamsSetOptimizedHuffman(encoder.params, encode.optimize_huffman || encode.progressive,
+                                                            stream),
+                     "nvjpegEncoderParamsSetOptimizedHuffman", error)
+        && nvjpeg_ok(nvjpegEncoderParamsSetEncoding(encoder.params, encoding, stream), "nvjpegEncoderParamsSetEncoding",
+                     error);
+}
+
+// A conversion waiting in the queue, owned by the thread that submitted it
+struct GpuJob {
+    const DraftRawImage* image;
+    int orientation;
+    int width;
+    int height;
+    JpegEncodeOptions encode;
+    // Arena bytes of its arrays
+    size_t bytes;
+    PixelBuffer* jpeg;
+    std::string* error;
+    bool done;
+    bool ok;
+};
+
+static size_t job_bytes(const DraftRawImage& image, int width, int height) {
+    const size_t samples = (size_t)image.width * image.height;
+    return align_arena(sizeof(GpuImage)) + align_arena(DRAFT_CURVE_SIZE) + align_arena(samples * 2)
+         + align_arena(samples * 3) + align_arena((size_t)width * height * 3);
+}
+
+static int blocks(int size, int block) {
+    return (size + block - 1) / block;
+}
+
+/**
+ * Develops and encodes a batch: the samples of every image are uploaded,
+ * each kernel runs once for the whole batch, then every image is encoded
+ * on the same stream and the JPEGs are retrieved after one synchronization
+ * @param fatal Set when the failure is a CUDA error the device may not
+ *              recover from
+ * @return false if no image could be delivered (error is set);
+ *         images nvJPEG rejected fail on their own with the batch succeeding
+ */
+static bool develop_batch(GpuDevice& device, const std::vector<GpuJob*>& jobs, bool* fatal, std::string* error) {
+    const size_t count = jobs.size();
+    *fatal = false;
+
+    // Arena: descriptors and curves, uploaded together, then the arrays of each image
+    const size_t curves = align_arena(sizeof(GpuImage) * count);
+    size_t size = curves + align_arena((size_t)DRAFT_CURVE_SIZE * count);
+    std::vector<unsigned char> header(size);
+    GpuImage* images = (GpuImage*)header.data();
+    int max_width = 0, max_height = 0, max_out_width = 0, max_out_height = 0;
+    for (size_t i = 0; i < count; i++) {
+        const GpuJob& job = *jobs[i];
+        const DraftRawImage& raw = *job.image;
+        GpuImage& image = images[i];
+        const size_t samples = (size_t)raw.width * raw.height;
+        image.curve = curves + (size_t)DRAFT_CURVE_SIZE * i;
+        image.samples = size;
+        size += align_arena(samples * 2);
+        image.rgb = size;
+        size += align_arena(samples * 3);
+        image.out = size;
+        size += align_arena((size_t)job.width * job.height * 3);
+        image.width = raw.width;
+        image.height = raw.height;
+        image.out_width = job.width;
+        image.out_height = job.height;
+        image.orientation = job.orientation;
+        for (int y = 0; y < 2; y++) {
+            for (int x = 0; x < 2; x++) {
+                image.color[y][x] = raw.color[y][x];
+                image.black[y][x] = raw.black[y][x];
+            }
+        }
+        draft_color_scale(raw, image.scale);
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) image.matrix[c][k] = raw.rgb_cam[c][k];
+        }
+        memcpy(header.data() + image.curve, draft_output_curve(raw.gamma_power, raw.gamma_slope), DRAFT_CURVE_SIZE);
+
+        max_width = std::max(max_width, raw.width);
+        max_height = std::max(max_height, raw.height);
+        max_out_width = std::max(max_out_width, job.width);
+        max_out_height = std::max(max_out_height, job.height);
+    }
+
+    if (!cuda_ok(cudaSetDevice(device.index), "Failed to select the CUDA device", error)) {
+        *fatal = true;
+        return false;
+    }
+    if (!reserve_arena(device, size, error) || !reserve_encoders(device, count, error)) return false;
+
+    // Pageable uploads return once the source has been staged, so the
+    // header and the LibRaw buffers need not outlive the calls
+    *fatal = true;
+    cudaStream_t stream = device.stream;
+    if (!cuda_ok(cudaMemcpyAsync(device.arena, header.data(), header.size(), cudaMemcpyHostToDevice, stream),
+                 "Failed to upload the batch", error)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const DraftRawImage& raw = *jobs[i]->image;
+        const size_t row = (size_t)raw.width * sizeof(unsigned short);
+        if (!cuda_ok(cudaMemcpy2DAsync(device.arena + images[i].samples, row, raw.raw, raw.pitch * sizeof(unsigned short),
+                                       row, raw.height, cudaMemcpyHostToDevice, stream),
+                     "Failed to upload the sensor data", error)) {
+            return false;
+        }
+    }
+
+    const GpuImage* descriptors = (const GpuImage*)device.arena;
+    const dim3 block(kBlockWidth, kBlockHeight);
+    const dim3 grid(blocks(max_width, kBlockWidth), blocks(max_height, kBlockHeight), (unsigned)count);
+    const dim3 out_grid(blocks(max_out_width, kBlockWidth), blocks(max_out_height, kBlockHeight), (unsigned)count);
+    scale_samples<<<grid, block, 0, stream>>>(descriptors, device.arena);
+    demosaic<<<grid, block, 0, stream>>>(descriptors, device.arena);
+    resize_orient<<<out_grid, block, 0, stream>>>(descriptors, device.arena);
+    if (!cuda_ok(cudaGetLastError(), "Failed to launch the development kernels", error)) return false;
+
+    std::vector<bool> encoded(count, false);
+    for (size_t i = 0; i < count; i++) {
+        const GpuJob& job = *jobs[i];
+        const bool transposed = job.orientation >= 5 && job.orientation <= 8;
+        const int out_width = transposed ? job.height : job.width;
+        const int out_height = transposed ? job.width : job.height;
+        nvjpegImage_t source;
+        memset(&source, 0, sizeof(source));
+        source.channel[0] = device.arena + images[i].out;
+        source.pitch[0] = (size_t)out_width * 3;
+        encoded[i] = configure_encoder(device.encoders[i], job.encode, stream, job.error)
+                  && nvjpeg_ok(nvjpegEncodeImage(device.nvjpeg, device.encoders[i].state, device.encoders[i].params,
+                                                 &source, NVJPEG_INPUT_RGBI, out_width, out_height, stream),
+                               "nvjpegEncodeImage", job.error);
+    }
+    if (!cuda_ok(cudaStreamSynchronize(stream), "Failed to develop the batch", error)) return false;
+    *fatal = false;
+
+    for (size_t i = 0; i < count; i++) {
+        GpuJob& job = *jobs[i];
+        if (!encoded[i]) continue;
+        size_t length = 0;
+        const nvjpegEncoderState_t state = device.encoders[i].state;
+        if (!nvjpeg_ok(nvjpegEncodeRetrieveBitstream(device.nvjpeg, state, nullptr, &length, stream),
+                       "nvjpegEncodeRetrieveBitstream", job.error)) {
+            continue;
+        }
+        job.jpeg->resize(length);
+        job.ok = nvjpeg_ok(nvjpegEncodeRetrieveBitstream(device.nvjpeg, state, job.jpeg->data(), &length, stream),
+                           "nvjpegEncodeRetrieveBitstream", job.error);
+        job.jpeg->resize(length);
+    }
+    return true;
+}
+
+static GpuOptions default_options() {
+    GpuOptions options;
+    options.enabled = 1;
+    options.device = 0;
+    options.max_batch_images = kDefaultMaxBatchImages;
+    options.max_batch_bytes = 0;
+    return options;
+}
+
+/**
+ * Process-wide state: the options, the device and the queue of jobs.
+ * Threads submitting a job queue it; whichever finds no batch running takes
+ * the queued jobs as the next batch and develops it for everyone, so a
+ * batch holds the conversions that arrived while the previous one ran.
+ */
+struct GpuState {
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::deque<GpuJob*> queue;
+    GpuOptions options;
+    bool running = false;
+    // 0 before the first use, 1 usable, -1 unavailable or disabled
+    int status = 0;
+    GpuDevice* device = nullptr;
+
+    GpuState() : options(default_options()) {}
+};
+
+// Never destroyed: the CUDA runtime may be torn down before static destructors run
+static GpuState& gpu_state() {
+    static GpuState* state = new GpuState();
+    return *state;
+}
+
+// Opens the device on first use; state.mutex must be held
+static bool device_ready(GpuState& state) {
+    if (state.status == 0) {
+        std::string error;
+        state.device = open_device(state.options.device, &error);
+        state.status = state.device ? 1 : -1;
+        if (state.device) {
+            preview_log(PREVIEW_LOG_INFO, "Developing RAW files on CUDA device " + std::to_string(state.device->index));
+        } else {
+            preview_log(PREVIEW_LOG_INFO, "GPU development unavailable, using the CPU: " + error);
+        }
+    }
+    return state.status == 1;
+}
+
+static size_t batch_budget(const GpuState& state) {
+    if (state.options.max_batch_bytes) return state.options.max_batch_bytes;
+    return state.device ? state.device->free_memory / 2 : (size_t)-1;
+}
+
+// Takes the next batch off the queue; it holds at least one job. The batch
+// is allocated before any job leaves the queue, so a std::bad_alloc loses none.
+static std::vector<GpuJob*> take_batch(GpuState& state) {
+    const size_t max_images = (size_t)std::max(state.options.max_batch_images, 1);
+    const size_t budget = batch_budget(state);
+    size_t count = 0, bytes = 0;
+    while (count < state.queue.size() && count < max_images) {
+        const size_t job_size = state.queue[count]->bytes;
+        if (count && bytes + job_size > budget) break;
+        bytes += job_size;
+        count++;
+    }
+    std::vector<GpuJob*> batch(state.queue.begin(), state.queue.begin() + count);
+    state.queue.erase(state.queue.begin(), state.queue.begin() + count);
+    return batch;
+}
+
+extern "C" void raw_preview_configure_gpu(const GpuOptions* options) {
+    GpuState& state = gpu_state();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.options = options ? *options : default_options();
+}
+
+extern "C" int raw_preview_gpu_available(void) {
+    GpuState& state = gpu_state();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.options.enabled && device_ready(state);
+}
+
+bool gpu_develop_supported(const JpegEncodeOptions& encode) {
+    nvjpegChromaSubsampling_t css;
+    return nvjpeg_subsampling(encode.subsampling, &css) && raw_preview_gpu_available();
+}
+
+// Green on one diagonal of the 2x2 cell, red and blue on the other
+static bool standard_bayer(const DraftRawImage& image) {
+    const int green = image.color[0][0] == 1 ? 0 : 1;
+    return image.color[0][green] == 1 && image.color[1][1 - green] == 1
+        && image.color[0][1 - green] != 1 && image.color[1][green] != 1
+        && image.color[0][1 - green] != image.color[1][green];
+}
+
+int gpu_develop_jpeg(const DraftRawImage& image, int orientation, int width, int height,
+                     const JpegEncodeOptions& encode, PixelBuffer& jpeg, std::string* error) {
+    if (!image.raw || image.width < 8 || image.height < 8 || image.pitch < (size_t)image.width
+        || !is_bayer_2x2(image) || !standard_bayer(image)
+        || width <= 0 || height <= 0 || width > image.width || height > image.height) {
+        *error = "Image layout not supported by the GPU backend";
+        return -1;
+    }
+
+    GpuJob job = { &image, orientation, width, height, encode, job_bytes(image, width, height), &jpeg, error, false, false };
+    GpuState& state = gpu_state();
+    std::unique_lock<std::mutex> lock(state.mutex);
+    if (!state.options.enabled || !device_ready(state)) {
+        *error = "No usable CUDA device";
+        return -1;
+    }
+    if (job.bytes > batch_budget(state)) {
+        *error = "Image exceeds the GPU memory budget";
+        return -1;
+    }
+
+    state.queue.push_back(&job);
+    while (!job.done) {
+        if (state.running) {
+            state.finished.wait(lock);
+            continue;
+        }
+
+        // Develop the next batch, which need not hold this thread's job
+        std::vector<GpuJob*> batch;
+        try {
+            batch = take_batch(state);
+        } catch (const std::bad_alloc&) {
+            // Leave the queue to the other threads and develop on the CPU
+            const auto queued = std::find(state.queue.begin(), state.queue.end(), &job);
+            if (queued != state.queue.end()) state.queue.erase(queued);
+            *error = "Out of memory queuing the GPU batch";
+            return -1;
+        }
+        state.running = true;
+        GpuDevice* device = state.status == 1 ? state.device : nullptr;
+        lock.unlock();
+
+        std::string batch_error = "CUDA device disabled after an earlier error";
+        bool fatal = false;
+        bool developed = false;
+        try {
+            developed = device && develop_batch(*device, batch, &fatal, &batch_error);
+        } catch (const std::exception& e) {
+            // Out of host memory: the jobs of this batch fall back to the CPU,
+            // and the threads waiting on the batch are still woken below
+            batch_error = std::string("GPU batch failed: ") + e.what();
+            developed = false;
+            fatal = false;
+        }
+
+        lock.lock();
+        for (GpuJob* queued : batch) {
+            if (!developed) queued->ok = false;
+            queued->done = true;
+            if (!queued->ok) {
+                try {
+                    *queued->error = batch_error;
+                } catch (const std::bad_alloc&) {
+                    // The job still fails, only without its reason
+                }
+            }
+        }
+        if (fatal && state.status == 1) {
+            state.status = -1;
+            preview_log(PREVIEW_LOG_WARN, "Disabling GPU development after a CUDA error: " + batch_error);
+        }
+        state.running = false;
+        state.finished.notify_all();
+    }
+    return job.ok ? 0 : -1;
+}
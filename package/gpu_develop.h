@@ -0,0 +1,75 @@
+#ifndef GPU_DEVELOP_H
+#define GPU_DEVELOP_H
+
+// Development of Bayer sensor data on a CUDA device (the `cuda` Cargo
+// feature): black level, white balance, demosaicing, camera matrix, output
+// curve, resize and orientation run as kernels, and nvJPEG encodes the
+// result. Conversions running concurrently on several threads are gathered
+// into batches, each developed with one launch per stage.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Settings of the GPU backend, process-wide
+typedef struct GpuOptions {
+    // Non-zero to develop RAW files on the GPU when one is usable
+    int enabled;
+    // CUDA device index; read when the device is first used
+    int device;
+    // Most conversions developed by one batch (at least 1)
+    int max_batch_images;
+    // Device memory a batch may use for its images; 0 selects half of the
+    // memory that was free when the device was first used
+    size_t max_batch_bytes;
+} GpuOptions;
+
+// Replaces the settings; a null pointer restores the defaults (enabled,
+// device 0, 16 images, automatic memory limit)
+void raw_preview_configure_gpu(const GpuOptions* options);
+
+// Returns non-zero if the backend is enabled and its device was initialized
+// (the first call initializes it)
+int raw_preview_gpu_available(void);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+#include "buffer_pool.h"
+#include "draft_demosaic.h"
+#include "preview_options.h"
+
+// Internal C++ interface, not exported to Rust
+
+/**
+ * Returns true if raw_preview_gpu_available() does and nvJPEG can produce
+ * JPEGs with these encoder settings (not grayscale)
+ */
+bool gpu_develop_supported(const JpegEncodeOptions& encode);
+
+/**
+ * Develops a 2x2 Bayer image, resizes, orients and encodes it on the GPU
+ * Samples are scaled with draft_color_scale() and clipped at white, the
+ * mosaic is interpolated with the Malvar-He-Cutler gradient-corrected
+ * filters, and the camera matrix and draft_output_curve() produce 8-bit
+ * sRGB, which is area-averaged to the output size. Blocks until the batch
+ * holding the image has been encoded.
+ * @param image Sensor data with is_bayer_2x2(image), at least 8x8 samples
+ * @param orientation EXIF orientation (1-8) applied after the resize
+ * @param width Output width before orientation, at most image.width
+ * @param height Output height before orientation, at most image.height
+ * @param encode JPEG settings; accurate_dct has no effect
+ * @param jpeg Receives the JPEG bytes
+ * @param error Receives the reason of a failure
+ * @return 0 on success, -1 on failure; the device is disabled for the rest
+ *         of the process after a CUDA error
+ */
+int gpu_develop_jpeg(const DraftRawImage& image, int orientation, int width, int height,
+                     const JpegEncodeOptions& encode, PixelBuffer& jpeg, std::string* error);
+
+#endif
+
+#endif // GPU_DEVELOP_H
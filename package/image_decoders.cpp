@@ -0,0 +1,490 @@
+#include "image_decoders.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include "pipeline_stats.h"
+
+#ifdef RAW_PREVIEW_HAVE_SPNG
+#include <spng.h>
+#endif
+#ifdef RAW_PREVIEW_HAVE_WEBP
+#include <webp/decode.h>
+#endif
+#ifdef RAW_PREVIEW_HAVE_TIFF
+#include <tiffio.h>
+#endif
+
+// Largest image side accepted, as stb_image's STBI_MAX_DIMENSIONS
+static const int kMaxDimension = 1 << 24;
+// Largest pixel count accepted, so that the RGB buffer size cannot overflow
+static const unsigned long long kMaxPixels = 1ULL << 30;
+
+static bool check_size(int width, int height, std::string* error) {
+    if (width <= 0 || height <= 0 || width > kMaxDimension || height > kMaxDimension ||
+        (unsigned long long)width * height > kMaxPixels) {
+        *error = "Image dimensions out of range: " + std::to_string(width) + "x" + std::to_string(height);
+        return false;
+    }
+    return true;
+}
+
+#ifdef RAW_PREVIEW_HAVE_SPNG
+// PNG through libspng, whose filters use SSE2/NEON unless built with SPNG_DISABLE_OPT
+static bool open_png(spng_ctx* ctx, const unsigned char* data, size_t size, int* width, int* height,
+                     std::string* error) {
+    spng_set_image_limits(ctx, kMaxDimension, kMaxDimension);
+    // Decode through bad checksums like stb_image does
+    spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);
+    spng_set_png_buffer(ctx, data, size);
+    struct spng_ihdr ihdr;
+    int result = spng_get_ihdr(ctx, &ihdr);
+    if (result != 0) {
+        *error = spng_strerror(result);
+        return false;
+    }
+    *width = (int)ihdr.width;
+    *height = (int)ihdr.height;
+    return check_size(*width, *height, error);
+}
+
+static bool png_read_size(const unsigned char* data, size_t size, int* width, int* height, std::string* error) {
+    spng_ctx* ctx = spng_ctx_new(0);
+    if (!ctx) {
+        *error = "Failed to create PNG decoder";
+        return false;
+    }
+    bool ok = open_png(ctx, data, size, width, height, error);
+    spng_ctx_free(ctx);
+    return ok;
+}
+
+static bool png_decode(const unsigned char* data, size_t size, int, int,
+                       PixelBuffer& rgb, int* width, int* height, std::string* error) {
+    spng_ctx* ctx = spng_ctx_new(0);
+    if (!ctx) {
+        *error = "Failed to create PNG decoder";
+        return false;
+    }
+    bool ok = open_png(ctx, data, size, width, height, error);
+    size_t rgb_size = 0;
+    int result = ok ? spng_decoded_image_size(ctx, SPNG_FMT_RGB8, &rgb_size) : 0;
+    if (ok && result == 0) {
+        rgb.resize(rgb_size);
+        result = spng_decode_image(ctx, rgb.data(), rgb_size, SPNG_FMT_RGB8, 0);
+    }
+    if (ok && result != 0) {
+        *error = spng_strerror(result);
+        ok = false;
+    }
+    spng_ctx_free(ctx);
+    return ok;
+}
+
+// Rows decoded per StripEncoder::push() by png_decode_strips
+static const int kPngBandRows = 16;
+
+static bool png_can_decode_strips(const unsigned char* data, size_t size) {
+    spng_ctx* ctx = spng_ctx_new(0);
+    if (!ctx) return false;
+    int width, height;
+    std::string error;
+    struct spng_ihdr ihdr;
+    // Interlaced rows come out pass by pass, not top to bottom
+    bool ok = open_png(ctx, data, size, &width, &height, &error) && spng_get_ihdr(ctx, &ihdr) == 0 &&
+              ihdr.interlace_method == SPNG_INTERLACE_NONE;
+    spng_ctx_free(ctx);
+    return ok;
+}
+
+static bool png_decode_strips(const unsigned char* data, size_t size, StripEncoder& encoder, std::string* error) {
+    spng_ctx* ctx = spng_ctx_new(0);
+    if (!ctx) {
+        *error = "Failed to create PNG decoder";
+        return false;
+    }
+    int width = 0, height = 0;
+    bool ok = open_png(ctx, data, size, &width, &height, error);
+    int result = 0;
+    if (ok) {
+        StageTimer timer(&PipelineStats::decode_ns);
+        result = spng_decode_image(ctx, nullptr, 0, SPNG_FMT_RGB8, SPNG_DECODE_PROGRESSIVE);
+        ok = result == 0;
+    }
+    try {
+        const size_t pitch = (size_t)width * 3;
+        PixelBuffer band(ok ? pitch * kPngBandRows : 0);
+        record_buffer(band.size());
+        for (int y = 0; ok && y < height; y += kPngBandRows) {
+            const int count = std::min(kPngBandRows, height - y);
+            {
+                StageTimer timer(&PipelineStats::decode_ns);
+                // The last row returns SPNG_EOI
+                for (int i = 0; ok && i < count; i++) {
+                    result = spng_decode_row(ctx, band.data() + i * pitch, pitch);
+                    ok = result == 0 || result == SPNG_EOI;
+                }
+            }
+            if (ok && !encoder.push(band.data(), count, pitch)) {
+                spng_ctx_free(ctx);
+                return false;
+            }
+        }
+    } catch (...) {
+        spng_ctx_free(ctx);
+        throw;
+    }
+    if (!ok && result != 0) {
+        *error = spng_strerror(result);
+    }
+    spng_ctx_free(ctx);
+    return ok;
+}
+#endif
+
+#ifdef RAW_PREVIEW_HAVE_WEBP
+// WebP through libwebp, whose rescaler produces the output size during the decode
+static bool webp_read_size(const unsigned char* data, size_t size, int* width, int* height, std::string* error) {
+    if (!WebPGetInfo(data, size, width, height)) {
+        *error = "Invalid WebP header";
+        return false;
+    }
+    return check_size(*width, *height, error);
+}
+
+static bool webp_decode(const unsigned char* data, size_t size, int min_width, int min_height,
+                        PixelBuffer& rgb, int* width, int* height, std::string* error) {
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config)) {
+        *error = "Incompatible libwebp version";
+        return false;
+    }
+    if (WebPGetFeatures(data, size, &config.input) != VP8_STATUS_OK) {
+        *error = "Invalid WebP header";
+        return false;
+    }
+    if (config.input.has_animation) {
+        *error = "Animated WebP images are not supported";
+        return false;
+    }
+    *width = config.input.width;
+    *height = config.input.height;
+    if (!check_size(*width, *height, error)) {
+        return false;
+    }
+    if (min_width > 0 && min_height > 0 && min_width <= *width && min_height <= *height &&
+        (min_width < *width || min_height < *height)) {
+        config.options.use_scaling = 1;
+        config.options.scaled_width = min_width;
+        config.options.scaled_height = min_height;
+        *width = min_width;
+        *height = min_height;
+    }
+
+    rgb.resize((size_t)*width * *height * 3);
+    config.output.colorspace = MODE_RGB;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = rgb.data();
+    config.output.u.RGBA.stride = *width * 3;
+    config.output.u.RGBA.size = rgb.size();
+    VP8StatusCode status = WebPDecode(data, size, &config);
+    WebPFreeDecBuffer(&config.output);
+    if (status != VP8_STATUS_OK) {
+        *error = "WebP decoding failed with status " + std::to_string((int)status);
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef RAW_PREVIEW_HAVE_TIFF
+// TIFF through libtiff, reading from memory. Every photometric
+// interpretation and compression TIFFRGBAImage handles is supported.
+struct TiffSource {
+    const unsigned char* data;
+    toff_t size;
+    toff_t position;
+};
+
+static tmsize_t tiff_read(thandle_t handle, void* buffer, tmsize_t count) {
+    TiffSource* source = (TiffSource*)handle;
+    if (count <= 0 || source->position >= source->size) return 0;
+    toff_t available = source->size - source->position;
+    if ((toff_t)count > available) count = (tmsize_t)available;
+    memcpy(buffer, source->data + source->position, (size_t)count);
+    source->position += count;
+    return count;
+}
+
+static tmsize_t tiff_write(thandle_t, void*, tmsize_t) {
+    return 0;
+}
+
+static toff_t tiff_seek(thandle_t handle, toff_t offset, int whence) {
+    TiffSource* source = (TiffSource*)handle;
+    toff_t base = whence == SEEK_CUR ? source->position : whence == SEEK_END ? source->size : 0;
+    if (offset > (toff_t)-1 - base) return (toff_t)-1;
+    source->position = base + offset;
+    return source->position;
+}
+
+static int tiff_close(thandle_t) {
+    return 0;
+}
+
+static toff_t tiff_size(thandle_t handle) {
+    return ((TiffSource*)handle)->size;
+}
+
+// Lets libtiff read uncompressed strips straight from the input
+static int tiff_map(thandle_t handle, void** base, toff_t* size) {
+    TiffSource* source = (TiffSource*)handle;
+    *base = (void*)source->data;
+    *size = source->size;
+    return 1;
+}
+
+static void tiff_unmap(thandle_t, void*, toff_t) {}
+
+// Keeps the first error for the caller instead of printing it to stderr
+static int tiff_error(TIFF*, void* user_data, const char* module, const char* format, va_list args) {
+    std::string* error = (std::string*)user_data;
+    if (error->empty()) {
+        char message[512];
+        vsnprintf(message, sizeof(message), format, args);
+        *error = std::string(module ? module : "libtiff") + ": " + message;
+    }
+    return 1;
+}
+
+static int tiff_warning(TIFF*, void*, const char*, const char*, va_list) {
+    return 1;
+}
+
+static TIFF* open_tiff(TiffSource& source, std::string* error) {
+    TIFFOpenOptions* options = TIFFOpenOptionsAlloc();
+    if (!options) {
+        *error = "Failed to create TIFF decoder";
+        return nullptr;
+    }
+    TIFFOpenOptionsSetErrorHandlerExtR(options, tiff_error, error);
+    TIFFOpenOptionsSetWarningHandlerExtR(options, tiff_warning, nullptr);
+    TIFF* tif = TIFFClientOpenExt("memory", "r", (thandle_t)&source, tiff_read, tiff_write, tiff_seek,
+                                  tiff_close, tiff_size, tiff_map, tiff_unmap, options);
+    TIFFOpenOptionsFree(options);
+    if (!tif && error->empty()) {
+        *error = "Failed to open TIFF image";
+    }
+    return tif;
+}
+
+static bool read_tiff_size(TIFF* tif, int* width, int* height, std::string* error) {
+    uint32_t tiff_width = 0, tiff_height = 0;
+    if (!TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &tiff_width) || !TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &tiff_height) ||
+        tiff_width > (uint32_t)kMaxDimension || tiff_height > (uint32_t)kMaxDimension) {
+        *error = "Invalid TIFF image size";
+        return false;
+    }
+    *width = (int)tiff_width;
+    *height = (int)tiff_height;
+    return check_size(*width, *height, error);
+}
+
+static bool tiff_read_size(const unsigned char* data, size_t size, int* width, int* height, std::string* error) {
+    TiffSource source = { data, (toff_t)size, 0 };
+    TIFF* tif = open_tiff(source, error);
+    if (!tif) return false;
+    bool ok = read_tiff_size(tif, width, height, error);
+    TIFFClose(tif);
+    return ok;
+}
+
+// TIFFRGBAImageGet() reads whole strips or tiles; bands hold at least this many rows
+static const uint32_t kTiffBandRows = 64;
+
+// Rows per TIFFRGBAImageGet() call: a multiple of the strip or tile height,
+// so no strip is decoded twice, and at most the image height
+static int tiff_band_rows(TIFF* tif, int height) {
+    uint32_t rows = 0;
+    if (TIFFIsTiled(tif)) {
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &rows);
+    } else {
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows);
+    }
+    if (rows == 0 || rows >= (uint32_t)height) return height;
+    if (rows < kTiffBandRows) rows = (kTiffBandRows + rows - 1) / rows * rows;
+    return (int)std::min(rows, (uint32_t)height);
+}
+
+// Images stored bottom-up come out of TIFFRGBAImageGet() flipped within each
+// band, so their bands arrive from the bottom of the image
+static bool tiff_bottom_up(const TIFFRGBAImage& image) {
+    switch (image.orientation) {
+    case ORIENTATION_BOTLEFT:
+    case ORIENTATION_BOTRIGHT:
+    case ORIENTATION_LEFTBOT:
+    case ORIENTATION_RIGHTBOT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Compacts packed ABGR words to RGB in place
+static void abgr_to_rgb(unsigned char* buffer, size_t pixels) {
+    const uint32_t* raster = (const uint32_t*)buffer;
+    for (size_t i = 0; i < pixels; i++) {
+        const uint32_t pixel = raster[i];
+        buffer[i * 3] = (unsigned char)TIFFGetR(pixel);
+        buffer[i * 3 + 1] = (unsigned char)TIFFGetG(pixel);
+        buffer[i * 3 + 2] = (unsigned char)TIFFGetB(pixel);
+    }
+}
+
+/**
+ * Reads count rows from row on, oriented top-left, into raster as RGB
+ * The rows are read as width x count ABGR words, then compacted in place.
+ * When tiff_bottom_up(image) they are output rows height - row - count on.
+ */
+static bool read_tiff_band(TIFFRGBAImage& image, int width, int row, int count, unsigned char* raster) {
+    image.row_offset = row;
+    image.col_offset = 0;
+    if (!TIFFRGBAImageGet(&image, (uint32_t*)raster, (uint32_t)width, (uint32_t)count)) return false;
+    abgr_to_rgb(raster, (size_t)width * count);
+    return true;
+}
+
+// Starts TIFFRGBAImage on the first image, to be read top-left first
+static bool begin_tiff_image(TIFF* tif, TIFFRGBAImage& image, std::string* error) {
+    char message[1024];
+    if (!TIFFRGBAImageOK(tif, message) || !TIFFRGBAImageBegin(&image, tif, 0, message)) {
+        *error = message;
+        return false;
+    }
+    image.req_orientation = ORIENTATION_TOPLEFT;
+    return true;
+}
+
+static bool tiff_decode(const unsigned char* data, size_t size, int, int,
+                        PixelBuffer& rgb, int* width, int* height, std::string* error) {
+    TiffSource source = { data, (toff_t)size, 0 };
+    TIFF* tif = open_tiff(source, error);
+    if (!tif) return false;
+    TIFFRGBAImage image;
+    bool ok = read_tiff_size(tif, width, height, error) && begin_tiff_image(tif, image, error);
+    if (!ok) {
+        TIFFClose(tif);
+        return false;
+    }
+
+    // Strip by strip through a band of ABGR words, so only the RGB image is
+    // held whole. A single-strip image is read at once into the RGB buffer,
+    // sized for the ABGR words, and compacted in place.
+    const size_t pixels = (size_t)*width * *height;
+    const size_t row_size = (size_t)*width * 3;
+    const int band_rows = tiff_band_rows(tif, *height);
+    try {
+        if (band_rows == *height) {
+            rgb.resize(pixels * 4);
+            ok = read_tiff_band(image, *width, 0, *height, rgb.data());
+        } else {
+            rgb.resize(pixels * 3);
+            PixelBuffer band((size_t)*width * band_rows * 4);
+            const bool bottom_up = tiff_bottom_up(image);
+            for (int row = 0; ok && row < *height; row += band_rows) {
+                const int count = std::min(band_rows, *height - row);
+                ok = read_tiff_band(image, *width, row, count, band.data());
+                const int first_row = bottom_up ? *height - row - count : row;
+                if (ok) memcpy(rgb.data() + (size_t)first_row * row_size, band.data(), (size_t)count * row_size);
+            }
+        }
+    } catch (...) {
+        TIFFRGBAImageEnd(&image);
+        TIFFClose(tif);
+        throw;
+    }
+    if (ok) {
+        rgb.resize(pixels * 3);
+    } else if (error->empty()) {
+        *error = "Failed to decode TIFF image";
+    }
+    TIFFRGBAImageEnd(&image);
+    TIFFClose(tif);
+    return ok;
+}
+
+static bool tiff_can_decode_strips(const unsigned char* data, size_t size) {
+    TiffSource source = { data, (toff_t)size, 0 };
+    std::string error;
+    TIFF* tif = open_tiff(source, &error);
+    if (!tif) return false;
+    TIFFRGBAImage image;
+    int width, height;
+    bool ok = read_tiff_size(tif, &width, &height, &error) && begin_tiff_image(tif, image, &error);
+    if (ok) {
+        ok = !tiff_bottom_up(image);
+        TIFFRGBAImageEnd(&image);
+    }
+    TIFFClose(tif);
+    return ok;
+}
+
+static bool tiff_decode_strips(const unsigned char* data, size_t size, StripEncoder& encoder, std::string* error) {
+    TiffSource source = { data, (toff_t)size, 0 };
+    TIFF* tif = open_tiff(source, error);
+    if (!tif) return false;
+    TIFFRGBAImage image;
+    int width, height;
+    bool ok = read_tiff_size(tif, &width, &height, error) && begin_tiff_image(tif, image, error);
+    if (!ok) {
+        TIFFClose(tif);
+        return false;
+    }
+
+    const int band_rows = tiff_band_rows(tif, height);
+    bool pushed = true;
+    try {
+        PixelBuffer band((size_t)width * band_rows * 4);
+        record_buffer(band.size());
+        for (int row = 0; ok && pushed && row < height; row += band_rows) {
+            const int count = std::min(band_rows, height - row);
+            {
+                StageTimer timer(&PipelineStats::decode_ns);
+                ok = read_tiff_band(image, width, row, count, band.data());
+            }
+            pushed = ok && encoder.push(band.data(), count, 0);
+        }
+    } catch (...) {
+        TIFFRGBAImageEnd(&image);
+        TIFFClose(tif);
+        throw;
+    }
+    if (!ok && error->empty()) {
+        *error = "Failed to decode TIFF image";
+    }
+    TIFFRGBAImageEnd(&image);
+    TIFFClose(tif);
+    return ok && pushed;
+}
+#endif
+
+const ImageDecoder* find_image_decoder(const unsigned char* data, size_t size) {
+#ifdef RAW_PREVIEW_HAVE_SPNG
+    static const ImageDecoder png = { "spng", png_read_size, png_decode, png_can_decode_strips, png_decode_strips };
+    if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) return &png;
+#endif
+#ifdef RAW_PREVIEW_HAVE_WEBP
+    static const ImageDecoder webp = { "libwebp", webp_read_size, webp_decode, nullptr, nullptr };
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0) return &webp;
+#endif
+#ifdef RAW_PREVIEW_HAVE_TIFF
+    static const ImageDecoder tiff = { "libtiff", tiff_read_size, tiff_decode,
+                                       tiff_can_decode_strips, tiff_decode_strips };
+    // Classic and BigTIFF, either byte order
+    if (size >= 4 && (memcmp(data, "II*\0", 4) == 0 || memcmp(data, "MM\0*", 4) == 0 ||
+                      memcmp(data, "II+\0", 4) == 0 || memcmp(data, "MM\0+", 4) == 0)) return &tiff;
+#endif
+    (void)data;
+    (void)size;
+    return nullptr;
+}
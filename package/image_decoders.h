@@ -0,0 +1,59 @@
+#ifndef IMAGE_DECODERS_H
+#define IMAGE_DECODERS_H
+
+// Native decoders for standard image formats, selected at build time by the
+// spng, webp and tiff Cargo features (RAW_PREVIEW_HAVE_SPNG,
+// RAW_PREVIEW_HAVE_WEBP, RAW_PREVIEW_HAVE_TIFF). Formats without a decoder
+// here are decoded by stb_image in libjpeg_wrapper.cpp. Internal C++
+// interface, not exported to Rust.
+
+#include <stddef.h>
+#include <string>
+#include "buffer_pool.h"
+#include "image_ops.h"
+
+/**
+ * One decoder backend
+ */
+struct ImageDecoder {
+    // Short name for log messages, e.g. "spng"
+    const char* name;
+    /**
+     * Reads the image size from the headers without decoding pixels
+     * @return false with error set if the headers cannot be read
+     */
+    bool (*read_size)(const unsigned char* data, size_t size, int* width, int* height, std::string* error);
+    /**
+     * Decodes the first image into tightly packed 8-bit RGB
+     * Alpha is dropped. Decoders that can scale (WebP) decode straight to
+     * min_width x min_height when it is smaller than the image; the others
+     * ignore it and return the full image. 0 x 0 requests the full image.
+     * @param rgb Receives the pixels, allocated from the buffer pool
+     * @return false with error set on failure
+     */
+    bool (*decode)(const unsigned char* data, size_t size, int min_width, int min_height,
+                   PixelBuffer& rgb, int* width, int* height, std::string* error);
+    /**
+     * Returns true if decode_strips can stream this image; null if the
+     * backend never can. Images that would not arrive top to bottom (an
+     * interlaced PNG, a TIFF stored bottom-up) are decoded whole instead.
+     */
+    bool (*can_decode_strips)(const unsigned char* data, size_t size);
+    /**
+     * Decodes the first image in bands of rows straight into a started
+     * StripEncoder, like decode_jpeg_strips(). Only one band of decoded rows
+     * is held at a time. Null when can_decode_strips is.
+     * @param encoder Encoder started with the full size from read_size
+     * @param error Receives the error message on failure, unless the encoder has it
+     * @return true on success
+     */
+    bool (*decode_strips)(const unsigned char* data, size_t size, StripEncoder& encoder, std::string* error);
+};
+
+/**
+ * Picks the backend for the signature at the start of data
+ * @return The decoder, or null if none compiled in handles the format
+ */
+const ImageDecoder* find_image_decoder(const unsigned char* data, size_t size);
+
+#endif // IMAGE_DECODERS_H
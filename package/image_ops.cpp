@@ -0,0 +1,1093 @@
+#include "image_ops.h"
+#include <algorithm>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <thread>
+#include "jpeglib.h"
+#include "pipeline_stats.h"
+
+// Vector unit used by the vertical resize pass. RAW_PREVIEW_NO_SIMD is set
+// by build.rs when SIMD is disabled, leaving only the scalar loop.
+#if !defined(RAW_PREVIEW_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define IMAGE_OPS_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IMAGE_OPS_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGE_OPS_NEON 1
+#endif
+#endif
+
+bool has_target_size(const PreviewOptions& options) {
+    return options.max_edge > 0 || options.target_width > 0 || options.target_height > 0;
+}
+
+void compute_target_size(int width, int height, const PreviewOptions& options, int* target_width, int* target_height) {
+    PreviewLevel level = { options.max_edge, options.target_width, options.target_height };
+    compute_level_size(width, height, level, target_width, target_height);
+}
+
+void compute_level_size(int width, int height, const PreviewLevel& level, int* target_width, int* target_height) {
+    *target_width = width;
+    *target_height = height;
+    if (width <= 0 || height <= 0) return;
+
+    double scale = 1.0;
+    if (level.max_edge > 0) scale = std::min(scale, (double)level.max_edge / std::max(width, height));
+    if (level.target_width > 0) scale = std::min(scale, (double)level.target_width / width);
+    if (level.target_height > 0) scale = std::min(scale, (double)level.target_height / height);
+
+    *target_width = std::min(width, std::max(1, (int)std::lround(width * scale)));
+    *target_height = std::min(height, std::max(1, (int)std::lround(height * scale)));
+}
+
+bool fills_target(const PreviewOptions& options) {
+    return options.crop_to_fill && options.target_width > 0 && options.target_height > 0;
+}
+
+void compute_fill_size(int width, int height, int box_width, int box_height,
+                       int* scaled_width, int* scaled_height, int* out_width, int* out_height) {
+    *scaled_width = *out_width = width;
+    *scaled_height = *out_height = height;
+    if (width <= 0 || height <= 0 || box_width <= 0 || box_height <= 0) return;
+
+    const double scale = std::min(1.0, std::max((double)box_width / width, (double)box_height / height));
+    *scaled_width = std::min(width, std::max(1, (int)std::lround(width * scale)));
+    *scaled_height = std::min(height, std::max(1, (int)std::lround(height * scale)));
+    *out_width = std::min(box_width, *scaled_width);
+    *out_height = std::min(box_height, *scaled_height);
+}
+
+void center_region(int width, int height, int out_width, int out_height,
+                   int* x, int* y, int* region_width, int* region_height) {
+    *region_width = width;
+    *region_height = height;
+    if (out_width > 0 && out_height > 0) {
+        if ((long long)width * out_height > (long long)height * out_width) {
+            *region_width = std::max(1, std::min(width, (int)std::lround((double)height * out_width / out_height)));
+        } else {
+            *region_height = std::max(1, std::min(height, (int)std::lround((double)width * out_height / out_width)));
+        }
+    }
+    *x = (width - *region_width) / 2;
+    *y = (height - *region_height) / 2;
+}
+
+bool valid_pyramid_levels(const PreviewLevel* levels, int count) {
+    if (!levels || count <= 0) return false;
+    for (int i = 0; i < count; i++) {
+        if (levels[i].max_edge <= 0 && levels[i].target_width <= 0 && levels[i].target_height <= 0) return false;
+    }
+    return true;
+}
+
+// Index of the level with the most pixels for a width x height source
+static int largest_level(int width, int height, const PreviewLevel* levels, int count) {
+    int largest = 0;
+    long long largest_area = -1;
+    for (int i = 0; i < count; i++) {
+        int w, h;
+        compute_level_size(width, height, levels[i], &w, &h);
+        if ((long long)w * h > largest_area) {
+            largest = i;
+            largest_area = (long long)w * h;
+        }
+    }
+    return largest;
+}
+
+PreviewOptions options_for_largest_level(const PreviewOptions& options, int width, int height,
+                                         const PreviewLevel* levels, int count) {
+    const PreviewLevel& level = levels[largest_level(width, height, levels, count)];
+    PreviewOptions result = options;
+    result.max_edge = level.max_edge;
+    result.target_width = level.target_width;
+    result.target_height = level.target_height;
+    // Pyramid levels always fit their bounds
+    result.crop_to_fill = 0;
+    return result;
+}
+
+// Source span and overlap weights of every output index along one axis
+struct AxisWeights {
+    std::vector<int> first;     // First source index contributing to output i
+    std::vector<int> count;     // Number of contributing source indices
+    std::vector<int> offset;    // Start of output i's weights in `weights`
+    std::vector<float> weights; // Overlap / scale, summing to 1 per output index
+};
+
+static void compute_axis_weights(int src_size, int dst_size, AxisWeights& axis) {
+    const double scale = (double)src_size / dst_size;
+    axis.first.resize(dst_size);
+    axis.count.resize(dst_size);
+    axis.offset.resize(dst_size);
+    axis.weights.clear();
+    axis.weights.reserve((size_t)dst_size * ((int)scale + 2));
+
+    for (int i = 0; i < dst_size; i++) {
+        const double start = i * scale;
+        const double end = (i + 1) * scale;
+        const int first = std::min(src_size - 1, (int)start);
+        const int last = std::max(first + 1, std::min(src_size, (int)std::ceil(end)));
+
+        axis.first[i] = first;
+        axis.count[i] = last - first;
+        axis.offset[i] = (int)axis.weights.size();
+        for (int j = first; j < last; j++) {
+            double overlap = std::min(end, j + 1.0) - std::max(start, (double)j);
+            axis.weights.push_back((float)(std::max(0.0, overlap) / scale));
+        }
+    }
+}
+
+// acc[i] += src[i] * weight for one row of samples
+static void accumulate_row(float* acc, const unsigned char* src, int n, float weight) {
+    int i = 0;
+#if defined(IMAGE_OPS_AVX2)
+    const __m256 w = _mm256_set1_ps(weight);
+    for (; i + 8 <= n; i += 8) {
+        __m128i px = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i));
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(px));
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(v, w)));
+    }
+#elif defined(IMAGE_OPS_SSE2)
+    const __m128 w = _mm_set1_ps(weight);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        __m128 v0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+        __m128 v1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+        __m128 v2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+        __m128 v3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(v0, w)));
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(v1, w)));
+        _mm_storeu_ps(acc + i + 8, _mm_add_ps(_mm_loadu_ps(acc + i + 8), _mm_mul_ps(v2, w)));
+        _mm_storeu_ps(acc + i + 12, _mm_add_ps(_mm_loadu_ps(acc + i + 12), _mm_mul_ps(v3, w)));
+    }
+#elif defined(IMAGE_OPS_NEON)
+    const float32x4_t w = vdupq_n_f32(weight);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t px = vld1q_u8(src + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(px));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(px));
+        vst1q_f32(acc + i, vmlaq_f32(vld1q_f32(acc + i), vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), w));
+        vst1q_f32(acc + i + 4, vmlaq_f32(vld1q_f32(acc + i + 4), vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), w));
+        vst1q_f32(acc + i + 8, vmlaq_f32(vld1q_f32(acc + i + 8), vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), w));
+        vst1q_f32(acc + i + 12, vmlaq_f32(vld1q_f32(acc + i + 12), vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), w));
+    }
+#endif
+    for (; i < n; i++) {
+        acc[i] += src[i] * weight;
+    }
+}
+
+// Area-average resizer fed one source row at a time, top to bottom
+// Vertical pass: each source row is blended into the float rows of the
+// (at most two) output rows it covers, the bulk of the work, vectorized;
+// horizontal pass: an output row is reduced to the output width as soon as
+// its last source row has arrived.
+class AreaResizer {
+public:
+    void start(int src_width, int src_height, int dst_width, int dst_height, int channels) {
+        src_row_ = src_width * channels;
+        dst_width_ = dst_width;
+        dst_height_ = dst_height;
+        channels_ = channels;
+        next_source_ = 0;
+        next_output_ = 0;
+        compute_axis_weights(src_height, dst_height, rows_);
+        compute_axis_weights(src_width, dst_width, cols_);
+        for (int i = 0; i < 2; i++) acc_[i].assign(src_row_, 0.0f);
+    }
+
+    // Index of the next output row to be completed
+    int next_output() const { return next_output_; }
+
+    // Adds the next source row; returns true if it completed output row
+    // next_output() (before the call), which is written to out
+    bool add_row(const unsigned char* src, unsigned char* out) {
+        const int j = next_source_++;
+        // With a scale of at least 1, a source row covers at most one
+        // output row besides the one in progress
+        for (int y = next_output_; y < dst_height_ && rows_.first[y] <= j; y++) {
+            const int k = j - rows_.first[y];
+            if (k >= rows_.count[y]) continue;
+            std::vector<float>& acc = acc_[y & 1];
+            if (k == 0) std::fill(acc.begin(), acc.end(), 0.0f);
+            accumulate_row(acc.data(), src, src_row_, rows_.weights[rows_.offset[y] + k]);
+        }
+
+        const int y = next_output_;
+        if (y >= dst_height_ || j != rows_.first[y] + rows_.count[y] - 1) return false;
+        reduce_row(acc_[y & 1].data(), out);
+        next_output_++;
+        return true;
+    }
+
+private:
+    void reduce_row(const float* acc, unsigned char* out) const {
+        for (int x = 0; x < dst_width_; x++) {
+            const float* wx = &cols_.weights[cols_.offset[x]];
+            const float* in = &acc[(size_t)cols_.first[x] * channels_];
+            for (int c = 0; c < channels_; c++) {
+                float sum = 0.0f;
+                for (int k = 0; k < cols_.count[x]; k++) {
+                    sum += in[k * channels_ + c] * wx[k];
+                }
+                int value = (int)(sum + 0.5f);
+                out[x * channels_ + c] = (unsigned char)std::min(255, std::max(0, value));
+            }
+        }
+    }
+
+    AxisWeights rows_, cols_;
+    std::vector<float> acc_[2]; // Output rows in progress, indexed by row parity
+    int src_row_ = 0;
+    int dst_width_ = 0;
+    int dst_height_ = 0;
+    int channels_ = 0;
+    int next_source_ = 0;
+    int next_output_ = 0;
+};
+
+bool resize_area(const unsigned char* src, int src_width, int src_height, int src_pitch,
+                 unsigned char* dst, int dst_width, int dst_height, int channels) {
+    if (!src || !dst || channels <= 0 || src_width <= 0 || src_height <= 0
+        || dst_width <= 0 || dst_height <= 0 || dst_width > src_width || dst_height > src_height) {
+        return false;
+    }
+
+    const int src_row = src_width * channels;
+    const int dst_row = dst_width * channels;
+    if (src_pitch <= 0) src_pitch = src_row;
+
+    if (dst_width == src_width && dst_height == src_height) {
+        for (int y = 0; y < dst_height; y++) {
+            memcpy(dst + (size_t)y * dst_row, src + (size_t)y * src_pitch, dst_row);
+        }
+        return true;
+    }
+
+    AreaResizer resizer;
+    resizer.start(src_width, src_height, dst_width, dst_height, channels);
+    for (int y = 0; y < src_height; y++) {
+        resizer.add_row(src + (size_t)y * src_pitch, dst + (size_t)resizer.next_output() * dst_row);
+    }
+    return true;
+}
+
+bool orientation_transposes(int orientation) {
+    return orientation >= 5 && orientation <= 8;
+}
+
+static void swap_pixels(unsigned char* a, unsigned char* b) {
+    std::swap(a[0], b[0]);
+    std::swap(a[1], b[1]);
+    std::swap(a[2], b[2]);
+}
+
+// Reverses the order of count RGB pixels in place
+static void reverse_pixels(unsigned char* pixels, size_t count) {
+    if (count < 2) return;
+    unsigned char* front = pixels;
+    unsigned char* back = pixels + (count - 1) * 3;
+    for (; front < back; front += 3, back -= 3) {
+        swap_pixels(front, back);
+    }
+}
+
+// Edge of the square tiles the transposing orientations are copied in. A
+// tile touches kOrientTile source rows and kOrientTile destination rows of
+// kOrientTile * 3 bytes, which stays in L1 for any image width.
+static const int kOrientTile = 32;
+
+// Orientations 5-8: dst(x, y) = src at origin + y * step_y + x * step_x,
+// where the steps are +-3 bytes (along a source row) or +-pitch (along a
+// source column), walked tile by tile
+static void transpose_tiled(const unsigned char* src, int src_width, int src_height, int orientation,
+                            unsigned char* dst) {
+    const ptrdiff_t pitch = (ptrdiff_t)src_width * 3;
+    const ptrdiff_t last_row = (ptrdiff_t)(src_height - 1) * pitch;
+    const ptrdiff_t last_col = (ptrdiff_t)(src_width - 1) * 3;
+    ptrdiff_t origin, step_x, step_y;
+    switch (orientation) {
+    case 5: origin = 0;                   step_x = pitch;  step_y = 3;  break; // Transpose
+    case 6: origin = last_row;            step_x = -pitch; step_y = 3;  break; // 90 CW
+    case 7: origin = last_row + last_col; step_x = -pitch; step_y = -3; break; // Transverse
+    default: origin = last_col;           step_x = pitch;  step_y = -3; break; // 90 CCW
+    }
+
+    const int dst_width = src_height;
+    const int dst_height = src_width;
+    for (int ty = 0; ty < dst_height; ty += kOrientTile) {
+        const int y_end = std::min(dst_height, ty + kOrientTile);
+        for (int tx = 0; tx < dst_width; tx += kOrientTile) {
+            const int x_end = std::min(dst_width, tx + kOrientTile);
+            for (int y = ty; y < y_end; y++) {
+                const unsigned char* in = src + origin + y * step_y + tx * step_x;
+                unsigned char* out = dst + ((size_t)y * dst_width + tx) * 3;
+                for (int x = tx; x < x_end; x++, in += step_x, out += 3) {
+                    out[0] = in[0];
+                    out[1] = in[1];
+                    out[2] = in[2];
+                }
+            }
+        }
+    }
+}
+
+void apply_exif_orientation(int orientation, PixelBuffer& rgb, int* width, int* height) {
+    const int w = *width;
+    const int h = *height;
+    if (orientation < 2 || orientation > 8 || w <= 0 || h <= 0 || rgb.size() < (size_t)w * h * 3) return;
+
+    const size_t row = (size_t)w * 3;
+    unsigned char* pixels = rgb.data();
+    switch (orientation) {
+    case 2: // Mirror horizontally
+        for (int y = 0; y < h; y++) {
+            reverse_pixels(pixels + y * row, w);
+        }
+        return;
+    case 3: // Rotate 180: the whole image is one reversed run of pixels
+        reverse_pixels(pixels, (size_t)w * h);
+        return;
+    case 4: // Mirror vertically
+        for (int y = 0; y < h / 2; y++) {
+            std::swap_ranges(pixels + y * row, pixels + (y + 1) * row, pixels + (size_t)(h - 1 - y) * row);
+        }
+        return;
+    default:
+        break;
+    }
+
+    PixelBuffer oriented(rgb.size());
+    transpose_tiled(pixels, w, h, orientation, oriented.data());
+    rgb.swap(oriented);
+    *width = h;
+    *height = w;
+}
+
+void select_jpeg_scaling(int width, int height, int min_width, int min_height, int* scaled_width, int* scaled_height) {
+    *scaled_width = width;
+    *scaled_height = height;
+
+    int count = 0;
+    tjscalingfactor* factors = tjGetScalingFactors(&count);
+    if (!factors) return;
+
+    for (int i = 0; i < count; i++) {
+        if (factors[i].num > factors[i].denom) continue; // Never upscale
+        int w = TJSCALED(width, factors[i]);
+        int h = TJSCALED(height, factors[i]);
+        if (w >= min_width && h >= min_height && (long long)w * h < (long long)*scaled_width * *scaled_height) {
+            *scaled_width = w;
+            *scaled_height = h;
+        }
+    }
+}
+
+int decode_jpeg_scaled(tjhandle decompressor, const unsigned char* data, size_t size, int min_width, int min_height,
+                       PixelBuffer& rgb, int* width, int* height) {
+    if (!decompressor) return -1;
+
+    int full_width, full_height, subsampling, colorspace;
+    if (tjDecompressHeader3(decompressor, data, (unsigned long)size, &full_width, &full_height, &subsampling, &colorspace) != 0) {
+        return -1;
+    }
+
+    select_jpeg_scaling(full_width, full_height, min_width, min_height, width, height);
+    rgb.resize((size_t)*width * *height * tjPixelSize[TJPF_RGB]);
+
+    // Requesting exactly the scaled size makes TurboJPEG use that scaling factor
+    return tjDecompress2(decompressor, data, (unsigned long)size, rgb.data(), *width, 0, *height, TJPF_RGB, TJFLAG_FASTDCT);
+}
+
+// Quality used when JpegEncodeOptions::quality is 0
+#define DEFAULT_JPEG_QUALITY 75
+
+// Luma sampling factors of each TJSAMP_* value (chroma is always 1x1)
+static const int luma_h_samp[TJ_NUMSAMP] = { 1, 2, 2, 1, 1, 4 };
+static const int luma_v_samp[TJ_NUMSAMP] = { 1, 1, 2, 1, 2, 1 };
+
+// libjpeg error manager that returns to compress_optimized() instead of exiting
+struct JpegErrorManager {
+    jpeg_error_mgr base;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorManager* manager = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, manager->message);
+    longjmp(manager->jump, 1);
+}
+
+static void jpeg_ignore_message(j_common_ptr) {}
+
+// Destination buffer of compress_optimized(), kept out of registers so its
+// value is still valid after longjmp()
+struct JpegDestination {
+    unsigned char* data;
+    unsigned long size;
+};
+
+/**
+ * Applies the settings tjCompress2() uses for encode to a libjpeg compressor
+ * for width x height RGB pixels
+ */
+static void configure_compressor(jpeg_compress_struct& cinfo, int width, int height, const JpegEncodeOptions& encode,
+                                 int quality) {
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_EXT_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    if (encode.subsampling == TJSAMP_GRAY) {
+        jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
+    } else {
+        cinfo.comp_info[0].h_samp_factor = luma_h_samp[encode.subsampling];
+        cinfo.comp_info[0].v_samp_factor = luma_v_samp[encode.subsampling];
+    }
+    cinfo.dct_method = encode.accurate_dct || quality >= 96 ? JDCT_ISLOW : JDCT_IFAST;
+    cinfo.optimize_coding = encode.optimize_huffman ? TRUE : FALSE;
+    if (encode.progressive) jpeg_simple_progression(&cinfo);
+}
+
+/**
+ * Compresses a baseline JPEG with optimized Huffman tables
+ * The TurboJPEG 2.x API cannot request optimize_coding, so this goes
+ * through the libjpeg API with the same settings tjCompress2() would use.
+ */
+static int compress_optimized(const unsigned char* rgb, int width, int height, const JpegEncodeOptions& encode,
+                              int quality, unsigned char** jpeg, unsigned long* jpeg_size, bool no_realloc,
+                              std::string* error) {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager manager;
+    JpegDestination destination = { no_realloc ? *jpeg : nullptr, no_realloc ? *jpeg_size : 0 };
+    memset(&cinfo, 0, sizeof(cinfo));
+
+    cinfo.err = jpeg_std_error(&manager.base);
+    manager.base.error_exit = jpeg_error_exit;
+    manager.base.output_message = jpeg_ignore_message;
+    if (setjmp(manager.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        if (destination.data && (!no_realloc || destination.data != *jpeg)) free(destination.data);
+        if (error) *error = manager.message;
+        return -1;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &destination.data, &destination.size);
+    configure_compressor(cinfo, width, height, encode, quality);
+
+    jpeg_start_compress(&cinfo, TRUE);
+    const size_t pitch = (size_t)width * 3;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(rgb + cinfo.next_scanline * pitch);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    if (no_realloc && destination.data != *jpeg) {
+        // libjpeg outgrew the caller's buffer; cannot happen with jpeg_buffer_size()
+        free(destination.data);
+        if (error) *error = "JPEG output buffer too small";
+        return -1;
+    }
+    *jpeg = destination.data;
+    *jpeg_size = destination.size;
+    return 0;
+}
+
+unsigned long jpeg_buffer_size(int width, int height, const JpegEncodeOptions& encode) {
+    const int subsampling = encode.subsampling >= 0 && encode.subsampling < TJ_NUMSAMP ? encode.subsampling : TJSAMP_444;
+    return tjBufSize(width, height, subsampling);
+}
+
+int compress_jpeg(tjhandle compressor, const unsigned char* rgb, int width, int height, const JpegEncodeOptions& encode,
+                  unsigned char** jpeg, unsigned long* jpeg_size, bool no_realloc, std::string* error) {
+    if (encode.subsampling < 0 || encode.subsampling >= TJ_NUMSAMP) {
+        if (error) *error = "Invalid JPEG subsampling";
+        return -1;
+    }
+    const int quality = encode.quality > 0 ? std::min(encode.quality, 100) : DEFAULT_JPEG_QUALITY;
+
+    if (encode.optimize_huffman && !encode.progressive) {
+        return compress_optimized(rgb, width, height, encode, quality, jpeg, jpeg_size, no_realloc, error);
+    }
+
+    int flags = encode.accurate_dct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT;
+    if (encode.progressive) flags |= TJFLAG_PROGRESSIVE;
+    if (no_realloc) flags |= TJFLAG_NOREALLOC;
+    if (tjCompress2(compressor, rgb, width, 0, height, TJPF_RGB, jpeg, jpeg_size,
+                    encode.subsampling, quality, flags) != 0) {
+        if (error) *error = tjGetErrorStr2(compressor);
+        return -1;
+    }
+    return 0;
+}
+
+int compress_jpeg_pooled(tjhandle compressor, const unsigned char* rgb, int width, int height,
+                         const JpegEncodeOptions& encode, unsigned char** jpeg, unsigned long* jpeg_size,
+                         std::string* error) {
+    *jpeg = nullptr;
+    *jpeg_size = 0;
+    unsigned long capacity = jpeg_buffer_size(width, height, encode);
+    if (capacity == (unsigned long)-1) return -1;
+    unsigned char* buffer = static_cast<unsigned char*>(pool_alloc(capacity));
+    if (!buffer) {
+        if (error) *error = "Failed to allocate JPEG buffer";
+        return -1;
+    }
+
+    unsigned long size = capacity;
+    if (compress_jpeg(compressor, rgb, width, height, encode, &buffer, &size, true, error) != 0) {
+        pool_free(buffer);
+        return -1;
+    }
+    *jpeg = buffer;
+    *jpeg_size = size;
+    return 0;
+}
+
+int compress_rgb_into(tjhandle compressor, const unsigned char* rgb, int width, int height,
+                      const JpegEncodeOptions& encode, PreviewAllocFn alloc, void* user_data,
+                      unsigned char** out_buf, size_t* out_size, std::string* error) {
+    if (!compressor || !rgb || !alloc || !out_buf || !out_size) return -1;
+
+    // jpeg_buffer_size() is the worst case for these dimensions, so NOREALLOC is safe
+    unsigned long capacity = jpeg_buffer_size(width, height, encode);
+    if (capacity == (unsigned long)-1) return -1;
+    unsigned char* jpeg = alloc(user_data, capacity);
+    if (!jpeg) return -2;
+
+    unsigned long jpeg_size = capacity;
+    if (compress_jpeg(compressor, rgb, width, height, encode, &jpeg, &jpeg_size, true, error) != 0) {
+        return -1;
+    }
+    *out_buf = jpeg;
+    *out_size = jpeg_size;
+    return 0;
+}
+
+// Images decoded at this many pixels or more go through StripEncoder
+static const long long kStripMinPixels = 16LL * 1000 * 1000;
+
+// Rows handed to libjpeg per call, decoding and encoding
+static const int kStripRows = 16;
+
+bool prefer_strips(int width, int height) {
+    return (long long)width * height >= kStripMinPixels;
+}
+
+struct StripEncoder::State {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager manager;
+    JpegDestination destination = { nullptr, 0 };
+    unsigned char* jpeg = nullptr; // Caller's buffer
+    bool created = false;
+    bool failed = false;
+    std::string error;
+
+    AreaResizer resizer;
+    bool resize = false;
+    int src_width = 0;
+    int src_height = 0;
+    int rows_pushed = 0;
+    int dst_width = 0;
+    int dst_height = 0;
+    int orientation = 1;
+    bool collect = false;  // Orientation needs the whole output image
+    PixelBuffer pixels;    // Output rows awaiting the compressor, or the whole output when collecting
+    int rows_ready = 0;
+    int rows_capacity = 0;
+
+    ~State() {
+        if (created) jpeg_destroy_compress(&cinfo);
+        if (destination.data && destination.data != jpeg) free(destination.data);
+    }
+
+    // The libjpeg calls, each returning false after error_exit()
+    bool start_compress(int width, int height, const JpegEncodeOptions& encode, int quality) {
+        memset(&cinfo, 0, sizeof(cinfo));
+        cinfo.err = jpeg_std_error(&manager.base);
+        manager.base.error_exit = jpeg_error_exit;
+        manager.base.output_message = jpeg_ignore_message;
+        if (setjmp(manager.jump)) return fail(manager.message);
+
+        jpeg_create_compress(&cinfo);
+        created = true;
+        jpeg_mem_dest(&cinfo, &destination.data, &destination.size);
+        configure_compressor(cinfo, width, height, encode, quality);
+        jpeg_start_compress(&cinfo, TRUE);
+        return true;
+    }
+
+    bool write_rows(const unsigned char* rows, int count, size_t pitch) {
+        if (setjmp(manager.jump)) return fail(manager.message);
+        for (int i = 0; i < count; i++) {
+            JSAMPROW row = const_cast<JSAMPROW>(rows + (size_t)i * pitch);
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        return true;
+    }
+
+    bool finish_compress() {
+        if (setjmp(manager.jump)) return fail(manager.message);
+        jpeg_finish_compress(&cinfo);
+        return true;
+    }
+
+    // Compresses the rows collected in pixels (mirrored for orientation 2)
+    bool flush() {
+        StageTimer timer(&PipelineStats::encode_ns);
+        const size_t pitch = (size_t)dst_width * 3;
+        if (orientation == 2) {
+            for (int i = 0; i < rows_ready; i++) reverse_pixels(pixels.data() + i * pitch, dst_width);
+        }
+        const int count = rows_ready;
+        rows_ready = 0;
+        return write_rows(pixels.data(), count, pitch);
+    }
+
+    bool fail(const std::string& message) {
+        failed = true;
+        error = message;
+        return false;
+    }
+};
+
+StripEncoder::StripEncoder() {}
+
+StripEncoder::~StripEncoder() {}
+
+bool StripEncoder::start(int src_width, int src_height, int dst_width, int dst_height, int orientation,
+                         const JpegEncodeOptions& encode, unsigned char* jpeg, unsigned long capacity) {
+    state_.reset(new State);
+    State& s = *state_;
+    if (!jpeg || src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0
+        || dst_width > src_width || dst_height > src_height) {
+        return s.fail("Invalid strip encoder arguments");
+    }
+    if (encode.subsampling < 0 || encode.subsampling >= TJ_NUMSAMP) return s.fail("Invalid JPEG subsampling");
+    const int quality = encode.quality > 0 ? std::min(encode.quality, 100) : DEFAULT_JPEG_QUALITY;
+
+    s.src_width = src_width;
+    s.src_height = src_height;
+    s.dst_width = dst_width;
+    s.dst_height = dst_height;
+    s.orientation = orientation;
+    s.collect = orientation >= 3 && orientation <= 8;
+    s.resize = dst_width != src_width || dst_height != src_height;
+    if (s.resize) s.resizer.start(src_width, src_height, dst_width, dst_height, 3);
+
+    // Rows are compressed straight from the caller's bands when nothing
+    // has to be done to them first
+    if (s.resize || s.collect || orientation == 2) {
+        s.rows_capacity = s.collect ? dst_height : std::min(kStripRows, dst_height);
+        s.pixels.resize((size_t)dst_width * 3 * s.rows_capacity);
+        record_buffer(s.pixels.size());
+    }
+
+    s.jpeg = jpeg;
+    s.destination.data = jpeg;
+    s.destination.size = capacity;
+    const bool transposed = orientation_transposes(orientation);
+    return s.start_compress(transposed ? dst_height : dst_width, transposed ? dst_width : dst_height, encode, quality);
+}
+
+bool StripEncoder::push(const unsigned char* rows, int count, size_t pitch) {
+    if (!state_ || state_->failed) return false;
+    State& s = *state_;
+    if (!rows || count < 0 || count > s.src_height - s.rows_pushed) return s.fail("Too many rows for the strip encoder");
+    const size_t src_row = (size_t)s.src_width * 3;
+    if (pitch == 0) pitch = src_row;
+    s.rows_pushed += count;
+
+    if (!s.rows_capacity) {
+        StageTimer timer(&PipelineStats::encode_ns);
+        return s.write_rows(rows, count, pitch);
+    }
+
+    const size_t dst_row = (size_t)s.dst_width * 3;
+    int i = 0;
+    while (i < count) {
+        {
+            StageTimer timer(&PipelineStats::resize_ns);
+            for (; i < count && s.rows_ready < s.rows_capacity; i++) {
+                const unsigned char* src = rows + (size_t)i * pitch;
+                unsigned char* out = s.pixels.data() + (size_t)s.rows_ready * dst_row;
+                if (!s.resize) {
+                    memcpy(out, src, src_row);
+                    s.rows_ready++;
+                } else if (s.resizer.add_row(src, out)) {
+                    s.rows_ready++;
+                }
+            }
+        }
+        if (!s.collect && s.rows_ready == s.rows_capacity && !s.flush()) return false;
+    }
+    return true;
+}
+
+bool StripEncoder::finish(unsigned long* jpeg_size) {
+    if (!state_ || state_->failed) return false;
+    State& s = *state_;
+    if (s.rows_pushed != s.src_height) return s.fail("Strip encoder finished before the last row");
+
+    if (s.collect) {
+        int width = s.dst_width, height = s.dst_height;
+        {
+            StageTimer timer(&PipelineStats::orient_ns);
+            if (orientation_transposes(s.orientation)) record_buffer(s.pixels.size());
+            apply_exif_orientation(s.orientation, s.pixels, &width, &height);
+        }
+        StageTimer timer(&PipelineStats::encode_ns);
+        if (!s.write_rows(s.pixels.data(), height, (size_t)width * 3)) return false;
+    } else if (s.rows_ready > 0 && !s.flush()) {
+        return false;
+    }
+
+    StageTimer timer(&PipelineStats::encode_ns);
+    if (!s.finish_compress()) return false;
+    if (s.destination.data != s.jpeg) {
+        // libjpeg outgrew the caller's buffer; cannot happen with jpeg_buffer_size()
+        return s.fail("JPEG output buffer too small");
+    }
+    *jpeg_size = s.destination.size;
+    return true;
+}
+
+const std::string& StripEncoder::error() const {
+    static const std::string none;
+    return state_ ? state_->error : none;
+}
+
+// Scanline JPEG decoder of decode_jpeg_strips() and decode_jpeg_region()
+struct JpegStripSource {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager manager;
+    bool created = false;
+    std::string error;
+
+    ~JpegStripSource() {
+        if (created) jpeg_destroy_decompress(&cinfo);
+    }
+
+    // Starts decoding at the DCT scale producing scaled_width x scaled_height,
+    // with the settings tjDecompress2() uses with TJFLAG_FASTDCT
+    bool start(const unsigned char* data, size_t size, int scaled_width, int scaled_height) {
+        memset(&cinfo, 0, sizeof(cinfo));
+        cinfo.err = jpeg_std_error(&manager.base);
+        manager.base.error_exit = jpeg_error_exit;
+        manager.base.output_message = jpeg_ignore_message;
+        if (setjmp(manager.jump)) {
+            error = manager.message;
+            return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+        created = true;
+        jpeg_mem_src(&cinfo, data, (unsigned long)size);
+        jpeg_read_header(&cinfo, TRUE);
+        cinfo.out_color_space = JCS_EXT_RGB;
+        cinfo.dct_method = JDCT_IFAST;
+        cinfo.scale_denom = 8;
+        for (cinfo.scale_num = 1; cinfo.scale_num <= 8; cinfo.scale_num++) {
+            jpeg_calc_output_dimensions(&cinfo);
+            if ((int)cinfo.output_width == scaled_width && (int)cinfo.output_height == scaled_height) break;
+        }
+        if (cinfo.scale_num > 8) {
+            error = "No DCT scale produces the requested size";
+            return false;
+        }
+        jpeg_start_decompress(&cinfo);
+        return true;
+    }
+
+    // Limits decoding to columns [x, x + width) and skips the first y rows.
+    // libjpeg widens the columns to iMCU boundaries; *xoffset receives the
+    // first decoded column and output_width the decoded width.
+    bool crop(int x, int y, int width, int* xoffset) {
+        if (setjmp(manager.jump)) {
+            error = manager.message;
+            return false;
+        }
+        JDIMENSION crop_x = (JDIMENSION)x, crop_width = (JDIMENSION)width;
+        jpeg_crop_scanline(&cinfo, &crop_x, &crop_width);
+        *xoffset = (int)crop_x;
+        JDIMENSION rows = (JDIMENSION)y;
+        while (rows > 0) {
+            JDIMENSION skipped = jpeg_skip_scanlines(&cinfo, rows);
+            if (skipped == 0) {
+                error = "Truncated JPEG data";
+                return false;
+            }
+            rows -= skipped;
+        }
+        return true;
+    }
+
+    // Decodes up to count (at most kStripRows) rows; returns the number
+    // decoded, or -1 on failure
+    int read(unsigned char* rows, int count, size_t pitch) {
+        if (setjmp(manager.jump)) {
+            error = manager.message;
+            return -1;
+        }
+        JSAMPROW pointers[kStripRows];
+        int decoded = 0;
+        while (decoded < count && cinfo.output_scanline < cinfo.output_height) {
+            for (int i = decoded; i < count; i++) pointers[i - decoded] = rows + (size_t)i * pitch;
+            decoded += (int)jpeg_read_scanlines(&cinfo, pointers, count - decoded);
+        }
+        return decoded;
+    }
+};
+
+int decode_jpeg_strips(const unsigned char* data, size_t size, int scaled_width, int scaled_height,
+                       StripEncoder& encoder, std::string* error) {
+    if (!data || scaled_width <= 0 || scaled_height <= 0) return -1;
+    JpegStripSource source;
+    bool started;
+    {
+        StageTimer timer(&PipelineStats::decode_ns);
+        started = source.start(data, size, scaled_width, scaled_height);
+    }
+    if (!started) {
+        if (error) *error = source.error;
+        return -1;
+    }
+
+    const size_t pitch = (size_t)scaled_width * 3;
+    PixelBuffer band(pitch * kStripRows);
+    record_buffer(band.size());
+    for (int y = 0; y < scaled_height;) {
+        int decoded;
+        {
+            StageTimer timer(&PipelineStats::decode_ns);
+            decoded = source.read(band.data(), std::min(kStripRows, scaled_height - y), pitch);
+        }
+        if (decoded <= 0) {
+            if (error) *error = decoded < 0 ? source.error : "Truncated JPEG data";
+            return -1;
+        }
+        if (!encoder.push(band.data(), decoded, pitch)) {
+            if (error) *error = encoder.error();
+            return -1;
+        }
+        y += decoded;
+    }
+    return 0;
+}
+
+int decode_jpeg_region(const unsigned char* data, size_t size, int scaled_width, int scaled_height,
+                       int x, int y, int region_width, int region_height, PixelBuffer& rgb, std::string* error) {
+    if (!data || region_width <= 0 || region_height <= 0 || x < 0 || y < 0 ||
+        x + region_width > scaled_width || y + region_height > scaled_height) return -1;
+    StageTimer timer(&PipelineStats::decode_ns);
+    JpegStripSource source;
+    int xoffset = 0;
+    if (!source.start(data, size, scaled_width, scaled_height) ||
+        !source.crop(x, y, region_width, &xoffset)) {
+        if (error) *error = source.error;
+        return -1;
+    }
+
+    // Decoded rows span whole iMCUs; keep the requested columns
+    const size_t pitch = (size_t)source.cinfo.output_width * 3;
+    const size_t row_size = (size_t)region_width * 3;
+    PixelBuffer band(pitch * kStripRows);
+    record_buffer(band.size());
+    rgb.resize(row_size * region_height);
+    record_buffer(rgb.size());
+    const unsigned char* columns_start = band.data() + (size_t)(x - xoffset) * 3;
+    for (int row = 0; row < region_height;) {
+        const int decoded = source.read(band.data(), std::min(kStripRows, region_height - row), pitch);
+        if (decoded <= 0) {
+            if (error) *error = decoded < 0 ? source.error : "Truncated JPEG data";
+            return -1;
+        }
+        for (int i = 0; i < decoded; i++) {
+            memcpy(rgb.data() + (size_t)(row + i) * row_size, columns_start + (size_t)i * pitch, row_size);
+        }
+        row += decoded;
+    }
+    // The rows below the region are never decoded; the destructor releases
+    // the decompressor without reading them
+    return 0;
+}
+
+// Pixels of one pyramid level: either borrowed from a larger image or owned
+struct PyramidLevelPixels {
+    const unsigned char* data = nullptr;
+    PixelBuffer storage;
+    int width = 0;
+    int height = 0;
+};
+
+// Compresses one level into output->data, a buffer of capacity bytes from
+// the calling thread's pool. Runs on its own thread when stats is set, which
+// then receives what that thread recorded.
+static void encode_level(const PyramidLevelPixels& pixels, const JpegEncodeOptions& encode, unsigned long capacity,
+                         PreviewLevelOutput* output, bool* ok, PipelineStats* stats) {
+    *ok = false;
+    tjhandle compressor = tjInitCompress();
+    if (compressor) {
+        unsigned char* jpeg = output->data;
+        unsigned long jpeg_size = capacity;
+        if (compress_jpeg(compressor, pixels.data, pixels.width, pixels.height, encode, &jpeg, &jpeg_size, true,
+                          nullptr) == 0) {
+            output->size = jpeg_size;
+            output->width = pixels.width;
+            output->height = pixels.height;
+            *ok = true;
+        }
+        tjDestroy(compressor);
+    }
+    if (stats) *stats = current_pipeline_stats();
+}
+
+// Joins every started worker, whichever way build_pyramid() leaves
+struct WorkerJoiner {
+    std::vector<std::thread>& workers;
+    ~WorkerJoiner() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i].joinable()) workers[i].join();
+        }
+    }
+};
+
+// encode_pyramid() once the arguments are checked; may throw std::bad_alloc
+// or std::system_error, after joining every worker it started
+static int build_pyramid(const unsigned char* rgb, int width, int height, const PreviewLevel* levels, int count,
+                         const JpegEncodeOptions& encode, PreviewLevelOutput* outputs) {
+    // Largest level first, so each level can be resized from the previous one
+    std::vector<int> order(count);
+    std::vector<PyramidLevelPixels> pixels(count);
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+        compute_level_size(width, height, levels[i], &pixels[i].width, &pixels[i].height);
+    }
+    std::stable_sort(order.begin(), order.end(), [&pixels](int a, int b) {
+        return (long long)pixels[a].width * pixels[a].height > (long long)pixels[b].width * pixels[b].height;
+    });
+
+    const unsigned char* source = rgb;
+    int source_width = width;
+    int source_height = height;
+    {
+        StageTimer timer(&PipelineStats::resize_ns);
+        for (int i = 0; i < count; i++) {
+            PyramidLevelPixels& level = pixels[order[i]];
+            // Rounding can make a level a pixel larger than the previous one in
+            // one dimension; resize such levels from the decoded image instead
+            const bool cascade = level.width <= source_width && level.height <= source_height;
+            const unsigned char* from = cascade ? source : rgb;
+            const int from_width = cascade ? source_width : width;
+            const int from_height = cascade ? source_height : height;
+
+            if (level.width == from_width && level.height == from_height) {
+                level.data = from;
+            } else {
+                level.storage.resize((size_t)level.width * level.height * 3);
+                record_buffer(level.storage.size());
+                resize_area(from, from_width, from_height, 0, level.storage.data(), level.width, level.height, 3);
+                level.data = level.storage.data();
+            }
+            source = level.data;
+            source_width = level.width;
+            source_height = level.height;
+        }
+    }
+
+    // Output buffers come from this thread's pool, which later frees them
+    std::vector<unsigned long> capacity(count);
+    for (int i = 0; i < count; i++) {
+        capacity[i] = jpeg_buffer_size(pixels[i].width, pixels[i].height, encode);
+        outputs[i].data = capacity[i] == (unsigned long)-1 ? nullptr : static_cast<unsigned char*>(pool_alloc(capacity[i]));
+        if (!outputs[i].data) {
+            free_pyramid(outputs, count);
+            return -1;
+        }
+        record_buffer(capacity[i]);
+    }
+
+    // Encode every level concurrently; the calling thread takes the largest
+    StageTimer encode_timer(&PipelineStats::encode_ns);
+    std::unique_ptr<bool[]> ok(new bool[count]());
+    std::unique_ptr<PipelineStats[]> worker_stats(new PipelineStats[count]());
+    {
+        std::vector<std::thread> workers;
+        workers.reserve(count - 1); // push_back must not throw with a running thread in hand
+        WorkerJoiner joiner = { workers };
+        for (int i = 1; i < count; i++) {
+            const int index = order[i];
+            try {
+                workers.push_back(std::thread(encode_level, std::cref(pixels[index]), std::cref(encode), capacity[index],
+                                              &outputs[index], &ok[index], &worker_stats[index]));
+            } catch (const std::system_error&) {
+                // No thread available
+                encode_level(pixels[index], encode, capacity[index], &outputs[index], &ok[index], nullptr);
+            }
+        }
+        encode_level(pixels[order[0]], encode, capacity[order[0]], &outputs[order[0]], &ok[order[0]], nullptr);
+    }
+    for (int i = 0; i < count; i++) {
+        merge_pipeline_stats(worker_stats[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!ok[i]) {
+            free_pyramid(outputs, count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int encode_pyramid(const unsigned char* rgb, int width, int height, const PreviewLevel* levels, int count,
+                   const JpegEncodeOptions& encode, PreviewLevelOutput* outputs) {
+    if (!rgb || !outputs || !valid_pyramid_levels(levels, count)) return -1;
+    for (int i = 0; i < count; i++) {
+        outputs[i].data = nullptr;
+        outputs[i].size = 0;
+        outputs[i].width = 0;
+        outputs[i].height = 0;
+    }
+
+    // Failed allocations of the levels or their threads fail the pyramid
+    // instead of unwinding into the C entry points
+    try {
+        return build_pyramid(rgb, width, height, levels, count, encode, outputs);
+    } catch (...) {
+        free_pyramid(outputs, count);
+        return -1;
+    }
+}
+
+void free_pyramid(PreviewLevelOutput* outputs, int count) {
+    if (!outputs) return;
+    for (int i = 0; i < count; i++) {
+        pool_free(outputs[i].data);
+        outputs[i].data = nullptr;
+        outputs[i].size = 0;
+        outputs[i].width = 0;
+        outputs[i].height = 0;
+    }
+}
@@ -0,0 +1,281 @@
+#ifndef IMAGE_OPS_H
+#define IMAGE_OPS_H
+
+// Pixel operations shared by the RAW and image wrappers.
+// Internal C++ interface, not exported to Rust.
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include "buffer_pool.h"
+#include "preview_options.h"
+#include "turbojpeg.h"
+
+/**
+ * Returns true if the options request an explicit output size
+ * (max_edge, target_width or target_height). Without one, every wrapper
+ * keeps its historical half-resolution output.
+ */
+bool has_target_size(const PreviewOptions& options);
+
+/**
+ * Computes the output size for a width x height image
+ * The aspect ratio is preserved and images are never upscaled. max_edge
+ * bounds the long edge; target_width/target_height bound each dimension
+ * (a zero dimension is unbounded). When several bounds are set the
+ * smallest resulting size wins.
+ * @param options Options with has_target_size(options) == true
+ */
+void compute_target_size(int width, int height, const PreviewOptions& options, int* target_width, int* target_height);
+
+/**
+ * Returns true if the options ask to fill a box (crop_to_fill with both
+ * target_width and target_height set) rather than fit in it
+ */
+bool fills_target(const PreviewOptions& options);
+
+/**
+ * Computes the sizes of a width x height image filling a box
+ * The image is scaled down (never up) until it covers box_width x
+ * box_height, then cropped to the box around its center. Along an axis
+ * where the image is smaller than the box it is kept whole.
+ * @param scaled_width Receives the width of the scaled image, before cropping
+ * @param scaled_height Receives the height of the scaled image
+ * @param out_width Receives the output width (at most box_width)
+ * @param out_height Receives the output height (at most box_height)
+ */
+void compute_fill_size(int width, int height, int box_width, int box_height,
+                       int* scaled_width, int* scaled_height, int* out_width, int* out_height);
+
+/**
+ * Computes the largest centered region of a width x height image with the
+ * aspect ratio of out_width x out_height
+ * Resizing the region to out_width x out_height never upscales when the
+ * image is at least that large.
+ */
+void center_region(int width, int height, int out_width, int out_height,
+                   int* x, int* y, int* region_width, int* region_height);
+
+/**
+ * Resizes interleaved 8-bit pixels with an area-average (box) filter
+ * Every output pixel is the average of the source area it covers, weighted
+ * by overlap, so arbitrary non-integer ratios are handled without aliasing.
+ * The vertical pass is vectorized with SSE2/AVX2/NEON when available.
+ * Only downscaling is supported (dst_width <= src_width, dst_height <= src_height).
+ * @param src Source pixels
+ * @param src_pitch Bytes per source row (0 = src_width * channels)
+ * @param dst Destination, dst_width * dst_height * channels bytes, tightly packed
+ * @return false on invalid arguments
+ */
+bool resize_area(const unsigned char* src, int src_width, int src_height, int src_pitch,
+                 unsigned char* dst, int dst_width, int dst_height, int channels);
+
+/**
+ * Returns true if an EXIF orientation swaps width and height (5-8)
+ */
+bool orientation_transposes(int orientation);
+
+/**
+ * Applies an EXIF orientation (1-8) to tightly packed RGB pixels
+ * Mirrors and the 180 degree rotation (2, 3, 4) run in place; the
+ * orientations that swap the axes (5-8) are a cache-blocked transpose into
+ * one new buffer, with the flip folded into the walk over the source.
+ * Values outside 2..8 leave the image untouched.
+ * @param rgb Pixels, replaced by the oriented image
+ * @param width Updated to the oriented width
+ * @param height Updated to the oriented height
+ */
+void apply_exif_orientation(int orientation, PixelBuffer& rgb, int* width, int* height);
+
+/**
+ * Picks the smallest TurboJPEG DCT scaling factor (1/1 down to 1/8) whose
+ * output still covers min_width x min_height, so decoding does as little
+ * work as possible before the final resize_area() pass
+ * @param width Full JPEG width
+ * @param height Full JPEG height
+ * @param scaled_width Receives the decoded width
+ * @param scaled_height Receives the decoded height
+ */
+void select_jpeg_scaling(int width, int height, int min_width, int min_height, int* scaled_width, int* scaled_height);
+
+/**
+ * Decodes a JPEG to RGB at the smallest DCT scale covering min_width x min_height
+ * @param decompressor TurboJPEG decompress (or transform) handle
+ * @param rgb Receives the tightly packed RGB pixels
+ * @param width Receives the decoded width
+ * @param height Receives the decoded height
+ * @return 0 on success, -1 on failure (tjGetErrorStr2(decompressor) has details)
+ */
+int decode_jpeg_scaled(tjhandle decompressor, const unsigned char* data, size_t size, int min_width, int min_height,
+                       PixelBuffer& rgb, int* width, int* height);
+
+/**
+ * Returns the worst-case JPEG size for a width x height image, i.e. the
+ * buffer size compress_jpeg() needs with no_realloc
+ */
+unsigned long jpeg_buffer_size(int width, int height, const JpegEncodeOptions& encode);
+
+/**
+ * Compresses tightly packed RGB pixels to JPEG with the given encoder settings
+ * Every JPEG the wrappers encode goes through here. Baseline JPEGs with
+ * optimized Huffman tables are produced through the libjpeg API, everything
+ * else through tjCompress2().
+ * @param compressor TurboJPEG compress handle
+ * @param jpeg With no_realloc, a buffer of jpeg_buffer_size() bytes; otherwise
+ *             null, and it receives a buffer released with tjFree() (prefer
+ *             compress_jpeg_pooled())
+ * @param jpeg_size Receives the number of JPEG bytes
+ * @param error Receives the error message on failure (may be null)
+ * @return 0 on success, -1 on failure
+ */
+int compress_jpeg(tjhandle compressor, const unsigned char* rgb, int width, int height, const JpegEncodeOptions& encode,
+                  unsigned char** jpeg, unsigned long* jpeg_size, bool no_realloc, std::string* error);
+
+/**
+ * Compresses RGB pixels into a buffer from the pool
+ * The buffer is sized with jpeg_buffer_size(); pages the JPEG does not
+ * reach are never touched.
+ * @param jpeg Receives a buffer released with pool_free() (null on failure)
+ * @return 0 on success, -1 on failure
+ */
+int compress_jpeg_pooled(tjhandle compressor, const unsigned char* rgb, int width, int height,
+                         const JpegEncodeOptions& encode, unsigned char** jpeg, unsigned long* jpeg_size,
+                         std::string* error);
+
+/**
+ * Compresses RGB pixels straight into a buffer obtained from alloc
+ * The buffer is sized with jpeg_buffer_size() and filled without
+ * reallocation, so the encode is the only pass over the output.
+ * @param compressor TurboJPEG compress handle
+ * @param rgb Tightly packed RGB pixels
+ * @param out_buf Receives the buffer returned by alloc (left untouched on failure)
+ * @param out_size Receives the number of JPEG bytes written
+ * @param error Receives the error message when compression fails (may be null)
+ * @return 0 on success, -2 if alloc failed, -1 if compression failed
+ */
+int compress_rgb_into(tjhandle compressor, const unsigned char* rgb, int width, int height,
+                      const JpegEncodeOptions& encode, PreviewAllocFn alloc, void* user_data,
+                      unsigned char** out_buf, size_t* out_size, std::string* error);
+
+/**
+ * Returns true if a decoded width x height image is large enough to be
+ * resized and compressed in strips (StripEncoder) rather than as a whole
+ */
+bool prefer_strips(int width, int height);
+
+/**
+ * Resizes, orients and compresses an image delivered in bands of rows
+ * Source rows go in top to bottom, in bands of any height. resize_area()
+ * runs as a stream, emitting each output row once the source rows it
+ * covers have arrived, and output rows are fed to libjpeg's scanline
+ * compressor (jpeg_write_scanlines) 16 at a time, so neither the source
+ * nor the resized image has to be held as a whole. Orientations 3-8 move
+ * rows across the image and need the whole output, which finish() orients
+ * before compressing it; that buffer is still only the output's size.
+ * The JPEG matches compress_jpeg() for the same pixels and settings.
+ */
+class StripEncoder {
+public:
+    StripEncoder();
+    ~StripEncoder();
+
+    /**
+     * Starts an image; call once per encoder
+     * @param dst_width Output width before orientation, at most src_width
+     * @param dst_height Output height before orientation, at most src_height
+     * @param orientation EXIF orientation (1-8) applied to the output
+     * @param jpeg Output buffer of at least jpeg_buffer_size() bytes for the
+     *             oriented output size, owned by the caller
+     * @return false on invalid arguments or libjpeg errors (see error())
+     */
+    bool start(int src_width, int src_height, int dst_width, int dst_height, int orientation,
+               const JpegEncodeOptions& encode, unsigned char* jpeg, unsigned long capacity);
+
+    /**
+     * Adds the next count source rows, pitch bytes apart (0 = tightly packed)
+     */
+    bool push(const unsigned char* rows, int count, size_t pitch);
+
+    /**
+     * Completes the JPEG once every source row has been pushed
+     * @param jpeg_size Receives the number of bytes written to the buffer given to start()
+     */
+    bool finish(unsigned long* jpeg_size);
+
+    const std::string& error() const;
+
+private:
+    StripEncoder(const StripEncoder&);
+    StripEncoder& operator=(const StripEncoder&);
+
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+/**
+ * Decodes a JPEG in bands of rows straight into a started StripEncoder
+ * Only one band of decoded rows is held at a time.
+ * @param scaled_width Decoded width, from select_jpeg_scaling()
+ * @param scaled_height Decoded height, from select_jpeg_scaling()
+ * @param encoder Encoder started with a scaled_width x scaled_height source
+ * @param error Receives the error message on failure (may be null)
+ * @return 0 on success, -1 on failure
+ */
+int decode_jpeg_strips(const unsigned char* data, size_t size, int scaled_width, int scaled_height,
+                       StripEncoder& encoder, std::string* error);
+
+/**
+ * Decodes a region of a JPEG at a DCT scale
+ * Rows above the region are only entropy decoded, rows below it are never
+ * read, and only the iMCU columns covering it go through the IDCT and color
+ * conversion (the libjpeg counterpart of TurboJPEG 3's cropping region).
+ * @param scaled_width Decoded width, from select_jpeg_scaling()
+ * @param scaled_height Decoded height, from select_jpeg_scaling()
+ * @param x Left edge of the region in scaled pixels
+ * @param y Top edge of the region in scaled pixels
+ * @param rgb Receives region_width x region_height tightly packed RGB pixels
+ * @param error Receives the error message on failure (may be null)
+ * @return 0 on success, -1 on failure
+ */
+int decode_jpeg_region(const unsigned char* data, size_t size, int scaled_width, int scaled_height,
+                       int x, int y, int region_width, int region_height, PixelBuffer& rgb, std::string* error);
+
+/**
+ * Computes the output size of one pyramid level for a width x height image
+ * Same rules as compute_target_size().
+ */
+void compute_level_size(int width, int height, const PreviewLevel& level, int* target_width, int* target_height);
+
+/**
+ * Returns true if every level sets at least one bound
+ */
+bool valid_pyramid_levels(const PreviewLevel* levels, int count);
+
+/**
+ * Returns a copy of options whose output size is the largest of the levels
+ * for a width x height source, i.e. the size the image must be decoded at
+ * before the pyramid is built
+ */
+PreviewOptions options_for_largest_level(const PreviewOptions& options, int width, int height,
+                                         const PreviewLevel* levels, int count);
+
+/**
+ * Builds a preview pyramid from one decoded RGB image and encodes it
+ * Levels are produced from largest to smallest, each one resized from the
+ * previous level, and then compressed concurrently on one thread per level.
+ * outputs[i] receives levels[i] whatever the order of the levels.
+ * @param rgb Tightly packed RGB pixels, at least as large as every level
+ * @param encode Encoder settings shared by every level
+ * @param outputs Array of count entries, each released with pool_free(); on
+ *                failure every entry is left null
+ * @return 0 on success, -1 on failure, failed allocations included (never throws)
+ */
+int encode_pyramid(const unsigned char* rgb, int width, int height, const PreviewLevel* levels, int count,
+                   const JpegEncodeOptions& encode, PreviewLevelOutput* outputs);
+
+/**
+ * Releases the buffers of a pyramid and resets the entries
+ */
+void free_pyramid(PreviewLevelOutput* outputs, int count);
+
+#endif // IMAGE_OPS_H
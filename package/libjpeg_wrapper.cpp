@@ -1,14 +1,48 @@
 #include <turbojpeg.h>
-#include <iostream>
 #include <fstream>
 #include <vector>
 #include <cstring>
+#include <algorithm>
+#include <functional>
 #include "TinyEXIF.h" // Include TinyEXIF header
+#include "buffer_pool.h"
 #include "libjpeg_wrapper.h"
-
+#include "image_decoders.h"
+#include "image_ops.h"
+#include "mapped_file.h"
+#include "pipeline_stats.h"
+#include "preview_log.h"
+
+// stb_image decodes into pool buffers too
+#define STBI_MALLOC(size) pool_alloc(size)
+#define STBI_REALLOC(buffer, size) pool_realloc(buffer, size)
+#define STBI_FREE(buffer) pool_free(buffer)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+// Options used when a caller passes a null PreviewOptions pointer
+static const PreviewOptions default_preview_options = { 0, 0, 0, 0, 0, 0, { 0, 0, 0, 0, 0 }, 0, 0, 0, 0 };
+
+// Encoder settings of a call, with null options selecting the defaults
+static const JpegEncodeOptions& encoding_of(const PreviewOptions* options) {
+    return (options ? options : &default_preview_options)->encode;
+}
+
+// Runs the body of an entry point, translating exceptions (such as
+// std::bad_alloc from a PixelBuffer) into -1 so none crosses the FFI boundary
+template <class Body>
+static int guarded(Body body) {
+    try {
+        return body();
+    } catch (const std::exception& e) {
+        preview_log(PREVIEW_LOG_ERROR, std::string("Exception occurred: ") + e.what());
+        return -1;
+    } catch (...) {
+        preview_log(PREVIEW_LOG_ERROR, "Unknown exception occurred");
+        return -1;
+    }
+}
+
 extern "C" {
 
 // Helper function to detect image format
@@ -72,29 +106,67 @@ void populate_exif_from_tinyexif(const TinyEXIF::EXIFInfo& exif_info, ExifData&
     exif_data.artist = nullptr;
 }
 
+// Helper function to locate the EXIF APP1 segment of a JPEG in place
+// Walks the marker segments that precede the entropy-coded data, so only
+// the header bytes are touched and nothing is copied.
+// segment receives the payload starting with the "Exif\0\0" signature.
+static bool find_exif_segment(const unsigned char* data, size_t size, const unsigned char** segment, unsigned* length) {
+    size_t pos = 2; // Skip SOI
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        const unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) { // Fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) { // Segments without a length
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9) return false; // Start of scan or end of image: no EXIF
+
+        const size_t segment_length = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+        if (segment_length < 2 || pos + 2 + segment_length > size) return false;
+        if (marker == 0xE1 && segment_length >= 2 + 6 && memcmp(data + pos + 4, "Exif\0\0", 6) == 0) {
+            *segment = data + pos + 4;
+            *length = (unsigned)(segment_length - 2);
+            return true;
+        }
+        pos += 2 + segment_length;
+    }
+    return false;
+}
+
 // Helper function to extract EXIF data from JPEG files
-void extract_jpeg_exif(const std::vector<unsigned char>& input_data, ExifData& exif_data) {
+// The APP1 segment is parsed once, in place; the orientation it carries is
+// returned so the caller does not parse it again (0 when there is no EXIF).
+int extract_jpeg_exif(const unsigned char* data, size_t size, ExifData& exif_data) {
     TinyEXIF::EXIFInfo original_exif_info;
-    bool has_original_exif = (original_exif_info.parseFrom(input_data.data(), input_data.size()) == TinyEXIF::PARSE_SUCCESS);
+    const unsigned char* segment = nullptr;
+    unsigned segment_length = 0;
+    bool has_original_exif = find_exif_segment(data, size, &segment, &segment_length)
+        && original_exif_info.parseFromEXIFSegment(segment, segment_length) == TinyEXIF::PARSE_SUCCESS;
     
     if (has_original_exif) {
-        std::cout << "EXIF found in JPEG file" << std::endl;
+        preview_log(PREVIEW_LOG_DEBUG, "EXIF found in JPEG file");
         populate_exif_from_tinyexif(original_exif_info, exif_data);
-    } else {
-        std::cout << "No EXIF data available, using basic info" << std::endl;
-        strncpy(exif_data.camera_make, "Unknown", 63);
-        exif_data.camera_make[63] = '\0';
-        strncpy(exif_data.camera_model, "JPEG Image", 63);
-        exif_data.camera_model[63] = '\0';
+        return original_exif_info.Orientation;
     }
+
+    preview_log(PREVIEW_LOG_DEBUG, "No EXIF data available, using basic info");
+    strncpy(exif_data.camera_make, "Unknown", 63);
+    exif_data.camera_make[63] = '\0';
+    strncpy(exif_data.camera_model, "JPEG Image", 63);
+    exif_data.camera_model[63] = '\0';
+    return 0;
 }
 
 // Helper function to set default EXIF data for non-JPEG files
-void extract_non_jpeg_exif(const std::vector<unsigned char>& input_data, ExifData& exif_data) {
+void extract_non_jpeg_exif(const unsigned char* data, size_t size, ExifData& exif_data) {
     strncpy(exif_data.camera_make, "Unknown", 63);
     exif_data.camera_make[63] = '\0';
     
-    if (is_png(input_data.data(), input_data.size())) {
+    if (is_png(data, size)) {
         strncpy(exif_data.camera_model, "PNG->JPEG Conversion", 63);
     } else {
         strncpy(exif_data.camera_model, "Image->JPEG Conversion", 63);
@@ -124,473 +196,830 @@ void finalize_exif_data(ExifData& exif_data, int width, int height) {
     }
 }
 
-// Helper function to save RGB data as JPEG
-int save_rgb_as_jpeg(unsigned char* rgb_data, int width, int height, const char* output_path) {
-    tjhandle compress_handle = tjInitCompress();
-    if (!compress_handle) {
-        std::cerr << "Failed to initialize TurboJPEG compressor" << std::endl;
+// Helper function to write JPEG bytes to output_path
+static int write_jpeg_file(const char* output_path, const unsigned char* jpeg, unsigned long jpeg_size) {
+    StageTimer timer(&PipelineStats::write_ns);
+    std::ofstream output_file(output_path, std::ios::binary);
+    if (!output_file) {
+        preview_log(PREVIEW_LOG_ERROR, std::string("Failed to open output file: ") + output_path);
         return -1;
     }
+    output_file.write(reinterpret_cast<const char*>(jpeg), jpeg_size);
+    return 0;
+}
 
-    unsigned char* jpeg_buffer = nullptr;
-    unsigned long jpeg_size = 0;
-    
-    if (tjCompress2(compress_handle, rgb_data, width, 0, height, TJPF_RGB, &jpeg_buffer, &jpeg_size, TJSAMP_444, 75, TJFLAG_FASTDCT) != 0) {
-        std::cerr << "Failed to compress JPEG: " << tjGetErrorStr() << std::endl;
-        tjDestroy(compress_handle);
+// Output of an image that decode_image() encodes in strips
+struct StripOutput {
+    PreviewAllocFn alloc = nullptr; // Null: the JPEG goes into a buffer from the pool
+    void* user_data = nullptr;
+    JpegEncodeOptions encode;
+    unsigned char* jpeg = nullptr;  // Set once the image has been encoded in strips
+    size_t size = 0;
+    bool alloc_failed = false;
+};
+
+// Pushes every source row into a started StripEncoder; false on failure,
+// with the message in *error unless the encoder has it
+typedef std::function<bool(StripEncoder& encoder, std::string* error)> StripFeed;
+
+// Helper function to encode a large image in strips into out
+static int encode_strips(StripOutput& out, int src_width, int src_height, int dst_width, int dst_height,
+                         int orientation, const StripFeed& feed) {
+    int oriented_width = dst_width;
+    int oriented_height = dst_height;
+    if (orientation_transposes(orientation)) std::swap(oriented_width, oriented_height);
+    unsigned long capacity = jpeg_buffer_size(oriented_width, oriented_height, out.encode);
+    if (capacity == (unsigned long)-1) return -1;
+
+    record_buffer(capacity);
+    unsigned char* jpeg = out.alloc ? out.alloc(out.user_data, capacity)
+                                    : static_cast<unsigned char*>(pool_alloc(capacity));
+    if (!jpeg) {
+        out.alloc_failed = true;
         return -1;
     }
 
-    // Write compressed JPEG to output file
-    std::ofstream output_file(output_path, std::ios::binary);
-    if (!output_file) {
-        std::cerr << "Failed to open output file: " << output_path << std::endl;
-        tjFree(jpeg_buffer);
-        tjDestroy(compress_handle);
+    StripEncoder encoder;
+    std::string error;
+    unsigned long jpeg_size = 0;
+    if (!encoder.start(src_width, src_height, dst_width, dst_height, orientation, out.encode, jpeg, capacity)
+        || !feed(encoder, &error) || !encoder.finish(&jpeg_size)) {
+        if (error.empty()) error = encoder.error();
+        preview_log(PREVIEW_LOG_ERROR, std::string("Failed to convert image in strips: ") + error);
+        if (!out.alloc) pool_free(jpeg);
         return -1;
     }
+    out.jpeg = jpeg;
+    out.size = jpeg_size;
+    return 0;
+}
 
-    output_file.write(reinterpret_cast<char*>(jpeg_buffer), jpeg_size);
-    output_file.close();
+// Helper function to scale RGB pixels down to (target_width, target_height)
+static void fit_rgb(PixelBuffer& rgb_data, int& width, int& height, int target_width, int target_height) {
+    target_width = std::min(width, target_width);
+    target_height = std::min(height, target_height);
+    if (target_width == width && target_height == height) return;
+
+    StageTimer timer(&PipelineStats::resize_ns);
+    PixelBuffer scaled((size_t)target_width * target_height * 3);
+    record_buffer(scaled.size());
+    resize_area(rgb_data.data(), width, height, 0, scaled.data(), target_width, target_height, 3);
+    rgb_data.swap(scaled);
+    width = target_width;
+    height = target_height;
+}
 
-    // Cleanup
-    tjFree(jpeg_buffer);
-    tjDestroy(compress_handle);
-    
-    return 0;
+// Helper function implementing PreviewOptions::crop_to_fill on decoded pixels
+// Crops width x height RGB pixels to the aspect ratio of out_width x
+// out_height around their center and scales the crop down into out, which
+// must not alias pixels.
+static void fill_rgb(const unsigned char* pixels, int& width, int& height, int out_width, int out_height,
+                     PixelBuffer& out) {
+    int x, y, region_width, region_height;
+    center_region(width, height, out_width, out_height, &x, &y, &region_width, &region_height);
+    out_width = std::min(out_width, region_width);
+    out_height = std::min(out_height, region_height);
+
+    StageTimer timer(&PipelineStats::resize_ns);
+    out.resize((size_t)out_width * out_height * 3);
+    record_buffer(out.size());
+    resize_area(pixels + ((size_t)y * width + x) * 3, region_width, region_height, width * 3,
+                out.data(), out_width, out_height, 3);
+    width = out_width;
+    height = out_height;
 }
 
-int process_image_to_jpeg(const char* input_path, const char* output_path, ExifData& exif_data) {
-    // Initialize EXIF data with defaults
-    init_exif_data(exif_data);
-    
-    // Read input file
-    std::ifstream file(input_path, std::ios::binary);
-    if (!file) {
-        std::cerr << "Failed to open input file: " << input_path << std::endl;
+// Helper function to pick the options an image is decoded with: the caller's
+// options, or for a pyramid the size of its largest level for a
+// width x height (oriented) image
+static PreviewOptions decode_options_for(const PreviewOptions& options, const PreviewLevel* levels, int level_count,
+                                         int width, int height) {
+    return levels ? options_for_largest_level(options, width, height, levels, level_count) : options;
+}
+
+// Helper function to decode a JPEG to RGB at the requested output size
+// Decodes at the smallest DCT scale covering the target, resizes to the
+// exact size and then applies the EXIF orientation. A known orientation
+// (>= 0) means exif_data is already filled from the EXIF segment. With
+// strips, a large decode is encoded straight into it in strips instead.
+// When filling a box only the center region that is kept is decoded.
+static int decode_jpeg(const unsigned char* data, size_t size, const PreviewOptions& base_options,
+                       const PreviewLevel* levels, int level_count,
+                       PixelBuffer& rgb_data, int& width, int& height, ExifData& exif_data,
+                       int known_orientation, StripOutput* strips) {
+    StageTimer open_timer(&PipelineStats::open_ns);
+    const int orientation = known_orientation >= 0 ? known_orientation : extract_jpeg_exif(data, size, exif_data);
+
+    tjhandle decompress_handle = tjInitDecompress();
+    if (!decompress_handle) {
+        preview_log(PREVIEW_LOG_ERROR, "Failed to initialize TurboJPEG decompressor");
         return -1;
     }
 
-    file.seekg(0, std::ios::end);
-    size_t size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    std::vector<unsigned char> input_data(size);
-    file.read(reinterpret_cast<char*>(input_data.data()), size);
-    file.close();
-
-    if (size == 0) {
-        std::cerr << "Empty input file: " << input_path << std::endl;
+    int subsampling, colorspace;
+    if (tjDecompressHeader3(decompress_handle, data, size, &width, &height, &subsampling, &colorspace) != 0) {
+        preview_log(PREVIEW_LOG_ERROR, std::string("Failed to read JPEG header: ") + tjGetErrorStr());
+        tjDestroy(decompress_handle);
         return -1;
     }
 
-    // Decode image to RGB data
-    int width, height;
-    unsigned char* rgb_data = nullptr;
-    
-    if (is_jpeg(input_data.data(), size)) {
-        // Handle JPEG files using TurboJPEG
-        extract_jpeg_exif(input_data, exif_data);
-        
-        tjhandle decompress_handle = tjInitDecompress();
-        if (!decompress_handle) {
-            std::cerr << "Failed to initialize TurboJPEG decompressor" << std::endl;
-            return -1;
+    // Store the original resolution in EXIF data
+    exif_data.raw_width = width;
+    exif_data.raw_height = height;
+    open_timer.stop();
+
+    bool transposed = orientation_transposes(orientation);
+    const PreviewOptions options = transposed
+        ? decode_options_for(base_options, levels, level_count, height, width)
+        : decode_options_for(base_options, levels, level_count, width, height);
+
+    // Target size in decoded (unrotated) pixels; half resolution by default
+    int target_width = (width + 1) / 2;
+    int target_height = (height + 1) / 2;
+    if (has_target_size(options)) {
+        if (transposed) {
+            compute_target_size(height, width, options, &target_height, &target_width);
+        } else {
+            compute_target_size(width, height, options, &target_width, &target_height);
         }
+    }
 
-        int subsampling, colorspace;
-        if (tjDecompressHeader3(decompress_handle, input_data.data(), size, &width, &height, &subsampling, &colorspace) != 0) {
-            std::cerr << "Failed to read JPEG header: " << tjGetErrorStr() << std::endl;
+    if (fills_target(options)) {
+        int box_width = options.target_width;
+        int box_height = options.target_height;
+        if (transposed) std::swap(box_width, box_height);
+        int cover_width, cover_height, out_width, out_height;
+        compute_fill_size(width, height, box_width, box_height, &cover_width, &cover_height, &out_width, &out_height);
+        int scaled_width, scaled_height, x, y, region_width, region_height;
+        select_jpeg_scaling(width, height, cover_width, cover_height, &scaled_width, &scaled_height);
+        center_region(scaled_width, scaled_height, out_width, out_height, &x, &y, &region_width, &region_height);
+
+        std::string error;
+        if (decode_jpeg_region(data, size, scaled_width, scaled_height, x, y, region_width, region_height,
+                               rgb_data, &error) == 0) {
             tjDestroy(decompress_handle);
-            return -1;
+            width = region_width;
+            height = region_height;
+            fit_rgb(rgb_data, width, height, out_width, out_height);
+        } else {
+            // CMYK and other inputs the scanline decoder rejects: decode the
+            // whole image, then crop
+            preview_log(PREVIEW_LOG_DEBUG, "Cropped JPEG decode failed, decoding the whole image: " + error);
+            StageTimer decode_timer(&PipelineStats::decode_ns);
+            PixelBuffer scaled;
+            if (decode_jpeg_scaled(decompress_handle, data, size, cover_width, cover_height, scaled, &width, &height) != 0) {
+                preview_log(PREVIEW_LOG_ERROR, std::string("Failed to decompress JPEG: ") + tjGetErrorStr2(decompress_handle));
+                tjDestroy(decompress_handle);
+                return -1;
+            }
+            tjDestroy(decompress_handle);
+            decode_timer.stop();
+            record_buffer(scaled.size());
+            fill_rgb(scaled.data(), width, height, out_width, out_height, rgb_data);
         }
 
-        // Store the original resolution in EXIF data
-        exif_data.raw_width = width;
-        exif_data.raw_height = height;
-
-        // Decompress to RGB with quarter resolution
-        width /= 2; // Adjust width for quarter resolution
-        height /= 2; // Adjust height for quarter resolution
-        size_t rgb_buffer_size = width * height * tjPixelSize[TJPF_RGB];
-        rgb_data = new unsigned char[rgb_buffer_size];
+        StageTimer orient_timer(&PipelineStats::orient_ns);
+        if (transposed) record_buffer(rgb_data.size());
+        apply_exif_orientation(orientation, rgb_data, &width, &height);
+        return 0;
+    }
 
-        if (tjDecompress2(decompress_handle, input_data.data(), size, rgb_data, width, 0, height, TJPF_RGB, TJFLAG_FASTDCT) != 0) {
-            std::cerr << "Failed to decompress JPEG: " << tjGetErrorStr() << std::endl;
-            delete[] rgb_data;
+    if (strips) {
+        int scaled_width, scaled_height;
+        select_jpeg_scaling(width, height, target_width, target_height, &scaled_width, &scaled_height);
+        if (prefer_strips(scaled_width, scaled_height)) {
             tjDestroy(decompress_handle);
-            return -1;
+            target_width = std::min(target_width, scaled_width);
+            target_height = std::min(target_height, scaled_height);
+            int result = encode_strips(*strips, scaled_width, scaled_height, target_width, target_height, orientation,
+                                       [&](StripEncoder& encoder, std::string* error) {
+                return decode_jpeg_strips(data, size, scaled_width, scaled_height, encoder, error) == 0;
+            });
+            width = transposed ? target_height : target_width;
+            height = transposed ? target_width : target_height;
+            return result;
         }
+    }
 
+    StageTimer decode_timer(&PipelineStats::decode_ns);
+    if (decode_jpeg_scaled(decompress_handle, data, size, target_width, target_height, rgb_data, &width, &height) != 0) {
+        preview_log(PREVIEW_LOG_ERROR, std::string("Failed to decompress JPEG: ") + tjGetErrorStr2(decompress_handle));
         tjDestroy(decompress_handle);
+        return -1;
+    }
+    tjDestroy(decompress_handle);
+    decode_timer.stop();
+    record_buffer(rgb_data.size());
 
-        // Rotate the image according to EXIF orientation
-        TinyEXIF::EXIFInfo exif_info;
-        exif_info.parseFrom(input_data.data(), input_data.size());
-        int orientation = exif_info.Orientation;
-        if (orientation > 1) {
-            unsigned char* rotated_data = new unsigned char[rgb_buffer_size];
-            // Only handle the most common orientations (1=normal, 3=180, 6=90 CW, 8=90 CCW)
-            if (orientation == 3) {
-                // 180 degree rotation
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        int src_idx = (y * width + x) * 3;
-                        int dst_idx = ((height - 1 - y) * width + (width - 1 - x)) * 3;
-                        rotated_data[dst_idx] = rgb_data[src_idx];
-                        rotated_data[dst_idx + 1] = rgb_data[src_idx + 1];
-                        rotated_data[dst_idx + 2] = rgb_data[src_idx + 2];
-                    }
-                }
-            } else if (orientation == 6) {
-                // 90 degree CW rotation
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        int src_idx = (y * width + x) * 3;
-                        int dst_idx = (x * height + (height - 1 - y)) * 3;
-                        rotated_data[dst_idx] = rgb_data[src_idx];
-                        rotated_data[dst_idx + 1] = rgb_data[src_idx + 1];
-                        rotated_data[dst_idx + 2] = rgb_data[src_idx + 2];
-                    }
-                }
-                std::swap(width, height);
-            } else if (orientation == 8) {
-                // 90 degree CCW rotation
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        int src_idx = (y * width + x) * 3;
-                        int dst_idx = ((width - 1 - x) * height + y) * 3;
-                        rotated_data[dst_idx] = rgb_data[src_idx];
-                        rotated_data[dst_idx + 1] = rgb_data[src_idx + 1];
-                        rotated_data[dst_idx + 2] = rgb_data[src_idx + 2];
-                    }
-                }
-                std::swap(width, height);
-            } else {
-                // Orientation not handled, keep as is
-                delete[] rotated_data;
-                rotated_data = nullptr;
-            }
-            if (rotated_data) {
-                delete[] rgb_data;
-                rgb_data = rotated_data;
-            }
+    // Resize before rotating so fewer pixels are moved
+    fit_rgb(rgb_data, width, height, target_width, target_height);
+
+    StageTimer orient_timer(&PipelineStats::orient_ns);
+    if (orientation_transposes(orientation)) record_buffer(rgb_data.size());
+    apply_exif_orientation(orientation, rgb_data, &width, &height);
+    return 0;
+}
+
+// A JPEG returned without decoding by try_jpeg_passthrough(): either the
+// input itself or a lossless transform of it owned by TurboJPEG
+struct PassthroughJpeg {
+    const unsigned char* data = nullptr;
+    unsigned long size = 0;
+    unsigned char* transformed = nullptr;
+    // EXIF orientation once the input has been probed, -1 before; passed to
+    // decode_image() so a JPEG that does not fit is not parsed twice
+    int orientation = -1;
+
+    ~PassthroughJpeg() {
+        if (transformed) tjFree(transformed);
+    }
+};
+
+// TurboJPEG lossless transform applying an EXIF orientation
+static int transform_for_orientation(int orientation) {
+    switch (orientation) {
+        case 2: return TJXOP_HFLIP;
+        case 3: return TJXOP_ROT180;
+        case 4: return TJXOP_VFLIP;
+        case 5: return TJXOP_TRANSPOSE;
+        case 6: return TJXOP_ROT90;
+        case 7: return TJXOP_TRANSVERSE;
+        case 8: return TJXOP_ROT270;
+        default: return TJXOP_NONE;
+    }
+}
+
+// Helper function implementing PreviewOptions::jpeg_passthrough
+// When the JPEG already fits the requested output size, fills out with the
+// input untouched (PREVIEW_PASSTHROUGH_ORIGINAL) or with a lossless
+// transform that applies the orientation and drops every metadata marker
+// (PREVIEW_PASSTHROUGH_STRIP_METADATA). exif_data receives the EXIF of any
+// JPEG probed, whether it passes or not. Without an output size every JPEG
+// fits.
+// @return 1 if out holds the output, 0 if the image must be decoded, -1 on failure
+static int try_jpeg_passthrough(const unsigned char* data, size_t size, const PreviewOptions& options,
+                                PassthroughJpeg& out, ExifData& exif_data) {
+    if (options.jpeg_passthrough == PREVIEW_PASSTHROUGH_OFF || !is_jpeg(data, size)) return 0;
+
+    StageTimer open_timer(&PipelineStats::open_ns);
+    const int orientation = extract_jpeg_exif(data, size, exif_data);
+    out.orientation = orientation;
+
+    tjhandle transformer = tjInitTransform();
+    if (!transformer) {
+        preview_log(PREVIEW_LOG_ERROR, "Failed to initialize TurboJPEG transformer");
+        return -1;
+    }
+
+    int width, height, subsampling, colorspace;
+    if (tjDecompressHeader3(transformer, data, size, &width, &height, &subsampling, &colorspace) != 0
+        || colorspace == TJCS_CMYK || colorspace == TJCS_YCCK) {
+        // Broken headers are reported by the decode path, which also converts CMYK to RGB
+        tjDestroy(transformer);
+        return 0;
+    }
+    open_timer.stop();
+
+    int oriented_width = width;
+    int oriented_height = height;
+    if (orientation_transposes(orientation)) std::swap(oriented_width, oriented_height);
+    if (has_target_size(options)) {
+        int target_width, target_height;
+        if (fills_target(options)) {
+            int cover_width, cover_height;
+            compute_fill_size(oriented_width, oriented_height, options.target_width, options.target_height,
+                              &cover_width, &cover_height, &target_width, &target_height);
+        } else {
+            compute_target_size(oriented_width, oriented_height, options, &target_width, &target_height);
+        }
+        if (target_width != oriented_width || target_height != oriented_height) {
+            tjDestroy(transformer);
+            return 0;
+        }
+    }
+
+    if (options.jpeg_passthrough == PREVIEW_PASSTHROUGH_STRIP_METADATA) {
+        StageTimer timer(&PipelineStats::encode_ns);
+        tjtransform transform;
+        memset(&transform, 0, sizeof(transform));
+        transform.op = transform_for_orientation(orientation);
+        // Like rotated RAW previews, drop partial edge MCUs that cannot be transformed losslessly
+        transform.options = TJXOPT_COPYNONE | TJXOPT_TRIM;
+        if (tjTransform(transformer, data, size, 1, &out.transformed, &out.size, &transform, 0) != 0
+            || tjDecompressHeader3(transformer, out.transformed, out.size, &oriented_width, &oriented_height,
+                                   &subsampling, &colorspace) != 0) {
+            preview_log(PREVIEW_LOG_DEBUG, std::string("Lossless JPEG transform failed, decoding instead: ") + tjGetErrorStr2(transformer));
+            if (out.transformed) tjFree(out.transformed);
+            out.transformed = nullptr;
+            out.size = 0;
+            tjDestroy(transformer);
+            return 0;
         }
+        record_buffer(out.size);
+        out.data = out.transformed;
     } else {
-        // For non-JPEG files (PNG, TIFF, etc.), use stb_image to decode
-        extract_non_jpeg_exif(input_data, exif_data);
+        out.data = data;
+        out.size = (unsigned long)size;
+    }
+    tjDestroy(transformer);
 
-        int channels;
-        rgb_data = stbi_load(input_path, &width, &height, &channels, 3); // Force RGB (3 channels)
+    exif_data.raw_width = width;
+    exif_data.raw_height = height;
+    finalize_exif_data(exif_data, oriented_width, oriented_height);
+    preview_log(PREVIEW_LOG_DEBUG, "JPEG already fits the requested size, returned without re-encoding");
+    return 1;
+}
 
-        if (!rgb_data) {
-            std::cerr << "Failed to decode image with stb_image: " << stbi_failure_reason() << std::endl;
-            return -1;
+// Frees an stb_image decode when it goes out of scope
+struct StbPixels {
+    unsigned char* data = nullptr;
+    ~StbPixels() {
+        if (data) stbi_image_free(data);
+    }
+};
+
+// Helper function to read the size of a non-JPEG image from its headers
+// with the native decoder of its format, or stb_image without one
+static int read_standard_image_size(const unsigned char* data, size_t size, const ImageDecoder* decoder,
+                                    int& width, int& height) {
+    if (decoder) {
+        std::string error;
+        if (decoder->read_size(data, size, &width, &height, &error)) {
+            return 0;
         }
+        preview_log(PREVIEW_LOG_DEBUG, std::string("Failed to read image header with ") + decoder->name + ": " +
+                                           error + ", trying stb_image");
+    }
+    int channels;
+    if (!stbi_info_from_memory(data, (int)size, &width, &height, &channels)) {
+        preview_log(PREVIEW_LOG_ERROR, std::string("Failed to read image header with stb_image: ") + stbi_failure_reason());
+        return -1;
+    }
+    return 0;
+}
 
-        // Store the original resolution in EXIF data
-        exif_data.raw_width = width;
-        exif_data.raw_height = height;
+// Helper function to decode non-JPEG files (PNG, WebP, TIFF, etc.)
+// The native decoder of the format (image_decoders.h) is tried first, with
+// stb_image as the fallback. With strips, a large image is resized and
+// encoded into it in strips instead of being resized into rgb_data; a
+// cropped fill never is. PNG and TIFF stream their rows into the strips, so
+// the decoded image is never held whole; an interlaced PNG, a bottom-up
+// TIFF and anything stb_image decodes are decoded whole first.
+static int decode_standard_image(const unsigned char* data, size_t size, const PreviewOptions& base_options,
+                                 const PreviewLevel* levels, int level_count,
+                                 PixelBuffer& rgb_data, int& width, int& height, ExifData& exif_data,
+                                 StripOutput* strips) {
+    extract_non_jpeg_exif(data, size, exif_data);
+
+    StageTimer decode_timer(&PipelineStats::decode_ns);
+    const ImageDecoder* decoder = find_image_decoder(data, size);
+    int full_width, full_height;
+    if (read_standard_image_size(data, size, decoder, full_width, full_height) != 0) {
+        return -1;
+    }
 
-        // Downscale the image by a factor of two using nearest neighbor
-        int new_width = width / 2;
-        int new_height = height / 2;
-        unsigned char* downscaled_data = new unsigned char[new_width * new_height * 3];
+    // Store the original resolution in EXIF data
+    exif_data.raw_width = full_width;
+    exif_data.raw_height = full_height;
+
+    const PreviewOptions options = decode_options_for(base_options, levels, level_count, full_width, full_height);
+
+    // Half resolution by default. When filling a box, decode to the size
+    // covering it and crop afterwards.
+    int target_width = std::max(1, full_width / 2);
+    int target_height = std::max(1, full_height / 2);
+    const bool fill = fills_target(options);
+    int out_width = 0, out_height = 0;
+    if (fill) {
+        compute_fill_size(full_width, full_height, options.target_width, options.target_height,
+                          &target_width, &target_height, &out_width, &out_height);
+    } else if (has_target_size(options)) {
+        compute_target_size(full_width, full_height, options, &target_width, &target_height);
+    }
 
-        for (int y = 0; y < new_height; ++y) {
-            for (int x = 0; x < new_width; ++x) {
-                int src_index = ((y * 2) * width + (x * 2)) * 3;
-                int dst_index = (y * new_width + x) * 3;
+    if (strips && !fill && decoder && decoder->decode_strips && prefer_strips(full_width, full_height) &&
+        decoder->can_decode_strips(data, size)) {
+        decode_timer.stop();
+        int result = encode_strips(*strips, full_width, full_height, target_width, target_height, 1,
+                                   [&](StripEncoder& encoder, std::string* error) {
+            return decoder->decode_strips(data, size, encoder, error);
+        });
+        width = target_width;
+        height = target_height;
+        return result;
+    }
 
-                // Copy RGB values
-                downscaled_data[dst_index] = rgb_data[src_index];
-                downscaled_data[dst_index + 1] = rgb_data[src_index + 1];
-                downscaled_data[dst_index + 2] = rgb_data[src_index + 2];
-            }
+    // Decoders that can scale decode straight to the target size
+    PixelBuffer decoded;
+    StbPixels stb;
+    const unsigned char* pixels = nullptr;
+    if (decoder) {
+        std::string error;
+        if (decoder->decode(data, size, target_width, target_height, decoded, &width, &height, &error)) {
+            pixels = decoded.data();
+            record_buffer(decoded.capacity());
+        } else {
+            preview_log(PREVIEW_LOG_DEBUG, std::string("Failed to decode image with ") + decoder->name + ": " +
+                                               error + ", trying stb_image");
+            PixelBuffer().swap(decoded);
+        }
+    }
+    if (!pixels) {
+        int channels;
+        stb.data = stbi_load_from_memory(data, (int)size, &width, &height, &channels, 3); // Force RGB (3 channels)
+        if (!stb.data) {
+            preview_log(PREVIEW_LOG_ERROR, std::string("Failed to decode image with stb_image: ") + stbi_failure_reason());
+            return -1;
         }
+        pixels = stb.data;
+        record_buffer((size_t)width * height * 3);
+    }
+    decode_timer.stop();
 
-        // Free the original RGB data and replace it with the downscaled data
-        stbi_image_free(rgb_data);
-        rgb_data = downscaled_data;
-        width = new_width;
-        height = new_height;
+    if (fill) {
+        fill_rgb(pixels, width, height, out_width, out_height, rgb_data);
+        return 0;
     }
 
-    // Finalize EXIF data with common values
-    finalize_exif_data(exif_data, width, height);
+    if (strips && prefer_strips(width, height)) {
+        const int source_height = height;
+        int result = encode_strips(*strips, width, height, target_width, target_height, 1,
+                                   [&](StripEncoder& encoder, std::string*) {
+            return encoder.push(pixels, source_height, 0);
+        });
+        width = target_width;
+        height = target_height;
+        return result;
+    }
 
-    // Save RGB data as JPEG
-    int result = save_rgb_as_jpeg(rgb_data, width, height, output_path);
-    
-    // Cleanup RGB data
-    if (is_jpeg(input_data.data(), size)) {
-        delete[] rgb_data;
-    } else {
-        stbi_image_free(rgb_data);
+    if (width == target_width && height == target_height && !decoded.empty()) {
+        // Already decoded at the output size
+        rgb_data.swap(decoded);
+        return 0;
     }
-    
+
+    StageTimer resize_timer(&PipelineStats::resize_ns);
+    rgb_data.resize((size_t)target_width * target_height * 3);
+    record_buffer(rgb_data.size());
+    resize_area(pixels, width, height, 0, rgb_data.data(), target_width, target_height, 3);
+    width = target_width;
+    height = target_height;
+    return 0;
+}
+
+// Helper function to decode image bytes to RGB and fill ExifData
+// When levels is non-null the image is decoded at the size of the largest
+// pyramid level instead of the size requested by options. jpeg_orientation
+// is the orientation of a JPEG whose EXIF was already extracted, or -1.
+// When strips is non-null, large images are encoded into it in strips and
+// rgb_data is left empty.
+static int decode_image(const unsigned char* data, size_t size, const PreviewOptions* options,
+                        const PreviewLevel* levels, int level_count,
+                        PixelBuffer& rgb_data, int& width, int& height, ExifData& exif_data,
+                        int jpeg_orientation = -1, StripOutput* strips = nullptr) {
+    const PreviewOptions& opts = options ? *options : default_preview_options;
+    int result = is_jpeg(data, size)
+        ? decode_jpeg(data, size, opts, levels, level_count, rgb_data, width, height, exif_data, jpeg_orientation, strips)
+        : decode_standard_image(data, size, opts, levels, level_count, rgb_data, width, height, exif_data, strips);
     if (result == 0) {
-        std::cout << "Successfully converted to JPEG: " << width << "x" << height << std::endl;
+        finalize_exif_data(exif_data, width, height);
     }
-    
     return result;
 }
 
-int process_image_bytes(const unsigned char* data, size_t size, const char* output_path, ExifData& exif_data) {
-    // Initialize EXIF data with defaults
-    init_exif_data(exif_data);
+// Helper function to decode image bytes and compress them at the requested size
+// The JPEG goes into a buffer from alloc, or from the pool (released with
+// pool_free) when alloc is null. Large images are decoded, resized and
+// compressed in strips, so they never exist in memory as a whole.
+// @return 0 on success, -2 if alloc failed, -1 on other failures
+static int encode_image(const unsigned char* data, size_t size, const PreviewOptions* options, int jpeg_orientation,
+                        PreviewAllocFn alloc, void* user_data, unsigned char** jpeg, size_t* jpeg_size,
+                        int& width, int& height, ExifData& exif_data) {
+    StripOutput strips;
+    strips.alloc = alloc;
+    strips.user_data = user_data;
+    strips.encode = encoding_of(options);
+
+    PixelBuffer rgb_data;
+    if (decode_image(data, size, options, nullptr, 0, rgb_data, width, height, exif_data, jpeg_orientation, &strips) != 0) {
+        return strips.alloc_failed ? -2 : -1;
+    }
+    if (strips.jpeg) {
+        *jpeg = strips.jpeg;
+        *jpeg_size = strips.size;
+        return 0;
+    }
 
-    if (!data || size == 0) {
-        std::cerr << "Empty input buffer" << std::endl;
+    tjhandle compress_handle = tjInitCompress();
+    if (!compress_handle) {
+        preview_log(PREVIEW_LOG_ERROR, "Failed to initialize TurboJPEG compressor");
         return -1;
     }
 
-    // Decode image to RGB data
-    int width, height;
-    unsigned char* rgb_data = nullptr;
+    StageTimer encode_timer(&PipelineStats::encode_ns);
+    std::string error;
+    int result;
+    if (alloc) {
+        // Encode straight into the caller's buffer
+        record_buffer(jpeg_buffer_size(width, height, strips.encode));
+        result = compress_rgb_into(compress_handle, rgb_data.data(), width, height, strips.encode, alloc, user_data,
+                                   jpeg, jpeg_size, &error);
+    } else {
+        unsigned long pooled_size = 0;
+        result = compress_jpeg_pooled(compress_handle, rgb_data.data(), width, height, strips.encode, jpeg,
+                                      &pooled_size, &error);
+        *jpeg_size = pooled_size;
+        if (result == 0) record_buffer(pooled_size);
+    }
+    tjDestroy(compress_handle);
+    if (result == -1) {
+        preview_log(PREVIEW_LOG_ERROR, std::string("Failed to compress JPEG: ") + error);
+    }
+    return result;
+}
 
+// Helper function to fill ExifData from the image headers without decoding pixels
+// output_width/output_height receive the full image size after orientation.
+static int read_image_metadata(const unsigned char* data, size_t size, ExifData& exif_data) {
+    StageTimer timer(&PipelineStats::open_ns);
+    int width, height;
     if (is_jpeg(data, size)) {
-        // JPEG path: reuse existing logic that parses jpeg bytes
-        std::vector<unsigned char> input_data(data, data + size);
-        extract_jpeg_exif(input_data, exif_data);
+        const int orientation = extract_jpeg_exif(data, size, exif_data);
 
         tjhandle decompress_handle = tjInitDecompress();
         if (!decompress_handle) {
-            std::cerr << "Failed to initialize TurboJPEG decompressor" << std::endl;
+            preview_log(PREVIEW_LOG_ERROR, "Failed to initialize TurboJPEG decompressor");
             return -1;
         }
-
         int subsampling, colorspace;
-        if (tjDecompressHeader3(decompress_handle, data, size, &width, &height, &subsampling, &colorspace) != 0) {
-            std::cerr << "Failed to read JPEG header: " << tjGetErrorStr() << std::endl;
-            tjDestroy(decompress_handle);
+        int result = tjDecompressHeader3(decompress_handle, data, size, &width, &height, &subsampling, &colorspace);
+        tjDestroy(decompress_handle);
+        if (result != 0) {
+            preview_log(PREVIEW_LOG_ERROR, std::string("Failed to read JPEG header: ") + tjGetErrorStr());
             return -1;
         }
 
         exif_data.raw_width = width;
         exif_data.raw_height = height;
+        if (orientation_transposes(orientation)) {
+            std::swap(width, height);
+        }
+    } else {
+        extract_non_jpeg_exif(data, size, exif_data);
 
-        width /= 2;
-        height /= 2;
-        size_t rgb_buffer_size = width * height * tjPixelSize[TJPF_RGB];
-        rgb_data = new unsigned char[rgb_buffer_size];
-
-        if (tjDecompress2(decompress_handle, data, size, rgb_data, width, 0, height, TJPF_RGB, TJFLAG_FASTDCT) != 0) {
-            std::cerr << "Failed to decompress JPEG: " << tjGetErrorStr() << std::endl;
-            delete[] rgb_data;
-            tjDestroy(decompress_handle);
+        if (read_standard_image_size(data, size, find_image_decoder(data, size), width, height) != 0) {
             return -1;
         }
+        exif_data.raw_width = width;
+        exif_data.raw_height = height;
+    }
 
-        tjDestroy(decompress_handle);
+    finalize_exif_data(exif_data, width, height);
+    return 0;
+}
 
-        TinyEXIF::EXIFInfo exif_info;
-        exif_info.parseFrom(data, size);
-        int orientation = exif_info.Orientation;
-        if (orientation > 1) {
-            unsigned char* rotated_data = new unsigned char[rgb_buffer_size];
-            if (orientation == 3) {
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        int src_idx = (y * width + x) * 3;
-                        int dst_idx = ((height - 1 - y) * width + (width - 1 - x)) * 3;
-                        rotated_data[dst_idx] = rgb_data[src_idx];
-                        rotated_data[dst_idx + 1] = rgb_data[src_idx + 1];
-                        rotated_data[dst_idx + 2] = rgb_data[src_idx + 2];
-                    }
-                }
-            } else if (orientation == 6) {
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        int src_idx = (y * width + x) * 3;
-                        int dst_idx = (x * height + (height - 1 - y)) * 3;
-                        rotated_data[dst_idx] = rgb_data[src_idx];
-                        rotated_data[dst_idx + 1] = rgb_data[src_idx + 1];
-                        rotated_data[dst_idx + 2] = rgb_data[src_idx + 2];
-                    }
-                }
-                std::swap(width, height);
-            } else if (orientation == 8) {
-                for (int y = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x) {
-                        int src_idx = (y * width + x) * 3;
-                        int dst_idx = ((width - 1 - x) * height + y) * 3;
-                        rotated_data[dst_idx] = rgb_data[src_idx];
-                        rotated_data[dst_idx + 1] = rgb_data[src_idx + 1];
-                        rotated_data[dst_idx + 2] = rgb_data[src_idx + 2];
-                    }
-                }
-                std::swap(width, height);
-            } else {
-                delete[] rotated_data;
-                rotated_data = nullptr;
-            }
-            if (rotated_data) {
-                delete[] rgb_data;
-                rgb_data = rotated_data;
-            }
+int process_image_to_jpeg(const char* input_path, const char* output_path, ExifData& exif_data) {
+    return process_image_to_jpeg_with_options(input_path, output_path, nullptr, exif_data);
+}
+
+int process_image_bytes(const unsigned char* data, size_t size, const char* output_path, ExifData& exif_data) {
+    return process_image_bytes_with_options(data, size, output_path, nullptr, exif_data);
+}
+
+int process_image_bytes_to_buffer(const unsigned char* data, size_t size, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
+    return process_image_bytes_to_buffer_with_options(data, size, nullptr, out_buf, out_size, exif_data);
+}
+
+int process_image_to_jpeg_with_options(const char* input_path, const char* output_path, const PreviewOptions* options, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        // Initialize EXIF data with defaults
+        init_exif_data(exif_data);
+
+        // Map the input file; every decoder reads straight from the mapping
+        StageTimer open_timer(&PipelineStats::open_ns);
+        MappedFile input;
+        if (!input.open(input_path)) {
+            preview_log(PREVIEW_LOG_ERROR, std::string("Failed to open input file: ") + input_path + " (" + input.error() + ")");
+            return -1;
         }
-    } else {
-        // Non-JPEG path: decode from memory using stb_image's memory API
-        extract_non_jpeg_exif(std::vector<unsigned char>(data, data + size), exif_data);
 
-        int channels;
-        rgb_data = stbi_load_from_memory(data, (int)size, &width, &height, &channels, 3);
-        if (!rgb_data) {
-            std::cerr << "Failed to decode image from memory with stb_image: " << stbi_failure_reason() << std::endl;
+        if (input.size() == 0) {
+            preview_log(PREVIEW_LOG_ERROR, std::string("Empty input file: ") + input_path);
             return -1;
         }
+        open_timer.stop();
 
-        exif_data.raw_width = width;
-        exif_data.raw_height = height;
+        PassthroughJpeg passthrough;
+        int passed = try_jpeg_passthrough(input.data(), input.size(), options ? *options : default_preview_options, passthrough, exif_data);
+        if (passed != 0) {
+            return passed < 0 ? -1 : write_jpeg_file(output_path, passthrough.data, passthrough.size);
+        }
 
-        int new_width = width / 2;
-        int new_height = height / 2;
-        unsigned char* downscaled_data = new unsigned char[new_width * new_height * 3];
-
-        for (int y = 0; y < new_height; ++y) {
-            for (int x = 0; x < new_width; ++x) {
-                int src_index = ((y * 2) * width + (x * 2)) * 3;
-                int dst_index = (y * new_width + x) * 3;
-                downscaled_data[dst_index] = rgb_data[src_index];
-                downscaled_data[dst_index + 1] = rgb_data[src_index + 1];
-                downscaled_data[dst_index + 2] = rgb_data[src_index + 2];
+        // Decode and compress the image, then write the JPEG
+        int width, height;
+        unsigned char* jpeg_buffer = nullptr;
+        size_t jpeg_size = 0;
+        if (encode_image(input.data(), input.size(), options, passthrough.orientation, nullptr, nullptr,
+                         &jpeg_buffer, &jpeg_size, width, height, exif_data) != 0) {
+            return -1;
+        }
+        int result = write_jpeg_file(output_path, jpeg_buffer, jpeg_size);
+        pool_free(jpeg_buffer);
+        if (result == 0) {
+            if (preview_log_enabled(PREVIEW_LOG_INFO)) {
+                preview_log(PREVIEW_LOG_INFO, std::string("Successfully converted to JPEG: ") + std::to_string(width) + "x" + std::to_string(height));
             }
         }
 
-        stbi_image_free(rgb_data);
-        rgb_data = downscaled_data;
-        width = new_width;
-        height = new_height;
-    }
+        return result;
+    });
+}
 
-    finalize_exif_data(exif_data, width, height);
+int process_image_bytes_with_options(const unsigned char* data, size_t size, const char* output_path, const PreviewOptions* options, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        // Initialize EXIF data with defaults
+        init_exif_data(exif_data);
 
-    int result = save_rgb_as_jpeg(rgb_data, width, height, output_path);
+        if (!data || size == 0) {
+            preview_log(PREVIEW_LOG_ERROR, "Empty input buffer");
+            return -1;
+        }
 
-    // Cleanup
-    if (is_jpeg(data, size)) {
-        delete[] rgb_data;
-    } else {
-        stbi_image_free(rgb_data);
-    }
+        PassthroughJpeg passthrough;
+        int passed = try_jpeg_passthrough(data, size, options ? *options : default_preview_options, passthrough, exif_data);
+        if (passed != 0) {
+            return passed < 0 ? -1 : write_jpeg_file(output_path, passthrough.data, passthrough.size);
+        }
 
-    if (result == 0) {
-        std::cout << "Successfully converted in-memory to JPEG: " << width << "x" << height << std::endl;
-    }
+        // Decode and compress the image, then write the JPEG
+        int width, height;
+        unsigned char* jpeg_buffer = nullptr;
+        size_t jpeg_size = 0;
+        if (encode_image(data, size, options, passthrough.orientation, nullptr, nullptr,
+                         &jpeg_buffer, &jpeg_size, width, height, exif_data) != 0) {
+            return -1;
+        }
+        int result = write_jpeg_file(output_path, jpeg_buffer, jpeg_size);
+        pool_free(jpeg_buffer);
+        if (result == 0) {
+            if (preview_log_enabled(PREVIEW_LOG_INFO)) {
+                preview_log(PREVIEW_LOG_INFO, std::string("Successfully converted in-memory to JPEG: ") + std::to_string(width) + "x" + std::to_string(height));
+            }
+        }
 
-    return result;
+        return result;
+    });
 }
 
 void free_buffer(unsigned char* buffer) {
-    delete[] buffer;
+    pool_free(buffer);
 }
 
-int process_image_bytes_to_buffer(const unsigned char* data, size_t size, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
-    if (!out_buf || !out_size) return -1;
-    *out_buf = nullptr;
-    *out_size = 0;
-
-    // Initialize EXIF data with defaults then reuse the existing logic to decode and produce RGB
-    init_exif_data(exif_data);
-    if (!data || size == 0) {
-        std::cerr << "Empty input buffer" << std::endl;
-        return -1;
-    }
-
-    int width, height;
-    unsigned char* rgb_data = nullptr;
-    size_t rgb_buffer_size = 0;
-
-    if (is_jpeg(data, size)) {
-        std::vector<unsigned char> input_data(data, data + size);
-        extract_jpeg_exif(input_data, exif_data);
+int process_image_bytes_to_buffer_with_options(const unsigned char* data, size_t size, const PreviewOptions* options, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        if (!out_buf || !out_size) return -1;
+        *out_buf = nullptr;
+        *out_size = 0;
+
+        // Initialize EXIF data with defaults then reuse the shared decode path
+        init_exif_data(exif_data);
+        if (!data || size == 0) {
+            preview_log(PREVIEW_LOG_ERROR, "Empty input buffer");
+            return -1;
+        }
 
-        tjhandle decompress_handle = tjInitDecompress();
-        if (!decompress_handle) return -1;
+        PassthroughJpeg passthrough;
+        int passed = try_jpeg_passthrough(data, size, options ? *options : default_preview_options, passthrough, exif_data);
+        if (passed != 0) {
+            if (passed < 0) return -1;
+            StageTimer write_timer(&PipelineStats::write_ns);
+            record_buffer(passthrough.size);
+            unsigned char* out = static_cast<unsigned char*>(pool_alloc(passthrough.size));
+            if (!out) return -1;
+            memcpy(out, passthrough.data, passthrough.size);
+            *out_buf = out;
+            *out_size = passthrough.size;
+            return 0;
+        }
 
-        int subsampling, colorspace;
-        if (tjDecompressHeader3(decompress_handle, data, size, &width, &height, &subsampling, &colorspace) != 0) {
-            tjDestroy(decompress_handle);
+        // Compress to JPEG in-memory; the pool buffer is handed to the caller,
+        // released with free_buffer
+        int width, height;
+        if (encode_image(data, size, options, passthrough.orientation, nullptr, nullptr,
+                         out_buf, out_size, width, height, exif_data) != 0) {
             return -1;
         }
+        return 0;
+    });
+}
 
-        exif_data.raw_width = width;
-        exif_data.raw_height = height;
-        width /= 2; height /= 2;
-        rgb_buffer_size = width * height * tjPixelSize[TJPF_RGB];
-        rgb_data = new unsigned char[rgb_buffer_size];
+int process_image_bytes_into(const unsigned char* data, size_t size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        if (!alloc || !out_size) return -1;
+        *out_size = 0;
 
-        if (tjDecompress2(decompress_handle, data, size, rgb_data, width, 0, height, TJPF_RGB, TJFLAG_FASTDCT) != 0) {
-            delete[] rgb_data;
-            tjDestroy(decompress_handle);
+        init_exif_data(exif_data);
+        if (!data || size == 0) {
+            preview_log(PREVIEW_LOG_ERROR, "Empty input buffer");
             return -1;
         }
-        tjDestroy(decompress_handle);
 
-        TinyEXIF::EXIFInfo exif_info;
-        exif_info.parseFrom(data, size);
-        int orientation = exif_info.Orientation;
-        // rotation code omitted for brevity: reuse existing rotation logic
-        if (orientation > 1) {
-            unsigned char* rotated_data = new unsigned char[rgb_buffer_size];
-            // ...perform rotations as above...
-            delete[] rgb_data; // For simplicity, skip rotate implementation here
-            rgb_data = rotated_data;
-        }
-    } else {
-        extract_non_jpeg_exif(std::vector<unsigned char>(data, data + size), exif_data);
-        int channels;
-        unsigned char* decoded = stbi_load_from_memory(data, (int)size, &width, &height, &channels, 3);
-        if (!decoded) return -1;
-        exif_data.raw_width = width;
-        exif_data.raw_height = height;
-        int new_width = width / 2;
-        int new_height = height / 2;
-        rgb_buffer_size = new_width * new_height * 3;
-        rgb_data = new unsigned char[rgb_buffer_size];
-        for (int y = 0; y < new_height; ++y) {
-            for (int x = 0; x < new_width; ++x) {
-                int src_index = ((y * 2) * width + (x * 2)) * 3;
-                int dst_index = (y * new_width + x) * 3;
-                rgb_data[dst_index] = decoded[src_index];
-                rgb_data[dst_index + 1] = decoded[src_index + 1];
-                rgb_data[dst_index + 2] = decoded[src_index + 2];
+        PassthroughJpeg passthrough;
+        int passed = try_jpeg_passthrough(data, size, options ? *options : default_preview_options, passthrough, exif_data);
+        if (passed != 0) {
+            if (passed < 0) return -1;
+            // The copy into the caller's buffer is the only pass over the output
+            StageTimer write_timer(&PipelineStats::write_ns);
+            unsigned char* out = alloc(user_data, passthrough.size);
+            if (!out) {
+                preview_log(PREVIEW_LOG_ERROR, "Failed to allocate output buffer");
+                return -1;
             }
+            record_buffer(passthrough.size);
+            memcpy(out, passthrough.data, passthrough.size);
+            *out_size = passthrough.size;
+            return 0;
         }
-        stbi_image_free(decoded);
-        width = new_width; height = new_height;
-    }
 
-    finalize_exif_data(exif_data, width, height);
+        // Encode straight into the caller's buffer
+        int width, height;
+        unsigned char* jpeg_buffer = nullptr;
+        int result = encode_image(data, size, options, passthrough.orientation, alloc, user_data,
+                                  &jpeg_buffer, out_size, width, height, exif_data);
+        if (result == -2) {
+            preview_log(PREVIEW_LOG_ERROR, "Failed to allocate output buffer");
+        }
+        return result == 0 ? 0 : -1;
+    });
+}
 
-    // Compress to JPEG in-memory
-    tjhandle compress_handle = tjInitCompress();
-    if (!compress_handle) {
-        if (is_jpeg(data, size)) delete[] rgb_data; else stbi_image_free(rgb_data);
-        return -1;
-    }
+int extract_image_metadata(const char* input_path, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        init_exif_data(exif_data);
 
-    unsigned char* jpeg_buffer = nullptr;
-    unsigned long jpeg_size = 0;
-    if (tjCompress2(compress_handle, rgb_data, width, 0, height, TJPF_RGB, &jpeg_buffer, &jpeg_size, TJSAMP_444, 75, TJFLAG_FASTDCT) != 0) {
-        tjDestroy(compress_handle);
-        if (is_jpeg(data, size)) delete[] rgb_data; else stbi_image_free(rgb_data);
-        return -1;
-    }
+        // Only the headers are read, so do not ask for the whole file
+        StageTimer open_timer(&PipelineStats::open_ns);
+        MappedFile input;
+        if (!input.open(input_path, false)) {
+            preview_log(PREVIEW_LOG_ERROR, std::string("Failed to open input file: ") + input_path + " (" + input.error() + ")");
+            return -1;
+        }
+        if (input.size() == 0) {
+            preview_log(PREVIEW_LOG_ERROR, std::string("Empty input file: ") + input_path);
+            return -1;
+        }
+        open_timer.stop();
+        return read_image_metadata(input.data(), input.size(), exif_data);
+    });
+}
 
-    // Allocate a buffer for the caller and copy jpeg data
-    unsigned char* out = new unsigned char[jpeg_size];
-    memcpy(out, jpeg_buffer, jpeg_size);
-    *out_buf = out;
-    *out_size = jpeg_size;
+int extract_image_metadata_from_bytes(const unsigned char* data, size_t size, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        init_exif_data(exif_data);
+        if (!data || size == 0) {
+            preview_log(PREVIEW_LOG_ERROR, "Empty input buffer");
+            return -1;
+        }
+        return read_image_metadata(data, size, exif_data);
+    });
+}
 
-    // Cleanup
-    tjFree(jpeg_buffer);
-    tjDestroy(compress_handle);
-    if (is_jpeg(data, size)) delete[] rgb_data; else stbi_image_free(rgb_data);
+int process_image_bytes_to_pyramid(const unsigned char* data, size_t size, const PreviewOptions* options, const PreviewLevel* levels, int level_count, PreviewLevelOutput* outputs, ExifData& exif_data) {
+    PipelineCall call;
+    return guarded([&] {
+        if (!outputs || !valid_pyramid_levels(levels, level_count)) return -1;
+        for (int i = 0; i < level_count; i++) {
+            outputs[i].data = nullptr;
+            outputs[i].size = 0;
+            outputs[i].width = 0;
+            outputs[i].height = 0;
+        }
 
-    return 0;
+        init_exif_data(exif_data);
+        if (!data || size == 0) {
+            preview_log(PREVIEW_LOG_ERROR, "Empty input buffer");
+            return -1;
+        }
+
+        // Decode once at the size of the largest level
+        int width, height;
+        PixelBuffer rgb_data;
+        if (decode_image(data, size, options, levels, level_count, rgb_data, width, height, exif_data) != 0) {
+            return -1;
+        }
+
+        if (encode_pyramid(rgb_data.data(), width, height, levels, level_count, encoding_of(options), outputs) != 0) {
+            preview_log(PREVIEW_LOG_ERROR, "Failed to encode preview pyramid");
+            return -1;
+        }
+        return 0;
+    });
 }
 
 }
@@ -1,6 +1,9 @@
 #ifndef LIBJPEG_WRAPPER_H
 #define LIBJPEG_WRAPPER_H
 
+#include <stddef.h>
+#include "preview_options.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,7 +12,7 @@ extern "C" {
 struct ExifData {
     char camera_make[64];
     char camera_model[64];
-    char* software;
+    const char* software;
     int iso_speed;
     double shutter;
     double aperture;
@@ -21,12 +24,12 @@ struct ExifData {
     int colors;
     int color_filter;
     double cam_mul[4];
-    char* date_taken;
-    char* lens;
+    const char* date_taken;
+    const char* lens;
     double max_aperture;
     int focal_length_35mm;
-    char* description;
-    char* artist;
+    const char* description;
+    const char* artist;
 };
 
 // Process image file to JPEG with EXIF extraction
@@ -41,10 +44,36 @@ int process_image_bytes(const unsigned char* data, size_t size, const char* outp
 void free_buffer(unsigned char* buffer);
 
 // Process image data from memory and return JPEG bytes in a newly-allocated buffer.
-// The caller receives `*out_buf` (allocated via new unsigned char[]) and `*out_size`.
+// The caller receives `*out_buf` (allocated from the buffer pool, buffer_pool.h) and `*out_size`.
 // The caller must call `free_buffer` to release the returned buffer.
 int process_image_bytes_to_buffer(const unsigned char* data, size_t size, unsigned char** out_buf, size_t* out_size, ExifData& exif_data);
 
+// Variants of the functions above taking PreviewOptions (see preview_options.h).
+// A null options pointer selects the defaults: half-resolution output.
+int process_image_to_jpeg_with_options(const char* input_path, const char* output_path, const PreviewOptions* options, ExifData& exif_data);
+
+int process_image_bytes_with_options(const unsigned char* data, size_t size, const char* output_path, const PreviewOptions* options, ExifData& exif_data);
+
+int process_image_bytes_to_buffer_with_options(const unsigned char* data, size_t size, const PreviewOptions* options, unsigned char** out_buf, size_t* out_size, ExifData& exif_data);
+
+// Processes image bytes and encodes the JPEG straight into a buffer obtained
+// from alloc(user_data, capacity), which the caller owns. The capacity
+// requested is TurboJPEG's worst case (tjBufSize); *out_size receives the
+// number of bytes actually written.
+int process_image_bytes_into(const unsigned char* data, size_t size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data);
+
+// Fill exif_data from the EXIF block and image header of a file or buffer
+// without decoding any pixels. output_width and output_height receive the
+// full image size after orientation. Returns 0 on success, -1 on failure.
+int extract_image_metadata(const char* input_path, ExifData& exif_data);
+int extract_image_metadata_from_bytes(const unsigned char* data, size_t size, ExifData& exif_data);
+
+// Decodes image bytes once and encodes one JPEG per entry of `levels` into
+// `outputs` (level_count entries, each released with free_buffer). The
+// output size fields of `options` are ignored. On failure no buffers are
+// returned.
+int process_image_bytes_to_pyramid(const unsigned char* data, size_t size, const PreviewOptions* options, const PreviewLevel* levels, int level_count, PreviewLevelOutput* outputs, ExifData& exif_data);
+
 #ifdef __cplusplus
 }
 #endif
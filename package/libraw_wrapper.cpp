@@ -1,23 +1,1311 @@
 #include "libraw_wrapper.h"
+#include "buffer_pool.h"
+#include "draft_demosaic.h"
+#ifdef RAW_PREVIEW_HAVE_CUDA
+#include "gpu_develop.h"
+#endif
+#include "image_ops.h"
+#include "mapped_file.h"
+#include "pipeline_stats.h"
+#include "raw_stream.h"
+#include "preview_log.h"
 #include "libraw/libraw.h"
 #include "turbojpeg.h"
 #include <string>
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <memory>
 
-// Global variable to store the last error message
-static std::string last_error;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * Processing context: keeps a LibRaw instance and TurboJPEG handles alive
+ * across conversions and stores the last error of the calls made on it.
+ * LibRaw::recycle() releases per-image buffers after every conversion.
+ * A context must only be used by one thread at a time.
+ */
+struct RawPreviewContext {
+    LibRaw processor;
+    tjhandle compressor;
+    tjhandle transformer;
+    std::string last_error;
+
+    // Copies of the metadata strings referenced by ExifData, so they stay
+    // valid after recycle() until the next conversion on this context
+    std::string software;
+    std::string description;
+    std::string lens;
+    std::string artist;
+
+    RawPreviewContext() : compressor(tjInitCompress()), transformer(tjInitTransform()) {}
+
+    ~RawPreviewContext() {
+        if (compressor) tjDestroy(compressor);
+        if (transformer) tjDestroy(transformer);
+    }
+};
+
+/**
+ * Returns the context used by the context-less entry points
+ * There is one per calling thread, so concurrent calls neither share a
+ * LibRaw instance nor race on the last error message.
+ */
+static RawPreviewContext* thread_context() {
+    static thread_local std::unique_ptr<RawPreviewContext> context;
+    if (!context) {
+        context.reset(new RawPreviewContext());
+    }
+    return context.get();
+}
+
+// Applies a per-call OpenMP thread count and restores the previous one, so a
+// thread count requested by one call does not leak into the next
+struct OmpThreadsGuard {
+#ifdef _OPENMP
+    int previous;
+    explicit OmpThreadsGuard(int num_threads) : previous(omp_get_max_threads()) {
+        if (num_threads > 0) omp_set_num_threads(num_threads);
+    }
+    ~OmpThreadsGuard() { omp_set_num_threads(previous); }
+#else
+    explicit OmpThreadsGuard(int) {}
+#endif
+};
+
+// Calls LibRaw::recycle() when a conversion leaves scope, on every exit path
+struct RecycleGuard {
+    LibRaw& processor;
+    explicit RecycleGuard(LibRaw& p) : processor(p) {}
+    ~RecycleGuard() { processor.recycle(); }
+};
+
+// Options used when a caller passes a null PreviewOptions pointer
+static const PreviewOptions default_preview_options = { 0, 0, 0, 0, 0, 0, { 0, 0, 0, 0, 0 }, 0, 0, 0, 0 };
+
+// LibRaw flip values (imgdata.sizes.flip) that dcraw_process() applies to its output
+#define LIBRAW_FLIP_180 3
+#define LIBRAW_FLIP_90_CCW 5
+#define LIBRAW_FLIP_90_CW 6
+
+// rawparams.options bit enabling DNG OpcodeList3 (applied after demosaicing)
+#define RAW_OPTION_DNG_STAGE3 0x10000
+
+// EXIF orientation doing what each LibRaw flip value (0-7) does
+static const int flip_orientations[8] = { 1, 2, 4, 3, 5, 8, 6, 7 };
+
+// JPEG bytes produced by the pipeline. The data is owned either by TurboJPEG,
+// by LibRaw when an embedded preview is returned untouched, or by the caller
+// when compress_rgb() encoded into a buffer obtained from alloc.
+struct JpegOutput {
+    unsigned char* data = nullptr;
+    unsigned long size = 0;
+    libraw_processed_image_t* thumb = nullptr;
+    bool external = false;
+    bool pooled = false; // data comes from compress_jpeg_pooled()
+
+    // Set by the *_into entry points; reset() and swap() keep it
+    PreviewAllocFn alloc = nullptr;
+    void* user_data = nullptr;
+
+    void swap(JpegOutput& other) {
+        std::swap(data, other.data);
+        std::swap(size, other.size);
+        std::swap(thumb, other.thumb);
+        std::swap(external, other.external);
+        std::swap(pooled, other.pooled);
+    }
+
+    // Releases the bytes so the output can be filled again
+    void reset() {
+        JpegOutput empty;
+        swap(empty);
+    }
+
+    ~JpegOutput() {
+        if (thumb) {
+            LibRaw::dcraw_clear_mem(thumb);
+        } else if (pooled) {
+            pool_free(data);
+        } else if (data && !external) {
+            tjFree(data);
+        }
+    }
+};
+
+/**
+ * Configures LibRaw processing parameters for fast preview generation
+ * @param processor LibRaw instance to configure before opening a file
+ */
+static void configure_preview_params(LibRaw* processor) {
+    processor->imgdata.params.output_bps = 8;        // 8 bits per channel for smaller files
+    processor->imgdata.params.output_color = 1;      // sRGB output color space
+    processor->imgdata.params.use_camera_wb = 1;     // Use camera white balance
+    processor->imgdata.params.no_auto_bright = 1;    // Disable auto brightness for speed
+    processor->imgdata.params.use_camera_matrix = 1; // Use camera color matrix
+    processor->imgdata.params.half_size = 1;         // Reduce resolution to one quarter (for speed, see configure_output_size)
+    processor->imgdata.params.user_qual = -1;        // Default demosaic (AHD) when half-size is too small
+    processor->imgdata.params.highlight = 0;         // Clip highlights
+    processor->imgdata.params.fbdd_noiserd = 0;      // No FBDD noise reduction
+
+    // Raw processing options for better DNG compatibility with non-standard files
+    processor->imgdata.rawparams.options = 0;        // Reset options
+    processor->imgdata.rawparams.options |= 0x2000;  // Don't check DNG illuminant strictly
+    processor->imgdata.rawparams.options |= 0x8000;  // DNG stage 2 processing
+    processor->imgdata.rawparams.options |= RAW_OPTION_DNG_STAGE3; // DNG stage 3 processing
+    processor->imgdata.rawparams.options |= 0x40000; // Allow size changes during processing
+}
+
+/**
+ * Applies a processing profile on top of configure_preview_params()
+ * PREVIEW_PROFILE_BALANCED keeps those settings.
+ * @param processor LibRaw instance that has been opened
+ * @param profile PREVIEW_PROFILE_* value
+ */
+static void configure_profile(LibRaw* processor, int profile) {
+    libraw_output_params_t& params = processor->imgdata.params;
+    switch (profile) {
+    case PREVIEW_PROFILE_FAST:
+        params.user_qual = 0;         // Bilinear demosaic when half-size is too small
+        params.output_color = 0;      // Camera color space: no matrix conversion
+        params.use_camera_matrix = 0;
+        processor->imgdata.rawparams.options &= ~RAW_OPTION_DNG_STAGE3;
+        break;
+    case PREVIEW_PROFILE_QUALITY:
+        params.user_qual = 11;        // DHT
+        params.highlight = 2;         // Blend clipped highlights
+        params.fbdd_noiserd = 1;      // Light FBDD noise reduction before demosaicing
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Chooses LibRaw's half_size mode for the requested output size
+ * Half-size output skips demosaicing entirely, so it is kept whenever it is
+ * still at least as large as the target; without a target it stays on.
+ * @param processor LibRaw instance that has been opened
+ * @param options Preview options
+ */
+static void configure_output_size(LibRaw* processor, const PreviewOptions& options) {
+    if (!has_target_size(options)) return;
+
+    int width = processor->imgdata.sizes.width;
+    int height = processor->imgdata.sizes.height;
+    if (processor->imgdata.sizes.flip & 4) std::swap(width, height); // Output is transposed
+
+    int target_width, target_height;
+    compute_target_size(width, height, options, &target_width, &target_height);
+    processor->imgdata.params.half_size = (width / 2 >= target_width && height / 2 >= target_height) ? 1 : 0;
+}
+
+/**
+ * Copies metadata from an opened LibRaw instance into ExifData
+ * String fields point into the context and stay valid until its next conversion.
+ * @param ctx Context whose LibRaw instance has been opened
+ * @param exif_data Structure to populate
+ */
+static void fill_exif_data(RawPreviewContext& ctx, ExifData& exif_data) {
+    LibRaw* processor = &ctx.processor;
+
+    // Note: camera make/model are char arrays in LibRaw, not pointers
+    strncpy((char*)exif_data.camera_make, processor->imgdata.idata.make, 63);
+    ((char*)exif_data.camera_make)[63] = '\0';
+    strncpy((char*)exif_data.camera_model, processor->imgdata.idata.model, 63);
+    ((char*)exif_data.camera_model)[63] = '\0';
+
+    ctx.software = processor->imgdata.idata.software;
+    ctx.description = processor->imgdata.other.desc;
+    ctx.lens = processor->imgdata.lens.Lens;
+    ctx.artist = processor->imgdata.other.artist;
+
+    exif_data.software = ctx.software.c_str();
+    exif_data.iso_speed = static_cast<int>(processor->imgdata.other.iso_speed);
+    exif_data.shutter = processor->imgdata.other.shutter;
+    exif_data.aperture = processor->imgdata.other.aperture;
+    exif_data.focal_length = processor->imgdata.other.focal_len;
+    exif_data.raw_width = processor->imgdata.sizes.raw_width;
+    exif_data.raw_height = processor->imgdata.sizes.raw_height;
+    exif_data.output_width = processor->imgdata.sizes.width;
+    exif_data.output_height = processor->imgdata.sizes.height;
+    exif_data.colors = processor->imgdata.idata.colors;
+    exif_data.color_filter = static_cast<int>(processor->imgdata.idata.filters);
+
+    // Copy camera multipliers
+    for (int i = 0; i < 4; i++) {
+        exif_data.cam_mul[i] = processor->imgdata.color.cam_mul[i];
+    }
+
+    exif_data.date_taken = ctx.description.c_str();
+    exif_data.lens = ctx.lens.c_str();
+    exif_data.max_aperture = processor->imgdata.lens.EXIF_MaxAp;
+    exif_data.focal_length_35mm = processor->imgdata.lens.FocalLengthIn35mmFormat;
+    exif_data.description = ctx.description.c_str();
+    exif_data.artist = ctx.artist.c_str();
+}
+
+/**
+ * Extracts the embedded JPEG preview if its long edge is at least min_size
+ * The preview is rotated losslessly to match the orientation dcraw_process()
+ * would have applied. Leaves last_error untouched: a missing or too small
+ * preview is not an error, the caller simply falls back to demosaicing.
+ * @param ctx Context whose LibRaw instance has been opened
+ * @param min_size Minimum long edge in pixels (0 accepts any size)
+ * @param output Receives the JPEG bytes
+ * @param width Receives the preview width in pixels
+ * @param height Receives the preview height in pixels
+ * @param index Entry of LibRaw's thumbnail list to extract, or -1 for the
+ *        one LibRaw selects (the largest)
+ * @return true if a usable preview was extracted
+ */
+static bool extract_embedded_jpeg(RawPreviewContext& ctx, int min_size, JpegOutput& output, int* width, int* height,
+                                  int index = -1) {
+    LibRaw* processor = &ctx.processor;
+    tjhandle transformer = ctx.transformer;
+    if (!transformer) return false;
+    StageTimer timer(&PipelineStats::decode_ns);
+
+    if ((index >= 0 ? processor->unpack_thumb_ex(index) : processor->unpack_thumb()) != LIBRAW_SUCCESS) return false;
+    if (processor->imgdata.thumbnail.tformat != LIBRAW_THUMBNAIL_JPEG) return false;
+
+    libraw_processed_image_t* thumb = processor->dcraw_make_mem_thumb();
+    if (!thumb) return false;
+    if (thumb->type != LIBRAW_IMAGE_JPEG || thumb->data_size == 0) {
+        LibRaw::dcraw_clear_mem(thumb);
+        return false;
+    }
+    record_buffer(thumb->data_size);
+
+    // LibRaw does not always know the preview size, so read it from the JPEG header
+    int subsampling, colorspace;
+    if (tjDecompressHeader3(transformer, thumb->data, thumb->data_size, width, height, &subsampling, &colorspace) != 0
+        || std::max(*width, *height) < min_size) {
+        LibRaw::dcraw_clear_mem(thumb);
+        return false;
+    }
+
+    int op = TJXOP_NONE;
+    switch (processor->imgdata.sizes.flip) {
+        case LIBRAW_FLIP_180: op = TJXOP_ROT180; break;
+        case LIBRAW_FLIP_90_CCW: op = TJXOP_ROT270; break;
+        case LIBRAW_FLIP_90_CW: op = TJXOP_ROT90; break;
+        default: break;
+    }
+
+    if (op == TJXOP_NONE) {
+        // Return LibRaw's buffer untouched
+        output.thumb = thumb;
+        output.data = thumb->data;
+        output.size = thumb->data_size;
+        return true;
+    }
+
+    tjtransform transform;
+    memset(&transform, 0, sizeof(transform));
+    transform.op = op;
+    transform.options = TJXOPT_TRIM; // Drop partial edge MCUs that cannot be rotated losslessly
+
+    unsigned char* rotated = nullptr;
+    unsigned long rotated_size = 0;
+    bool ok = tjTransform(transformer, thumb->data, thumb->data_size, 1, &rotated, &rotated_size, &transform, 0) == 0
+        && tjDecompressHeader3(transformer, rotated, rotated_size, width, height, &subsampling, &colorspace) == 0;
+
+    LibRaw::dcraw_clear_mem(thumb);
+    if (!ok) {
+        if (rotated) tjFree(rotated);
+        return false;
+    }
+
+    record_buffer(rotated_size);
+    output.data = rotated;
+    output.size = rotated_size;
+    return true;
+}
+
+/**
+ * compress_rgb() for large bitmaps: resizes and compresses them in strips
+ * (StripEncoder), so no resized copy of the bitmap is made
+ */
+static int compress_rgb_strips(RawPreviewContext& ctx, const unsigned char* rgb, int width, int height,
+                               int target_width, int target_height, const PreviewOptions& options,
+                               JpegOutput& output, ExifData& exif_data) {
+    unsigned long capacity = jpeg_buffer_size(target_width, target_height, options.encode);
+    if (capacity == (unsigned long)-1) {
+        ctx.last_error = "Failed to convert to JPEG: invalid output size";
+        return RW_ERROR_PROCESS;
+    }
+    record_buffer(capacity);
+    unsigned char* jpeg = output.alloc ? output.alloc(output.user_data, capacity)
+                                       : static_cast<unsigned char*>(pool_alloc(capacity));
+    if (!jpeg) {
+        ctx.last_error = "Failed to allocate output buffer";
+        return RW_ERROR_WRITE;
+    }
+
+    StripEncoder encoder;
+    unsigned long jpeg_size = 0;
+    if (!encoder.start(width, height, target_width, target_height, 1, options.encode, jpeg, capacity)
+        || !encoder.push(rgb, height, 0) || !encoder.finish(&jpeg_size)) {
+        if (!output.alloc) pool_free(jpeg);
+        ctx.last_error = "Failed to convert to JPEG: ";
+        ctx.last_error += encoder.error();
+        return RW_ERROR_PROCESS;
+    }
+    output.data = jpeg;
+    output.size = jpeg_size;
+    output.external = output.alloc != nullptr;
+    output.pooled = !output.alloc;
+
+    exif_data.output_width = target_width;
+    exif_data.output_height = target_height;
+    return RW_SUCCESS;
+}
+
+/**
+ * Scales RGB pixels down to the requested output size and compresses them
+ * When output has an allocator the JPEG is encoded straight into its buffer.
+ * Large bitmaps go through compress_rgb_strips().
+ * @param ctx Context providing the compressor
+ * @param rgb Tightly packed RGB pixels
+ * @param options Preview options; without a target size the pixels are compressed as-is
+ * @param output Receives the JPEG bytes (must be empty)
+ * @param exif_data Receives the output dimensions
+ * @return RW_SUCCESS on success, RW_ERROR_PROCESS or RW_ERROR_WRITE (allocation) on failure (ctx.last_error is set)
+ */
+static int compress_rgb(RawPreviewContext& ctx, const unsigned char* rgb, int width, int height,
+                        const PreviewOptions& options, JpegOutput& output, ExifData& exif_data) {
+    if (!ctx.compressor) {
+        ctx.last_error = "Failed to initialize TurboJPEG compressor";
+        return RW_ERROR_PROCESS;
+    }
+
+    int target_width = width, target_height = height;
+    if (has_target_size(options)) {
+        compute_target_size(width, height, options, &target_width, &target_height);
+    }
+    if (prefer_strips(width, height)) {
+        return compress_rgb_strips(ctx, rgb, width, height, target_width, target_height, options, output, exif_data);
+    }
+
+    PixelBuffer scaled;
+    if (target_width < width || target_height < height) {
+        StageTimer timer(&PipelineStats::resize_ns);
+        scaled.resize((size_t)target_width * target_height * 3);
+        record_buffer(scaled.size());
+        resize_area(rgb, width, height, 0, scaled.data(), target_width, target_height, 3);
+        rgb = scaled.data();
+        width = target_width;
+        height = target_height;
+    }
+
+    StageTimer timer(&PipelineStats::encode_ns);
+    int ret;
+    std::string error;
+    if (output.alloc) {
+        record_buffer(jpeg_buffer_size(width, height, options.encode));
+        size_t jpeg_size = 0;
+        ret = compress_rgb_into(ctx.compressor, rgb, width, height, options.encode, output.alloc, output.user_data,
+                                &output.data, &jpeg_size, &error);
+        if (ret == -2) {
+            ctx.last_error = "Failed to allocate output buffer";
+            return RW_ERROR_WRITE;
+        }
+        output.size = jpeg_size;
+        output.external = ret == 0;
+    } else {
+        ret = compress_jpeg_pooled(ctx.compressor, rgb, width, height, options.encode, &output.data, &output.size, &error);
+        output.pooled = ret == 0;
+        record_buffer(output.size);
+    }
+    if (ret != 0) {
+        ctx.last_error = "Failed to convert to JPEG: ";
+        ctx.last_error += error;
+        return RW_ERROR_PROCESS;
+    }
+
+    exif_data.output_width = width;
+    exif_data.output_height = height;
+    return RW_SUCCESS;
+}
+
+/**
+ * Scales an extracted embedded preview down to the requested output size
+ * Decodes at the smallest DCT scale covering the target, then resizes and
+ * re-encodes. Leaves output untouched when it already fits.
+ * @return true if output holds a usable preview afterwards
+ */
+static bool fit_embedded_jpeg(RawPreviewContext& ctx, const PreviewOptions& options, JpegOutput& output,
+                              int width, int height, ExifData& exif_data) {
+    int target_width, target_height;
+    compute_target_size(width, height, options, &target_width, &target_height);
+    if (target_width >= width && target_height >= height) return true;
+
+    PixelBuffer rgb;
+    int decoded_width, decoded_height;
+    {
+        StageTimer timer(&PipelineStats::decode_ns);
+        if (decode_jpeg_scaled(ctx.transformer, output.data, output.size, target_width, target_height,
+                               rgb, &decoded_width, &decoded_height) != 0) {
+            return false;
+        }
+        record_buffer(rgb.size());
+    }
+
+    JpegOutput scaled;
+    scaled.alloc = output.alloc;
+    scaled.user_data = output.user_data;
+    if (compress_rgb(ctx, rgb.data(), decoded_width, decoded_height, options, scaled, exif_data) != RW_SUCCESS) {
+        ctx.last_error.clear(); // Not fatal, the caller falls back to demosaicing
+        return false;
+    }
+    output.swap(scaled);
+    return true;
+}
+
+/**
+ * Describes the unpacked sensor data for develop_draft() and the GPU backend
+ * Gathers the layout, black levels and color parameters the way
+ * dcraw_process() would use them with configure_preview_params().
+ * @param ctx Context whose LibRaw instance has been unpacked
+ * @return false if the sensor is not a 3-color filter array
+ */
+static bool fill_draft_image(RawPreviewContext& ctx, DraftRawImage& image) {
+    LibRaw* processor = &ctx.processor;
+    const libraw_data_t& data = processor->imgdata;
+    if (!data.rawdata.raw_image || data.idata.filters == 0 || data.idata.colors != 3
+        || processor->is_fuji_rotated() || data.sizes.pixel_aspect != 1.0) {
+        return false;
+    }
+
+    // Black level pattern of cblack[6..], cblack[4] rows by cblack[5] columns
+    const unsigned* cblack = data.color.cblack;
+    const unsigned pattern_rows = cblack[4], pattern_cols = cblack[5];
+    const bool black_pattern = pattern_rows && pattern_cols;
+    if (black_pattern && (DRAFT_PATTERN_SIZE % pattern_rows || DRAFT_PATTERN_SIZE % pattern_cols)) return false;
+
+    image.pitch = data.sizes.raw_pitch / sizeof(ushort);
+    image.raw = data.rawdata.raw_image + (size_t)data.sizes.top_margin * image.pitch + data.sizes.left_margin;
+    image.width = data.sizes.width;
+    image.height = data.sizes.height;
+    for (int row = 0; row < DRAFT_PATTERN_SIZE; row++) {
+        for (int col = 0; col < DRAFT_PATTERN_SIZE; col++) {
+            const int color = processor->COLOR(row, col);
+            if (color < 0 || color > 3) return false;
+            unsigned black = data.color.black + cblack[color];
+            if (black_pattern) black += cblack[6 + (row % pattern_rows) * pattern_cols + col % pattern_cols];
+            image.color[row][col] = color == 3 ? 1 : color; // Second green
+            image.black[row][col] = (unsigned short)std::min(black, 0xffffu);
+        }
+    }
+    image.maximum = data.color.maximum;
+
+    const float* cam_mul = data.color.cam_mul;
+    const bool camera_wb = data.params.use_camera_wb && cam_mul[0] > 0 && cam_mul[1] > 0 && cam_mul[2] > 0;
+    const bool camera_matrix = data.params.use_camera_matrix && data.color.cmatrix[0][0] > 0.125f;
+    for (int c = 0; c < 3; c++) {
+        image.multipliers[c] = camera_wb ? cam_mul[c] : data.color.pre_mul[c];
+        for (int i = 0; i < 3; i++) {
+            if (data.params.output_color == 0) {
+                image.rgb_cam[i][c] = i == c ? 1.0f : 0.0f; // Camera color space
+            } else {
+                image.rgb_cam[i][c] = camera_matrix ? data.color.cmatrix[i][c] : data.color.rgb_cam[i][c];
+            }
+        }
+    }
+    image.gamma_power = data.params.gamm[0];
+    image.gamma_slope = data.params.gamm[1];
+    return true;
+}
+
+/**
+ * Develops the unpacked sensor data by binning it (develop_draft())
+ * Applies the flip LibRaw would.
+ * @param ctx Context whose LibRaw instance has been unpacked
+ * @param options Preview options; the bin is chosen to cover their output size
+ * @return true on success; false if the sensor is not a 3-color filter
+ *         array or no bin covers the output size, leaving rgb untouched
+ */
+static bool develop_draft_image(RawPreviewContext& ctx, const PreviewOptions& options, PixelBuffer& rgb,
+                                int* width, int* height) {
+    DraftRawImage image;
+    if (!fill_draft_image(ctx, image)) return false;
+
+    // The output size applies to the flipped image
+    const int flip = ctx.processor.imgdata.sizes.flip & 7;
+    int target_width = 0, target_height = 0;
+    if (has_target_size(options)) {
+        if (flip & 4) {
+            compute_target_size(image.height, image.width, options, &target_height, &target_width);
+        } else {
+            compute_target_size(image.width, image.height, options, &target_width, &target_height);
+        }
+    }
+    const int bin = select_draft_bin(image, target_width, target_height);
+    if (!bin) return false;
+
+    {
+        StageTimer timer(&PipelineStats::demosaic_ns);
+        develop_draft(image, bin, rgb, width, height);
+    }
+    record_buffer(rgb.size());
+
+    StageTimer timer(&PipelineStats::orient_ns);
+    apply_exif_orientation(flip_orientations[flip], rgb, width, height);
+    return true;
+}
+
+/**
+ * Runs unpack() on an opened LibRaw instance
+ * @param ctx Context whose LibRaw instance has been opened
+ * @return RW_SUCCESS on success, RW_ERROR_UNPACK on failure (ctx.last_error is set)
+ */
+static int unpack_raw(RawPreviewContext& ctx) {
+    LibRaw* processor = &ctx.processor;
+    int ret;
+    {
+        StageTimer timer(&PipelineStats::unpack_ns);
+        ret = processor->unpack();
+    }
+    if (ret != LIBRAW_SUCCESS) {
+        ctx.last_error = "Failed to unpack RAW data: ";
+        ctx.last_error += libraw_strerror(ret);
+        return RW_ERROR_UNPACK;
+    }
+    record_buffer((size_t)processor->imgdata.sizes.raw_pitch * processor->imgdata.sizes.raw_height);
+    return RW_SUCCESS;
+}
+
+/**
+ * Runs dcraw_process() on an unpacked LibRaw instance
+ * The 8-bit bitmap is copied out of LibRaw with copy_mem_image() into a pool
+ * buffer instead of a fresh dcraw_make_mem_image() allocation. With
+ * options.draft_demosaic, develop_draft_image() replaces dcraw_process()
+ * whenever it can.
+ * @param ctx Context whose LibRaw instance has been unpacked
+ * @param options Preview options; the output size only steers the draft development
+ * @param rgb Receives the processed, tightly packed RGB bitmap
+ * @param width Receives the bitmap width
+ * @param height Receives the bitmap height
+ * @param exif_data Structure to refresh with the processed image size
+ * @return RW_SUCCESS on success, error code on failure (ctx.last_error is set)
+ */
+static int develop_unpacked(RawPreviewContext& ctx, const PreviewOptions& options, PixelBuffer& rgb,
+                            int* width, int* height, ExifData& exif_data) {
+    LibRaw* processor = &ctx.processor;
+    int ret;
+
+    if (options.draft_demosaic) {
+        if (develop_draft_image(ctx, options, rgb, width, height)) return RW_SUCCESS;
+        preview_log(PREVIEW_LOG_DEBUG, "Draft demosaic does not apply to this image, running dcraw_process()");
+    }
+
+    // Process the RAW data (demosaicing, color correction, etc.)
+    {
+        StageTimer timer(&PipelineStats::demosaic_ns);
+        ret = processor->dcraw_process();
+    }
+    if (ret != LIBRAW_SUCCESS) {
+        ctx.last_error = "Failed to process image: ";
+        ctx.last_error += libraw_strerror(ret);
+        return RW_ERROR_PROCESS;
+    }
+
+    // Processing may adjust the image size (e.g. Fuji rotation), so refresh it
+    fill_exif_data(ctx, exif_data);
+
+    // 16-bit, 4-channel working image of dcraw_process()
+    record_buffer((size_t)processor->imgdata.sizes.iwidth * processor->imgdata.sizes.iheight * 4 * sizeof(ushort));
+
+    // Validate that LibRaw produces the expected image format (RGB bitmap)
+    int colors, bps;
+    processor->get_mem_image_format(width, height, &colors, &bps);
+    if (colors != 3 || bps != 8 || *width <= 0 || *height <= 0) {
+        ctx.last_error = "Unsupported image format";
+        return RW_ERROR_PROCESS;
+    }
+
+    // Generate processed image data in memory
+    StageTimer timer(&PipelineStats::make_image_ns);
+    const int stride = *width * 3;
+    rgb.resize((size_t)stride * *height);
+    ret = processor->copy_mem_image(rgb.data(), stride, 0);
+    if (ret != LIBRAW_SUCCESS) {
+        ctx.last_error = "Failed to generate image data: ";
+        ctx.last_error += libraw_strerror(ret);
+        return RW_ERROR_WRITE;
+    }
+    record_buffer(rgb.size());
+
+    // Release the working image before the bitmap is resized and encoded
+    processor->free_image();
+    return RW_SUCCESS;
+}
+
+/**
+ * Runs unpack() + dcraw_process() on an opened LibRaw instance
+ * See develop_unpacked() for the parameters.
+ */
+static int develop_image(RawPreviewContext& ctx, const PreviewOptions& options, PixelBuffer& rgb,
+                         int* width, int* height, ExifData& exif_data) {
+    // Unpacking and processing run LibRaw's OpenMP loops when built with the `openmp` feature
+    OmpThreadsGuard threads(options.num_threads);
+
+    int ret = unpack_raw(ctx);
+    if (ret != RW_SUCCESS) return ret;
+    return develop_unpacked(ctx, options, rgb, width, height, exif_data);
+}
+
+#ifdef RAW_PREVIEW_HAVE_CUDA
+/**
+ * Develops, resizes and encodes the unpacked sensor data on the GPU
+ * (gpu_develop_jpeg()) in place of dcraw_process() and TurboJPEG
+ * Applies to 2x2 Bayer sensors with the fast and balanced profiles and the
+ * encoder settings nvJPEG supports; draft_demosaic keeps the CPU binning.
+ * Without an output size the image is halved when half_size is set, like
+ * dcraw_process() does.
+ * @param ctx Context whose LibRaw instance has been unpacked
+ * @param output Receives the JPEG bytes
+ * @return true on success; false to fall back to dcraw_process(), with
+ *         ctx.last_error untouched
+ */
+static bool develop_gpu_image(RawPreviewContext& ctx, const PreviewOptions& options, JpegOutput& output,
+                              ExifData& exif_data) {
+    if (options.draft_demosaic || options.profile == PREVIEW_PROFILE_QUALITY || !gpu_develop_supported(options.encode)) {
+        return false;
+    }
+    DraftRawImage image;
+    if (!fill_draft_image(ctx, image) || !is_bayer_2x2(image)) return false;
+
+    const libraw_data_t& data = ctx.processor.imgdata;
+    const int flip = data.sizes.flip & 7;
+    int width = image.width, height = image.height;
+    if (has_target_size(options)) {
+        // The output size applies to the flipped image
+        if (flip & 4) {
+            compute_target_size(image.height, image.width, options, &height, &width);
+        } else {
+            compute_target_size(image.width, image.height, options, &width, &height);
+        }
+    } else if (data.params.half_size) {
+        width /= 2;
+        height /= 2;
+    }
+
+    PixelBuffer jpeg;
+    std::string error;
+    {
+        StageTimer timer(&PipelineStats::demosaic_ns);
+        if (gpu_develop_jpeg(image, flip_orientations[flip], width, height, options.encode, jpeg, &error) != 0) {
+            preview_log(PREVIEW_LOG_DEBUG, "GPU development failed, running dcraw_process(): " + error);
+            return false;
+        }
+    }
+    record_buffer(jpeg.size());
+
+    unsigned char* bytes = output.alloc ? output.alloc(output.user_data, jpeg.size())
+                                        : static_cast<unsigned char*>(pool_alloc(jpeg.size()));
+    if (!bytes) return false;
+    memcpy(bytes, jpeg.data(), jpeg.size());
+    output.data = bytes;
+    output.size = jpeg.size();
+    output.external = output.alloc != nullptr;
+    output.pooled = !output.alloc;
+
+    if (flip & 4) std::swap(width, height);
+    exif_data.output_width = width;
+    exif_data.output_height = height;
+    return true;
+}
+#endif
+
+/**
+ * Develops an opened LibRaw instance and compresses the result
+ * With the `cuda` feature, develop_gpu_image() replaces dcraw_process()
+ * and TurboJPEG whenever it can.
+ * @param ctx Context whose LibRaw instance has been opened and configured
+ * @param output Receives the JPEG bytes (must be empty)
+ * @param exif_data Structure to refresh with the output size
+ * @return RW_SUCCESS on success, error code on failure (ctx.last_error is set)
+ */
+static int render_image(RawPreviewContext& ctx, const PreviewOptions& options, JpegOutput& output,
+                        ExifData& exif_data) {
+    OmpThreadsGuard threads(options.num_threads);
+
+    int ret = unpack_raw(ctx);
+    if (ret != RW_SUCCESS) return ret;
+#ifdef RAW_PREVIEW_HAVE_CUDA
+    if (develop_gpu_image(ctx, options, output, exif_data)) return RW_SUCCESS;
+#endif
+
+    PixelBuffer rgb;
+    int width = 0, height = 0;
+    ret = develop_unpacked(ctx, options, rgb, &width, &height, exif_data);
+    if (ret != RW_SUCCESS) return ret;
+
+    // Compress the RGB bitmap (resized first if requested)
+    return compress_rgb(ctx, rgb.data(), width, height, options, output, exif_data);
+}
+
+/**
+ * Produces a JPEG preview from an opened LibRaw instance
+ * Uses the embedded preview when requested and usable, otherwise runs
+ * unpack() + dcraw_process() and compresses the result with TurboJPEG.
+ * @param ctx Context whose LibRaw instance has been opened
+ * @param options Preview options
+ * @param output Receives the JPEG bytes
+ * @param exif_data Structure to populate with metadata
+ * @return RW_SUCCESS on success, error code on failure (ctx.last_error is set)
+ */
+static int render_preview(RawPreviewContext& ctx, const PreviewOptions& options, JpegOutput& output, ExifData& exif_data) {
+    LibRaw* processor = &ctx.processor;
+    fill_exif_data(ctx, exif_data);
+
+    if (options.use_embedded_preview) {
+        int width = 0, height = 0;
+        if (extract_embedded_jpeg(ctx, options.min_preview_size, output, &width, &height)) {
+            exif_data.output_width = width;
+            exif_data.output_height = height;
+            if (!has_target_size(options) || fit_embedded_jpeg(ctx, options, output, width, height, exif_data)) {
+                return RW_SUCCESS;
+            }
+            output.reset();
+        }
+        preview_log(PREVIEW_LOG_DEBUG, "No usable embedded preview, demosaicing the RAW data");
+    }
+
+    configure_profile(processor, options.profile);
+    configure_output_size(processor, options);
+    return render_image(ctx, options, output, exif_data);
+}
+
+/**
+ * Produces a preview pyramid from an opened LibRaw instance
+ * The image is decoded once, at the size of the largest level (from the
+ * embedded preview when requested and usable), and every level is derived
+ * from that single decode.
+ * @param ctx Context whose LibRaw instance has been opened
+ * @param options Preview options; the output size fields are ignored
+ * @param levels Requested level sizes
+ * @param count Number of levels
+ * @param outputs Receives one JPEG per level
+ * @param exif_data Structure to populate with metadata; the output size is the largest level's
+ * @return RW_SUCCESS on success, error code on failure (ctx.last_error is set)
+ */
+static int render_pyramid(RawPreviewContext& ctx, const PreviewOptions& options, const PreviewLevel* levels, int count,
+                          PreviewLevelOutput* outputs, ExifData& exif_data) {
+    LibRaw* processor = &ctx.processor;
+    fill_exif_data(ctx, exif_data);
+
+    int width = processor->imgdata.sizes.width;
+    int height = processor->imgdata.sizes.height;
+    if (processor->imgdata.sizes.flip & 4) std::swap(width, height); // Output is transposed
+    PreviewOptions decode_options = options_for_largest_level(options, width, height, levels, count);
+
+    bool encoded = false;
+    if (options.use_embedded_preview) {
+        JpegOutput embedded;
+        int preview_width = 0, preview_height = 0;
+        if (extract_embedded_jpeg(ctx, options.min_preview_size, embedded, &preview_width, &preview_height)) {
+            int target_width, target_height;
+            compute_target_size(preview_width, preview_height, decode_options, &target_width, &target_height);
+
+            PixelBuffer rgb;
+            int decoded_width, decoded_height;
+            int decoded;
+            {
+                StageTimer timer(&PipelineStats::decode_ns);
+                decoded = decode_jpeg_scaled(ctx.transformer, embedded.data, embedded.size, target_width, target_height,
+                                             rgb, &decoded_width, &decoded_height);
+            }
+            record_buffer(rgb.size());
+            encoded = decoded == 0
+                && encode_pyramid(rgb.data(), decoded_width, decoded_height, levels, count, options.encode, outputs) == 0;
+        }
+        if (!encoded) preview_log(PREVIEW_LOG_DEBUG, "No usable embedded preview, demosaicing the RAW data");
+    }
+
+    if (!encoded) {
+        configure_profile(processor, options.profile);
+        configure_output_size(processor, decode_options);
+
+        PixelBuffer rgb;
+        int rgb_width = 0, rgb_height = 0;
+        int ret = develop_image(ctx, decode_options, rgb, &rgb_width, &rgb_height, exif_data);
+        if (ret != RW_SUCCESS) return ret;
+
+        encoded = encode_pyramid(rgb.data(), rgb_width, rgb_height, levels, count, options.encode, outputs) == 0;
+        if (!encoded) {
+            ctx.last_error = "Failed to encode preview pyramid";
+            return RW_ERROR_PROCESS;
+        }
+    }
+
+    // Report the largest level as the output size
+    exif_data.output_width = 0;
+    exif_data.output_height = 0;
+    for (int i = 0; i < count; i++) {
+        if ((long long)outputs[i].width * outputs[i].height > (long long)exif_data.output_width * exif_data.output_height) {
+            exif_data.output_width = outputs[i].width;
+            exif_data.output_height = outputs[i].height;
+        }
+    }
+    return RW_SUCCESS;
+}
+
+/**
+ * Finds the smallest and largest embedded JPEGs
+ * Entries are compared by byte length, which LibRaw always knows, unlike
+ * their pixel size. Unpacking an entry changes LibRaw's current thumbnail,
+ * so each stage extracts its JPEG by index.
+ * @param smallest Receives the index of the smallest JPEG in LibRaw's
+ *        thumbnail list, or -1 if there are fewer than two JPEGs of
+ *        different sizes
+ * @param largest Receives the index of the largest JPEG, or -1 if the list
+ *        holds none
+ */
+static void find_embedded_jpegs(LibRaw* processor, int* smallest, int* largest) {
+    const libraw_thumbnail_list_t& list = processor->imgdata.thumbs_list;
+    const int count = std::min(list.thumbcount, LIBRAW_THUMBNAIL_MAXCOUNT);
+    *smallest = -1;
+    *largest = -1;
+    for (int i = 0; i < count; i++) {
+        const libraw_thumbnail_item_t& item = list.thumblist[i];
+        if (item.tformat != LIBRAW_INTERNAL_THUMBNAIL_JPEG || item.tlength == 0) continue;
+        if (*smallest < 0 || item.tlength < list.thumblist[*smallest].tlength) *smallest = i;
+        if (*largest < 0 || item.tlength > list.thumblist[*largest].tlength) *largest = i;
+    }
+    if (*smallest >= 0 && list.thumblist[*smallest].tlength == list.thumblist[*largest].tlength) *smallest = -1;
+}
+
+/**
+ * Produces the thumbnail stage from the embedded preview: decoded at 1/8
+ * scale, the smallest DCT scale, and compressed as-is
+ * @return true if thumbnail holds the JPEG
+ */
+static bool shrink_embedded_jpeg(RawPreviewContext& ctx, const PreviewOptions& options, const JpegOutput& preview,
+                                 int width, int height, JpegOutput& thumbnail, int* thumbnail_width,
+                                 int* thumbnail_height, ExifData& exif_data) {
+    PixelBuffer rgb;
+    {
+        StageTimer timer(&PipelineStats::decode_ns);
+        if (decode_jpeg_scaled(ctx.transformer, preview.data, preview.size, (width + 7) / 8, (height + 7) / 8,
+                               rgb, thumbnail_width, thumbnail_height) != 0) {
+            return false;
+        }
+        record_buffer(rgb.size());
+    }
+
+    PreviewOptions as_is = options;
+    as_is.max_edge = as_is.target_width = as_is.target_height = 0;
+    if (compress_rgb(ctx, rgb.data(), *thumbnail_width, *thumbnail_height, as_is, thumbnail, exif_data) != RW_SUCCESS) {
+        ctx.last_error.clear(); // Not fatal, the next stage follows
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Produces the stages of a progressive conversion from an opened LibRaw
+ * instance, calling callback after each one
+ * The embedded JPEGs are extracted before anything is unpacked, and the
+ * embedded preview is extracted once for both embedded stages.
+ * @param ctx Context whose LibRaw instance has been opened
+ * @param stages PREVIEW_STAGE_* bits
+ * @return RW_SUCCESS once the requested stages are delivered or callback
+ *         stopped them, error code on failure (ctx.last_error is set)
+ */
+static int render_progressive(RawPreviewContext& ctx, const PreviewOptions& options, int stages,
+                              PreviewStageFn callback, void* user_data, ExifData& exif_data) {
+    LibRaw* processor = &ctx.processor;
+    fill_exif_data(ctx, exif_data);
+
+    bool delivered = false;
+    // Returns false once the callback asks to stop
+    auto deliver = [&](int stage, const JpegOutput& jpeg, int width, int height) {
+        exif_data.output_width = width;
+        exif_data.output_height = height;
+        delivered = true;
+        return callback(user_data, stage, jpeg.data, jpeg.size, width, height, &exif_data) == 0;
+    };
+
+    if (stages & (PREVIEW_STAGE_THUMBNAIL | PREVIEW_STAGE_PREVIEW)) {
+        JpegOutput preview;
+        int preview_width = 0, preview_height = 0;
+        bool have_preview = false;
+        int smallest, largest;
+        find_embedded_jpegs(processor, &smallest, &largest);
+
+        if (stages & PREVIEW_STAGE_THUMBNAIL) {
+            JpegOutput thumbnail;
+            int width = 0, height = 0;
+            bool have_thumbnail = smallest >= 0 && extract_embedded_jpeg(ctx, 0, thumbnail, &width, &height, smallest);
+            if (!have_thumbnail) {
+                // A single embedded JPEG: derive the thumbnail from it
+                have_preview = extract_embedded_jpeg(ctx, 0, preview, &preview_width, &preview_height, largest);
+                have_thumbnail = have_preview && shrink_embedded_jpeg(ctx, options, preview, preview_width, preview_height,
+                                                                      thumbnail, &width, &height, exif_data);
+            }
+            if (have_thumbnail && !deliver(PREVIEW_STAGE_THUMBNAIL, thumbnail, width, height)) return RW_SUCCESS;
+        }
+
+        if (stages & PREVIEW_STAGE_PREVIEW) {
+            if (!have_preview) {
+                preview.reset();
+                have_preview = extract_embedded_jpeg(ctx, 0, preview, &preview_width, &preview_height, largest);
+            }
+            if (have_preview && std::max(preview_width, preview_height) >= options.min_preview_size) {
+                exif_data.output_width = preview_width;
+                exif_data.output_height = preview_height;
+                if (!has_target_size(options)
+                    || fit_embedded_jpeg(ctx, options, preview, preview_width, preview_height, exif_data)) {
+                    if (!deliver(PREVIEW_STAGE_PREVIEW, preview, exif_data.output_width, exif_data.output_height)) {
+                        return RW_SUCCESS;
+                    }
+                }
+            }
+        }
+    }
+
+    if (stages & PREVIEW_STAGE_RENDER) {
+        configure_profile(processor, options.profile);
+        configure_output_size(processor, options);
+
+        JpegOutput output;
+        int ret = render_image(ctx, options, output, exif_data);
+        if (ret != RW_SUCCESS) return ret;
+        deliver(PREVIEW_STAGE_RENDER, output, exif_data.output_width, exif_data.output_height);
+    }
+
+    if (!delivered) {
+        ctx.last_error = "No embedded preview to deliver";
+        return RW_ERROR_PROCESS;
+    }
+    return RW_SUCCESS;
+}
+
+/**
+ * Writes JPEG bytes to a file
+ * @param ctx Context receiving the error message on failure
+ * @param path Output file path
+ * @param output JPEG bytes to write
+ * @return RW_SUCCESS on success, RW_ERROR_WRITE on failure
+ */
+static int write_jpeg_file(RawPreviewContext& ctx, const char* path, const JpegOutput& output) {
+    StageTimer timer(&PipelineStats::write_ns);
+    std::ofstream jpeg_file(path, std::ios::binary);
+    if (!jpeg_file.is_open()) {
+        ctx.last_error = "Failed to open output file: ";
+        ctx.last_error += path;
+        return RW_ERROR_WRITE;
+    }
+
+    jpeg_file.write(reinterpret_cast<const char*>(output.data), output.size);
+    if (!jpeg_file) {
+        ctx.last_error = "Failed to write output file: ";
+        ctx.last_error += path;
+        return RW_ERROR_WRITE;
+    }
+    return RW_SUCCESS;
+}
+
+/**
+ * Configures the context's LibRaw instance and opens the input
+ * Files are memory-mapped and opened with open_buffer() like in-memory
+ * input, so LibRaw reads them in place instead of through its own buffered
+ * stream. The mapping must outlive the processing of the image. A stream
+ * is handed to LibRaw as is and read on demand.
+ * @param input_path Path to the input RAW file, or null to read from data or stream
+ * @param stream Input stream when input_path and data are null
+ * @param mapped Receives the mapping of input_path (unused when input_path is null)
+ * @param read_ahead Read the whole file ahead; false when only the metadata is needed
+ * @return RW_SUCCESS on success, RW_ERROR_OPEN_FILE on failure (ctx.last_error is set)
+ */
+static int open_input(RawPreviewContext& ctx, const char* input_path, const unsigned char* data, size_t size,
+                      ReaderDatastream* stream, MappedFile* mapped, bool read_ahead = true) {
+    LibRaw* processor = &ctx.processor;
+    configure_preview_params(processor);
+    StageTimer timer(&PipelineStats::open_ns);
+
+    if (stream) {
+        int ret = processor->open_datastream(stream);
+        if (ret != LIBRAW_SUCCESS) {
+            ctx.last_error = "Failed to open stream: ";
+            ctx.last_error += libraw_strerror(ret);
+            return RW_ERROR_OPEN_FILE;
+        }
+        return RW_SUCCESS;
+    }
+
+    if (input_path) {
+        if (!mapped->open(input_path, read_ahead)) {
+            ctx.last_error = "Failed to open file: ";
+            ctx.last_error += mapped->error();
+            return RW_ERROR_OPEN_FILE;
+        }
+        data = mapped->data();
+        size = mapped->size();
+    }
+
+    // Use LibRaw's open_buffer API to read from memory
+    int ret = processor->open_buffer(const_cast<unsigned char*>(data), (size_t)size);
+    if (ret != LIBRAW_SUCCESS) {
+        ctx.last_error = input_path ? "Failed to open file: " : "Failed to open buffer: ";
+        ctx.last_error += libraw_strerror(ret);
+        return RW_ERROR_OPEN_FILE;
+    }
+    return RW_SUCCESS;
+}
+
+/**
+ * Opens the input, renders the preview and recycles LibRaw afterwards
+ * Exactly one of input_path, data or stream is used.
+ * @param ctx Processing context
+ * @param input_path Path to the input RAW file, or null to read from data or stream
+ * @param data Input RAW bytes when input_path is null
+ * @param size Length of data in bytes
+ * @param stream Input stream when input_path and data are null
+ * @param options Preview options, or null for the defaults
+ * @param output Receives the JPEG bytes
+ * @param exif_data Structure to populate with metadata
+ * @return RW_SUCCESS on success, error code on failure (ctx.last_error is set)
+ */
+static int convert_input(RawPreviewContext& ctx, const char* input_path, const unsigned char* data, size_t size,
+                         ReaderDatastream* stream, const PreviewOptions* options, JpegOutput& output,
+                         ExifData& exif_data) {
+    if (!input_path && !stream && (!data || size == 0)) {
+        ctx.last_error = "Empty input buffer";
+        return RW_ERROR_OPEN_FILE;
+    }
+
+    MappedFile mapped; // Declared first: released after LibRaw is recycled
+    RecycleGuard recycle(ctx.processor);
+    int ret = open_input(ctx, input_path, data, size, stream, &mapped);
+    if (ret == RW_SUCCESS) {
+        ret = render_preview(ctx, options ? *options : default_preview_options, output, exif_data);
+    }
+    if (ret != RW_SUCCESS && stream && stream->failed()) {
+        ctx.last_error += " (the input stream reported a read error)";
+    }
+    if (ret == RW_ERROR_UNPACK && input_path) {
+        // Provide more helpful error message for DNG files
+        std::string input_str(input_path);
+        if (input_str.length() > 4) {
+            std::string ext = input_str.substr(input_str.length() - 4);
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if (ext == ".dng") {
+                ctx.last_error += " (Note: This may be a non-standard DNG file from a mobile device or unsupported DNG variant)";
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * Converts the input and writes the JPEG to output_path, encodes it into a
+ * buffer from alloc, or copies it into a newly-allocated buffer when both
+ * are null
+ * Translates exceptions into RW_ERROR_UNKNOWN.
+ * @return RW_SUCCESS on success, error code on failure (ctx->last_error is set)
+ */
+static int run_conversion(RawPreviewContext* ctx, const char* input_path, const unsigned char* data, size_t size,
+                          ReaderDatastream* stream, const char* output_path, const PreviewOptions* options,
+                          PreviewAllocFn alloc, void* user_data,
+                          unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
+    if (!ctx) return RW_ERROR_UNKNOWN;
+    PipelineCall call;
+    ctx->last_error.clear();
+
+    try {
+        JpegOutput output;
+        output.alloc = alloc;
+        output.user_data = user_data;
+        int ret = convert_input(*ctx, input_path, data, size, stream, options, output, exif_data);
+        if (ret != RW_SUCCESS) return ret;
+
+        if (output_path) {
+            return write_jpeg_file(*ctx, output_path, output);
+        }
+
+        StageTimer timer(&PipelineStats::write_ns);
+        if (alloc) {
+            if (!output.external) {
+                // Embedded preview returned as-is: the copy is the only pass
+                unsigned char* out = alloc(user_data, output.size);
+                if (!out) {
+                    ctx->last_error = "Failed to allocate output buffer";
+                    return RW_ERROR_WRITE;
+                }
+                record_buffer(output.size);
+                memcpy(out, output.data, output.size);
+            }
+            *out_size = output.size;
+            return RW_SUCCESS;
+        }
+
+        // Hand over the encoded buffer, or copy an embedded preview into one
+        // from the pool (released with free_buffer)
+        if (output.pooled) {
+            *out_buf = output.data;
+            *out_size = output.size;
+            output.data = nullptr;
+            output.pooled = false;
+            return RW_SUCCESS;
+        }
+        record_buffer(output.size);
+        unsigned char* out = static_cast<unsigned char*>(pool_alloc(output.size));
+        if (!out) {
+            ctx->last_error = "Failed to allocate output buffer";
+            return RW_ERROR_WRITE;
+        }
+        memcpy(out, output.data, output.size);
+        *out_buf = out;
+        *out_size = output.size;
+        return RW_SUCCESS;
+
+    } catch (const std::exception& e) {
+        ctx->last_error = "Exception occurred: ";
+        ctx->last_error += e.what();
+        return RW_ERROR_UNKNOWN;
+    } catch (...) {
+        ctx->last_error = "Unknown exception occurred";
+        return RW_ERROR_UNKNOWN;
+    }
+}
+
+/**
+ * Converts RAW bytes to a preview pyramid, translating exceptions into RW_ERROR_UNKNOWN
+ * @return RW_SUCCESS on success, error code on failure (ctx->last_error is set)
+ */
+static int run_pyramid_conversion(RawPreviewContext* ctx, const unsigned char* data, size_t size,
+                                  const PreviewOptions* options, const PreviewLevel* levels, int count,
+                                  PreviewLevelOutput* outputs, ExifData& exif_data) {
+    if (!ctx) return RW_ERROR_UNKNOWN;
+    PipelineCall call;
+    ctx->last_error.clear();
+
+    if (!valid_pyramid_levels(levels, count)) {
+        ctx->last_error = "Invalid pyramid levels: every level needs max_edge, target_width or target_height";
+        return RW_ERROR_UNKNOWN;
+    }
+    if (!data || size == 0) {
+        ctx->last_error = "Empty input buffer";
+        return RW_ERROR_OPEN_FILE;
+    }
+
+    try {
+        RecycleGuard recycle(ctx->processor);
+        int ret = open_input(*ctx, nullptr, data, size, nullptr, nullptr);
+        if (ret != RW_SUCCESS) return ret;
+        return render_pyramid(*ctx, options ? *options : default_preview_options, levels, count, outputs, exif_data);
+
+    } catch (const std::exception& e) {
+        free_pyramid(outputs, count);
+        ctx->last_error = "Exception occurred: ";
+        ctx->last_error += e.what();
+        return RW_ERROR_UNKNOWN;
+    } catch (...) {
+        free_pyramid(outputs, count);
+        ctx->last_error = "Unknown exception occurred";
+        return RW_ERROR_UNKNOWN;
+    }
+}
+
+/**
+ * Opens the input once and runs render_progressive(), translating exceptions
+ * into RW_ERROR_UNKNOWN
+ * Only the render stage needs the whole file, so without it the file is not
+ * read ahead.
+ * @return RW_SUCCESS on success, error code on failure (ctx->last_error is set)
+ */
+static int run_progressive_conversion(RawPreviewContext* ctx, const char* input_path, const unsigned char* data,
+                                      size_t size, const PreviewOptions* options, int stages,
+                                      PreviewStageFn callback, void* user_data, ExifData& exif_data) {
+    if (!ctx) return RW_ERROR_UNKNOWN;
+    PipelineCall call;
+    ctx->last_error.clear();
+
+    if (!callback) {
+        ctx->last_error = "Missing stage callback";
+        return RW_ERROR_UNKNOWN;
+    }
+    if (!input_path && (!data || size == 0)) {
+        ctx->last_error = "Empty input buffer";
+        return RW_ERROR_OPEN_FILE;
+    }
+
+    try {
+        MappedFile mapped; // Declared first: released after LibRaw is recycled
+        RecycleGuard recycle(ctx->processor);
+        int ret = open_input(*ctx, input_path, data, size, nullptr, &mapped, (stages & PREVIEW_STAGE_RENDER) != 0);
+        if (ret != RW_SUCCESS) return ret;
+        return render_progressive(*ctx, options ? *options : default_preview_options, stages, callback, user_data,
+                                  exif_data);
+
+    } catch (const std::exception& e) {
+        ctx->last_error = "Exception occurred: ";
+        ctx->last_error += e.what();
+        return RW_ERROR_UNKNOWN;
+    } catch (...) {
+        ctx->last_error = "Unknown exception occurred";
+        return RW_ERROR_UNKNOWN;
+    }
+}
+
+/**
+ * Opens the input and fills exif_data from its metadata without unpacking
+ * or decoding any pixels
+ * output_width/output_height receive the full image size after orientation.
+ * Exactly one of input_path, data or stream is used.
+ * @return RW_SUCCESS on success, error code on failure (ctx->last_error is set)
+ */
+static int run_metadata_extraction(RawPreviewContext* ctx, const char* input_path, const unsigned char* data, size_t size,
+                                   ReaderDatastream* stream, ExifData& exif_data) {
+    if (!ctx) return RW_ERROR_UNKNOWN;
+    PipelineCall call;
+    ctx->last_error.clear();
+
+    if (!input_path && !stream && (!data || size == 0)) {
+        ctx->last_error = "Empty input buffer";
+        return RW_ERROR_OPEN_FILE;
+    }
+
+    try {
+        MappedFile mapped; // Declared first: released after LibRaw is recycled
+        RecycleGuard recycle(ctx->processor);
+        int ret = open_input(*ctx, input_path, data, size, stream, &mapped, false);
+        if (ret != RW_SUCCESS) {
+            if (stream && stream->failed()) ctx->last_error += " (the input stream reported a read error)";
+            return ret;
+        }
+
+        fill_exif_data(*ctx, exif_data);
+        if (ctx->processor.imgdata.sizes.flip & 4) {
+            std::swap(exif_data.output_width, exif_data.output_height);
+        }
+        return RW_SUCCESS;
+
+    } catch (const std::exception& e) {
+        ctx->last_error = "Exception occurred: ";
+        ctx->last_error += e.what();
+        return RW_ERROR_UNKNOWN;
+    } catch (...) {
+        ctx->last_error = "Unknown exception occurred";
+        return RW_ERROR_UNKNOWN;
+    }
+}
 
 extern "C" {
 
 /**
- * Retrieves the last error message that occurred during processing
+ * Retrieves the last error message that occurred on the calling thread
  * @return Pointer to the error message string
  */
 
 const char* get_last_error() {
-    return last_error.c_str();
+    return thread_context()->last_error.c_str();
 }
 
 /**
@@ -81,393 +1369,144 @@ int convert_ppm_to_jpeg(const std::vector<unsigned char>& ppm_data, int width, i
  * Processes a RAW image file and converts it to JPEG format
  * @param input_path Path to the input RAW file
  * @param output_path Path where the output JPEG will be saved
- * @param exif_data Reference to ExifData structure (currently unused but kept for API compatibility)
+ * @param exif_data Reference to ExifData structure populated with metadata
  * @return RW_SUCCESS on success, error code on failure
  */
 int process_raw_to_jpeg(const char* input_path, const char* output_path, ExifData& exif_data) {
-    // Suppress unused parameter warning - exif_data kept for future API compatibility
-    (void)exif_data;
-    
-    last_error.clear();
-    LibRaw* processor = new LibRaw();
-
-    try {
-        // Configure LibRaw processing parameters for fast preview generation
-        processor->imgdata.params.output_bps = 8;        // 8 bits per channel for smaller files
-        processor->imgdata.params.output_color = 1;      // sRGB output color space
-        processor->imgdata.params.use_camera_wb = 1;     // Use camera white balance
-        processor->imgdata.params.no_auto_bright = 1;    // Disable auto brightness for speed
-        processor->imgdata.params.use_camera_matrix = 1; // Use camera color matrix
-        processor->imgdata.params.half_size = 1;         // Reduce resolution to one quarter (for speed)
-        
-        // Raw processing options for better DNG compatibility with non-standard files
-        processor->imgdata.rawparams.options = 0;        // Reset options
-        processor->imgdata.rawparams.options |= 0x2000;  // Don't check DNG illuminant strictly
-        processor->imgdata.rawparams.options |= 0x8000;  // DNG stage 2 processing
-        processor->imgdata.rawparams.options |= 0x10000; // DNG stage 3 processing
-        processor->imgdata.rawparams.options |= 0x40000; // Allow size changes during processing
-
-        // Open and validate the RAW file
-        int ret = processor->open_file(input_path);
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to open file: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_OPEN_FILE;
-        }
-
-        // Unpack the RAW sensor data
-        ret = processor->unpack();
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to unpack RAW data: ";
-            last_error += libraw_strerror(ret);
-            
-            // Provide more helpful error message for DNG files
-            std::string input_str(input_path);
-            if (input_str.length() > 4) {
-                std::string ext = input_str.substr(input_str.length() - 4);
-                std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-                if (ext == ".dng") {
-                    last_error += " (Note: This may be a non-standard DNG file from a mobile device or unsupported DNG variant)";
-                }
-            }
-            
-            delete processor;
-            return RW_ERROR_UNPACK;
-        }
-
-        // Process the RAW data (demosaicing, color correction, etc.)
-        ret = processor->dcraw_process();
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to process image: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_PROCESS;
-        }
-
-        // Extract EXIF data from the processed image
-        // Note: camera make/model are char arrays in LibRaw, not pointers
-        strncpy((char*)exif_data.camera_make, processor->imgdata.idata.make, 63);
-        ((char*)exif_data.camera_make)[63] = '\0';
-        strncpy((char*)exif_data.camera_model, processor->imgdata.idata.model, 63);
-        ((char*)exif_data.camera_model)[63] = '\0';
-        
-        exif_data.software = processor->imgdata.idata.software;
-        exif_data.iso_speed = static_cast<int>(processor->imgdata.other.iso_speed);
-        exif_data.shutter = processor->imgdata.other.shutter;
-        exif_data.aperture = processor->imgdata.other.aperture;
-        exif_data.focal_length = processor->imgdata.other.focal_len;
-        exif_data.raw_width = processor->imgdata.sizes.raw_width;
-        exif_data.raw_height = processor->imgdata.sizes.raw_height;
-        exif_data.output_width = processor->imgdata.sizes.width;
-        exif_data.output_height = processor->imgdata.sizes.height;
-        exif_data.colors = processor->imgdata.idata.colors;
-        exif_data.color_filter = static_cast<int>(processor->imgdata.idata.filters);
-        
-        // Copy camera multipliers
-        for (int i = 0; i < 4; i++) {
-            exif_data.cam_mul[i] = processor->imgdata.color.cam_mul[i];
-        }
-        
-        exif_data.date_taken = processor->imgdata.other.desc;
-        exif_data.lens = processor->imgdata.lens.Lens;
-        exif_data.max_aperture = processor->imgdata.lens.EXIF_MaxAp;
-        exif_data.focal_length_35mm = processor->imgdata.lens.FocalLengthIn35mmFormat;
-        exif_data.description = processor->imgdata.other.desc;
-        exif_data.artist = processor->imgdata.other.artist;
-
-        // Generate processed image data in memory
-        libraw_processed_image_t* image = processor->dcraw_make_mem_image();
-        if (!image) {
-            last_error = "Failed to generate image data: ";
-            last_error += libraw_strerror(LIBRAW_UNSPECIFIED_ERROR);
-            delete processor;
-            return RW_ERROR_WRITE;
-        }
+    return process_raw_to_jpeg_with_options(input_path, output_path, nullptr, exif_data);
+}
 
-        // Validate that we got the expected image format (RGB bitmap)
-        if (image->type != LIBRAW_IMAGE_BITMAP || image->colors != 3 || image->bits != 8) {
-            last_error = "Unsupported image format";
-            LibRaw::dcraw_clear_mem(image);
-            delete processor;
-            return RW_ERROR_PROCESS;
-        }
+int process_raw_bytes_to_jpeg(const unsigned char* data, size_t size, const char* output_path, ExifData& exif_data) {
+    return process_raw_bytes_to_jpeg_with_options(data, size, output_path, nullptr, exif_data);
+}
 
-        // Extract image dimensions and pixel data
-        int width = image->width;
-        int height = image->height;
-        std::vector<unsigned char> ppm_data(image->data, image->data + (width * height * 3));
+int process_raw_bytes_to_jpeg_buffer(const unsigned char* data, size_t size, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
+    return process_raw_bytes_to_jpeg_buffer_with_options(data, size, nullptr, out_buf, out_size, exif_data);
+}
 
-        // Clean up LibRaw image data
-        LibRaw::dcraw_clear_mem(image);
+int process_raw_to_jpeg_with_options(const char* input_path, const char* output_path, const PreviewOptions* options, ExifData& exif_data) {
+    return raw_preview_context_process_file(thread_context(), input_path, output_path, options, exif_data);
+}
 
-        // Convert the RGB data to JPEG format
-        ret = convert_ppm_to_jpeg(ppm_data, width, height, output_path, 75); // 75% quality for balance of size/quality
-        if (ret != RW_SUCCESS) {
-            last_error = "Failed to convert to JPEG";
-            delete processor;
-            return ret;
-        }
+int process_raw_bytes_to_jpeg_with_options(const unsigned char* data, size_t size, const char* output_path, const PreviewOptions* options, ExifData& exif_data) {
+    return raw_preview_context_process_bytes(thread_context(), data, size, output_path, options, exif_data);
+}
 
-        delete processor;
-        return RW_SUCCESS;
+int process_raw_bytes_to_jpeg_buffer_with_options(const unsigned char* data, size_t size, const PreviewOptions* options, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
+    return raw_preview_context_process_bytes_to_buffer(thread_context(), data, size, options, out_buf, out_size, exif_data);
+}
 
-    } catch (const std::exception& e) {
-        last_error = "Exception occurred: ";
-        last_error += e.what();
-        delete processor;
-        return RW_ERROR_UNKNOWN;
-    } catch (...) {
-        last_error = "Unknown exception occurred";
-        delete processor;
-        return RW_ERROR_UNKNOWN;
-    }
+int process_raw_bytes_to_jpeg_into(const unsigned char* data, size_t size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data) {
+    return raw_preview_context_process_bytes_into(thread_context(), data, size, options, alloc, user_data, out_size, exif_data);
 }
 
-int process_raw_bytes_to_jpeg(const unsigned char* data, size_t size, const char* output_path, ExifData& exif_data) {
-    (void)exif_data;
-    last_error.clear();
-    if (!data || size == 0) {
-        last_error = "Empty input buffer";
-        return RW_ERROR_OPEN_FILE;
-    }
+int process_raw_bytes_to_pyramid(const unsigned char* data, size_t size, const PreviewOptions* options, const PreviewLevel* levels, int level_count, PreviewLevelOutput* outputs, ExifData& exif_data) {
+    return raw_preview_context_process_bytes_to_pyramid(thread_context(), data, size, options, levels, level_count, outputs, exif_data);
+}
 
-    LibRaw* processor = new LibRaw();
-    try {
-        processor->imgdata.params.output_bps = 8;
-        processor->imgdata.params.output_color = 1;
-        processor->imgdata.params.use_camera_wb = 1;
-        processor->imgdata.params.no_auto_bright = 1;
-        processor->imgdata.params.use_camera_matrix = 1;
-        processor->imgdata.params.half_size = 1;
-
-        processor->imgdata.rawparams.options = 0;
-        processor->imgdata.rawparams.options |= 0x2000;
-        processor->imgdata.rawparams.options |= 0x8000;
-        processor->imgdata.rawparams.options |= 0x10000;
-        processor->imgdata.rawparams.options |= 0x40000;
+int process_raw_progressive(const char* input_path, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data) {
+    return raw_preview_context_process_file_progressive(thread_context(), input_path, options, stages, callback, user_data, exif_data);
+}
 
-    // Use LibRaw's open_buffer API to read from memory
-    int ret = processor->open_buffer(const_cast<unsigned char*>(data), (size_t)size);
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to open buffer: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_OPEN_FILE;
-        }
+int process_raw_bytes_progressive(const unsigned char* data, size_t size, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data) {
+    return raw_preview_context_process_bytes_progressive(thread_context(), data, size, options, stages, callback, user_data, exif_data);
+}
 
-        ret = processor->unpack();
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to unpack RAW data: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_UNPACK;
-        }
+int extract_raw_metadata(const char* input_path, ExifData& exif_data) {
+    return raw_preview_context_extract_metadata(thread_context(), input_path, exif_data);
+}
 
-        ret = processor->dcraw_process();
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to process image: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_PROCESS;
-        }
+int extract_raw_metadata_from_bytes(const unsigned char* data, size_t size, ExifData& exif_data) {
+    return raw_preview_context_extract_metadata_from_bytes(thread_context(), data, size, exif_data);
+}
 
-        strncpy((char*)exif_data.camera_make, processor->imgdata.idata.make, 63);
-        ((char*)exif_data.camera_make)[63] = '\0';
-        strncpy((char*)exif_data.camera_model, processor->imgdata.idata.model, 63);
-        ((char*)exif_data.camera_model)[63] = '\0';
-
-        exif_data.software = processor->imgdata.idata.software;
-        exif_data.iso_speed = static_cast<int>(processor->imgdata.other.iso_speed);
-        exif_data.shutter = processor->imgdata.other.shutter;
-        exif_data.aperture = processor->imgdata.other.aperture;
-        exif_data.focal_length = processor->imgdata.other.focal_len;
-        exif_data.raw_width = processor->imgdata.sizes.raw_width;
-        exif_data.raw_height = processor->imgdata.sizes.raw_height;
-        exif_data.output_width = processor->imgdata.sizes.width;
-        exif_data.output_height = processor->imgdata.sizes.height;
-        exif_data.colors = processor->imgdata.idata.colors;
-        exif_data.color_filter = static_cast<int>(processor->imgdata.idata.filters);
-
-        for (int i = 0; i < 4; i++) {
-            exif_data.cam_mul[i] = processor->imgdata.color.cam_mul[i];
-        }
+int process_raw_stream_to_jpeg_into(PreviewReadFn read, void* read_user_data, unsigned long long size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data) {
+    return raw_preview_context_process_stream_into(thread_context(), read, read_user_data, size, options, alloc, user_data, out_size, exif_data);
+}
 
-        exif_data.date_taken = processor->imgdata.other.desc;
-        exif_data.lens = processor->imgdata.lens.Lens;
-        exif_data.max_aperture = processor->imgdata.lens.EXIF_MaxAp;
-        exif_data.focal_length_35mm = processor->imgdata.lens.FocalLengthIn35mmFormat;
-        exif_data.description = processor->imgdata.other.desc;
-        exif_data.artist = processor->imgdata.other.artist;
-
-        libraw_processed_image_t* image = processor->dcraw_make_mem_image();
-        if (!image) {
-            last_error = "Failed to generate image data: ";
-            last_error += libraw_strerror(LIBRAW_UNSPECIFIED_ERROR);
-            delete processor;
-            return RW_ERROR_WRITE;
-        }
+int extract_raw_metadata_from_stream(PreviewReadFn read, void* read_user_data, unsigned long long size, ExifData& exif_data) {
+    return raw_preview_context_extract_metadata_from_stream(thread_context(), read, read_user_data, size, exif_data);
+}
 
-        if (image->type != LIBRAW_IMAGE_BITMAP || image->colors != 3 || image->bits != 8) {
-            last_error = "Unsupported image format";
-            LibRaw::dcraw_clear_mem(image);
-            delete processor;
-            return RW_ERROR_PROCESS;
-        }
+RawPreviewContext* raw_preview_context_create() {
+    try {
+        return new RawPreviewContext();
+    } catch (...) {
+        return nullptr;
+    }
+}
 
-        int width = image->width;
-        int height = image->height;
-        std::vector<unsigned char> ppm_data(image->data, image->data + (width * height * 3));
-        LibRaw::dcraw_clear_mem(image);
+void raw_preview_context_destroy(RawPreviewContext* ctx) {
+    delete ctx;
+}
 
-        ret = convert_ppm_to_jpeg(ppm_data, width, height, output_path, 75);
-        if (ret != RW_SUCCESS) {
-            last_error = "Failed to convert to JPEG";
-            delete processor;
-            return ret;
-        }
+const char* raw_preview_context_last_error(const RawPreviewContext* ctx) {
+    return ctx ? ctx->last_error.c_str() : "Null context";
+}
 
-        delete processor;
-        return RW_SUCCESS;
+int raw_preview_context_process_file(RawPreviewContext* ctx, const char* input_path, const char* output_path, const PreviewOptions* options, ExifData& exif_data) {
+    if (!input_path || !output_path) return RW_ERROR_UNKNOWN;
+    return run_conversion(ctx, input_path, nullptr, 0, nullptr, output_path, options, nullptr, nullptr, nullptr, nullptr, exif_data);
+}
 
-    } catch (const std::exception& e) {
-        last_error = "Exception occurred: ";
-        last_error += e.what();
-        delete processor;
-        return RW_ERROR_UNKNOWN;
-    } catch (...) {
-        last_error = "Unknown exception occurred";
-        delete processor;
-        return RW_ERROR_UNKNOWN;
-    }
+int raw_preview_context_process_bytes(RawPreviewContext* ctx, const unsigned char* data, size_t size, const char* output_path, const PreviewOptions* options, ExifData& exif_data) {
+    if (!output_path) return RW_ERROR_UNKNOWN;
+    return run_conversion(ctx, nullptr, data, size, nullptr, output_path, options, nullptr, nullptr, nullptr, nullptr, exif_data);
 }
 
-int process_raw_bytes_to_jpeg_buffer(const unsigned char* data, size_t size, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
+int raw_preview_context_process_bytes_to_buffer(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, unsigned char** out_buf, size_t* out_size, ExifData& exif_data) {
     if (!out_buf || !out_size) return RW_ERROR_UNKNOWN;
     *out_buf = nullptr;
     *out_size = 0;
+    return run_conversion(ctx, nullptr, data, size, nullptr, nullptr, options, nullptr, nullptr, out_buf, out_size, exif_data);
+}
 
-    last_error.clear();
-    if (!data || size == 0) {
-        last_error = "Empty input buffer";
-        return RW_ERROR_OPEN_FILE;
-    }
-
-    LibRaw* processor = new LibRaw();
-    try {
-        processor->imgdata.params.output_bps = 8;
-        processor->imgdata.params.output_color = 1;
-        processor->imgdata.params.use_camera_wb = 1;
-        processor->imgdata.params.no_auto_bright = 1;
-        processor->imgdata.params.use_camera_matrix = 1;
-        processor->imgdata.params.half_size = 1;
-
-        processor->imgdata.rawparams.options = 0;
-        processor->imgdata.rawparams.options |= 0x2000;
-        processor->imgdata.rawparams.options |= 0x8000;
-        processor->imgdata.rawparams.options |= 0x10000;
-        processor->imgdata.rawparams.options |= 0x40000;
-
-        int ret = processor->open_buffer(const_cast<unsigned char*>(data), (size_t)size);
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to open buffer: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_OPEN_FILE;
-        }
-
-        ret = processor->unpack();
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to unpack RAW data: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_UNPACK;
-        }
-
-        ret = processor->dcraw_process();
-        if (ret != LIBRAW_SUCCESS) {
-            last_error = "Failed to process image: ";
-            last_error += libraw_strerror(ret);
-            delete processor;
-            return RW_ERROR_PROCESS;
-        }
-
-        strncpy((char*)exif_data.camera_make, processor->imgdata.idata.make, 63);
-        ((char*)exif_data.camera_make)[63] = '\0';
-        strncpy((char*)exif_data.camera_model, processor->imgdata.idata.model, 63);
-        ((char*)exif_data.camera_model)[63] = '\0';
-
-        exif_data.software = processor->imgdata.idata.software;
-        exif_data.iso_speed = static_cast<int>(processor->imgdata.other.iso_speed);
-        exif_data.shutter = processor->imgdata.other.shutter;
-        exif_data.aperture = processor->imgdata.other.aperture;
-        exif_data.focal_length = processor->imgdata.other.focal_len;
-        exif_data.raw_width = processor->imgdata.sizes.raw_width;
-        exif_data.raw_height = processor->imgdata.sizes.raw_height;
-        exif_data.output_width = processor->imgdata.sizes.width;
-        exif_data.output_height = processor->imgdata.sizes.height;
-        exif_data.colors = processor->imgdata.idata.colors;
-        exif_data.color_filter = static_cast<int>(processor->imgdata.idata.filters);
-
-        for (int i = 0; i < 4; i++) exif_data.cam_mul[i] = processor->imgdata.color.cam_mul[i];
-
-        exif_data.date_taken = processor->imgdata.other.desc;
-        exif_data.lens = processor->imgdata.lens.Lens;
-        exif_data.max_aperture = processor->imgdata.lens.EXIF_MaxAp;
-        exif_data.focal_length_35mm = processor->imgdata.lens.FocalLengthIn35mmFormat;
-        exif_data.description = processor->imgdata.other.desc;
-        exif_data.artist = processor->imgdata.other.artist;
-
-        libraw_processed_image_t* image = processor->dcraw_make_mem_image();
-        if (!image) {
-            last_error = "Failed to generate image data: ";
-            last_error += libraw_strerror(LIBRAW_UNSPECIFIED_ERROR);
-            delete processor;
-            return RW_ERROR_WRITE;
-        }
+int raw_preview_context_process_bytes_into(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data) {
+    if (!alloc || !out_size) return RW_ERROR_UNKNOWN;
+    *out_size = 0;
+    return run_conversion(ctx, nullptr, data, size, nullptr, nullptr, options, alloc, user_data, nullptr, out_size, exif_data);
+}
 
-        if (image->type != LIBRAW_IMAGE_BITMAP || image->colors != 3 || image->bits != 8) {
-            last_error = "Unsupported image format";
-            LibRaw::dcraw_clear_mem(image);
-            delete processor;
-            return RW_ERROR_PROCESS;
-        }
+int raw_preview_context_process_stream_into(RawPreviewContext* ctx, PreviewReadFn read, void* read_user_data, unsigned long long size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data) {
+    if (!read || !alloc || !out_size) return RW_ERROR_UNKNOWN;
+    *out_size = 0;
+    ReaderDatastream stream(read, read_user_data, size); // Outlives LibRaw's use of it in run_conversion
+    return run_conversion(ctx, nullptr, nullptr, 0, &stream, nullptr, options, alloc, user_data, nullptr, out_size, exif_data);
+}
 
-        int width = image->width;
-        int height = image->height;
-        std::vector<unsigned char> ppm_data(image->data, image->data + (width * height * 3));
-        LibRaw::dcraw_clear_mem(image);
+int raw_preview_context_process_bytes_to_pyramid(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, const PreviewLevel* levels, int level_count, PreviewLevelOutput* outputs, ExifData& exif_data) {
+    if (!outputs) return RW_ERROR_UNKNOWN;
+    for (int i = 0; i < level_count; i++) {
+        outputs[i].data = nullptr;
+        outputs[i].size = 0;
+        outputs[i].width = 0;
+        outputs[i].height = 0;
+    }
+    return run_pyramid_conversion(ctx, data, size, options, levels, level_count, outputs, exif_data);
+}
 
-        // Compress to JPEG in memory using TurboJPEG
-        tjhandle jpeg_compressor = tjInitCompress();
-        if (!jpeg_compressor) { delete processor; return RW_ERROR_PROCESS; }
+int raw_preview_context_process_file_progressive(RawPreviewContext* ctx, const char* input_path, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data) {
+    if (!input_path) return RW_ERROR_UNKNOWN;
+    return run_progressive_conversion(ctx, input_path, nullptr, 0, options, stages, callback, user_data, exif_data);
+}
 
-        unsigned char* jpeg_buf = nullptr;
-        unsigned long jpeg_size = 0;
-        int cres = tjCompress2(jpeg_compressor, ppm_data.data(), width, 0, height, TJPF_RGB, &jpeg_buf, &jpeg_size, TJSAMP_444, 75, TJFLAG_FASTDCT);
-        if (cres != 0) { tjDestroy(jpeg_compressor); delete processor; return RW_ERROR_PROCESS; }
+int raw_preview_context_process_bytes_progressive(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data) {
+    return run_progressive_conversion(ctx, nullptr, data, size, options, stages, callback, user_data, exif_data);
+}
 
-        // Copy to caller buffer
-        unsigned char* out = new unsigned char[jpeg_size];
-        memcpy(out, jpeg_buf, jpeg_size);
-        *out_buf = out;
-        *out_size = jpeg_size;
+int raw_preview_context_extract_metadata(RawPreviewContext* ctx, const char* input_path, ExifData& exif_data) {
+    if (!input_path) return RW_ERROR_UNKNOWN;
+    return run_metadata_extraction(ctx, input_path, nullptr, 0, nullptr, exif_data);
+}
 
-        tjFree(jpeg_buf);
-        tjDestroy(jpeg_compressor);
-        delete processor;
-        return RW_SUCCESS;
+int raw_preview_context_extract_metadata_from_bytes(RawPreviewContext* ctx, const unsigned char* data, size_t size, ExifData& exif_data) {
+    return run_metadata_extraction(ctx, nullptr, data, size, nullptr, exif_data);
+}
 
-    } catch (const std::exception& e) {
-        last_error = "Exception occurred: ";
-        last_error += e.what();
-        delete processor;
-        return RW_ERROR_UNKNOWN;
-    } catch (...) {
-        last_error = "Unknown exception occurred";
-        delete processor;
-        return RW_ERROR_UNKNOWN;
-    }
+int raw_preview_context_extract_metadata_from_stream(RawPreviewContext* ctx, PreviewReadFn read, void* read_user_data, unsigned long long size, ExifData& exif_data) {
+    if (!read) return RW_ERROR_UNKNOWN;
+    ReaderDatastream stream(read, read_user_data, size);
+    return run_metadata_extraction(ctx, nullptr, nullptr, 0, &stream, exif_data);
 }
 
 } // extern "C"
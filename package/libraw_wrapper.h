@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include "preview_options.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,7 +20,7 @@ extern "C" {
 struct ExifData {
     char camera_make[64];
     char camera_model[64];
-    char* software;
+    const char* software;
     int iso_speed;
     double shutter;
     double aperture;
@@ -31,12 +32,12 @@ struct ExifData {
     int colors;
     int color_filter;
     double cam_mul[4];
-    char* date_taken;
-    char* lens;
+    const char* date_taken;
+    const char* lens;
     double max_aperture;
     int focal_length_35mm;
-    char* description;
-    char* artist;
+    const char* description;
+    const char* artist;
 };
 
 // Process RAW file to JPEG
@@ -48,16 +49,106 @@ int process_raw_to_jpeg(const char* input_path, const char* output_path, ExifDat
 int process_raw_bytes_to_jpeg(const unsigned char* data, size_t size, const char* output_path, ExifData& exif_data);
 
 // Process RAW data from memory and return JPEG bytes in a newly-allocated buffer.
-// Caller receives *out_buf (allocated via new unsigned char[]) and *out_size and must call get_last_error()/free_buffer as needed.
+// Caller receives *out_buf (allocated from the buffer pool, buffer_pool.h) and *out_size and must call get_last_error()/free_buffer as needed.
 int process_raw_bytes_to_jpeg_buffer(const unsigned char* data, size_t size, unsigned char** out_buf, size_t* out_size, ExifData& exif_data);
 
+// Variants of the three entry points above that take PreviewOptions.
+// `options` may be null to use the defaults.
+int process_raw_to_jpeg_with_options(const char* input_path, const char* output_path, const PreviewOptions* options, ExifData& exif_data);
+int process_raw_bytes_to_jpeg_with_options(const unsigned char* data, size_t size, const char* output_path, const PreviewOptions* options, ExifData& exif_data);
+int process_raw_bytes_to_jpeg_buffer_with_options(const unsigned char* data, size_t size, const PreviewOptions* options, unsigned char** out_buf, size_t* out_size, ExifData& exif_data);
+
+// Process RAW data from memory and encode the JPEG straight into a buffer
+// obtained from alloc(user_data, capacity), which the caller owns. The
+// capacity requested is TurboJPEG's worst case (tjBufSize); *out_size
+// receives the number of bytes actually written. `options` may be null.
+int process_raw_bytes_to_jpeg_into(const unsigned char* data, size_t size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data);
+
+// Decodes RAW bytes once and encodes one JPEG per entry of `levels` into
+// `outputs` (level_count entries, each released with free_buffer). The
+// output size fields of `options` are ignored. On failure no buffers are
+// returned.
+int process_raw_bytes_to_pyramid(const unsigned char* data, size_t size, const PreviewOptions* options, const PreviewLevel* levels, int level_count, PreviewLevelOutput* outputs, ExifData& exif_data);
+
+// Stages of a progressive conversion, delivered in this order
+#define PREVIEW_STAGE_THUMBNAIL 1 // Smallest embedded JPEG, or the embedded preview at 1/8 scale
+#define PREVIEW_STAGE_PREVIEW 2   // Embedded preview, fitted to the output size
+#define PREVIEW_STAGE_RENDER 4    // RAW data developed with the options
+
+// Receives one stage of a progressive conversion. jpeg and exif_data are
+// only valid during the call; exif_data's output size is the stage's.
+// Returning nonzero skips the remaining stages.
+typedef int (*PreviewStageFn)(void* user_data, int stage, const unsigned char* jpeg, size_t size, int width, int height, const ExifData* exif_data);
+
+// Opens a RAW file or buffer once and delivers a JPEG for each requested
+// stage (PREVIEW_STAGE_* bits) to callback as soon as it is ready, so a
+// viewer can show the thumbnail within milliseconds and refine it later.
+// Embedded stages the input has no JPEG for are skipped; use_embedded_preview
+// is ignored. Returns an error if the render stage fails or if no stage
+// could be delivered.
+int process_raw_progressive(const char* input_path, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data);
+int process_raw_bytes_progressive(const unsigned char* data, size_t size, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data);
+
+// Reader callback of the stream entry points: copies up to size bytes of
+// the input starting at offset into buf. Returns the number of bytes
+// copied, which is only short at the end of the input, or -1 on error.
+// It may block until the range is available, and may be called from
+// LibRaw's worker threads, but never from two threads at the same time.
+typedef long long (*PreviewReadFn)(void* user_data, unsigned long long offset, unsigned char* buf, size_t size);
+
+// Process RAW data read on demand through read(read_user_data, ...) from an
+// input of `size` bytes, encoding the JPEG into a buffer from alloc like
+// process_raw_bytes_to_jpeg_into. Only the ranges LibRaw needs are read:
+// with PreviewOptions::use_embedded_preview that is the headers and the
+// preview, a fraction of the file.
+int process_raw_stream_to_jpeg_into(PreviewReadFn read, void* read_user_data, unsigned long long size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data);
+
+// Fill exif_data from the metadata of a RAW file, buffer or stream without unpacking
+// or decoding any pixels, so scans run at I/O speed. output_width and
+// output_height receive the full image size after orientation.
+// Returns 0 on success, error code on failure
+int extract_raw_metadata(const char* input_path, ExifData& exif_data);
+int extract_raw_metadata_from_bytes(const unsigned char* data, size_t size, ExifData& exif_data);
+int extract_raw_metadata_from_stream(PreviewReadFn read, void* read_user_data, unsigned long long size, ExifData& exif_data);
+
 // Convert PPM data in memory to JPEG
 // quality ranges from 1 to 100, with 100 being the best quality
 int convert_ppm_to_jpeg(const std::vector<unsigned char>& ppm_data, int width, int height, const char* jpeg_path, int quality);
 
-// Get error message for the last error
+// Get error message for the last error on the calling thread
+// The context-less entry points above run on a per-thread context, so the
+// message is never overwritten by a concurrent call from another thread.
 const char* get_last_error();
 
+// Opaque processing context. It keeps a LibRaw instance and TurboJPEG handles
+// alive across calls (LibRaw::recycle() is called between images) and stores
+// the last error of the calls made on it. A context may be moved between
+// threads but must not be used by two threads at the same time.
+struct RawPreviewContext;
+
+// Create a context. Returns null on allocation failure.
+RawPreviewContext* raw_preview_context_create();
+
+// Destroy a context created with raw_preview_context_create(). Null is ignored.
+void raw_preview_context_destroy(RawPreviewContext* ctx);
+
+// Get error message for the last error on this context
+const char* raw_preview_context_last_error(const RawPreviewContext* ctx);
+
+// Context variants of the *_with_options entry points. String fields of
+// exif_data point into the context and stay valid until its next call.
+int raw_preview_context_process_file(RawPreviewContext* ctx, const char* input_path, const char* output_path, const PreviewOptions* options, ExifData& exif_data);
+int raw_preview_context_process_bytes(RawPreviewContext* ctx, const unsigned char* data, size_t size, const char* output_path, const PreviewOptions* options, ExifData& exif_data);
+int raw_preview_context_process_bytes_to_buffer(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, unsigned char** out_buf, size_t* out_size, ExifData& exif_data);
+int raw_preview_context_process_bytes_into(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data);
+int raw_preview_context_extract_metadata(RawPreviewContext* ctx, const char* input_path, ExifData& exif_data);
+int raw_preview_context_extract_metadata_from_bytes(RawPreviewContext* ctx, const unsigned char* data, size_t size, ExifData& exif_data);
+int raw_preview_context_process_stream_into(RawPreviewContext* ctx, PreviewReadFn read, void* read_user_data, unsigned long long size, const PreviewOptions* options, PreviewAllocFn alloc, void* user_data, size_t* out_size, ExifData& exif_data);
+int raw_preview_context_extract_metadata_from_stream(RawPreviewContext* ctx, PreviewReadFn read, void* read_user_data, unsigned long long size, ExifData& exif_data);
+int raw_preview_context_process_bytes_to_pyramid(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, const PreviewLevel* levels, int level_count, PreviewLevelOutput* outputs, ExifData& exif_data);
+int raw_preview_context_process_file_progressive(RawPreviewContext* ctx, const char* input_path, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data);
+int raw_preview_context_process_bytes_progressive(RawPreviewContext* ctx, const unsigned char* data, size_t size, const PreviewOptions* options, int stages, PreviewStageFn callback, void* user_data, ExifData& exif_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,84 @@
+#include "mapped_file.h"
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if !defined(_WIN32)
+#define MAPPED_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+#ifdef MAPPED_FILE_MMAP
+    if (mapped_) munmap(const_cast<unsigned char*>(data_), size_);
+#endif
+}
+
+bool MappedFile::open(const char* path, bool read_ahead) {
+    if (!path) {
+        error_ = "Null path";
+        return false;
+    }
+
+#ifdef MAPPED_FILE_MMAP
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        error_ = strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        error_ = strerror(errno);
+        close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        // Pipes and empty files cannot be mapped; read whatever is there
+        close(fd);
+        return read_fallback(path);
+    }
+
+    void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (view == MAP_FAILED) {
+        return read_fallback(path);
+    }
+
+    if (read_ahead) {
+        // Decoders walk the file front to back; start reading ahead right away
+        madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+        madvise(view, (size_t)st.st_size, MADV_WILLNEED);
+    }
+
+    data_ = static_cast<const unsigned char*>(view);
+    size_ = (size_t)st.st_size;
+    mapped_ = true;
+    return true;
+#else
+    return read_fallback(path);
+#endif
+}
+
+bool MappedFile::read_fallback(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error_ = strerror(errno);
+        return false;
+    }
+
+    buffer_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (file.bad()) {
+        error_ = "Read error";
+        buffer_.clear();
+        return false;
+    }
+
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+// Read-only view of a whole input file, shared by the RAW and image wrappers.
+// Internal C++ interface, not exported to Rust.
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ * Maps an input file into memory so decoders read it in place
+ * On POSIX systems the file is mmap()ed with MADV_SEQUENTIAL and
+ * MADV_WILLNEED, so the kernel reads ahead and the bytes are only ever held
+ * once, in the page cache. Elsewhere, or when mapping fails, the file is
+ * read into a heap buffer instead. The view stays valid until the object is
+ * destroyed.
+ */
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile();
+
+    /**
+     * Opens and maps the file at path
+     * @param read_ahead Ask the kernel to read the whole file ahead; pass
+     *                   false when only a few header pages will be touched
+     * @return false on failure; error() describes it
+     */
+    bool open(const char* path, bool read_ahead = true);
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string& error() const { return error_; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    bool read_fallback(const char* path);
+
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<unsigned char> buffer_;
+    std::string error_;
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,52 @@
+#include "pipeline_stats.h"
+#include <cstring>
+
+static thread_local PipelineStats thread_stats;
+static thread_local int call_depth = 0;
+
+static unsigned long long elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+extern "C" void get_last_pipeline_stats(PipelineStats* stats) {
+    if (stats) *stats = thread_stats;
+}
+
+PipelineStats& current_pipeline_stats() {
+    return thread_stats;
+}
+
+void record_buffer(size_t bytes) {
+    thread_stats.bytes_allocated += bytes;
+    if (bytes > thread_stats.peak_buffer_bytes) thread_stats.peak_buffer_bytes = bytes;
+}
+
+void merge_pipeline_stats(const PipelineStats& stats) {
+    thread_stats.open_ns += stats.open_ns;
+    thread_stats.unpack_ns += stats.unpack_ns;
+    thread_stats.demosaic_ns += stats.demosaic_ns;
+    thread_stats.make_image_ns += stats.make_image_ns;
+    thread_stats.decode_ns += stats.decode_ns;
+    thread_stats.resize_ns += stats.resize_ns;
+    thread_stats.orient_ns += stats.orient_ns;
+    thread_stats.encode_ns += stats.encode_ns;
+    thread_stats.write_ns += stats.write_ns;
+    thread_stats.bytes_allocated += stats.bytes_allocated;
+    if (stats.peak_buffer_bytes > thread_stats.peak_buffer_bytes) thread_stats.peak_buffer_bytes = stats.peak_buffer_bytes;
+}
+
+PipelineCall::PipelineCall() : start_(std::chrono::steady_clock::now()), outermost_(call_depth++ == 0) {
+    if (outermost_) memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+PipelineCall::~PipelineCall() {
+    call_depth--;
+    if (outermost_) thread_stats.total_ns = elapsed_ns(start_);
+}
+
+void StageTimer::stop() {
+    if (!stage_) return;
+    thread_stats.*stage_ += elapsed_ns(start_);
+    stage_ = nullptr;
+}
@@ -0,0 +1,112 @@
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+// Per-call instrumentation shared by the RAW and image wrappers.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Where the time and memory of one conversion went. Every entry point of
+// both wrappers resets and fills the statistics of the calling thread;
+// stages a call does not run stay 0. Times are wall-clock nanoseconds.
+// This structure must match NativePipelineStats in src/stats.rs
+struct PipelineStats {
+    // Mapping the file and parsing the headers: open_buffer() for RAW
+    // files, the EXIF block and JPEG header for images
+    unsigned long long open_ns;
+    // LibRaw unpack(): decoding the sensor data
+    unsigned long long unpack_ns;
+    // LibRaw dcraw_process(), or the draft binning that replaces it:
+    // demosaicing and color conversion. On the GPU, the whole batch holding
+    // the image, including its resize, orientation and encode
+    unsigned long long demosaic_ns;
+    // LibRaw copy_mem_image(): conversion to an 8-bit RGB bitmap
+    unsigned long long make_image_ns;
+    // Extracting an embedded RAW preview, decoding a JPEG or other image
+    unsigned long long decode_ns;
+    // Area-average resizing to the requested output size
+    unsigned long long resize_ns;
+    // Applying the EXIF orientation
+    unsigned long long orient_ns;
+    // JPEG compression (all levels of a pyramid, which encode in parallel)
+    unsigned long long encode_ns;
+    // Writing the output file or copying the JPEG to the caller
+    unsigned long long write_ns;
+    // Whole call, including the stages above
+    unsigned long long total_ns;
+    // Sum of the sizes of the image and JPEG buffers the call allocated
+    unsigned long long bytes_allocated;
+    // Size of the largest of those buffers
+    unsigned long long peak_buffer_bytes;
+};
+
+// Copies the statistics of the last conversion made on the calling thread
+void get_last_pipeline_stats(struct PipelineStats* stats);
+
+#ifdef __cplusplus
+}
+
+#include <chrono>
+#include <stddef.h>
+
+// Internal C++ interface, not exported to Rust
+
+/**
+ * Statistics of the call in progress on this thread
+ */
+PipelineStats& current_pipeline_stats();
+
+/**
+ * Accounts one buffer of bytes in bytes_allocated and peak_buffer_bytes
+ */
+void record_buffer(size_t bytes);
+
+/**
+ * Adds statistics recorded on a helper thread to those of the calling
+ * thread: stage times and bytes_allocated are summed, peak_buffer_bytes is
+ * the larger of the two, total_ns is left alone
+ */
+void merge_pipeline_stats(const PipelineStats& stats);
+
+/**
+ * Marks an entry point: the outermost one on a thread resets the statistics
+ * and sets total_ns when it returns, so entry points may call each other
+ */
+class PipelineCall {
+public:
+    PipelineCall();
+    ~PipelineCall();
+
+private:
+    PipelineCall(const PipelineCall&);
+    PipelineCall& operator=(const PipelineCall&);
+
+    std::chrono::steady_clock::time_point start_;
+    bool outermost_;
+};
+
+/**
+ * Adds the lifetime of the timer to one stage of the current statistics
+ * Usage: StageTimer timer(&PipelineStats::unpack_ns);
+ */
+class StageTimer {
+public:
+    explicit StageTimer(unsigned long long PipelineStats::*stage)
+        : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { stop(); }
+
+    // Ends the stage before the timer leaves scope
+    void stop();
+
+private:
+    StageTimer(const StageTimer&);
+    StageTimer& operator=(const StageTimer&);
+
+    unsigned long long PipelineStats::*stage_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#endif
+
+#endif // PIPELINE_STATS_H
@@ -0,0 +1,40 @@
+#include "preview_log.h"
+#include <atomic>
+#include <mutex>
+
+// The level is read on every would-be message, so it is an atomic checked
+// without locking; the callback and its user data change together under
+// the mutex, which is only taken for messages that are actually delivered.
+static std::atomic<int> log_max_level(PREVIEW_LOG_OFF);
+static std::mutex log_mutex;
+static PreviewLogFn log_callback = nullptr;
+static void* log_user_data = nullptr;
+
+extern "C" void raw_preview_set_log_callback(PreviewLogFn callback, void* user_data, int max_level) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    log_callback = callback;
+    log_user_data = user_data;
+    log_max_level.store(callback ? max_level : PREVIEW_LOG_OFF, std::memory_order_relaxed);
+}
+
+bool preview_log_enabled(int level) {
+    return level > PREVIEW_LOG_OFF && level <= log_max_level.load(std::memory_order_relaxed);
+}
+
+void preview_log(int level, const char* message) {
+    if (!preview_log_enabled(level)) return;
+
+    PreviewLogFn callback;
+    void* user_data;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        callback = log_callback;
+        user_data = log_user_data;
+    }
+    // Called outside the lock so a callback may log or re-register itself
+    if (callback) callback(user_data, level, message);
+}
+
+void preview_log(int level, const std::string& message) {
+    preview_log(level, message.c_str());
+}
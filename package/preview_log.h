@@ -0,0 +1,52 @@
+#ifndef PREVIEW_LOG_H
+#define PREVIEW_LOG_H
+
+// Optional log sink shared by the RAW and image wrappers. Nothing is logged
+// until a callback is registered, and nothing is ever written to stdout or
+// stderr.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Severity of a log message; a lower value is more severe
+enum PreviewLogLevel {
+    PREVIEW_LOG_OFF = 0,
+    PREVIEW_LOG_ERROR = 1,
+    PREVIEW_LOG_WARN = 2,
+    PREVIEW_LOG_INFO = 3,
+    PREVIEW_LOG_DEBUG = 4,
+};
+
+// Receives one message. Called on the thread that produced it, possibly on
+// several threads at once; message is only valid during the call.
+typedef void (*PreviewLogFn)(void* user_data, int level, const char* message);
+
+// Registers the process-wide log callback. Messages less severe than
+// max_level are dropped before they are formatted. A null callback or
+// PREVIEW_LOG_OFF restores the default: silence.
+void raw_preview_set_log_callback(PreviewLogFn callback, void* user_data, int max_level);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+// Internal C++ interface, not exported to Rust
+
+/**
+ * Returns true if a message of this level would reach the callback
+ * Call sites that build their message check this first, so the
+ * formatting is skipped while logging is off.
+ */
+bool preview_log_enabled(int level);
+
+/**
+ * Passes message to the registered callback if level is enabled
+ */
+void preview_log(int level, const char* message);
+void preview_log(int level, const std::string& message);
+
+#endif
+
+#endif // PREVIEW_LOG_H
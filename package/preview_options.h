@@ -0,0 +1,127 @@
+#ifndef PREVIEW_OPTIONS_H
+#define PREVIEW_OPTIONS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// JPEG encoder settings, part of PreviewOptions. All fields zero keeps the
+// historical encoding: quality 75, 4:4:4, baseline, fast integer DCT.
+// This structure must match NativeJpegEncodeOptions in src/options.rs
+struct JpegEncodeOptions {
+    // 1-100, higher is better quality. 0 selects 75.
+    int quality;
+    // Chroma subsampling as a TurboJPEG TJSAMP_* value: 0 = 4:4:4,
+    // 1 = 4:2:2, 2 = 4:2:0, 3 = grayscale, 4 = 4:4:0, 5 = 4:1:1
+    int subsampling;
+    // Non-zero: progressive JPEG. Its Huffman tables are always optimized.
+    int progressive;
+    // Non-zero: compute optimal Huffman tables for a baseline JPEG (a few
+    // percent smaller, slower to encode)
+    int optimize_huffman;
+    // Non-zero: accurate integer DCT instead of the fast one
+    int accurate_dct;
+};
+
+// Options shared by the *_with_options entry points of both wrappers.
+// Passing a null pointer selects the defaults (all fields zero), which
+// reproduces the behaviour of the option-less entry points.
+// This structure must match NativePreviewOptions in src/options.rs
+struct PreviewOptions {
+    // Non-zero: return the JPEG preview embedded in a RAW file as-is instead
+    // of running unpack() + dcraw_process(). Falls back to demosaicing when
+    // the file has no embedded JPEG or it is smaller than min_preview_size.
+    int use_embedded_preview;
+    // Minimum long edge (in pixels) the embedded preview must have to be used.
+    // 0 accepts an embedded JPEG of any size.
+    int min_preview_size;
+    // Number of OpenMP threads LibRaw may use for this call. 0 keeps the
+    // OpenMP runtime default (OMP_NUM_THREADS). Ignored unless the crate is
+    // built with the `openmp` feature.
+    int num_threads;
+    // Output size. When all three are 0 the historical half-resolution
+    // output is kept. Otherwise the preview is scaled down (never up) with
+    // its aspect ratio preserved so that the long edge is at most max_edge
+    // and the image fits in target_width x target_height (0 = unbounded).
+    // The cheapest reduction (LibRaw half_size, TurboJPEG DCT scaling) is
+    // applied first and an area-average resize produces the exact size.
+    int max_edge;
+    int target_width;
+    int target_height;
+    // Settings of every JPEG the call encodes. A JPEG preview embedded in a
+    // RAW file keeps the camera's encoding unless it has to be resized.
+    struct JpegEncodeOptions encode;
+    // JPEG inputs of the image wrapper that already fit the output size
+    // (every JPEG when no size is set) are returned without a decode/encode
+    // cycle: a PREVIEW_PASSTHROUGH_* value. Ignored for RAW files and pyramids.
+    int jpeg_passthrough;
+    // Non-zero to develop RAW files by binning the sensor cells straight to
+    // RGB (draft_demosaic.h) instead of dcraw_process(), when the binned
+    // image covers the output size. Ignored for images.
+    int draft_demosaic;
+    // LibRaw processing settings for RAW files that are demosaiced: a
+    // PREVIEW_PROFILE_* value. Ignored for images and embedded previews.
+    int profile;
+    // Non-zero to fill the target_width x target_height box instead of
+    // fitting in it: the image is scaled (never up) until it covers the box
+    // and its center is cropped to it. Requires both dimensions; max_edge is
+    // then ignored. JPEGs decode only the cropped region. Ignored for RAW
+    // files and pyramids.
+    int crop_to_fill;
+};
+
+// Values of PreviewOptions::jpeg_passthrough
+// OFF: always decode and re-encode.
+// ORIGINAL: return the input bytes untouched, metadata and EXIF orientation
+// tag included; encode settings do not apply.
+// STRIP_METADATA: losslessly apply the EXIF orientation and drop every
+// APPn/COM marker (partial edge MCUs are trimmed when the orientation
+// transposes or flips the image). Falls back to decoding if the transform fails.
+#define PREVIEW_PASSTHROUGH_OFF 0
+#define PREVIEW_PASSTHROUGH_ORIGINAL 1
+#define PREVIEW_PASSTHROUGH_STRIP_METADATA 2
+
+// Values of PreviewOptions::profile
+// BALANCED: sRGB through the camera matrix, DNG opcode lists 2 and 3,
+// LibRaw's default demosaic (AHD) when half-size output is too small.
+// FAST: camera color space without the matrix conversion, no DNG opcode
+// list 3, bilinear demosaic.
+// QUALITY: BALANCED with DHT demosaic, highlight blending and light FBDD
+// noise reduction.
+#define PREVIEW_PROFILE_BALANCED 0
+#define PREVIEW_PROFILE_FAST 1
+#define PREVIEW_PROFILE_QUALITY 2
+
+// Size of one level of a preview pyramid, with the same meaning as the
+// output size fields of PreviewOptions. At least one bound must be set.
+// This structure must match NativePreviewLevel in src/options.rs
+struct PreviewLevel {
+    int max_edge;
+    int target_width;
+    int target_height;
+};
+
+// One encoded level of a preview pyramid. data is allocated from the buffer
+// pool and must be released with free_buffer.
+// This structure must match NativePreviewLevelOutput in src/options.rs
+struct PreviewLevelOutput {
+    unsigned char* data;
+    size_t size;
+    int width;
+    int height;
+};
+
+// Allocator used by the *_into entry points to obtain the output buffer, so
+// the JPEG is encoded straight into memory owned by the caller. Must return
+// at least size writable bytes, or null on failure. It may be called more
+// than once per conversion (e.g. when an embedded preview is rejected);
+// only the buffer returned by the last call holds the output.
+typedef unsigned char* (*PreviewAllocFn)(void* user_data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PREVIEW_OPTIONS_H
@@ -0,0 +1,107 @@
+#include "raw_stream.h"
+#include "pipeline_stats.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+const size_t ReaderDatastream::kWindowSize;
+
+long long ReaderDatastream::fetch(INT64 offset, unsigned char* buf, size_t length) {
+    if (failed_ || offset >= size_) return 0;
+    length = (size_t)std::min<INT64>((INT64)length, size_ - offset);
+    long long n = read_(user_data_, (unsigned long long)offset, buf, length);
+    if (n < 0) {
+        failed_ = true;
+        return 0;
+    }
+    return std::min<long long>(n, (long long)length);
+}
+
+bool ReaderDatastream::fill(INT64 offset) {
+    if (window_.empty()) {
+        window_.resize(kWindowSize);
+        record_buffer(kWindowSize);
+    }
+    long long n = fetch(offset, window_.data(), window_.size());
+    if (n <= 0) return false;
+    window_start_ = offset;
+    window_length_ = (size_t)n;
+    return true;
+}
+
+int ReaderDatastream::read(void* ptr, size_t size, size_t nmemb) {
+    if (size == 0 || nmemb == 0) return 0;
+    unsigned char* dst = static_cast<unsigned char*>(ptr);
+    size_t wanted = size * nmemb;
+    size_t done = 0;
+
+    while (done < wanted && position_ < size_) {
+        if (!buffered(position_)) {
+            size_t remaining = wanted - done;
+            if (remaining >= kWindowSize) {
+                // Sensor data and previews: no copy through the window
+                long long n = fetch(position_, dst + done, remaining);
+                if (n <= 0) break;
+                done += (size_t)n;
+                position_ += n;
+                continue;
+            }
+            if (!fill(position_)) break;
+        }
+        size_t offset = (size_t)(position_ - window_start_);
+        size_t n = std::min(wanted - done, window_length_ - offset);
+        memcpy(dst + done, window_.data() + offset, n);
+        done += n;
+        position_ += (INT64)n;
+    }
+    return (int)(done / size);
+}
+
+int ReaderDatastream::seek(INT64 offset, int whence) {
+    INT64 target;
+    switch (whence) {
+    case SEEK_SET: target = offset; break;
+    case SEEK_CUR: target = position_ + offset; break;
+    case SEEK_END: target = size_ + offset; break;
+    default: return -1;
+    }
+    // Clamped like LibRaw's own buffer stream
+    position_ = std::max<INT64>(0, std::min(target, size_));
+    return 0;
+}
+
+int ReaderDatastream::get_char() {
+    if (position_ >= size_) return -1;
+    if (!buffered(position_) && !fill(position_)) return -1;
+    return window_[(size_t)(position_++ - window_start_)];
+}
+
+char* ReaderDatastream::gets(char* str, int size) {
+    if (size <= 0 || position_ >= size_) return nullptr;
+    int length = 0;
+    while (length < size - 1) {
+        int c = get_char();
+        if (c < 0) break;
+        str[length++] = (char)c;
+        if (c == '\n') break;
+    }
+    str[length] = 0;
+    return length > 0 ? str : nullptr;
+}
+
+int ReaderDatastream::scanf_one(const char* fmt, void* val) {
+    // LibRaw scans one number at a time; a short token buffer is enough
+    char token[64];
+    INT64 start = position_;
+    int length = (int)read(token, 1, sizeof(token) - 1);
+    token[length] = 0;
+
+    std::string format(fmt);
+    format += "%n";
+    int consumed = 0;
+    int ret = sscanf(token, format.c_str(), val, &consumed);
+    // Leave the stream right after the token, as fscanf() would
+    position_ = start + (ret > 0 ? consumed : 0);
+    return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef RAW_STREAM_H
+#define RAW_STREAM_H
+
+// LibRaw input stream backed by a caller-supplied read callback.
+// Internal C++ interface, not exported to Rust.
+
+#include <stddef.h>
+#include <vector>
+#include "libraw_wrapper.h"
+#include "libraw/libraw.h"
+
+/**
+ * Serves LibRaw's reads from a PreviewReadFn instead of a file or buffer
+ * Nothing is read up front: LibRaw seeks to the headers, IFDs and preview
+ * or sensor data it needs and only those ranges are requested, so a RAW
+ * file can be converted while it is still being downloaded, or from a
+ * remote store with ranged reads. Small reads (LibRaw parses headers byte
+ * by byte) are served from a window refilled with one callback per
+ * kWindowSize bytes; reads at least that large go straight to the
+ * destination. The callback is only ever called by one thread at a time.
+ */
+class ReaderDatastream : public LibRaw_abstract_datastream {
+public:
+    static const size_t kWindowSize = 64 * 1024;
+
+    ReaderDatastream(PreviewReadFn read, void* user_data, unsigned long long size)
+        : read_(read), user_data_(user_data), size_((INT64)size) {}
+
+    int valid() override { return read_ != nullptr; }
+    int read(void* ptr, size_t size, size_t nmemb) override;
+    int seek(INT64 offset, int whence) override;
+    INT64 tell() override { return position_; }
+    INT64 size() override { return size_; }
+    int get_char() override;
+    char* gets(char* str, int size) override;
+    int scanf_one(const char* fmt, void* val) override;
+    int eof() override { return position_ >= size_; }
+
+    // True once the callback has reported an error; LibRaw then sees the
+    // stream as truncated
+    bool failed() const { return failed_; }
+
+private:
+    ReaderDatastream(const ReaderDatastream&);
+    ReaderDatastream& operator=(const ReaderDatastream&);
+
+    bool buffered(INT64 position) const {
+        return position >= window_start_ && position < window_start_ + (INT64)window_length_;
+    }
+    long long fetch(INT64 offset, unsigned char* buf, size_t length);
+    bool fill(INT64 offset);
+
+    PreviewReadFn read_;
+    void* user_data_;
+    INT64 size_;
+    INT64 position_ = 0;
+    bool failed_ = false;
+
+    // Allocated on the first small read, never when only large ranges are read
+    std::vector<unsigned char> window_;
+    INT64 window_start_ = 0;
+    size_t window_length_ = 0;
+};
+
+#endif // RAW_STREAM_H
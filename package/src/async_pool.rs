@@ -0,0 +1,412 @@
+/// Async conversions on a dedicated worker pool
+///
+/// Available with the `async` feature. Conversions block their thread for
+/// as long as LibRaw and TurboJPEG run, often hundreds of milliseconds, so
+/// calling them from an async task stalls the executor. An [`AsyncPool`]
+/// runs them on its own threads instead, each keeping a
+/// [`RawPreviewContext`](crate::RawPreviewContext) across conversions, and
+/// hands back a [`PreviewFuture`] that resolves when the conversion is done.
+///
+/// The futures do not depend on a particular runtime: they are woken from
+/// the pool threads and work with tokio, async-std or a plain `block_on`.
+///
+/// The pool bounds the work waiting for a worker: once
+/// [`AsyncPoolOptions::max_queued`] conversions are queued, new ones fail
+/// immediately instead of piling up. Dropping a future whose conversion has
+/// not started removes it from the queue, so cancelled requests never reach
+/// LibRaw.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, convert_raw_bytes_to_vec_async};
+///
+/// # async fn handle(bytes: Vec<u8>) -> Result<(), String> {
+/// let (jpeg, exif) = convert_raw_bytes_to_vec_async(bytes, &PreviewOptions::fit_long_edge(1024)).await?;
+/// println!("{}: {} bytes", exif.camera_model, jpeg.len());
+/// # Ok(())
+/// # }
+/// ```
+use std::collections::VecDeque;
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+use std::task::{Context, Poll, Waker};
+use std::thread::{self, JoinHandle};
+
+use crate::batch::{BatchInput, convert_input};
+use crate::exif_data::ExifInfo;
+use crate::file_detector::detect_format;
+use crate::options::PreviewOptions;
+use crate::raw_processor::RawPreviewContext;
+
+type Output = Result<(Vec<u8>, ExifInfo), String>;
+
+/// Options of an [`AsyncPool`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct AsyncPoolOptions {
+    /// Number of worker threads (0 uses the available parallelism)
+    pub num_workers: usize,
+    /// Maximum number of conversions waiting for a worker; further ones fail
+    /// right away (0 uses four times the number of workers)
+    pub max_queued: usize,
+}
+
+/// Worker pool running conversions for async callers
+///
+/// Dropping the pool fails the queued conversions and joins the workers
+/// once their current conversion finishes.
+pub struct AsyncPool {
+    shared: Arc<PoolShared>,
+    threads: Vec<JoinHandle<()>>,
+}
+
+impl AsyncPool {
+    /// Starts the worker threads
+    pub fn new(options: AsyncPoolOptions) -> Self {
+        let num_workers = if options.num_workers > 0 {
+            options.num_workers
+        } else {
+            thread::available_parallelism().map_or(1, |n| n.get())
+        };
+        let max_queued = if options.max_queued > 0 {
+            options.max_queued
+        } else {
+            num_workers * 4
+        };
+        Self::start(num_workers, max_queued)
+    }
+
+    fn start(num_workers: usize, max_queued: usize) -> Self {
+        let shared = Arc::new(PoolShared {
+            queue: Mutex::new(QueueState {
+                jobs: VecDeque::new(),
+                closed: false,
+            }),
+            work_available: Condvar::new(),
+            max_queued,
+        });
+        let threads = (0..num_workers)
+            .map(|_| {
+                let shared = Arc::clone(&shared);
+                thread::spawn(move || run_worker(&shared))
+            })
+            .collect();
+        Self { shared, threads }
+    }
+
+    /// Queues the conversion of any [`BatchInput`]
+    ///
+    /// Like in a batch, a `num_threads` of 0 in `options` runs LibRaw on a
+    /// single thread per worker.
+    pub fn submit(&self, input: BatchInput, options: &PreviewOptions) -> PreviewFuture {
+        let slot = Arc::new(Slot::default());
+        let mut options = *options;
+        if options.num_threads == 0 {
+            options.num_threads = 1;
+        }
+
+        let mut queue = self.shared.queue.lock().unwrap();
+        if queue.closed {
+            slot.complete(Err("The conversion pool has shut down".to_string()));
+        } else if queue.jobs.len() >= self.shared.max_queued {
+            slot.complete(Err(format!(
+                "Conversion queue is full ({} conversions waiting)",
+                queue.jobs.len()
+            )));
+        } else {
+            queue.jobs.push_back(Job {
+                input,
+                options,
+                slot: Arc::clone(&slot),
+            });
+            self.shared.work_available.notify_one();
+        }
+        drop(queue);
+
+        PreviewFuture {
+            slot,
+            shared: Arc::downgrade(&self.shared),
+        }
+    }
+
+    /// Async [`convert_raw_bytes_to_vec_with_options`](crate::convert_raw_bytes_to_vec_with_options)
+    pub fn convert_raw_bytes_to_vec(
+        &self,
+        bytes: Vec<u8>,
+        options: &PreviewOptions,
+    ) -> PreviewFuture {
+        self.submit(BatchInput::RawBytes(bytes), options)
+    }
+
+    /// Async [`process_image_bytes_to_vec_with_options`](crate::process_image_bytes_to_vec_with_options)
+    pub fn process_image_bytes_to_vec(
+        &self,
+        bytes: Vec<u8>,
+        options: &PreviewOptions,
+    ) -> PreviewFuture {
+        self.submit(BatchInput::ImageBytes(bytes), options)
+    }
+
+    /// Async [`process_any_bytes_with_options`](crate::process_any_bytes_with_options)
+    ///
+    /// The format is detected before queueing, so unrecognized content fails
+    /// without waiting for a worker.
+    pub fn process_any_bytes(&self, bytes: Vec<u8>, options: &PreviewOptions) -> PreviewFuture {
+        match detect_format(&bytes) {
+            Some(format) if format.is_raw() => self.convert_raw_bytes_to_vec(bytes, options),
+            Some(_) => self.process_image_bytes_to_vec(bytes, options),
+            None => PreviewFuture::ready(Err(crate::UNRECOGNIZED_CONTENT.to_string())),
+        }
+    }
+
+    /// Number of conversions waiting for a worker
+    pub fn queued(&self) -> usize {
+        self.shared.queue.lock().unwrap().jobs.len()
+    }
+}
+
+impl Drop for AsyncPool {
+    fn drop(&mut self) {
+        let pending = {
+            let mut queue = self.shared.queue.lock().unwrap();
+            queue.closed = true;
+            std::mem::take(&mut queue.jobs)
+        };
+        self.shared.work_available.notify_all();
+        for job in pending {
+            job.slot
+                .complete(Err("The conversion pool has shut down".to_string()));
+        }
+        for handle in self.threads.drain(..) {
+            let _ = handle.join();
+        }
+    }
+}
+
+/// The pool used by the `*_async` functions, started on first use with
+/// the default [`AsyncPoolOptions`]
+fn default_pool() -> &'static AsyncPool {
+    static POOL: OnceLock<AsyncPool> = OnceLock::new();
+    POOL.get_or_init(|| AsyncPool::new(AsyncPoolOptions::default()))
+}
+
+/// Async [`convert_raw_bytes_to_vec_with_options`](crate::convert_raw_bytes_to_vec_with_options)
+/// on a shared pool with one worker per core
+pub fn convert_raw_bytes_to_vec_async(bytes: Vec<u8>, options: &PreviewOptions) -> PreviewFuture {
+    default_pool().convert_raw_bytes_to_vec(bytes, options)
+}
+
+/// Async [`process_image_bytes_to_vec_with_options`](crate::process_image_bytes_to_vec_with_options)
+/// on a shared pool with one worker per core
+pub fn process_image_bytes_to_vec_async(bytes: Vec<u8>, options: &PreviewOptions) -> PreviewFuture {
+    default_pool().process_image_bytes_to_vec(bytes, options)
+}
+
+/// Async [`process_any_bytes_with_options`](crate::process_any_bytes_with_options)
+/// on a shared pool with one worker per core
+pub fn process_any_bytes_async(bytes: Vec<u8>, options: &PreviewOptions) -> PreviewFuture {
+    default_pool().process_any_bytes(bytes, options)
+}
+
+/// A conversion queued on an [`AsyncPool`]
+///
+/// Resolves to the JPEG preview and metadata, or the error message.
+/// Dropping it before a worker picks the conversion up cancels it; once
+/// started, the conversion finishes and its result is discarded.
+pub struct PreviewFuture {
+    slot: Arc<Slot>,
+    shared: std::sync::Weak<PoolShared>,
+}
+
+impl PreviewFuture {
+    fn ready(result: Output) -> Self {
+        let slot = Arc::new(Slot::default());
+        slot.complete(result);
+        Self {
+            slot,
+            shared: std::sync::Weak::new(),
+        }
+    }
+}
+
+impl Future for PreviewFuture {
+    type Output = Output;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Output> {
+        let mut state = self.slot.state.lock().unwrap();
+        match state.result.take() {
+            Some(result) => Poll::Ready(result),
+            None => {
+                state.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+impl Drop for PreviewFuture {
+    fn drop(&mut self) {
+        if let Some(shared) = self.shared.upgrade() {
+            shared
+                .queue
+                .lock()
+                .unwrap()
+                .jobs
+                .retain(|job| !Arc::ptr_eq(&job.slot, &self.slot));
+        }
+    }
+}
+
+/// Where a worker leaves the result of a conversion for its future
+#[derive(Default)]
+struct Slot {
+    state: Mutex<SlotState>,
+}
+
+#[derive(Default)]
+struct SlotState {
+    result: Option<Output>,
+    waker: Option<Waker>,
+}
+
+impl Slot {
+    fn complete(&self, result: Output) {
+        let waker = {
+            let mut state = self.state.lock().unwrap();
+            state.result = Some(result);
+            state.waker.take()
+        };
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+}
+
+struct Job {
+    input: BatchInput,
+    options: PreviewOptions,
+    slot: Arc<Slot>,
+}
+
+struct PoolShared {
+    queue: Mutex<QueueState>,
+    work_available: Condvar,
+    max_queued: usize,
+}
+
+struct QueueState {
+    jobs: VecDeque<Job>,
+    /// Set when the pool is dropped
+    closed: bool,
+}
+
+impl PoolShared {
+    /// Blocks until a job is available; returns `None` once the pool is closed
+    fn next_job(&self) -> Option<Job> {
+        let mut queue = self.queue.lock().unwrap();
+        loop {
+            if queue.closed {
+                return None;
+            }
+            if let Some(job) = queue.jobs.pop_front() {
+                return Some(job);
+            }
+            queue = self.work_available.wait(queue).unwrap();
+        }
+    }
+}
+
+fn run_worker(shared: &PoolShared) {
+    // Created on first RAW input so image-only workloads never touch LibRaw
+    let mut context: Option<Result<RawPreviewContext, String>> = None;
+
+    while let Some(job) = shared.next_job() {
+        // A future dropped while its conversion runs has nobody to wake;
+        // the result is simply left in the slot and freed with it
+        if Arc::strong_count(&job.slot) == 1 {
+            continue;
+        }
+        let (result, _stats) = convert_input(&mut context, job.input, &job.options);
+        job.slot.complete(result);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::task::Wake;
+
+    struct ThreadWaker(thread::Thread);
+
+    impl Wake for ThreadWaker {
+        fn wake(self: Arc<Self>) {
+            self.0.unpark();
+        }
+    }
+
+    // Minimal executor, so the tests need no runtime
+    fn block_on<F: Future>(future: F) -> F::Output {
+        let mut future = std::pin::pin!(future);
+        let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+        let mut cx = Context::from_waker(&waker);
+        loop {
+            if let Poll::Ready(output) = future.as_mut().poll(&mut cx) {
+                return output;
+            }
+            thread::park();
+        }
+    }
+
+    fn missing_path(i: usize) -> BatchInput {
+        BatchInput::Path(format!("/nonexistent/raw_preview_rs_async_{}.cr2", i).into())
+    }
+
+    #[test]
+    fn test_futures_resolve() {
+        let pool = AsyncPool::new(AsyncPoolOptions {
+            num_workers: 2,
+            ..Default::default()
+        });
+        let futures: Vec<PreviewFuture> = (0..8)
+            .map(|i| pool.submit(missing_path(i), &PreviewOptions::default()))
+            .collect();
+        for future in futures {
+            let err = block_on(future).unwrap_err();
+            assert!(err.contains("Failed to read"), "{}", err);
+        }
+    }
+
+    #[test]
+    fn test_unrecognized_bytes_fail_without_queueing() {
+        let pool = AsyncPool::new(AsyncPoolOptions::default());
+        let err =
+            block_on(pool.process_any_bytes(b"plain text".to_vec(), &PreviewOptions::default()))
+                .unwrap_err();
+        assert!(err.contains("Unrecognized image format"));
+        assert_eq!(pool.queued(), 0);
+    }
+
+    #[test]
+    fn test_admission_and_cancellation() {
+        // Without workers every accepted job stays queued
+        let pool = AsyncPool::start(0, 2);
+        let options = PreviewOptions::default();
+        let first = pool.submit(missing_path(0), &options);
+        let second = pool.submit(missing_path(1), &options);
+        let err = block_on(pool.submit(missing_path(2), &options)).unwrap_err();
+        assert!(err.contains("queue is full"), "{}", err);
+        assert_eq!(pool.queued(), 2);
+
+        // Dropping a queued future frees its place
+        drop(first);
+        assert_eq!(pool.queued(), 1);
+        let third = pool.submit(missing_path(3), &options);
+        assert_eq!(pool.queued(), 2);
+
+        // Shutting down fails what is still queued
+        drop(pool);
+        for future in [second, third] {
+            assert!(block_on(future).unwrap_err().contains("shut down"));
+        }
+    }
+}
@@ -0,0 +1,424 @@
+/// Batch conversion
+///
+/// This module runs many conversions on a pool of worker threads. Each worker
+/// owns its own [`RawPreviewContext`], so workers never share native state or
+/// error messages. Jobs are spread over per-worker queues and idle workers
+/// steal from the back of their neighbours' queues, which keeps every core
+/// busy when file sizes (and therefore conversion times) vary a lot.
+///
+/// The number of inputs that are queued, being converted or waiting to be
+/// consumed is bounded by [`BatchOptions::max_in_flight`], so a batch over
+/// millions of files holds only a few encoded previews in memory at a time.
+use std::collections::VecDeque;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread::{self, JoinHandle};
+
+use crate::exif_data::ExifInfo;
+use crate::file_detector::{detect_format, is_raw_file};
+use crate::image_processor::process_image_bytes_to_vec_with_options;
+use crate::options::PreviewOptions;
+use crate::or_tiff_image;
+use crate::raw_processor::RawPreviewContext;
+use crate::stats::{PipelineStats, last_pipeline_stats};
+
+/// One input of a batch
+#[derive(Debug, Clone)]
+pub enum BatchInput {
+    /// A file on disk; RAW and standard images are told apart by their
+    /// content signature, or by extension when it has none
+    Path(PathBuf),
+    /// RAW file contents
+    RawBytes(Vec<u8>),
+    /// Standard image file contents (JPEG, PNG, TIFF, ...)
+    ImageBytes(Vec<u8>),
+}
+
+/// Options controlling a batch run
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct BatchOptions {
+    /// Options applied to every conversion. When `preview.num_threads` is 0,
+    /// workers use a single LibRaw thread each, since the pool already keeps
+    /// every core busy.
+    pub preview: PreviewOptions,
+    /// Number of worker threads (0 uses the available parallelism)
+    pub num_workers: usize,
+    /// Maximum number of inputs that are queued, being converted or whose
+    /// result has not been consumed yet (0 uses twice the number of workers)
+    pub max_in_flight: usize,
+}
+
+/// Result of one batch input
+#[derive(Debug)]
+pub struct BatchResult {
+    /// Position of the input in the sequence passed to [`process_batch`]
+    pub index: usize,
+    /// The JPEG preview and metadata, or the error message
+    pub result: Result<(Vec<u8>, ExifInfo), String>,
+    /// Native pipeline statistics of the conversion (all zero when the
+    /// input could not be read)
+    pub stats: PipelineStats,
+}
+
+/// Converts a sequence of inputs to JPEG previews in parallel
+///
+/// Inputs are pulled lazily from `inputs`, so it can be an iterator over a
+/// directory listing of any size. Results are delivered in completion order;
+/// use [`BatchResult::index`] to match them to their inputs. Dropping the
+/// returned iterator early stops the batch: no new inputs are started and
+/// the worker threads are joined once their current conversion finishes.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{BatchInput, BatchOptions, process_batch};
+///
+/// let paths = vec!["a.cr2", "b.nef", "c.jpg"];
+/// let inputs = paths.clone().into_iter().map(|p| BatchInput::Path(p.into()));
+/// for item in process_batch(inputs, BatchOptions::default()) {
+///     match item.result {
+///         Ok((jpeg, exif)) => println!("{}: {} bytes ({})", paths[item.index], jpeg.len(), exif.camera_model),
+///         Err(e) => eprintln!("{}: {}", paths[item.index], e),
+///     }
+/// }
+/// ```
+pub fn process_batch<I>(inputs: I, options: BatchOptions) -> BatchResults
+where
+    I: IntoIterator<Item = BatchInput>,
+    I::IntoIter: Send + 'static,
+{
+    let num_workers = if options.num_workers > 0 {
+        options.num_workers
+    } else {
+        thread::available_parallelism().map_or(1, |n| n.get())
+    };
+    let max_in_flight = if options.max_in_flight > 0 {
+        options.max_in_flight
+    } else {
+        num_workers * 2
+    };
+    let mut preview = options.preview;
+    if preview.num_threads == 0 {
+        preview.num_threads = 1;
+    }
+
+    let shared = Arc::new(Shared {
+        queues: (0..num_workers)
+            .map(|_| Mutex::new(VecDeque::new()))
+            .collect(),
+        state: Mutex::new(QueueState { closed: false }),
+        work_available: Condvar::new(),
+        permits: Semaphore::new(max_in_flight),
+        cancelled: AtomicBool::new(false),
+    });
+    let (sender, receiver) = mpsc::channel();
+
+    let mut threads = Vec::with_capacity(num_workers + 1);
+    for worker_index in 0..num_workers {
+        let shared = Arc::clone(&shared);
+        let sender = sender.clone();
+        threads.push(thread::spawn(move || {
+            run_worker(&shared, worker_index, &preview, &sender)
+        }));
+    }
+    drop(sender);
+
+    let feeder_shared = Arc::clone(&shared);
+    let inputs = inputs.into_iter();
+    threads.push(thread::spawn(move || run_feeder(&feeder_shared, inputs)));
+
+    BatchResults {
+        receiver,
+        shared,
+        threads,
+    }
+}
+
+/// Iterator over the results of [`process_batch`], in completion order
+pub struct BatchResults {
+    receiver: Receiver<BatchResult>,
+    shared: Arc<Shared>,
+    threads: Vec<JoinHandle<()>>,
+}
+
+impl Iterator for BatchResults {
+    type Item = BatchResult;
+
+    fn next(&mut self) -> Option<BatchResult> {
+        let result = self.receiver.recv().ok()?;
+        // The result now belongs to the caller, so it no longer counts
+        // against the in-flight limit
+        self.shared.permits.release();
+        Some(result)
+    }
+}
+
+impl Drop for BatchResults {
+    fn drop(&mut self) {
+        self.shared.cancelled.store(true, Ordering::SeqCst);
+        self.shared.permits.close();
+        self.shared.close_queues();
+        for handle in self.threads.drain(..) {
+            let _ = handle.join();
+        }
+    }
+}
+
+/// A unit of work: an input and its position in the batch
+struct Job {
+    index: usize,
+    input: BatchInput,
+}
+
+/// State shared by the feeder, the workers and the result iterator
+struct Shared {
+    /// One queue per worker; the owner pops from the front, thieves from the back
+    queues: Vec<Mutex<VecDeque<Job>>>,
+    state: Mutex<QueueState>,
+    work_available: Condvar,
+    permits: Semaphore,
+    cancelled: AtomicBool,
+}
+
+struct QueueState {
+    /// Set once no more jobs will be pushed
+    closed: bool,
+}
+
+impl Shared {
+    fn push(&self, worker_index: usize, job: Job) {
+        self.queues[worker_index].lock().unwrap().push_back(job);
+        // Notify under the state lock so a worker that just found every queue
+        // empty cannot miss this job before it starts waiting
+        let _state = self.state.lock().unwrap();
+        self.work_available.notify_one();
+    }
+
+    fn close_queues(&self) {
+        self.state.lock().unwrap().closed = true;
+        self.work_available.notify_all();
+    }
+
+    /// Pops from the worker's own queue, or steals from another worker
+    fn find_job(&self, worker_index: usize) -> Option<Job> {
+        if let Some(job) = self.queues[worker_index].lock().unwrap().pop_front() {
+            return Some(job);
+        }
+        let count = self.queues.len();
+        (1..count).find_map(|offset| {
+            self.queues[(worker_index + offset) % count]
+                .lock()
+                .unwrap()
+                .pop_back()
+        })
+    }
+
+    /// Blocks until a job is available; returns `None` once the batch is
+    /// finished or cancelled
+    fn next_job(&self, worker_index: usize) -> Option<Job> {
+        loop {
+            if self.cancelled.load(Ordering::SeqCst) {
+                return None;
+            }
+            if let Some(job) = self.find_job(worker_index) {
+                return Some(job);
+            }
+            let state = self.state.lock().unwrap();
+            if let Some(job) = self.find_job(worker_index) {
+                return Some(job);
+            }
+            if state.closed {
+                return None;
+            }
+            drop(self.work_available.wait(state).unwrap());
+        }
+    }
+}
+
+/// Counting semaphore bounding the number of inputs in flight
+struct Semaphore {
+    state: Mutex<SemaphoreState>,
+    released: Condvar,
+}
+
+struct SemaphoreState {
+    permits: usize,
+    closed: bool,
+}
+
+impl Semaphore {
+    fn new(permits: usize) -> Self {
+        Self {
+            state: Mutex::new(SemaphoreState {
+                permits,
+                closed: false,
+            }),
+            released: Condvar::new(),
+        }
+    }
+
+    /// Takes a permit, blocking until one is available. Returns `false` if
+    /// the semaphore was closed.
+    fn acquire(&self) -> bool {
+        let mut state = self.state.lock().unwrap();
+        while state.permits == 0 && !state.closed {
+            state = self.released.wait(state).unwrap();
+        }
+        if state.closed {
+            return false;
+        }
+        state.permits -= 1;
+        true
+    }
+
+    fn release(&self) {
+        self.state.lock().unwrap().permits += 1;
+        self.released.notify_one();
+    }
+
+    /// Wakes every blocked `acquire` and makes it fail
+    fn close(&self) {
+        self.state.lock().unwrap().closed = true;
+        self.released.notify_all();
+    }
+}
+
+/// Pulls inputs and distributes them round-robin over the worker queues
+fn run_feeder<I: Iterator<Item = BatchInput>>(shared: &Shared, inputs: I) {
+    let worker_count = shared.queues.len();
+    for (index, input) in inputs.enumerate() {
+        if !shared.permits.acquire() {
+            break;
+        }
+        shared.push(index % worker_count, Job { index, input });
+    }
+    shared.close_queues();
+}
+
+fn run_worker(
+    shared: &Shared,
+    worker_index: usize,
+    options: &PreviewOptions,
+    sender: &Sender<BatchResult>,
+) {
+    // Created on first RAW input so image-only batches never touch LibRaw
+    let mut context: Option<Result<RawPreviewContext, String>> = None;
+
+    while let Some(job) = shared.next_job(worker_index) {
+        let (result, stats) = convert_input(&mut context, job.input, options);
+        if sender
+            .send(BatchResult {
+                index: job.index,
+                result,
+                stats,
+            })
+            .is_err()
+        {
+            // The result iterator is gone
+            break;
+        }
+    }
+}
+
+// Converts one input and returns the statistics of its native call
+pub(crate) fn convert_input(
+    context: &mut Option<Result<RawPreviewContext, String>>,
+    input: BatchInput,
+    options: &PreviewOptions,
+) -> (Result<(Vec<u8>, ExifInfo), String>, PipelineStats) {
+    let (bytes, is_raw) = match read_input(input) {
+        Ok(input) => input,
+        Err(e) => return (Err(e), PipelineStats::default()),
+    };
+
+    let result = if !is_raw {
+        process_image_bytes_to_vec_with_options(&bytes, options)
+    } else {
+        let result = match context.get_or_insert_with(RawPreviewContext::new) {
+            Ok(context) => context.convert_bytes_to_vec(&bytes, options),
+            Err(e) => return (Err(e.clone()), PipelineStats::default()),
+        };
+        or_tiff_image(
+            result,
+            || detect_format(&bytes),
+            || process_image_bytes_to_vec_with_options(&bytes, options),
+        )
+    };
+    // Workers make their native calls on their own thread
+    (result, last_pipeline_stats())
+}
+
+// Returns the bytes of an input and whether they are a RAW file
+fn read_input(input: BatchInput) -> Result<(Vec<u8>, bool), String> {
+    Ok(match input {
+        BatchInput::Path(path) => {
+            let bytes = std::fs::read(&path)
+                .map_err(|e| format!("Failed to read '{}': {}", path.display(), e))?;
+            let is_raw = match detect_format(&bytes) {
+                Some(format) => format.is_raw(),
+                None => path
+                    .file_name()
+                    .and_then(|name| name.to_str())
+                    .is_some_and(is_raw_file),
+            };
+            (bytes, is_raw)
+        }
+        BatchInput::RawBytes(bytes) => (bytes, true),
+        BatchInput::ImageBytes(bytes) => (bytes, false),
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn missing_path(i: usize) -> BatchInput {
+        BatchInput::Path(PathBuf::from(format!(
+            "/nonexistent/raw_preview_rs_batch_{}.cr2",
+            i
+        )))
+    }
+
+    #[test]
+    fn test_empty_batch() {
+        let inputs: Vec<BatchInput> = Vec::new();
+        assert_eq!(process_batch(inputs, BatchOptions::default()).count(), 0);
+    }
+
+    #[test]
+    fn test_every_input_yields_one_result() {
+        let options = BatchOptions {
+            num_workers: 3,
+            max_in_flight: 2,
+            ..Default::default()
+        };
+        let results: Vec<BatchResult> = process_batch((0..20).map(missing_path), options).collect();
+
+        let mut indices: Vec<usize> = results.iter().map(|r| r.index).collect();
+        indices.sort_unstable();
+        assert_eq!(indices, (0..20).collect::<Vec<_>>());
+        assert!(results.iter().all(|r| r.result.is_err()));
+        assert!(results.iter().all(|r| r.stats == PipelineStats::default()));
+    }
+
+    #[test]
+    fn test_dropping_results_stops_batch() {
+        let options = BatchOptions {
+            num_workers: 2,
+            max_in_flight: 1,
+            ..Default::default()
+        };
+        let mut results = process_batch((0..1000).map(missing_path), options);
+        assert!(results.next().is_some());
+        drop(results);
+    }
+
+    #[test]
+    fn test_semaphore_close_unblocks_acquire() {
+        let semaphore = Semaphore::new(1);
+        assert!(semaphore.acquire());
+        semaphore.close();
+        assert!(!semaphore.acquire());
+    }
+}
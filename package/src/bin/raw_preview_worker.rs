@@ -0,0 +1,18 @@
+//! Worker process of `raw_preview_rs::WorkerClient`
+//!
+//! Started by the client, which passes the shared memory ring and its socket
+//! as file descriptors 3 and 4; not meant to be run by hand.
+
+#[cfg(unix)]
+fn main() {
+    if let Err(e) = raw_preview_rs::worker::serve() {
+        eprintln!("raw_preview_worker: {}", e);
+        std::process::exit(1);
+    }
+}
+
+#[cfg(not(unix))]
+fn main() {
+    eprintln!("raw_preview_worker: only supported on Unix");
+    std::process::exit(1);
+}
@@ -0,0 +1,184 @@
+/// Reuse of the native pixel and JPEG buffers
+///
+/// The decoded bitmap, its resized and rotated copies and the encoded JPEG
+/// of a conversion are the only large allocations of the native pipeline.
+/// Both wrappers draw them from a pool kept per thread: a buffer released
+/// on any thread goes back on the free list of the thread that allocated
+/// it, and the next conversion on that thread (a batch or async worker, a
+/// reused [`RawPreviewContext`](crate::RawPreviewContext)) takes it back
+/// instead of asking the system for fresh, unfaulted pages. The pool is on
+/// by default; [`configure_buffer_pool`] bounds or disables it.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{BufferPoolOptions, configure_buffer_pool, trim_buffer_pool};
+///
+/// // Keep up to 16 MiB of free buffers per thread, on huge pages
+/// configure_buffer_pool(&BufferPoolOptions {
+///     max_cached_bytes: 16 * 1024 * 1024,
+///     use_hugepages: true,
+/// });
+///
+/// // ... convert ...
+///
+/// // Give the buffers of this thread back once it goes idle
+/// trim_buffer_pool();
+/// ```
+use std::ffi::c_int;
+
+/// Limits of the native buffer pool
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct BufferPoolOptions {
+    /// Bytes of free buffers each thread keeps for reuse, including those
+    /// other threads released; buffers released past this are returned to
+    /// the system. `0` disables the pool.
+    pub max_cached_bytes: usize,
+    /// Back new buffers of 2 MiB and more with transparent huge pages
+    /// (Linux `madvise(MADV_HUGEPAGE)`); ignored elsewhere
+    pub use_hugepages: bool,
+}
+
+impl Default for BufferPoolOptions {
+    fn default() -> Self {
+        Self {
+            max_cached_bytes: 64 * 1024 * 1024,
+            use_hugepages: false,
+        }
+    }
+}
+
+/// C-compatible pool limits
+/// This structure must match the BufferPoolOptions struct in buffer_pool.h
+#[repr(C)]
+#[derive(Debug)]
+struct NativeBufferPoolOptions {
+    max_cached_bytes: usize,
+    use_hugepages: c_int,
+}
+
+impl From<&BufferPoolOptions> for NativeBufferPoolOptions {
+    fn from(options: &BufferPoolOptions) -> Self {
+        Self {
+            max_cached_bytes: options.max_cached_bytes,
+            use_hugepages: options.use_hugepages as c_int,
+        }
+    }
+}
+
+unsafe extern "C" {
+    fn raw_preview_configure_buffer_pool(options: *const NativeBufferPoolOptions);
+    fn raw_preview_trim_buffer_pool();
+    fn raw_preview_buffer_pool_cached_bytes() -> usize;
+}
+
+/// Replaces the limits of the buffer pool
+///
+/// The setting is process-wide and may be changed at any time; threads
+/// holding more than the new limit trim their cache on their next release.
+pub fn configure_buffer_pool(options: &BufferPoolOptions) {
+    let native = NativeBufferPoolOptions::from(options);
+    unsafe { raw_preview_configure_buffer_pool(&native) };
+}
+
+/// Returns every free buffer cached by the calling thread to the system
+///
+/// Buffers cached by other threads are released when those threads exit
+/// or call this function themselves.
+pub fn trim_buffer_pool() {
+    unsafe { raw_preview_trim_buffer_pool() };
+}
+
+/// Returns the bytes of free buffers cached for the calling thread
+///
+/// Includes the buffers it allocated that other threads have released
+/// since and it has not reused yet.
+pub fn cached_buffer_bytes() -> usize {
+    unsafe { raw_preview_buffer_pool_cached_bytes() }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::exif_data::ExifData;
+    use crate::image_processor::{free_buffer, process_image_bytes_to_buffer_c};
+    use std::sync::mpsc;
+    use std::{mem, ptr, thread};
+
+    // Uncompressed 24-bit BMP of a horizontal gradient
+    fn gradient_bmp(width: u32, height: u32) -> Vec<u8> {
+        let row = (width * 3).div_ceil(4) * 4;
+        let pixels = row * height;
+        let mut bmp = Vec::with_capacity(54 + pixels as usize);
+        bmp.extend_from_slice(b"BM");
+        bmp.extend_from_slice(&(54 + pixels).to_le_bytes());
+        bmp.extend_from_slice(&0u32.to_le_bytes());
+        bmp.extend_from_slice(&54u32.to_le_bytes());
+        bmp.extend_from_slice(&40u32.to_le_bytes());
+        bmp.extend_from_slice(&width.to_le_bytes());
+        bmp.extend_from_slice(&height.to_le_bytes());
+        bmp.extend_from_slice(&1u16.to_le_bytes());
+        bmp.extend_from_slice(&24u16.to_le_bytes());
+        bmp.extend_from_slice(&[0; 24]);
+        for _ in 0..height {
+            for x in 0..row {
+                bmp.push((x % 256) as u8);
+            }
+        }
+        bmp
+    }
+
+    #[test]
+    fn test_native_options_conversion() {
+        let native = NativeBufferPoolOptions::from(&BufferPoolOptions::default());
+        assert_eq!(native.max_cached_bytes, 64 * 1024 * 1024);
+        assert_eq!(native.use_hugepages, 0);
+
+        let native = NativeBufferPoolOptions::from(&BufferPoolOptions {
+            max_cached_bytes: 0,
+            use_hugepages: true,
+        });
+        assert_eq!(native.max_cached_bytes, 0);
+        assert_eq!(native.use_hugepages, 1);
+    }
+
+    #[test]
+    fn test_buffer_returns_to_allocating_thread() {
+        let bmp = gradient_bmp(512, 512);
+        let (send_buffer, receive_buffer) = mpsc::channel::<usize>();
+        let (send_freed, receive_freed) = mpsc::channel::<()>();
+
+        // The JPEG is allocated here and released on the consumer thread
+        let producer = thread::spawn(move || {
+            let mut exif: ExifData = unsafe { mem::zeroed() };
+            let mut data = ptr::null_mut();
+            let mut size = 0;
+            let ret = unsafe {
+                process_image_bytes_to_buffer_c(
+                    bmp.as_ptr(),
+                    bmp.len(),
+                    &mut data,
+                    &mut size,
+                    &mut exif,
+                )
+            };
+            assert_eq!(ret, 0);
+            assert!(size > 0);
+            let cached = cached_buffer_bytes();
+            send_buffer.send(data as usize).unwrap();
+            receive_freed.recv().unwrap();
+            assert!(cached_buffer_bytes() > cached);
+
+            trim_buffer_pool();
+            assert_eq!(cached_buffer_bytes(), 0);
+        });
+        let consumer = thread::spawn(move || {
+            let data = receive_buffer.recv().unwrap() as *mut u8;
+            unsafe { free_buffer(data) };
+            let cached = cached_buffer_bytes();
+            send_freed.send(()).unwrap();
+            assert_eq!(cached, 0);
+        });
+        consumer.join().unwrap();
+        producer.join().unwrap();
+    }
+}
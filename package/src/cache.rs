@@ -0,0 +1,808 @@
+/// Content-addressed preview cache
+///
+/// [`PreviewCache`] sits in front of the conversion functions and returns a
+/// preview rendered earlier for the same input and options without touching
+/// LibRaw or TurboJPEG. Inputs are identified by an XXH3-128 hash of their
+/// bytes, or of their path, size and modification time for files, combined
+/// with every option that changes the output and the crate version.
+///
+/// Previews are kept in a bounded in-memory LRU tier and, optionally, in an
+/// on-disk tier that survives restarts and can be shared by processes on
+/// the same machine. A cache is `Sync`: share one between threads behind an
+/// `Arc`.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{CacheOptions, PreviewCache, PreviewOptions};
+///
+/// let cache = PreviewCache::new(CacheOptions {
+///     disk_dir: Some("/var/cache/previews".into()),
+///     ..Default::default()
+/// })
+/// .unwrap();
+/// let bytes = std::fs::read("photo.nef").unwrap();
+/// let options = PreviewOptions::fit_long_edge(1024);
+/// let (jpeg, exif) = cache.convert_raw_bytes_to_vec(&bytes, &options).unwrap();
+/// // Rendered once; this one is a memory lookup
+/// let (again, _) = cache.convert_raw_bytes_to_vec(&bytes, &options).unwrap();
+/// assert_eq!(jpeg, again);
+/// println!("{}: {:?}", exif.camera_model, cache.stats());
+/// ```
+use std::collections::{BTreeMap, HashMap};
+use std::fs;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::UNIX_EPOCH;
+
+use xxhash_rust::xxh3::Xxh3;
+
+use crate::exif_data::ExifInfo;
+use crate::image_processor::process_image_bytes_to_vec_with_options;
+use crate::options::{NativePreviewOptions, PreviewOptions};
+use crate::process_any_image_with_options;
+use crate::raw_processor::convert_raw_bytes_to_vec_with_options;
+
+/// Version of the key derivation and of the on-disk entry format; bump it
+/// when either changes so stale entries are no longer found
+const CACHE_FORMAT_VERSION: u32 = 1;
+
+/// First bytes of every on-disk entry
+const ENTRY_MAGIC: &[u8; 4] = b"RPVC";
+
+/// Options of a [`PreviewCache`]
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct CacheOptions {
+    /// Upper bound of the JPEG and metadata bytes kept in memory; the least
+    /// recently used previews are evicted beyond it (0 disables the memory
+    /// tier)
+    pub max_memory_bytes: usize,
+    /// Directory of the on-disk tier, created if missing (`None` keeps the
+    /// cache in memory only). The directory is never trimmed by the cache.
+    pub disk_dir: Option<PathBuf>,
+}
+
+impl Default for CacheOptions {
+    /// 256 MiB in memory, no disk tier
+    fn default() -> Self {
+        Self {
+            max_memory_bytes: 256 * 1024 * 1024,
+            disk_dir: None,
+        }
+    }
+}
+
+/// Counters of a [`PreviewCache`]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CacheStats {
+    /// Lookups answered from memory
+    pub memory_hits: u64,
+    /// Lookups answered from disk
+    pub disk_hits: u64,
+    /// Lookups that had to render the preview
+    pub misses: u64,
+    /// Previews currently held in memory
+    pub memory_entries: usize,
+    /// Bytes currently held in memory
+    pub memory_bytes: usize,
+}
+
+/// Identity of a cached preview: what was rendered and how
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct CacheKey(u128);
+
+/// How the input of a key is interpreted; part of the key because the same
+/// bytes give different previews through the RAW and image pipelines
+#[derive(Clone, Copy)]
+enum InputKind {
+    RawBytes = 1,
+    ImageBytes = 2,
+    File = 3,
+}
+
+impl CacheKey {
+    /// Key of RAW file contents converted with `options`
+    pub fn for_raw_bytes(bytes: &[u8], options: &PreviewOptions) -> Self {
+        let mut hasher = key_hasher(InputKind::RawBytes, options);
+        hasher.update(bytes);
+        Self(hasher.digest128())
+    }
+
+    /// Key of standard image contents converted with `options`
+    pub fn for_image_bytes(bytes: &[u8], options: &PreviewOptions) -> Self {
+        let mut hasher = key_hasher(InputKind::ImageBytes, options);
+        hasher.update(bytes);
+        Self(hasher.digest128())
+    }
+
+    /// Key of a file converted with `options`, from its path, size and
+    /// modification time; the contents are not read
+    pub fn for_file(path: &Path, options: &PreviewOptions) -> Result<Self, String> {
+        let metadata = fs::metadata(path)
+            .map_err(|e| format!("Failed to stat input file '{}': {}", path.display(), e))?;
+        let modified = metadata
+            .modified()
+            .ok()
+            .and_then(|time| time.duration_since(UNIX_EPOCH).ok())
+            .map_or(0, |since| since.as_nanos());
+
+        let mut hasher = key_hasher(InputKind::File, options);
+        hasher.update(path.as_os_str().as_encoded_bytes());
+        hasher.update(&metadata.len().to_le_bytes());
+        hasher.update(&modified.to_le_bytes());
+        Ok(Self(hasher.digest128()))
+    }
+
+    /// Lowercase hexadecimal form, used as the on-disk file name
+    pub fn to_hex(&self) -> String {
+        format!("{:032x}", self.0)
+    }
+}
+
+/// Starts a key hash with everything but the input itself
+fn key_hasher(kind: InputKind, options: &PreviewOptions) -> Xxh3 {
+    let mut hasher = Xxh3::new();
+    hasher.update(&CACHE_FORMAT_VERSION.to_le_bytes());
+    hasher.update(env!("CARGO_PKG_VERSION").as_bytes());
+    hasher.update(&[kind as u8]);
+    for value in options_fingerprint(options) {
+        hasher.update(&value.to_le_bytes());
+    }
+    hasher
+}
+
+/// The option values that change the rendered preview, as the native side
+/// sees them. `num_threads` only changes how fast it is rendered.
+fn options_fingerprint(options: &PreviewOptions) -> [i32; 15] {
+    let native = NativePreviewOptions::from(options);
+    [
+        native.use_embedded_preview,
+        native.min_preview_size,
+        native.max_edge,
+        native.target_width,
+        native.target_height,
+        native.encode.quality,
+        native.encode.subsampling,
+        native.encode.progressive,
+        native.encode.optimize_huffman,
+        native.encode.accurate_dct,
+        native.jpeg_passthrough,
+        native.draft_demosaic,
+        native.profile,
+        native.crop_to_fill,
+        0, // Reserved so new options do not shift the ones above
+    ]
+}
+
+/// Hash of the crate version and of every option that changes the rendered
+/// preview, for callers that persist previews outside the cache
+pub(crate) fn options_digest(options: &PreviewOptions) -> u64 {
+    let mut hasher = Xxh3::new();
+    hasher.update(env!("CARGO_PKG_VERSION").as_bytes());
+    for value in options_fingerprint(options) {
+        hasher.update(&value.to_le_bytes());
+    }
+    hasher.digest()
+}
+
+/// A rendered preview
+#[derive(Debug)]
+struct CachedPreview {
+    jpeg: Vec<u8>,
+    exif: ExifInfo,
+}
+
+impl CachedPreview {
+    /// Bytes charged against `max_memory_bytes`
+    fn footprint(&self) -> usize {
+        let exif = &self.exif;
+        std::mem::size_of::<Self>()
+            + self.jpeg.len()
+            + [
+                &exif.camera_make,
+                &exif.camera_model,
+                &exif.software,
+                &exif.date_taken,
+                &exif.lens,
+                &exif.description,
+                &exif.artist,
+            ]
+            .iter()
+            .map(|s| s.len())
+            .sum::<usize>()
+    }
+}
+
+/// In-memory LRU tier: entries plus their recency, oldest first
+#[derive(Default)]
+struct MemoryTier {
+    entries: HashMap<CacheKey, (Arc<CachedPreview>, u64)>,
+    recency: BTreeMap<u64, CacheKey>,
+    next_tick: u64,
+    bytes: usize,
+}
+
+impl MemoryTier {
+    fn get(&mut self, key: &CacheKey) -> Option<Arc<CachedPreview>> {
+        let tick = self.next_tick;
+        let (preview, last_used) = self.entries.get_mut(key)?;
+        self.recency.remove(last_used);
+        *last_used = tick;
+        self.recency.insert(tick, *key);
+        self.next_tick += 1;
+        Some(Arc::clone(preview))
+    }
+
+    fn insert(&mut self, key: CacheKey, preview: Arc<CachedPreview>, max_bytes: usize) {
+        let size = preview.footprint();
+        if size > max_bytes {
+            return;
+        }
+        self.remove(&key);
+        while self.bytes + size > max_bytes {
+            let Some((_, oldest)) = self.recency.pop_first() else {
+                break;
+            };
+            if let Some((evicted, _)) = self.entries.remove(&oldest) {
+                self.bytes -= evicted.footprint();
+            }
+        }
+
+        let tick = self.next_tick;
+        self.next_tick += 1;
+        self.recency.insert(tick, key);
+        self.entries.insert(key, (preview, tick));
+        self.bytes += size;
+    }
+
+    fn remove(&mut self, key: &CacheKey) {
+        if let Some((preview, tick)) = self.entries.remove(key) {
+            self.recency.remove(&tick);
+            self.bytes -= preview.footprint();
+        }
+    }
+}
+
+/// Bounded in-memory and optional on-disk cache of rendered previews
+///
+/// Concurrent misses on the same key both render the preview; the last one
+/// to finish is kept. Failed conversions are not cached.
+pub struct PreviewCache {
+    max_memory_bytes: usize,
+    disk_dir: Option<PathBuf>,
+    memory: Mutex<MemoryTier>,
+    memory_hits: AtomicU64,
+    disk_hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+impl PreviewCache {
+    /// Creates a cache, and its disk directory when one is configured
+    pub fn new(options: CacheOptions) -> Result<Self, String> {
+        if let Some(dir) = &options.disk_dir {
+            fs::create_dir_all(dir).map_err(|e| {
+                format!(
+                    "Failed to create cache directory '{}': {}",
+                    dir.display(),
+                    e
+                )
+            })?;
+        }
+        Ok(Self {
+            max_memory_bytes: options.max_memory_bytes,
+            disk_dir: options.disk_dir,
+            memory: Mutex::new(MemoryTier::default()),
+            memory_hits: AtomicU64::new(0),
+            disk_hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        })
+    }
+
+    /// [`convert_raw_bytes_to_vec_with_options`](crate::convert_raw_bytes_to_vec_with_options)
+    /// through the cache, keyed by the RAW bytes and the options
+    pub fn convert_raw_bytes_to_vec(
+        &self,
+        bytes: &[u8],
+        options: &PreviewOptions,
+    ) -> Result<(Vec<u8>, ExifInfo), String> {
+        self.get_or_insert_with(CacheKey::for_raw_bytes(bytes, options), || {
+            convert_raw_bytes_to_vec_with_options(bytes, options)
+        })
+    }
+
+    /// [`process_image_bytes_to_vec_with_options`](crate::process_image_bytes_to_vec_with_options)
+    /// through the cache, keyed by the image bytes and the options
+    pub fn process_image_bytes_to_vec(
+        &self,
+        bytes: &[u8],
+        options: &PreviewOptions,
+    ) -> Result<(Vec<u8>, ExifInfo), String> {
+        self.get_or_insert_with(CacheKey::for_image_bytes(bytes, options), || {
+            process_image_bytes_to_vec_with_options(bytes, options)
+        })
+    }
+
+    /// [`process_any_image_with_options`](crate::process_any_image_with_options)
+    /// through the cache, keyed by the input path, size and modification time
+    ///
+    /// On a hit the cached JPEG is written to `output_path`; on a miss the
+    /// file written by the conversion is read back into the cache.
+    pub fn process_any_image(
+        &self,
+        input_path: &str,
+        output_path: &str,
+        options: &PreviewOptions,
+    ) -> Result<ExifInfo, String> {
+        let key = CacheKey::for_file(Path::new(input_path), options)?;
+        if let Some(preview) = self.lookup(&key) {
+            fs::write(output_path, &preview.jpeg)
+                .map_err(|e| format!("Failed to write output file '{}': {}", output_path, e))?;
+            return Ok(preview.exif.clone());
+        }
+
+        self.misses.fetch_add(1, Ordering::Relaxed);
+        let exif = process_any_image_with_options(input_path, output_path, options)?;
+        match fs::read(output_path) {
+            Ok(jpeg) => self.store(
+                key,
+                Arc::new(CachedPreview {
+                    jpeg,
+                    exif: exif.clone(),
+                }),
+            ),
+            Err(e) => log::warn!("Not caching '{}': {}", output_path, e),
+        }
+        Ok(exif)
+    }
+
+    /// Returns the preview cached under `key`, or renders it with `render`
+    /// and caches it
+    ///
+    /// The extension point behind the other methods, for inputs they do not
+    /// cover; `key` must identify everything `render` depends on.
+    pub fn get_or_insert_with<F>(
+        &self,
+        key: CacheKey,
+        render: F,
+    ) -> Result<(Vec<u8>, ExifInfo), String>
+    where
+        F: FnOnce() -> Result<(Vec<u8>, ExifInfo), String>,
+    {
+        if let Some(preview) = self.lookup(&key) {
+            return Ok((preview.jpeg.clone(), preview.exif.clone()));
+        }
+
+        self.misses.fetch_add(1, Ordering::Relaxed);
+        let (jpeg, exif) = render()?;
+        let preview = Arc::new(CachedPreview { jpeg, exif });
+        self.store(key, Arc::clone(&preview));
+        Ok((preview.jpeg.clone(), preview.exif.clone()))
+    }
+
+    /// Returns the counters and the current memory usage
+    pub fn stats(&self) -> CacheStats {
+        let memory = self.memory.lock().unwrap_or_else(|e| e.into_inner());
+        CacheStats {
+            memory_hits: self.memory_hits.load(Ordering::Relaxed),
+            disk_hits: self.disk_hits.load(Ordering::Relaxed),
+            misses: self.misses.load(Ordering::Relaxed),
+            memory_entries: memory.entries.len(),
+            memory_bytes: memory.bytes,
+        }
+    }
+
+    /// Drops every preview held in memory; the disk tier is left as is
+    pub fn clear_memory(&self) {
+        *self.memory.lock().unwrap_or_else(|e| e.into_inner()) = MemoryTier::default();
+    }
+
+    /// Looks `key` up in memory, then on disk, counting the hit
+    fn lookup(&self, key: &CacheKey) -> Option<Arc<CachedPreview>> {
+        if self.max_memory_bytes > 0 {
+            let found = self
+                .memory
+                .lock()
+                .unwrap_or_else(|e| e.into_inner())
+                .get(key);
+            if let Some(preview) = found {
+                self.memory_hits.fetch_add(1, Ordering::Relaxed);
+                return Some(preview);
+            }
+        }
+
+        let path = self.entry_path(key)?;
+        let bytes = fs::read(&path).ok()?;
+        let Some(preview) = decode_entry(&bytes) else {
+            log::warn!("Removing corrupt cache entry {}", path.display());
+            let _ = fs::remove_file(&path);
+            return None;
+        };
+        self.disk_hits.fetch_add(1, Ordering::Relaxed);
+        let preview = Arc::new(preview);
+        self.insert_memory(*key, Arc::clone(&preview));
+        Some(preview)
+    }
+
+    /// Adds a freshly rendered preview to both tiers
+    fn store(&self, key: CacheKey, preview: Arc<CachedPreview>) {
+        if let Some(path) = self.entry_path(&key) {
+            if let Err(e) = write_entry(&path, &preview) {
+                log::warn!("Failed to write cache entry {}: {}", path.display(), e);
+            }
+        }
+        self.insert_memory(key, preview);
+    }
+
+    fn insert_memory(&self, key: CacheKey, preview: Arc<CachedPreview>) {
+        if self.max_memory_bytes > 0 {
+            self.memory
+                .lock()
+                .unwrap_or_else(|e| e.into_inner())
+                .insert(key, preview, self.max_memory_bytes);
+        }
+    }
+
+    /// `<disk_dir>/<first two hex digits>/<hex>.rpc`, so no directory grows
+    /// too large
+    fn entry_path(&self, key: &CacheKey) -> Option<PathBuf> {
+        let hex = key.to_hex();
+        let dir = self.disk_dir.as_ref()?;
+        Some(dir.join(&hex[..2]).join(format!("{}.rpc", hex)))
+    }
+}
+
+/// Writes an entry atomically: readers see the old file, no file or the
+/// complete new one, never a partial write
+fn write_entry(path: &Path, preview: &CachedPreview) -> std::io::Result<()> {
+    write_file_atomically(path, &encode_entry(preview))
+}
+
+/// Writes a file through a temporary file in the same directory (created if
+/// missing) renamed over `path`
+pub(crate) fn write_file_atomically(path: &Path, bytes: &[u8]) -> std::io::Result<()> {
+    static NEXT_TEMP: AtomicU64 = AtomicU64::new(0);
+
+    let dir = path.parent().unwrap_or(Path::new("."));
+    fs::create_dir_all(dir)?;
+    let temp = dir.join(format!(
+        ".{}.{}.tmp",
+        std::process::id(),
+        NEXT_TEMP.fetch_add(1, Ordering::Relaxed)
+    ));
+    let result = fs::File::create(&temp)
+        .and_then(|mut file| file.write_all(bytes))
+        .and_then(|()| fs::rename(&temp, path));
+    if result.is_err() {
+        let _ = fs::remove_file(&temp);
+    }
+    result
+}
+
+/// Serializes an entry: magic, format version, the `ExifInfo` fields in
+/// declaration order (see [`put_exif`]), then the JPEG prefixed with its
+/// u32 length
+fn encode_entry(preview: &CachedPreview) -> Vec<u8> {
+    let mut out = Vec::with_capacity(preview.footprint() + 256);
+    out.extend_from_slice(ENTRY_MAGIC);
+    out.extend_from_slice(&CACHE_FORMAT_VERSION.to_le_bytes());
+    put_exif(&mut out, &preview.exif);
+    out.extend_from_slice(&(preview.jpeg.len() as u32).to_le_bytes());
+    out.extend_from_slice(&preview.jpeg);
+    out
+}
+
+/// Parses an entry written by [`encode_entry`]; `None` if it is truncated,
+/// from another format version or has trailing bytes
+fn decode_entry(bytes: &[u8]) -> Option<CachedPreview> {
+    let mut r = Reader(bytes);
+    if r.take(4)? != ENTRY_MAGIC || r.u32()? != CACHE_FORMAT_VERSION {
+        return None;
+    }
+    let exif = r.exif()?;
+    let jpeg = r.bytes()?.to_vec();
+    if !r.0.is_empty() {
+        return None;
+    }
+    Some(CachedPreview { jpeg, exif })
+}
+
+/// Serializes the `ExifInfo` fields in declaration order. Integers and
+/// floats are little-endian, strings are prefixed with their u32 length.
+fn put_exif(out: &mut Vec<u8>, exif: &ExifInfo) {
+    let put_str = |out: &mut Vec<u8>, s: &str| {
+        out.extend_from_slice(&(s.len() as u32).to_le_bytes());
+        out.extend_from_slice(s.as_bytes());
+    };
+    put_str(out, &exif.camera_make);
+    put_str(out, &exif.camera_model);
+    put_str(out, &exif.software);
+    out.extend_from_slice(&exif.iso_speed.to_le_bytes());
+    out.extend_from_slice(&exif.shutter.to_le_bytes());
+    out.extend_from_slice(&exif.aperture.to_le_bytes());
+    out.extend_from_slice(&exif.focal_length.to_le_bytes());
+    for value in [
+        exif.raw_width,
+        exif.raw_height,
+        exif.output_width,
+        exif.output_height,
+        exif.colors,
+        exif.color_filter,
+    ] {
+        out.extend_from_slice(&value.to_le_bytes());
+    }
+    for value in exif.cam_mul {
+        out.extend_from_slice(&value.to_le_bytes());
+    }
+    put_str(out, &exif.date_taken);
+    put_str(out, &exif.lens);
+    out.extend_from_slice(&exif.max_aperture.to_le_bytes());
+    out.extend_from_slice(&exif.focal_length_35mm.to_le_bytes());
+    put_str(out, &exif.description);
+    put_str(out, &exif.artist);
+}
+
+/// Serializes an `ExifInfo` on its own, for other processes (the worker)
+#[cfg(all(unix, feature = "worker"))]
+pub(crate) fn encode_exif(exif: &ExifInfo) -> Vec<u8> {
+    let mut out = Vec::with_capacity(256);
+    put_exif(&mut out, exif);
+    out
+}
+
+/// Parses the output of [`encode_exif`]; `None` if it is truncated or has
+/// trailing bytes
+#[cfg(all(unix, feature = "worker"))]
+pub(crate) fn decode_exif(bytes: &[u8]) -> Option<ExifInfo> {
+    let mut r = Reader(bytes);
+    let exif = r.exif()?;
+    r.0.is_empty().then_some(exif)
+}
+
+/// Cursor over serialized bytes
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, n: usize) -> Option<&'a [u8]> {
+        if self.0.len() < n {
+            return None;
+        }
+        let (head, rest) = self.0.split_at(n);
+        self.0 = rest;
+        Some(head)
+    }
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+    fn i32(&mut self) -> Option<i32> {
+        Some(i32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+    fn f64(&mut self) -> Option<f64> {
+        Some(f64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+    fn bytes(&mut self) -> Option<&'a [u8]> {
+        let len = self.u32()? as usize;
+        self.take(len)
+    }
+    fn string(&mut self) -> Option<String> {
+        String::from_utf8(self.bytes()?.to_vec()).ok()
+    }
+    fn exif(&mut self) -> Option<ExifInfo> {
+        Some(ExifInfo {
+            camera_make: self.string()?,
+            camera_model: self.string()?,
+            software: self.string()?,
+            iso_speed: self.i32()?,
+            shutter: self.f64()?,
+            aperture: self.f64()?,
+            focal_length: self.f64()?,
+            raw_width: self.i32()?,
+            raw_height: self.i32()?,
+            output_width: self.i32()?,
+            output_height: self.i32()?,
+            colors: self.i32()?,
+            color_filter: self.i32()?,
+            cam_mul: [self.f64()?, self.f64()?, self.f64()?, self.f64()?],
+            date_taken: self.string()?,
+            lens: self.string()?,
+            max_aperture: self.f64()?,
+            focal_length_35mm: self.i32()?,
+            description: self.string()?,
+            artist: self.string()?,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::options::PreviewProfile;
+    use std::cell::Cell;
+
+    fn sample_exif() -> ExifInfo {
+        ExifInfo {
+            camera_make: "Nikon".to_string(),
+            camera_model: "D850".to_string(),
+            iso_speed: 400,
+            shutter: 0.004,
+            output_width: 1024,
+            output_height: 683,
+            cam_mul: [2.0, 1.0, 1.5, 1.0],
+            lens: "24-70mm f/2.8".to_string(),
+            ..Default::default()
+        }
+    }
+
+    fn temp_cache_dir(name: &str) -> PathBuf {
+        let dir =
+            std::env::temp_dir().join(format!("raw_preview_cache_{}_{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    #[test]
+    fn test_keys_depend_on_input_and_output_options() {
+        let options = PreviewOptions::fit_long_edge(1024);
+        let key = CacheKey::for_raw_bytes(b"raw data", &options);
+        assert_eq!(key, CacheKey::for_raw_bytes(b"raw data", &options));
+        assert_ne!(key, CacheKey::for_raw_bytes(b"raw datb", &options));
+        assert_ne!(key, CacheKey::for_image_bytes(b"raw data", &options));
+        assert_ne!(
+            key,
+            CacheKey::for_raw_bytes(b"raw data", &PreviewOptions::fit_long_edge(512))
+        );
+
+        // The thread count does not change the output
+        let threaded = PreviewOptions {
+            num_threads: 8,
+            ..options
+        };
+        assert_eq!(key, CacheKey::for_raw_bytes(b"raw data", &threaded));
+        assert_eq!(key.to_hex().len(), 32);
+
+        let draft = PreviewOptions {
+            draft_demosaic: true,
+            ..options
+        };
+        assert_ne!(key, CacheKey::for_raw_bytes(b"raw data", &draft));
+
+        let fast = PreviewOptions {
+            profile: PreviewProfile::Fast,
+            ..options
+        };
+        assert_ne!(key, CacheKey::for_raw_bytes(b"raw data", &fast));
+
+        let fill = PreviewOptions {
+            crop_to_fill: true,
+            ..options
+        };
+        assert_ne!(key, CacheKey::for_raw_bytes(b"raw data", &fill));
+    }
+
+    #[test]
+    fn test_entry_round_trip() {
+        let preview = CachedPreview {
+            jpeg: vec![0xFF, 0xD8, 1, 2, 3, 0xFF, 0xD9],
+            exif: sample_exif(),
+        };
+        let encoded = encode_entry(&preview);
+        let decoded = decode_entry(&encoded).unwrap();
+        assert_eq!(decoded.jpeg, preview.jpeg);
+        assert_eq!(decoded.exif.camera_model, "D850");
+        assert_eq!(decoded.exif.lens, "24-70mm f/2.8");
+        assert_eq!(decoded.exif.cam_mul, [2.0, 1.0, 1.5, 1.0]);
+        assert_eq!(decoded.exif.output_height, 683);
+
+        assert!(decode_entry(&encoded[..encoded.len() - 1]).is_none());
+        assert!(decode_entry(b"RPVC").is_none());
+        let mut trailing = encoded.clone();
+        trailing.push(0);
+        assert!(decode_entry(&trailing).is_none());
+    }
+
+    #[cfg(all(unix, feature = "worker"))]
+    #[test]
+    fn test_exif_round_trip() {
+        let encoded = encode_exif(&sample_exif());
+        let decoded = decode_exif(&encoded).unwrap();
+        assert_eq!(decoded.camera_model, "D850");
+        assert_eq!(decoded.output_height, 683);
+        assert!(decode_exif(&encoded[..encoded.len() - 1]).is_none());
+    }
+
+    #[test]
+    fn test_memory_tier_evicts_least_recently_used() {
+        let entry = |n: usize| {
+            Arc::new(CachedPreview {
+                jpeg: vec![0; n],
+                exif: ExifInfo::default(),
+            })
+        };
+        let base = entry(0).footprint();
+        let mut tier = MemoryTier::default();
+        let max = 3 * (base + 100);
+        for i in 0..3u128 {
+            tier.insert(CacheKey(i), entry(100), max);
+        }
+        assert!(tier.get(&CacheKey(0)).is_some()); // 1 is now the oldest
+        tier.insert(CacheKey(3), entry(100), max);
+
+        assert!(tier.get(&CacheKey(1)).is_none());
+        assert!(tier.get(&CacheKey(0)).is_some());
+        assert_eq!(tier.entries.len(), 3);
+        assert_eq!(tier.bytes, 3 * (base + 100));
+
+        // Larger than the whole tier: not kept
+        tier.insert(CacheKey(4), entry(max), max);
+        assert!(tier.get(&CacheKey(4)).is_none());
+    }
+
+    #[test]
+    fn test_renders_once_per_key() {
+        let cache = PreviewCache::new(CacheOptions::default()).unwrap();
+        let renders = Cell::new(0);
+        let render = || {
+            renders.set(renders.get() + 1);
+            Ok((vec![1, 2, 3], sample_exif()))
+        };
+
+        let key = CacheKey::for_image_bytes(b"jpeg", &PreviewOptions::default());
+        let (jpeg, _) = cache.get_or_insert_with(key, render).unwrap();
+        let (again, exif) = cache.get_or_insert_with(key, render).unwrap();
+        assert_eq!(jpeg, again);
+        assert_eq!(exif.camera_make, "Nikon");
+        assert_eq!(renders.get(), 1);
+
+        // Errors are returned and not cached
+        let other = CacheKey::for_image_bytes(b"png", &PreviewOptions::default());
+        assert!(
+            cache
+                .get_or_insert_with(other, || Err("bad".to_string()))
+                .is_err()
+        );
+        assert!(cache.get_or_insert_with(other, render).is_ok());
+
+        let stats = cache.stats();
+        assert_eq!(
+            (stats.memory_hits, stats.misses, stats.memory_entries),
+            (1, 3, 2)
+        );
+    }
+
+    #[test]
+    fn test_disk_tier_survives_memory() {
+        let dir = temp_cache_dir("disk");
+        let cache = PreviewCache::new(CacheOptions {
+            disk_dir: Some(dir.clone()),
+            ..Default::default()
+        })
+        .unwrap();
+        let key = CacheKey::for_raw_bytes(b"raw", &PreviewOptions::default());
+        cache
+            .get_or_insert_with(key, || Ok((vec![9; 16], sample_exif())))
+            .unwrap();
+
+        // A new cache over the same directory, e.g. after a restart
+        let reopened = PreviewCache::new(CacheOptions {
+            disk_dir: Some(dir.clone()),
+            max_memory_bytes: 0,
+        })
+        .unwrap();
+        let (jpeg, exif) = reopened
+            .get_or_insert_with(key, || Err("not cached".to_string()))
+            .unwrap();
+        assert_eq!(jpeg, vec![9; 16]);
+        assert_eq!(exif.camera_model, "D850");
+        assert_eq!(reopened.stats().disk_hits, 1);
+
+        // Corrupt entries are dropped and rendered again
+        let path = reopened.entry_path(&key).unwrap();
+        fs::write(&path, b"RPVC garbage").unwrap();
+        let (jpeg, _) = reopened
+            .get_or_insert_with(key, || Ok((vec![7], sample_exif())))
+            .unwrap();
+        assert_eq!(jpeg, vec![7]);
+
+        let _ = fs::remove_dir_all(&dir);
+    }
+}
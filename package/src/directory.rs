@@ -0,0 +1,645 @@
+/// Directory conversion
+///
+/// [`scan_directory`] lists the images under a directory tree on several
+/// threads, recognizing each file from its content signature or, when it has
+/// none, its extension. [`generate_directory_previews`] feeds the listing to
+/// [`process_batch`] largest file first, so the longest conversions start
+/// early and do not leave a single worker busy at the end, and writes one
+/// JPEG per input into a mirror of the tree.
+///
+/// Progress is appended to a file in the output directory as previews are
+/// written. A later run over the same tree skips every input whose size and
+/// modification time are unchanged since its preview was written, so an
+/// interrupted run resumes where it stopped.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{BatchOptions, DirectoryOptions, PreviewOptions, generate_directory_previews};
+///
+/// let options = DirectoryOptions {
+///     batch: BatchOptions {
+///         preview: PreviewOptions::fit_long_edge(1024),
+///         ..Default::default()
+///     },
+///     ..Default::default()
+/// };
+/// let run = generate_directory_previews("/mnt/card/DCIM".as_ref(), "/tmp/previews".as_ref(), &options)
+///     .unwrap();
+/// println!("{} to convert, {} up to date", run.total(), run.skipped());
+/// for item in run {
+///     if let Err(e) = item.result {
+///         eprintln!("{}: {}", item.source.display(), e);
+///     }
+/// }
+/// ```
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io::{BufRead, BufReader, Write};
+use std::path::{Path, PathBuf};
+use std::sync::{Condvar, Mutex};
+use std::thread;
+use std::time::UNIX_EPOCH;
+
+use crate::batch::{BatchInput, BatchOptions, BatchResults, process_batch};
+use crate::cache::{options_digest, write_file_atomically};
+use crate::exif_data::ExifInfo;
+use crate::file_detector::{InputFormat, detect_file_format, is_supported_file};
+use crate::options::PreviewOptions;
+use crate::stats::PipelineStats;
+
+/// Name of the progress file kept in the output directory
+pub const PROGRESS_FILE_NAME: &str = ".raw_preview_progress";
+
+/// First word of the progress file; the rest of its first line identifies
+/// the crate version and options the previews were rendered with
+const PROGRESS_MAGIC: &str = "raw_preview_rs-progress-1";
+
+/// Options of [`scan_directory`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ScanOptions {
+    /// Number of threads listing directories (0 uses the available
+    /// parallelism)
+    pub num_threads: usize,
+    /// Skip files and directories whose name starts with a dot, such as
+    /// `.Trashes` on memory cards and macOS `._` resource forks
+    pub skip_hidden: bool,
+}
+
+impl Default for ScanOptions {
+    /// One thread per core, hidden entries skipped
+    fn default() -> Self {
+        Self {
+            num_threads: 0,
+            skip_hidden: true,
+        }
+    }
+}
+
+/// An image found by [`scan_directory`]
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ScannedFile {
+    /// Full path of the file
+    pub path: PathBuf,
+    /// Path relative to the scanned directory
+    pub relative_path: PathBuf,
+    /// File size in bytes
+    pub size: u64,
+    /// Modification time in nanoseconds since the Unix epoch (0 when the
+    /// platform does not report it)
+    pub modified: u128,
+    /// Format recognized from the content, or `None` if the file was
+    /// selected by its extension alone
+    pub format: Option<InputFormat>,
+}
+
+/// Lists the supported images under `root`, largest first
+///
+/// Directories are read in parallel. Symbolic links to files are followed;
+/// links to directories are not, so the walk cannot loop. Directories that
+/// cannot be read are logged and skipped.
+///
+/// # Returns
+/// * `Ok(files)` sorted by decreasing size, then by relative path
+/// * `Err(String)` if `root` is not a readable directory
+pub fn scan_directory(root: &Path, options: &ScanOptions) -> Result<Vec<ScannedFile>, String> {
+    scan_excluding(root, options, None)
+}
+
+/// Options of [`generate_directory_previews`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct DirectoryOptions {
+    /// Conversion options, worker threads and in-flight limit. Changing
+    /// `batch.preview` makes every preview out of date.
+    pub batch: BatchOptions,
+    /// How the input tree is listed
+    pub scan: ScanOptions,
+    /// Convert every input, even those whose preview is up to date
+    pub force: bool,
+}
+
+/// Result of one input of [`generate_directory_previews`]
+#[derive(Debug)]
+pub struct DirectoryResult {
+    /// The input file
+    pub source: PathBuf,
+    /// Where its preview is written: the input's path under the output
+    /// directory, with `.jpg` appended to the file name
+    pub output: PathBuf,
+    /// Metadata of the input once its preview is written, or the error
+    /// message of the conversion or of the write
+    pub result: Result<ExifInfo, String>,
+    /// Native pipeline statistics of the conversion
+    pub stats: PipelineStats,
+}
+
+/// Converts every image under `input_dir` into a preview under `output_dir`
+///
+/// The tree is listed first, then inputs whose preview is up to date are
+/// left out (unless [`DirectoryOptions::force`] is set) and the others are
+/// converted in parallel. Each preview is written atomically and recorded in
+/// the progress file ([`PROGRESS_FILE_NAME`]) as the returned iterator
+/// yields its result; failed inputs are not recorded and are retried by the
+/// next run. Dropping the iterator stops the run like [`process_batch`].
+///
+/// `output_dir` may lie inside `input_dir`; it is not scanned.
+///
+/// # Returns
+/// * `Ok(run)` iterating over the results in completion order
+/// * `Err(String)` if the input cannot be listed or the output directory or
+///   progress file cannot be created
+pub fn generate_directory_previews(
+    input_dir: &Path,
+    output_dir: &Path,
+    options: &DirectoryOptions,
+) -> Result<DirectoryPreviews, String> {
+    fs::create_dir_all(output_dir).map_err(|e| {
+        format!(
+            "Failed to create output directory '{}': {}",
+            output_dir.display(),
+            e
+        )
+    })?;
+    let excluded = fs::canonicalize(output_dir).ok();
+    let files = scan_excluding(input_dir, &options.scan, excluded.as_deref())?;
+
+    let mut progress = Progress::open(output_dir, &options.batch.preview)?;
+    let mut pending = Vec::with_capacity(files.len());
+    let mut skipped = 0;
+    for file in files {
+        let output = output_path(output_dir, &file.relative_path);
+        if !options.force && progress.is_up_to_date(&file) && output.is_file() {
+            progress.keep(&file);
+            skipped += 1;
+        } else {
+            pending.push((file, output));
+        }
+    }
+    progress.start()?;
+
+    let inputs: Vec<BatchInput> = pending
+        .iter()
+        .map(|(file, _)| BatchInput::Path(file.path.clone()))
+        .collect();
+    Ok(DirectoryPreviews {
+        results: process_batch(inputs, options.batch),
+        pending,
+        skipped,
+        progress,
+    })
+}
+
+/// Iterator over the results of [`generate_directory_previews`], in
+/// completion order
+pub struct DirectoryPreviews {
+    results: BatchResults,
+    /// Inputs being converted and their output paths, by batch index
+    pending: Vec<(ScannedFile, PathBuf)>,
+    skipped: usize,
+    progress: Progress,
+}
+
+impl DirectoryPreviews {
+    /// Number of inputs being converted
+    pub fn total(&self) -> usize {
+        self.pending.len()
+    }
+
+    /// Number of inputs left out because their preview is up to date
+    pub fn skipped(&self) -> usize {
+        self.skipped
+    }
+}
+
+impl Iterator for DirectoryPreviews {
+    type Item = DirectoryResult;
+
+    fn next(&mut self) -> Option<DirectoryResult> {
+        let item = self.results.next()?;
+        let (file, output) = &self.pending[item.index];
+        let result = item.result.and_then(|(jpeg, exif)| {
+            write_file_atomically(output, &jpeg)
+                .map_err(|e| format!("Failed to write '{}': {}", output.display(), e))?;
+            self.progress.record(file);
+            Ok(exif)
+        });
+        Some(DirectoryResult {
+            source: file.path.clone(),
+            output: output.clone(),
+            result,
+            stats: item.stats,
+        })
+    }
+}
+
+/// `<output_dir>/<relative path>.jpg`; the input extension is kept so that
+/// `IMG_1.CR2` and `IMG_1.JPG` do not share a preview
+fn output_path(output_dir: &Path, relative_path: &Path) -> PathBuf {
+    let mut name = relative_path.as_os_str().to_os_string();
+    name.push(".jpg");
+    output_dir.join(name)
+}
+
+/// Progress file of an output directory
+///
+/// Its first line is [`PROGRESS_MAGIC`] and the options digest; every other
+/// line records one preview as `<size> <modified> <relative path>`. Entries
+/// are appended as previews are written, and the file is rewritten with the
+/// entries still up to date when a run starts. A file written with other
+/// options or another crate version is ignored. Paths that are not UTF-8 or
+/// contain a line break are never recorded, so those inputs are converted
+/// on every run.
+struct Progress {
+    path: PathBuf,
+    header: String,
+    /// Entries of the previous run, by relative path
+    previous: HashMap<String, (u64, u128)>,
+    /// Lines carried over into the rewritten file
+    kept: String,
+    file: Option<File>,
+}
+
+impl Progress {
+    fn open(output_dir: &Path, options: &PreviewOptions) -> Result<Self, String> {
+        let path = output_dir.join(PROGRESS_FILE_NAME);
+        let header = format!("{} {:016x}", PROGRESS_MAGIC, options_digest(options));
+        let mut previous = HashMap::new();
+        if let Ok(file) = File::open(&path) {
+            let mut lines = BufReader::new(file).lines();
+            if lines.next().and_then(Result::ok).as_deref() == Some(header.as_str()) {
+                for line in lines.map_while(Result::ok) {
+                    if let Some((relative, size, modified)) = parse_entry(&line) {
+                        previous.insert(relative.to_string(), (size, modified));
+                    }
+                }
+            }
+        }
+        Ok(Self {
+            path,
+            header,
+            previous,
+            kept: String::new(),
+            file: None,
+        })
+    }
+
+    fn is_up_to_date(&self, file: &ScannedFile) -> bool {
+        entry_key(file)
+            .and_then(|relative| self.previous.get(relative))
+            .is_some_and(|&(size, modified)| size == file.size && modified == file.modified)
+    }
+
+    /// Carries the entry of an up-to-date input over to the rewritten file
+    fn keep(&mut self, file: &ScannedFile) {
+        if let Some(line) = entry_line(file) {
+            self.kept.push_str(&line);
+        }
+    }
+
+    /// Replaces the file with the header and the kept entries, then opens it
+    /// for appending
+    fn start(&mut self) -> Result<(), String> {
+        let contents = format!("{}\n{}", self.header, self.kept);
+        write_file_atomically(&self.path, contents.as_bytes())
+            .and_then(|()| OpenOptions::new().append(true).open(&self.path))
+            .map(|file| {
+                self.file = Some(file);
+                self.previous = HashMap::new();
+                self.kept = String::new();
+            })
+            .map_err(|e| format!("Failed to write '{}': {}", self.path.display(), e))
+    }
+
+    /// Appends the entry of a preview just written. A failure only costs a
+    /// reconversion on the next run, so it is logged rather than returned.
+    fn record(&mut self, file: &ScannedFile) {
+        let (Some(line), Some(progress)) = (entry_line(file), self.file.as_mut()) else {
+            return;
+        };
+        // One write per entry, so an interrupted run leaves whole lines
+        if let Err(e) = progress.write_all(line.as_bytes()) {
+            log::warn!(
+                "Failed to record progress in {}: {}",
+                self.path.display(),
+                e
+            );
+        }
+    }
+}
+
+fn entry_key(file: &ScannedFile) -> Option<&str> {
+    file.relative_path
+        .to_str()
+        .filter(|relative| !relative.contains(['\n', '\r']))
+}
+
+fn entry_line(file: &ScannedFile) -> Option<String> {
+    entry_key(file).map(|relative| format!("{} {} {}\n", file.size, file.modified, relative))
+}
+
+fn parse_entry(line: &str) -> Option<(&str, u64, u128)> {
+    let mut fields = line.splitn(3, ' ');
+    let size = fields.next()?.parse().ok()?;
+    let modified = fields.next()?.parse().ok()?;
+    Some((fields.next()?, size, modified))
+}
+
+/// Shared state of the directory walk
+struct Walk {
+    state: Mutex<WalkState>,
+    changed: Condvar,
+}
+
+struct WalkState {
+    /// Directories not read yet
+    pending: Vec<PathBuf>,
+    /// Directories being read
+    active: usize,
+    files: Vec<ScannedFile>,
+}
+
+fn scan_excluding(
+    root: &Path,
+    options: &ScanOptions,
+    excluded: Option<&Path>,
+) -> Result<Vec<ScannedFile>, String> {
+    fs::read_dir(root)
+        .map_err(|e| format!("Failed to read directory '{}': {}", root.display(), e))?;
+    let num_threads = if options.num_threads > 0 {
+        options.num_threads
+    } else {
+        thread::available_parallelism().map_or(1, |n| n.get())
+    };
+
+    let walk = Walk {
+        state: Mutex::new(WalkState {
+            pending: vec![root.to_path_buf()],
+            active: 0,
+            files: Vec::new(),
+        }),
+        changed: Condvar::new(),
+    };
+    thread::scope(|scope| {
+        for _ in 0..num_threads {
+            scope.spawn(|| walk_directories(&walk, root, options, excluded));
+        }
+    });
+
+    let mut files = walk.state.into_inner().unwrap().files;
+    files.sort_unstable_by(|a, b| {
+        b.size
+            .cmp(&a.size)
+            .then_with(|| a.relative_path.cmp(&b.relative_path))
+    });
+    Ok(files)
+}
+
+/// Reads directories until every directory of the tree has been read
+fn walk_directories(walk: &Walk, root: &Path, options: &ScanOptions, excluded: Option<&Path>) {
+    loop {
+        let dir = {
+            let mut state = walk.state.lock().unwrap();
+            loop {
+                if let Some(dir) = state.pending.pop() {
+                    state.active += 1;
+                    break dir;
+                }
+                if state.active == 0 {
+                    // Nothing left and nobody can add more
+                    return;
+                }
+                state = walk.changed.wait(state).unwrap();
+            }
+        };
+
+        let mut subdirs = Vec::new();
+        let mut files = Vec::new();
+        read_directory(&dir, root, options, excluded, &mut subdirs, &mut files);
+
+        let mut state = walk.state.lock().unwrap();
+        state.pending.append(&mut subdirs);
+        state.files.append(&mut files);
+        state.active -= 1;
+        walk.changed.notify_all();
+    }
+}
+
+/// Lists one directory, sorting its entries into subdirectories to walk and
+/// images
+fn read_directory(
+    dir: &Path,
+    root: &Path,
+    options: &ScanOptions,
+    excluded: Option<&Path>,
+    subdirs: &mut Vec<PathBuf>,
+    files: &mut Vec<ScannedFile>,
+) {
+    let entries = match fs::read_dir(dir) {
+        Ok(entries) => entries,
+        Err(e) => {
+            log::warn!("Skipping directory {}: {}", dir.display(), e);
+            return;
+        }
+    };
+    for entry in entries.flatten() {
+        let name = entry.file_name();
+        if options.skip_hidden && name.as_encoded_bytes().starts_with(b".") {
+            continue;
+        }
+        let path = entry.path();
+        let Ok(file_type) = entry.file_type() else {
+            continue;
+        };
+        if file_type.is_dir() {
+            let is_excluded = excluded
+                .is_some_and(|excluded| fs::canonicalize(&path).is_ok_and(|p| p == excluded));
+            if !is_excluded {
+                subdirs.push(path);
+            }
+            continue;
+        }
+        // Follows symbolic links to files
+        let Ok(metadata) = fs::metadata(&path) else {
+            continue;
+        };
+        if !metadata.is_file() {
+            continue;
+        }
+        let format = match detect_file_format(&path) {
+            Ok(format) => format,
+            Err(e) => {
+                log::warn!("Skipping {}", e);
+                continue;
+            }
+        };
+        if format.is_none() && !name.to_str().is_some_and(is_supported_file) {
+            continue;
+        }
+        let modified = metadata
+            .modified()
+            .ok()
+            .and_then(|time| time.duration_since(UNIX_EPOCH).ok())
+            .map_or(0, |since| since.as_nanos());
+        files.push(ScannedFile {
+            relative_path: path.strip_prefix(root).unwrap_or(&path).to_path_buf(),
+            path,
+            size: metadata.len(),
+            modified,
+            format,
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_tree(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!(
+            "raw_preview_directory_{}_{}",
+            name,
+            std::process::id()
+        ));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(dir.join("DCIM/100CANON")).unwrap();
+        fs::create_dir_all(dir.join(".Trashes")).unwrap();
+        // Content signatures win over extensions; unknown content is kept
+        // only with a supported extension
+        fs::write(dir.join("DCIM/100CANON/IMG_0001.CR2"), [0u8; 300]).unwrap();
+        fs::write(
+            dir.join("DCIM/100CANON/IMG_0002.JPG"),
+            b"\xFF\xD8\xFF\xE0 jpeg",
+        )
+        .unwrap();
+        fs::write(dir.join("DCIM/no_extension"), b"\x89PNG\r\n\x1A\n png data").unwrap();
+        fs::write(dir.join("DCIM/notes.txt"), b"not an image").unwrap();
+        fs::write(dir.join("DCIM/100CANON/._IMG_0001.CR2"), [0u8; 4]).unwrap();
+        fs::write(dir.join(".Trashes/IMG_0003.JPG"), b"\xFF\xD8\xFF\xE0").unwrap();
+        dir
+    }
+
+    fn relative_paths(files: &[ScannedFile]) -> Vec<String> {
+        files
+            .iter()
+            .map(|file| file.relative_path.to_string_lossy().replace('\\', "/"))
+            .collect()
+    }
+
+    #[test]
+    fn test_scan_directory() {
+        let dir = temp_tree("scan");
+        let options = ScanOptions {
+            num_threads: 3,
+            ..Default::default()
+        };
+        let files = scan_directory(&dir, &options).unwrap();
+        assert_eq!(
+            relative_paths(&files),
+            [
+                "DCIM/100CANON/IMG_0001.CR2",
+                "DCIM/no_extension",
+                "DCIM/100CANON/IMG_0002.JPG"
+            ]
+        );
+        assert!(files.windows(2).all(|pair| pair[0].size >= pair[1].size));
+        assert_eq!(files[0].format, None);
+        assert_eq!(files[1].format, Some(InputFormat::Png));
+        assert_eq!(files[2].format, Some(InputFormat::Jpeg));
+
+        let with_hidden = ScanOptions {
+            skip_hidden: false,
+            ..options
+        };
+        assert_eq!(scan_directory(&dir, &with_hidden).unwrap().len(), 5);
+        assert!(scan_directory(&dir.join("missing"), &options).is_err());
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_output_dir_is_not_scanned() {
+        let dir = temp_tree("excluded");
+        fs::create_dir_all(dir.join("previews/DCIM")).unwrap();
+        fs::write(
+            dir.join("previews/DCIM/IMG_0002.JPG.jpg"),
+            b"\xFF\xD8\xFF\xE0",
+        )
+        .unwrap();
+        let excluded = fs::canonicalize(dir.join("previews")).unwrap();
+        let files = scan_excluding(&dir, &ScanOptions::default(), Some(&excluded)).unwrap();
+        assert_eq!(files.len(), 3);
+        assert_eq!(
+            output_path(&dir.join("previews"), &files[2].relative_path),
+            dir.join("previews/DCIM/100CANON/IMG_0002.JPG.jpg")
+        );
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_progress_resumes() {
+        let dir = temp_tree("progress");
+        let files = scan_directory(&dir, &ScanOptions::default()).unwrap();
+        let options = PreviewOptions::fit_long_edge(512);
+
+        let mut progress = Progress::open(&dir, &options).unwrap();
+        assert!(!progress.is_up_to_date(&files[0]));
+        progress.start().unwrap();
+        progress.record(&files[0]);
+        progress.record(&files[1]);
+        drop(progress);
+
+        // A new run finds the recorded inputs, unless they changed
+        let mut progress = Progress::open(&dir, &options).unwrap();
+        assert!(progress.is_up_to_date(&files[0]));
+        assert!(progress.is_up_to_date(&files[1]));
+        assert!(!progress.is_up_to_date(&files[2]));
+        let touched = ScannedFile {
+            modified: files[0].modified + 1,
+            ..files[0].clone()
+        };
+        assert!(!progress.is_up_to_date(&touched));
+
+        // Only kept entries survive the rewrite at the start of a run
+        progress.keep(&files[1]);
+        progress.start().unwrap();
+        drop(progress);
+        let progress = Progress::open(&dir, &options).unwrap();
+        assert!(!progress.is_up_to_date(&files[0]));
+        assert!(progress.is_up_to_date(&files[1]));
+
+        // Other options make every entry stale
+        let other = Progress::open(&dir, &PreviewOptions::fit_long_edge(256)).unwrap();
+        assert!(!other.is_up_to_date(&files[1]));
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_failed_conversions_are_not_recorded() {
+        let dir = temp_tree("generate");
+        let output = dir.join("previews");
+        // The test inputs are not decodable images
+        let run = generate_directory_previews(&dir, &output, &DirectoryOptions::default()).unwrap();
+        assert_eq!((run.total(), run.skipped()), (3, 0));
+        let results: Vec<DirectoryResult> = run.collect();
+        assert_eq!(results.len(), 3);
+        assert!(results.iter().all(|item| item.result.is_err()));
+        assert!(results.iter().all(|item| !item.output.exists()));
+        assert!(
+            results
+                .iter()
+                .all(|item| item.output.starts_with(&output) && item.source.starts_with(&dir))
+        );
+
+        let run = generate_directory_previews(&dir, &output, &DirectoryOptions::default()).unwrap();
+        assert_eq!((run.total(), run.skipped()), (3, 0));
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_parse_entry() {
+        assert_eq!(
+            parse_entry("1024 1700000000123456789 DCIM/IMG 1.CR2"),
+            Some(("DCIM/IMG 1.CR2", 1024, 1700000000123456789))
+        );
+        assert_eq!(parse_entry("1024 DCIM/IMG_1.CR2"), None);
+        assert_eq!(parse_entry(""), None);
+    }
+}
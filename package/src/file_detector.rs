@@ -1,7 +1,136 @@
 /// File type detection utilities for image processing
 /// 
 /// This module provides functions to identify supported file formats
-/// including RAW files from various camera manufacturers and standard image formats.
+/// including RAW files from various camera manufacturers and standard image formats,
+/// either from the filename extension or from the signature at the start of the content.
+
+use std::fs::File;
+use std::io::Read;
+use std::path::Path;
+
+/// Number of leading bytes [`detect_format`] looks at
+pub const SIGNATURE_LEN: usize = 16;
+
+/// File format recognized from the content of a file
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum InputFormat {
+    /// JPEG (`FF D8 FF`)
+    Jpeg,
+    /// PNG
+    Png,
+    /// GIF (87a and 89a)
+    Gif,
+    /// Windows bitmap
+    Bmp,
+    /// WebP (RIFF container)
+    WebP,
+    /// TIFF container: NEF, ARW, DNG, PEF, SRW, 3FR, ERF, ... and plain TIFF.
+    /// LibRaw tells them apart from their IFDs.
+    Tiff,
+    /// Canon CR2 (TIFF with a `CR` marker)
+    Cr2,
+    /// Canon CR3 (ISO base media file with the `crx ` brand)
+    Cr3,
+    /// Fujifilm RAF
+    Raf,
+    /// Olympus ORF
+    Orf,
+    /// Panasonic RW2 / RAW
+    Rw2,
+    /// Sigma X3F
+    X3f,
+    /// Minolta MRW
+    Mrw,
+}
+
+impl InputFormat {
+    /// Whether the format is converted by LibRaw rather than the image decoder
+    ///
+    /// TIFF containers count as RAW: most of them are camera files, and
+    /// without the `tiff` feature the image decoder (stb_image) has no TIFF
+    /// support. With it, TIFFs LibRaw cannot open are decoded as images.
+    pub fn is_raw(self) -> bool {
+        !matches!(self, Self::Jpeg | Self::Png | Self::Gif | Self::Bmp | Self::WebP)
+    }
+
+    /// Short display name, e.g. "CR3"
+    pub fn name(self) -> &'static str {
+        match self {
+            Self::Jpeg => "JPEG",
+            Self::Png => "PNG",
+            Self::Gif => "GIF",
+            Self::Bmp => "BMP",
+            Self::WebP => "WebP",
+            Self::Tiff => "TIFF",
+            Self::Cr2 => "CR2",
+            Self::Cr3 => "CR3",
+            Self::Raf => "RAF",
+            Self::Orf => "ORF",
+            Self::Rw2 => "RW2",
+            Self::X3f => "X3F",
+            Self::Mrw => "MRW",
+        }
+    }
+}
+
+/// Recognizes a file format from the first bytes of its content
+///
+/// Only the first [`SIGNATURE_LEN`] bytes are looked at; shorter input is
+/// matched against the signatures it is long enough for.
+///
+/// # Returns
+/// * `Some(format)` if the content starts with a known signature
+/// * `None` otherwise (including RAW formats LibRaw identifies by file size)
+pub fn detect_format(header: &[u8]) -> Option<InputFormat> {
+    let at = |offset: usize, signature: &[u8]| {
+        header.get(offset..offset + signature.len()) == Some(signature)
+    };
+
+    if at(0, b"\xFF\xD8\xFF") {
+        Some(InputFormat::Jpeg)
+    } else if at(0, b"\x89PNG\r\n\x1A\n") {
+        Some(InputFormat::Png)
+    } else if at(0, b"GIF87a") || at(0, b"GIF89a") {
+        Some(InputFormat::Gif)
+    } else if at(0, b"RIFF") && at(8, b"WEBP") {
+        Some(InputFormat::WebP)
+    } else if at(0, b"FUJIFILMCCD-RAW") {
+        Some(InputFormat::Raf)
+    } else if at(4, b"ftypcrx ") {
+        Some(InputFormat::Cr3)
+    } else if at(0, b"II*\0") && at(8, b"CR\x02") {
+        Some(InputFormat::Cr2)
+    } else if at(0, b"II*\0") || at(0, b"MM\0*") {
+        Some(InputFormat::Tiff)
+    } else if at(0, b"IIRO") || at(0, b"IIRS") || at(0, b"MMOR") {
+        Some(InputFormat::Orf)
+    } else if at(0, b"IIU\0") {
+        Some(InputFormat::Rw2)
+    } else if at(0, b"FOVb") {
+        Some(InputFormat::X3f)
+    } else if at(0, b"\0MRM") {
+        Some(InputFormat::Mrw)
+    } else if at(0, b"BM") && header.len() >= 14 {
+        // "BM" alone is too weak: also require the reserved header fields to be zero
+        (header[6..10] == [0, 0, 0, 0]).then_some(InputFormat::Bmp)
+    } else {
+        None
+    }
+}
+
+/// Recognizes the format of a file from its first [`SIGNATURE_LEN`] bytes
+///
+/// # Returns
+/// * `Ok(Some(format))` if the file starts with a known signature
+/// * `Ok(None)` if it does not
+/// * `Err(String)` if the file cannot be opened or read
+pub fn detect_file_format(path: &Path) -> Result<Option<InputFormat>, String> {
+    let mut header = Vec::with_capacity(SIGNATURE_LEN);
+    File::open(path)
+        .and_then(|file| file.take(SIGNATURE_LEN as u64).read_to_end(&mut header))
+        .map_err(|e| format!("Failed to read input file '{}': {}", path.display(), e))?;
+    Ok(detect_format(&header))
+}
 
 /// Checks if a file extension corresponds to a supported RAW format
 ///
@@ -146,6 +275,34 @@ mod tests {
         assert!(!is_supported_file("video.mp4"));
     }
 
+    #[test]
+    fn test_content_detection() {
+        assert_eq!(detect_format(b"\xFF\xD8\xFF\xE1\0\x10Exif"), Some(InputFormat::Jpeg));
+        assert_eq!(detect_format(b"\x89PNG\r\n\x1A\n\0\0\0\rIHDR"), Some(InputFormat::Png));
+        assert_eq!(detect_format(b"RIFF\x24\0\0\0WEBPVP8 "), Some(InputFormat::WebP));
+        assert_eq!(detect_format(b"II*\0\x10\0\0\0CR\x02\0"), Some(InputFormat::Cr2));
+        assert_eq!(detect_format(b"\0\0\0\x18ftypcrx \0\0\0\x01"), Some(InputFormat::Cr3));
+        assert_eq!(detect_format(b"MM\0*\0\0\0\x08"), Some(InputFormat::Tiff));
+        assert_eq!(detect_format(b"FUJIFILMCCD-RAW 0201"), Some(InputFormat::Raf));
+        assert_eq!(detect_format(b"IIRO\x08\0\0\0"), Some(InputFormat::Orf));
+        assert_eq!(detect_format(b"IIU\0\x18\0\0\0"), Some(InputFormat::Rw2));
+        assert_eq!(detect_format(b"BM\x36\0\x0C\0\0\0\0\0\x36\0\0\0"), Some(InputFormat::Bmp));
+        assert_eq!(detect_format(b"BMW owners manual"), None);
+        assert_eq!(detect_format(b"%PDF-1.7"), None);
+        assert_eq!(detect_format(b""), None);
+        // Too short for the CR2 marker: still a TIFF container
+        assert_eq!(detect_format(b"II*\0"), Some(InputFormat::Tiff));
+    }
+
+    #[test]
+    fn test_raw_formats() {
+        assert!(InputFormat::Cr3.is_raw());
+        assert!(InputFormat::Tiff.is_raw());
+        assert!(!InputFormat::Jpeg.is_raw());
+        assert!(!InputFormat::WebP.is_raw());
+        assert_eq!(InputFormat::Raf.name(), "RAF");
+    }
+
     #[test]
     fn test_file_type_detection() {
         assert_eq!(get_file_type("photo.cr2"), "RAW");
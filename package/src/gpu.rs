@@ -0,0 +1,148 @@
+/// Development of RAW files on a CUDA GPU
+///
+/// With the `cuda` feature, conversions of Bayer sensor data that produce a
+/// JPEG (the default and Fast profiles, or without a profile) are developed
+/// on the GPU: black level, white balance, demosaicing, camera matrix,
+/// output curve, resize and orientation run as kernels, and nvJPEG encodes
+/// the result. Conversions running at the same time on several threads
+/// (a batch, the async pool, a directory scan) are gathered into batches
+/// developed together, so the device stays busy with many small images.
+///
+/// X-Trans and monochrome sensors, the Quality profile, grayscale output,
+/// draft demosaicing and pyramids keep the CPU pipeline, as does every
+/// conversion when no device can be initialized or after a CUDA error.
+/// Without the feature the functions below do nothing.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{GpuOptions, configure_gpu, gpu_available};
+///
+/// // Use the second device and at most 8 images per batch
+/// configure_gpu(&GpuOptions {
+///     device: 1,
+///     max_batch_images: 8,
+///     ..GpuOptions::default()
+/// });
+///
+/// if !gpu_available() {
+///     println!("developing on the CPU");
+/// }
+/// ```
+use std::ffi::c_int;
+
+/// Settings of the GPU backend
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct GpuOptions {
+    /// Develop on the GPU when a device is usable
+    pub enabled: bool,
+    /// CUDA device index; only read before the device is first used
+    pub device: u32,
+    /// Most conversions developed by one batch (at least 1)
+    pub max_batch_images: usize,
+    /// Device memory a batch may use for its images; `0` selects half of
+    /// the memory free when the device is first used
+    pub max_batch_bytes: usize,
+}
+
+impl Default for GpuOptions {
+    fn default() -> Self {
+        Self {
+            enabled: true,
+            device: 0,
+            max_batch_images: 16,
+            max_batch_bytes: 0,
+        }
+    }
+}
+
+/// C-compatible GPU settings
+/// This structure must match the GpuOptions struct in gpu_develop.h
+#[cfg_attr(not(feature = "cuda"), allow(dead_code))]
+#[repr(C)]
+#[derive(Debug)]
+struct NativeGpuOptions {
+    enabled: c_int,
+    device: c_int,
+    max_batch_images: c_int,
+    max_batch_bytes: usize,
+}
+
+impl From<&GpuOptions> for NativeGpuOptions {
+    fn from(options: &GpuOptions) -> Self {
+        Self {
+            enabled: options.enabled as c_int,
+            device: options.device.min(c_int::MAX as u32) as c_int,
+            max_batch_images: options.max_batch_images.clamp(1, c_int::MAX as usize) as c_int,
+            max_batch_bytes: options.max_batch_bytes,
+        }
+    }
+}
+
+#[cfg(feature = "cuda")]
+unsafe extern "C" {
+    fn raw_preview_configure_gpu(options: *const NativeGpuOptions);
+    fn raw_preview_gpu_available() -> c_int;
+}
+
+/// Replaces the settings of the GPU backend
+///
+/// The setting is process-wide. Disabling the backend or changing the batch
+/// limits applies to the next batch; the device index only takes effect
+/// before the device is first used.
+pub fn configure_gpu(options: &GpuOptions) {
+    #[cfg(feature = "cuda")]
+    {
+        let native = NativeGpuOptions::from(options);
+        unsafe { raw_preview_configure_gpu(&native) };
+    }
+    #[cfg(not(feature = "cuda"))]
+    let _ = options;
+}
+
+/// Returns true if conversions can be developed on the GPU
+///
+/// The first call initializes the device. Always false without the `cuda`
+/// feature, when the backend is disabled, and after a CUDA error has
+/// disabled the device.
+pub fn gpu_available() -> bool {
+    #[cfg(feature = "cuda")]
+    {
+        unsafe { raw_preview_gpu_available() != 0 }
+    }
+    #[cfg(not(feature = "cuda"))]
+    {
+        false
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_native_options_conversion() {
+        let native = NativeGpuOptions::from(&GpuOptions::default());
+        assert_eq!(native.enabled, 1);
+        assert_eq!(native.device, 0);
+        assert_eq!(native.max_batch_images, 16);
+        assert_eq!(native.max_batch_bytes, 0);
+
+        let native = NativeGpuOptions::from(&GpuOptions {
+            enabled: false,
+            device: u32::MAX,
+            max_batch_images: 0,
+            max_batch_bytes: 1 << 30,
+        });
+        assert_eq!(native.enabled, 0);
+        assert_eq!(native.device, c_int::MAX);
+        assert_eq!(native.max_batch_images, 1);
+        assert_eq!(native.max_batch_bytes, 1 << 30);
+    }
+
+    #[cfg(not(feature = "cuda"))]
+    #[test]
+    fn test_unavailable_without_feature() {
+        configure_gpu(&GpuOptions::default());
+        assert!(!gpu_available());
+    }
+}
@@ -3,6 +3,11 @@
 /// This module handles processing of standard image formats,
 /// including EXIF extraction from all image files through the libjpeg wrapper.
 use crate::exif_data::{ExifData, ExifInfo};
+use crate::options::{
+    NativeAllocFn, NativePreviewLevel, NativePreviewLevelOutput, NativePreviewOptions,
+    PreviewLevel, PreviewOptions, PyramidLevel, finish_vec_output, native_pyramid_levels,
+    vec_output_alloc,
+};
 use std::ffi::{CStr, CString};
 use std::os::raw::c_char;
 use std::path::Path;
@@ -36,6 +41,57 @@ unsafe extern "C" {
         out_size: *mut usize,
         exif_data: *mut ExifData,
     ) -> libc::c_int;
+
+    fn process_image_to_jpeg_with_options(
+        input_path: *const libc::c_char,
+        output_path: *const libc::c_char,
+        options: *const NativePreviewOptions,
+        exif_data: *mut ExifData,
+    ) -> libc::c_int;
+
+    #[link_name = "process_image_bytes_with_options"]
+    fn process_image_bytes_with_options_c(
+        data: *const u8,
+        size: usize,
+        output_path: *const libc::c_char,
+        options: *const NativePreviewOptions,
+        exif_data: *mut ExifData,
+    ) -> libc::c_int;
+
+    #[link_name = "process_image_bytes_into"]
+    fn process_image_bytes_into_c(
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        alloc: NativeAllocFn,
+        user_data: *mut libc::c_void,
+        out_size: *mut usize,
+        exif_data: *mut ExifData,
+    ) -> libc::c_int;
+
+    #[link_name = "extract_image_metadata"]
+    fn extract_image_metadata_c(
+        input_path: *const libc::c_char,
+        exif_data: *mut ExifData,
+    ) -> libc::c_int;
+
+    #[link_name = "extract_image_metadata_from_bytes"]
+    fn extract_image_metadata_from_bytes_c(
+        data: *const u8,
+        size: usize,
+        exif_data: *mut ExifData,
+    ) -> libc::c_int;
+
+    #[link_name = "process_image_bytes_to_pyramid"]
+    fn process_image_bytes_to_pyramid_c(
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        levels: *const NativePreviewLevel,
+        level_count: libc::c_int,
+        outputs: *mut NativePreviewLevelOutput,
+        exif_data: *mut ExifData,
+    ) -> libc::c_int;
 }
 
 /// Helper function to safely convert C char arrays to Rust strings (same as raw_processor)
@@ -57,30 +113,9 @@ fn safe_string_from_ptr(ptr: *const c_char) -> String {
     }
 }
 
-/// Processes any image file (JPEG, PNG, TIFF, BMP, WebP, etc.) with EXIF extraction
-///
-/// This function handles all image formats by processing them through
-/// the libjpeg wrapper to generate a JPEG preview and extract metadata.
-///
-/// # Arguments
-/// * `input_path` - Path to the input image file
-/// * `output_path` - Path where the output will be saved
-///
-/// # Returns
-/// * `Ok(ExifInfo)` with extracted EXIF information on success
-/// * `Err(String)` with error message on failure
-pub fn process_image_file(input_path: &str, output_path: &str) -> Result<ExifInfo, String> {
-    // Validate input file exists
-    if !Path::new(input_path).exists() {
-        return Err(format!("Input image file does not exist: {}", input_path));
-    }
-
-    // Convert paths to CString
-    let c_input_path = CString::new(input_path).map_err(|_| "Invalid input path")?;
-    let c_output_path = CString::new(output_path).map_err(|_| "Invalid output path")?;
-
-    // Initialize EXIF data structure for libjpeg wrapper to populate (same as raw_processor)
-    let mut exif_data = ExifData {
+/// Creates an empty EXIF data structure for the libjpeg wrapper to populate (same as raw_processor)
+fn empty_exif_data() -> ExifData {
+    ExifData {
         camera_make: [0; 64],
         camera_model: [0; 64],
         software: ptr::null(),
@@ -101,23 +136,12 @@ pub fn process_image_file(input_path: &str, output_path: &str) -> Result<ExifInf
         focal_length_35mm: 0,
         description: ptr::null(),
         artist: ptr::null(),
-    };
-
-    // Process image using the libjpeg wrapper
-    let result = unsafe {
-        process_image_to_jpeg(
-            c_input_path.as_ptr(),
-            c_output_path.as_ptr(),
-            &mut exif_data,
-        )
-    };
-
-    if result != 0 {
-        return Err("Failed to process image file".to_string());
     }
+}
 
-    // Successfully processed - extract EXIF data from the C structure (same as raw_processor)
-    let exif_info = ExifInfo {
+/// Extracts EXIF data from the C structure into an owned ExifInfo (same as raw_processor)
+fn exif_info_from(exif_data: &ExifData) -> ExifInfo {
+    ExifInfo {
         camera_make: safe_string_from_array(&exif_data.camera_make),
         camera_model: safe_string_from_array(&exif_data.camera_model),
         software: safe_string_from_ptr(exif_data.software),
@@ -138,43 +162,120 @@ pub fn process_image_file(input_path: &str, output_path: &str) -> Result<ExifInf
         focal_length_35mm: exif_data.focal_length_35mm,
         description: safe_string_from_ptr(exif_data.description),
         artist: safe_string_from_ptr(exif_data.artist),
+    }
+}
+
+/// Processes any image file (JPEG, PNG, TIFF, BMP, WebP, etc.) with EXIF extraction
+///
+/// This function handles all image formats by processing them through
+/// the libjpeg wrapper to generate a JPEG preview and extract metadata.
+///
+/// # Arguments
+/// * `input_path` - Path to the input image file
+/// * `output_path` - Path where the output will be saved
+///
+/// # Returns
+/// * `Ok(ExifInfo)` with extracted EXIF information on success
+/// * `Err(String)` with error message on failure
+pub fn process_image_file(input_path: &str, output_path: &str) -> Result<ExifInfo, String> {
+    process_image_file_with_options(input_path, output_path, &PreviewOptions::default())
+}
+
+/// Processes any image file using the given preview options
+///
+/// See [`PreviewOptions`] for how the output size is chosen. JPEG input is
+/// decoded at the smallest DCT scale that still covers the requested size.
+pub fn process_image_file_with_options(
+    input_path: &str,
+    output_path: &str,
+    options: &PreviewOptions,
+) -> Result<ExifInfo, String> {
+    // Validate input file exists
+    if !Path::new(input_path).exists() {
+        return Err(format!("Input image file does not exist: {}", input_path));
+    }
+
+    // Convert paths to CString
+    let c_input_path = CString::new(input_path).map_err(|_| "Invalid input path")?;
+    let c_output_path = CString::new(output_path).map_err(|_| "Invalid output path")?;
+
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
+
+    // Process image using the libjpeg wrapper
+    let result = unsafe {
+        process_image_to_jpeg_with_options(
+            c_input_path.as_ptr(),
+            c_output_path.as_ptr(),
+            &native_options,
+            &mut exif_data,
+        )
     };
-    Ok(exif_info)
+
+    if result != 0 {
+        return Err("Failed to process image file".to_string());
+    }
+
+    Ok(exif_info_from(&exif_data))
+}
+
+/// Reads the metadata of an image file without decoding its pixels
+///
+/// Only the EXIF block and the image header are parsed, so this runs at I/O
+/// speed. `output_width`/`output_height` hold the full image size after
+/// orientation.
+pub fn extract_image_metadata(input_path: &str) -> Result<ExifInfo, String> {
+    if !Path::new(input_path).exists() {
+        return Err(format!("Input image file does not exist: {}", input_path));
+    }
+    let c_input_path = CString::new(input_path).map_err(|_| "Invalid input path")?;
+
+    let mut exif_data = empty_exif_data();
+    let result = unsafe { extract_image_metadata_c(c_input_path.as_ptr(), &mut exif_data) };
+    if result != 0 {
+        return Err("Failed to read image metadata".to_string());
+    }
+
+    Ok(exif_info_from(&exif_data))
+}
+
+/// Reads the metadata of image bytes without decoding their pixels, like
+/// [`extract_image_metadata`]
+pub fn extract_image_metadata_from_bytes(bytes: &[u8]) -> Result<ExifInfo, String> {
+    let mut exif_data = empty_exif_data();
+    let result =
+        unsafe { extract_image_metadata_from_bytes_c(bytes.as_ptr(), bytes.len(), &mut exif_data) };
+    if result != 0 {
+        return Err("Failed to read image metadata".to_string());
+    }
+
+    Ok(exif_info_from(&exif_data))
 }
 
 /// Accept image data as bytes and process it in-memory via the native FFI.
 /// The resulting JPEG preview is written to the provided `output_path`.
 pub fn process_image_bytes(bytes: &[u8], output_path: &str) -> Result<ExifInfo, String> {
+    process_image_bytes_with_options(bytes, output_path, &PreviewOptions::default())
+}
+
+/// Process image bytes using the given preview options and write the JPEG
+/// preview to `output_path`
+pub fn process_image_bytes_with_options(
+    bytes: &[u8],
+    output_path: &str,
+    options: &PreviewOptions,
+) -> Result<ExifInfo, String> {
     let c_output = CString::new(output_path).map_err(|_| "Invalid output path")?;
 
-    let mut exif_data = ExifData {
-        camera_make: [0; 64],
-        camera_model: [0; 64],
-        software: ptr::null(),
-        iso_speed: 0,
-        shutter: 0.0,
-        aperture: 0.0,
-        focal_length: 0.0,
-        raw_width: 0,
-        raw_height: 0,
-        output_width: 0,
-        output_height: 0,
-        colors: 0,
-        color_filter: 0,
-        cam_mul: [0.0; 4],
-        date_taken: ptr::null(),
-        lens: ptr::null(),
-        max_aperture: 0.0,
-        focal_length_35mm: 0,
-        description: ptr::null(),
-        artist: ptr::null(),
-    };
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
 
     let ret = unsafe {
-        process_image_bytes_c(
+        process_image_bytes_with_options_c(
             bytes.as_ptr(),
             bytes.len(),
             c_output.as_ptr(),
+            &native_options,
             &mut exif_data,
         )
     };
@@ -182,67 +283,81 @@ pub fn process_image_bytes(bytes: &[u8], output_path: &str) -> Result<ExifInfo,
         return Err("Failed to process image bytes".to_string());
     }
 
-    let exif_info = ExifInfo {
-        camera_make: safe_string_from_array(&exif_data.camera_make),
-        camera_model: safe_string_from_array(&exif_data.camera_model),
-        software: safe_string_from_ptr(exif_data.software),
-        iso_speed: exif_data.iso_speed,
-        shutter: exif_data.shutter,
-        aperture: exif_data.aperture,
-        focal_length: exif_data.focal_length,
-        raw_width: exif_data.raw_width,
-        raw_height: exif_data.raw_height,
-        output_width: exif_data.output_width,
-        output_height: exif_data.output_height,
-        colors: exif_data.colors,
-        color_filter: exif_data.color_filter,
-        cam_mul: exif_data.cam_mul,
-        date_taken: safe_string_from_ptr(exif_data.date_taken),
-        lens: safe_string_from_ptr(exif_data.lens),
-        max_aperture: exif_data.max_aperture,
-        focal_length_35mm: exif_data.focal_length_35mm,
-        description: safe_string_from_ptr(exif_data.description),
-        artist: safe_string_from_ptr(exif_data.artist),
-    };
-    Ok(exif_info)
+    Ok(exif_info_from(&exif_data))
 }
 
 /// Process image bytes and return the resulting JPEG as a Vec<u8> along with ExifInfo
 pub fn process_image_bytes_to_vec(bytes: &[u8]) -> Result<(Vec<u8>, ExifInfo), String> {
-    let mut exif_data = ExifData {
-        /* ...existing init... */
-        camera_make: [0; 64],
-        camera_model: [0; 64],
-        software: ptr::null(),
-        iso_speed: 0,
-        shutter: 0.0,
-        aperture: 0.0,
-        focal_length: 0.0,
-        raw_width: 0,
-        raw_height: 0,
-        output_width: 0,
-        output_height: 0,
-        colors: 0,
-        color_filter: 0,
-        cam_mul: [0.0; 4],
-        date_taken: ptr::null(),
-        lens: ptr::null(),
-        max_aperture: 0.0,
-        focal_length_35mm: 0,
-        description: ptr::null(),
-        artist: ptr::null(),
+    process_image_bytes_to_vec_with_options(bytes, &PreviewOptions::default())
+}
+
+/// Process image bytes using the given preview options and return the
+/// resulting JPEG as a Vec<u8> along with ExifInfo
+pub fn process_image_bytes_to_vec_with_options(
+    bytes: &[u8],
+    options: &PreviewOptions,
+) -> Result<(Vec<u8>, ExifInfo), String> {
+    let mut jpeg_vec = Vec::new();
+    let exif = process_image_bytes_into(bytes, options, &mut jpeg_vec)?;
+    // The buffer was sized for the worst case; give the slack back
+    jpeg_vec.shrink_to_fit();
+    Ok((jpeg_vec, exif))
+}
+
+/// Process image bytes and encode the JPEG straight into `out`
+///
+/// TurboJPEG compresses directly into the vector's memory, so no
+/// intermediate JPEG buffer is allocated or copied. `out` is cleared first
+/// and its capacity is reused across calls; it grows to TurboJPEG's
+/// worst-case size for the preview.
+pub fn process_image_bytes_into(
+    bytes: &[u8],
+    options: &PreviewOptions,
+    out: &mut Vec<u8>,
+) -> Result<ExifInfo, String> {
+    out.clear();
+    let result = unsafe {
+        process_image_bytes_with_alloc(
+            bytes,
+            &NativePreviewOptions::from(options),
+            vec_output_alloc,
+            out as *mut Vec<u8> as *mut libc::c_void,
+        )
     };
+    match result {
+        Ok((out_size, exif)) => {
+            unsafe { finish_vec_output(out, out_size)? };
+            Ok(exif)
+        }
+        Err(e) => {
+            out.clear();
+            Err(e)
+        }
+    }
+}
 
-    // Prepare output pointers
-    let mut out_ptr: *mut u8 = std::ptr::null_mut();
+/// Process image bytes into the buffer returned by `alloc`
+///
+/// Returns the number of JPEG bytes written to that buffer.
+///
+/// # Safety
+/// `alloc` must follow the `PreviewAllocFn` contract for `user_data`.
+pub(crate) unsafe fn process_image_bytes_with_alloc(
+    bytes: &[u8],
+    options: &NativePreviewOptions,
+    alloc: NativeAllocFn,
+    user_data: *mut libc::c_void,
+) -> Result<(usize, ExifInfo), String> {
+    let mut exif_data = empty_exif_data();
     let mut out_size: usize = 0;
-
     let ret = unsafe {
-        process_image_bytes_to_buffer_c(
+        process_image_bytes_into_c(
             bytes.as_ptr(),
             bytes.len(),
-            &mut out_ptr as *mut *mut u8,
-            &mut out_size as *mut usize,
+            options,
+            alloc,
+            user_data,
+            &mut out_size,
             &mut exif_data,
         )
     };
@@ -250,43 +365,62 @@ pub fn process_image_bytes_to_vec(bytes: &[u8]) -> Result<(Vec<u8>, ExifInfo), S
     if ret != 0 {
         return Err("Failed to process image bytes to buffer".to_string());
     }
+    Ok((out_size, exif_info_from(&exif_data)))
+}
 
-    if out_ptr.is_null() || out_size == 0 {
-        return Err("No JPEG data returned".to_string());
-    }
+/// Process image bytes into a set of JPEG previews of different sizes
+///
+/// The image is decoded once, at the size of the largest level; each smaller
+/// level is resized from the next larger one and all levels are encoded in
+/// parallel. The output size fields of `options` are ignored; the returned
+/// levels are in the order of `levels`.
+pub fn process_image_bytes_to_pyramid(
+    bytes: &[u8],
+    levels: &[PreviewLevel],
+    options: &PreviewOptions,
+) -> Result<(Vec<PyramidLevel>, ExifInfo), String> {
+    let native_levels = native_pyramid_levels(levels)?;
+    let mut outputs = vec![NativePreviewLevelOutput::empty(); native_levels.len()];
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
 
-    // Copy buffer into Vec<u8>
-    let slice = unsafe { std::slice::from_raw_parts(out_ptr, out_size) };
-    let jpeg_vec = slice.to_vec();
+    let ret = unsafe {
+        process_image_bytes_to_pyramid_c(
+            bytes.as_ptr(),
+            bytes.len(),
+            &native_options,
+            native_levels.as_ptr(),
+            native_levels.len() as libc::c_int,
+            outputs.as_mut_ptr(),
+            &mut exif_data,
+        )
+    };
 
-    // Free the C++ buffer
-    unsafe { free_buffer(out_ptr) };
+    if ret != 0 {
+        return Err("Failed to process image bytes to pyramid".to_string());
+    }
 
-    // Convert ExifData to ExifInfo
-    let exif_info = ExifInfo {
-        camera_make: safe_string_from_array(&exif_data.camera_make),
-        camera_model: safe_string_from_array(&exif_data.camera_model),
-        software: safe_string_from_ptr(exif_data.software),
-        iso_speed: exif_data.iso_speed,
-        shutter: exif_data.shutter,
-        aperture: exif_data.aperture,
-        focal_length: exif_data.focal_length,
-        raw_width: exif_data.raw_width,
-        raw_height: exif_data.raw_height,
-        output_width: exif_data.output_width,
-        output_height: exif_data.output_height,
-        colors: exif_data.colors,
-        color_filter: exif_data.color_filter,
-        cam_mul: exif_data.cam_mul,
-        date_taken: safe_string_from_ptr(exif_data.date_taken),
-        lens: safe_string_from_ptr(exif_data.lens),
-        max_aperture: exif_data.max_aperture,
-        focal_length_35mm: exif_data.focal_length_35mm,
-        description: safe_string_from_ptr(exif_data.description),
-        artist: safe_string_from_ptr(exif_data.artist),
-    };
+    // Copy every level into a Vec<u8> and free the C++ buffers
+    let mut pyramid = Vec::with_capacity(outputs.len());
+    let mut missing = false;
+    for output in &outputs {
+        if output.data.is_null() || output.size == 0 {
+            missing = true;
+            continue;
+        }
+        let slice = unsafe { std::slice::from_raw_parts(output.data, output.size) };
+        pyramid.push(PyramidLevel {
+            jpeg: slice.to_vec(),
+            width: output.width.max(0) as u32,
+            height: output.height.max(0) as u32,
+        });
+        unsafe { free_buffer(output.data) };
+    }
+    if missing {
+        return Err("No JPEG data returned".to_string());
+    }
 
-    Ok((jpeg_vec, exif_info))
+    Ok((pyramid, exif_info_from(&exif_data)))
 }
 
 #[cfg(test)]
@@ -329,4 +463,16 @@ mod tests {
         let res = process_image_bytes_to_vec(&[]);
         assert!(res.is_err());
     }
+
+    #[test]
+    fn test_extract_image_metadata_missing_file() {
+        let res = extract_image_metadata("/nonexistent/photo.jpg");
+        assert!(res.is_err());
+    }
+
+    #[test]
+    fn test_process_image_bytes_to_pyramid_requires_levels() {
+        let res = process_image_bytes_to_pyramid(&[0xFF, 0xD8], &[], &PreviewOptions::default());
+        assert!(res.is_err());
+    }
 }
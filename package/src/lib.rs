@@ -1,3 +1,9 @@
+#[cfg(feature = "async")]
+pub mod async_pool;
+pub mod batch;
+pub mod buffer_pool;
+pub mod cache;
+pub mod directory;
 pub mod exif_data;
 /// Universal Image Processing Library
 ///
@@ -25,17 +31,63 @@ pub mod exif_data;
 /// }
 /// ```
 pub mod file_detector;
+pub mod gpu;
 pub mod image_processor;
+pub mod logging;
+pub mod options;
 pub mod raw_processor;
+pub mod stats;
+#[cfg(all(unix, feature = "worker"))]
+pub mod worker;
 
 // Re-export the main public API
+#[cfg(feature = "async")]
+pub use async_pool::{
+    AsyncPool, AsyncPoolOptions, PreviewFuture, convert_raw_bytes_to_vec_async,
+    process_any_bytes_async, process_image_bytes_to_vec_async,
+};
+pub use batch::{BatchInput, BatchOptions, BatchResult, BatchResults, process_batch};
+pub use buffer_pool::{
+    BufferPoolOptions, cached_buffer_bytes, configure_buffer_pool, trim_buffer_pool,
+};
+pub use cache::{CacheKey, CacheOptions, CacheStats, PreviewCache};
+pub use directory::{
+    DirectoryOptions, DirectoryPreviews, DirectoryResult, ScanOptions, ScannedFile,
+    generate_directory_previews, scan_directory,
+};
 pub use exif_data::ExifInfo;
-pub use file_detector::{get_file_type, is_image_file, is_raw_file, is_supported_file};
-pub use image_processor::process_image_file;
-pub use raw_processor::convert_raw_to_jpeg;
+pub use file_detector::{
+    InputFormat, SIGNATURE_LEN, detect_file_format, detect_format, get_file_type, is_image_file,
+    is_raw_file, is_supported_file,
+};
+pub use gpu::{GpuOptions, configure_gpu, gpu_available};
+pub use image_processor::{
+    extract_image_metadata, extract_image_metadata_from_bytes, process_image_file,
+    process_image_file_with_options,
+};
+pub use logging::set_native_log_level;
+pub use options::{
+    ChromaSubsampling, DctMethod, JpegEncodeOptions, JpegPassthrough, PreviewFrame, PreviewLevel,
+    PreviewOptions, PreviewProfile, PreviewStage, ProgressiveStages, PyramidLevel, image_decoders,
+    parallel_processing_available, simd_enabled,
+};
+pub use raw_processor::{
+    RawPreviewContext, convert_raw_bytes_progressive, convert_raw_progressive,
+    convert_raw_reader_into, convert_raw_to_jpeg, convert_raw_to_jpeg_with_options,
+    extract_raw_metadata, extract_raw_metadata_from_bytes, extract_raw_metadata_from_reader,
+};
+pub use stats::{PipelineStats, last_pipeline_stats};
+#[cfg(all(unix, feature = "worker"))]
+pub use worker::{WorkerClient, WorkerInput, WorkerOptions, WorkerOutput};
 // Re-export in-memory Vec-returning APIs
-pub use image_processor::process_image_bytes_to_vec;
-pub use raw_processor::convert_raw_bytes_to_vec;
+pub use image_processor::{
+    process_image_bytes_into, process_image_bytes_to_pyramid, process_image_bytes_to_vec,
+    process_image_bytes_to_vec_with_options,
+};
+pub use raw_processor::{
+    convert_raw_bytes_into, convert_raw_bytes_to_pyramid, convert_raw_bytes_to_vec,
+    convert_raw_bytes_to_vec_with_options,
+};
 
 use std::path::Path;
 
@@ -102,18 +154,129 @@ use std::path::Path;
 /// }
 /// ```
 pub fn process_any_image(input_path: &str, output_path: &str) -> Result<ExifInfo, String> {
-    // Extract filename for type detection
-    let filename = Path::new(input_path)
+    process_any_image_with_options(input_path, output_path, &PreviewOptions::default())
+}
+
+/// Processes any supported image file using the given preview options
+///
+/// Like [`process_any_image`], with control over the output size and the
+/// embedded preview fast path for RAW files.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, process_any_image_with_options};
+///
+/// // Generate a preview whose long edge is at most 1024 px
+/// let options = PreviewOptions::fit_long_edge(1024);
+/// let exif = process_any_image_with_options("IMG_1234.CR3", "preview_1024.jpg", &options);
+/// ```
+pub fn process_any_image_with_options(
+    input_path: &str,
+    output_path: &str,
+    options: &PreviewOptions,
+) -> Result<ExifInfo, String> {
+    // Route to appropriate processor based on file type
+    if is_raw_input(input_path)? {
+        or_tiff_image(
+            convert_raw_to_jpeg_with_options(input_path, output_path, options),
+            || detect_file_format(Path::new(input_path)).ok().flatten(),
+            || process_image_file_with_options(input_path, output_path, options),
+        )
+    } else {
+        // Use image_processor for all standard image files (JPEG, PNG, etc.)
+        process_image_file_with_options(input_path, output_path, options)
+    }
+}
+
+/// Processes any supported image held in memory
+///
+/// The bytes version of [`process_any_image`]: the format is recognized from
+/// the signature at the start of the content (see [`detect_format`]), so the
+/// caller does not need to know whether it holds a RAW file, and content that
+/// is neither is rejected before any decoding starts.
+///
+/// # Returns
+/// * `Ok((Vec<u8>, ExifInfo))` with the JPEG preview and the metadata
+/// * `Err(String)` if the format is not recognized or the conversion fails
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::process_any_bytes;
+///
+/// let bytes = std::fs::read("upload.bin").unwrap();
+/// match process_any_bytes(&bytes) {
+///     Ok((jpeg, exif)) => println!("{}: {} bytes", exif.camera_model, jpeg.len()),
+///     Err(e) => eprintln!("Rejected: {}", e),
+/// }
+/// ```
+pub fn process_any_bytes(bytes: &[u8]) -> Result<(Vec<u8>, ExifInfo), String> {
+    process_any_bytes_with_options(bytes, &PreviewOptions::default())
+}
+
+/// Processes any supported image held in memory using the given preview options
+///
+/// Like [`process_any_bytes`], with control over the output size, encoding
+/// and the embedded preview fast path for RAW files.
+pub fn process_any_bytes_with_options(
+    bytes: &[u8],
+    options: &PreviewOptions,
+) -> Result<(Vec<u8>, ExifInfo), String> {
+    match detect_format(bytes) {
+        Some(format) if format.is_raw() => or_tiff_image(
+            convert_raw_bytes_to_vec_with_options(bytes, options),
+            || Some(format),
+            || process_image_bytes_to_vec_with_options(bytes, options),
+        ),
+        Some(_) => process_image_bytes_to_vec_with_options(bytes, options),
+        None => Err(UNRECOGNIZED_CONTENT.to_string()),
+    }
+}
+
+/// Retries a failed RAW conversion of a TIFF container as a standard image
+///
+/// TIFF files go to LibRaw first, as most of them are camera files (see
+/// [`InputFormat::is_raw`]). With the `tiff` decoder, scans and exports that
+/// LibRaw cannot open are decoded as images instead; the RAW error is kept
+/// if that fails too.
+pub(crate) fn or_tiff_image<T>(
+    raw: Result<T, String>,
+    format: impl FnOnce() -> Option<InputFormat>,
+    image: impl FnOnce() -> Result<T, String>,
+) -> Result<T, String> {
+    match raw {
+        Err(e) if cfg!(feature = "tiff") && format() == Some(InputFormat::Tiff) => {
+            image().map_err(|_| e)
+        }
+        raw => raw,
+    }
+}
+
+pub(crate) const UNRECOGNIZED_CONTENT: &str = "Unrecognized image format: the data does not start with the signature of a supported RAW or image format";
+
+/// Decides whether a file goes to LibRaw or to the image decoder
+///
+/// The content signature wins over the extension, so misnamed files take the
+/// right path. The extension decides for content without a known signature
+/// (RAW formats LibRaw identifies by their size) and for unreadable files,
+/// whose processor then reports the error. Every standard image format has a
+/// signature, so a file named like one without it is rejected up front.
+fn is_raw_input(input_path: &str) -> Result<bool, String> {
+    let path = Path::new(input_path);
+    let filename = path
         .file_name()
         .and_then(|name| name.to_str())
         .ok_or_else(|| format!("Invalid input path: {}", input_path))?;
 
-    // Route to appropriate processor based on file type
+    let detected = detect_file_format(path);
+    if let Ok(Some(format)) = detected {
+        return Ok(format.is_raw());
+    }
     if is_raw_file(filename) {
-        convert_raw_to_jpeg(input_path, output_path)
+        Ok(true)
+    } else if is_image_file(filename) && detected.is_err() {
+        Ok(false)
     } else if is_image_file(filename) {
-        // Use image_processor for all standard image files (JPEG, PNG, TIFF, etc.)
-        process_image_file(input_path, output_path)
+        Err(format!("'{}': {}", filename, UNRECOGNIZED_CONTENT))
     } else {
         Err(format!(
             "Unsupported file format: '{}'. Supported formats include RAW files (CR2, CR3, NEF, ARW, etc.) and image files (JPG, PNG, TIFF, etc.)",
@@ -122,6 +285,35 @@ pub fn process_any_image(input_path: &str, output_path: &str) -> Result<ExifInfo
     }
 }
 
+/// Reads the metadata of any supported image file without decoding it
+///
+/// Dispatches on the file content and type like [`process_any_image`], but stops after
+/// parsing the headers: RAW files are opened with LibRaw without being
+/// unpacked, other files only have their EXIF block and image header read.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::extract_metadata;
+///
+/// for path in ["IMG_1234.CR3", "photo.jpg"] {
+///     if let Ok(exif) = extract_metadata(path) {
+///         println!("{}: {} {} {}x{}", path, exif.camera_make, exif.camera_model,
+///             exif.output_width, exif.output_height);
+///     }
+/// }
+/// ```
+pub fn extract_metadata(input_path: &str) -> Result<ExifInfo, String> {
+    if is_raw_input(input_path)? {
+        or_tiff_image(
+            extract_raw_metadata(input_path),
+            || detect_file_format(Path::new(input_path)).ok().flatten(),
+            || extract_image_metadata(input_path),
+        )
+    } else {
+        extract_image_metadata(input_path)
+    }
+}
+
 /// Checks if a file can be processed by this library
 ///
 /// # Arguments
@@ -209,4 +401,64 @@ mod tests {
         assert!(get_file_info("image.jpg").contains("Standard image"));
         assert!(get_file_info("document.txt").contains("Unsupported"));
     }
+
+    #[test]
+    fn test_process_any_bytes_rejects_unknown_content() {
+        let err = process_any_bytes(b"<html><body>Not found</body></html>").unwrap_err();
+        assert!(err.contains("Unrecognized image format"));
+        assert!(process_any_bytes(&[]).is_err());
+    }
+
+    #[test]
+    fn test_misnamed_file_routing() {
+        let dir = std::env::temp_dir();
+        let id = std::process::id();
+        let raw_as_jpg = dir.join(format!("raw_preview_rs_route_{}.jpg", id));
+        let text_as_jpg = dir.join(format!("raw_preview_rs_route_{}_text.jpg", id));
+        std::fs::write(&raw_as_jpg, b"FUJIFILMCCD-RAW 0201FF383501").unwrap();
+        std::fs::write(&text_as_jpg, b"not an image at all").unwrap();
+
+        // Content wins over the extension
+        assert_eq!(is_raw_input(raw_as_jpg.to_str().unwrap()), Ok(true));
+        let err = is_raw_input(text_as_jpg.to_str().unwrap()).unwrap_err();
+        assert!(err.contains("Unrecognized image format"));
+        // Unreadable files fall back to the extension
+        assert_eq!(is_raw_input("/nonexistent/photo.png"), Ok(false));
+        assert_eq!(is_raw_input("/nonexistent/photo.nef"), Ok(true));
+
+        let _ = std::fs::remove_file(&raw_as_jpg);
+        let _ = std::fs::remove_file(&text_as_jpg);
+    }
+
+    #[test]
+    fn test_tiff_fallback() {
+        let raw = || Err::<&str, String>("raw error".to_string());
+        let image = || Ok::<&str, String>("image");
+
+        let tiff = or_tiff_image(raw(), || Some(InputFormat::Tiff), image);
+        if cfg!(feature = "tiff") {
+            assert_eq!(tiff, Ok("image"));
+        } else {
+            assert_eq!(tiff, Err("raw error".to_string()));
+        }
+        // Other RAW formats, and image failures, keep the RAW error
+        let cr2 = or_tiff_image(raw(), || Some(InputFormat::Cr2), image);
+        assert_eq!(cr2, Err("raw error".to_string()));
+        let failed = or_tiff_image(
+            raw(),
+            || Some(InputFormat::Tiff),
+            || Err("image error".to_string()),
+        );
+        assert_eq!(failed, Err("raw error".to_string()));
+        assert_eq!(
+            or_tiff_image(Ok("raw"), || Some(InputFormat::Tiff), image),
+            Ok("raw")
+        );
+    }
+
+    #[test]
+    fn test_extract_metadata_unsupported_format() {
+        let err = extract_metadata("document.txt").unwrap_err();
+        assert!(err.contains("Unsupported file format"));
+    }
 }
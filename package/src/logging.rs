@@ -0,0 +1,105 @@
+/// Native log messages, bridged to the [`log`] crate
+///
+/// The C++ wrappers never write to stdout or stderr. Their diagnostics
+/// (decoder errors, which path a conversion took, ...) are dropped unless
+/// [`set_native_log_level`] registers the bridge, after which they are
+/// emitted through the `log` facade under the `raw_preview_rs::native`
+/// target, on the thread that produced them.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::set_native_log_level;
+///
+/// // With a logger installed (env_logger, tracing-log, ...)
+/// set_native_log_level(log::LevelFilter::Warn);
+/// ```
+use log::{Level, LevelFilter};
+use std::ffi::{CStr, c_char, c_int, c_void};
+
+/// Target of every record forwarded from the native code
+pub const NATIVE_LOG_TARGET: &str = "raw_preview_rs::native";
+
+// Values of PreviewLogLevel in preview_log.h
+const PREVIEW_LOG_OFF: c_int = 0;
+const PREVIEW_LOG_ERROR: c_int = 1;
+const PREVIEW_LOG_WARN: c_int = 2;
+const PREVIEW_LOG_INFO: c_int = 3;
+const PREVIEW_LOG_DEBUG: c_int = 4;
+
+type NativeLogFn =
+    unsafe extern "C" fn(user_data: *mut c_void, level: c_int, message: *const c_char);
+
+unsafe extern "C" {
+    fn raw_preview_set_log_callback(
+        callback: Option<NativeLogFn>,
+        user_data: *mut c_void,
+        max_level: c_int,
+    );
+}
+
+/// Forwards native messages up to `level` to the `log` crate
+///
+/// Messages less severe than `level` are discarded in the native code
+/// before they are formatted, so keep it as low as you need: the default,
+/// [`LevelFilter::Off`], costs one atomic load per would-be message.
+/// `Trace` is treated as `Debug`, the most verbose native level. The
+/// setting is process-wide and may be changed at any time.
+pub fn set_native_log_level(level: LevelFilter) {
+    let native = native_level(level);
+    let callback: Option<NativeLogFn> = if native == PREVIEW_LOG_OFF {
+        None
+    } else {
+        Some(forward_native_log)
+    };
+    unsafe { raw_preview_set_log_callback(callback, std::ptr::null_mut(), native) };
+}
+
+fn native_level(level: LevelFilter) -> c_int {
+    match level {
+        LevelFilter::Off => PREVIEW_LOG_OFF,
+        LevelFilter::Error => PREVIEW_LOG_ERROR,
+        LevelFilter::Warn => PREVIEW_LOG_WARN,
+        LevelFilter::Info => PREVIEW_LOG_INFO,
+        LevelFilter::Debug | LevelFilter::Trace => PREVIEW_LOG_DEBUG,
+    }
+}
+
+fn log_level(native: c_int) -> Level {
+    match native {
+        PREVIEW_LOG_ERROR => Level::Error,
+        PREVIEW_LOG_WARN => Level::Warn,
+        PREVIEW_LOG_INFO => Level::Info,
+        _ => Level::Debug,
+    }
+}
+
+unsafe extern "C" fn forward_native_log(
+    _user_data: *mut c_void,
+    level: c_int,
+    message: *const c_char,
+) {
+    if message.is_null() {
+        return;
+    }
+    let message = unsafe { CStr::from_ptr(message) }.to_string_lossy();
+    log::log!(target: NATIVE_LOG_TARGET, log_level(level), "{}", message);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_level_mapping_round_trips() {
+        for level in [Level::Error, Level::Warn, Level::Info, Level::Debug] {
+            assert_eq!(log_level(native_level(level.to_level_filter())), level);
+        }
+        assert_eq!(native_level(LevelFilter::Off), PREVIEW_LOG_OFF);
+        assert_eq!(native_level(LevelFilter::Trace), PREVIEW_LOG_DEBUG);
+    }
+
+    #[test]
+    fn test_forward_ignores_null_message() {
+        unsafe { forward_native_log(std::ptr::null_mut(), PREVIEW_LOG_ERROR, std::ptr::null()) };
+    }
+}
@@ -0,0 +1,833 @@
+/// Preview generation options
+///
+/// This module defines the options accepted by the `*_with_options` and
+/// `*_to_pyramid` functions and their C-compatible counterparts passed to
+/// the native wrappers.
+use crate::exif_data::ExifInfo;
+
+/// Options controlling how a preview is generated
+///
+/// `PreviewOptions::default()` reproduces the behaviour of the functions
+/// that take no options.
+///
+/// # Output size
+/// When `max_edge`, `target_width` and `target_height` are all 0 the preview
+/// is generated at half the original resolution. Otherwise it is scaled down
+/// (never up), keeping its aspect ratio, until it satisfies every non-zero
+/// bound. The cheapest reduction is applied first (LibRaw half-size
+/// decoding for RAW files, DCT scaling for JPEG files) and an area-average
+/// filter produces the exact size.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{convert_raw_to_jpeg_with_options, PreviewOptions};
+///
+/// // Use the embedded preview when it is at least 1024 px on its long edge
+/// let options = PreviewOptions::embedded_preview(1024);
+/// let exif = convert_raw_to_jpeg_with_options("photo.cr2", "preview.jpg", &options);
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+pub struct PreviewOptions {
+    /// Return the JPEG preview embedded in RAW files as-is, skipping
+    /// demosaicing entirely. Falls back to demosaicing when the file has no
+    /// embedded JPEG or it is smaller than `min_preview_size`.
+    pub use_embedded_preview: bool,
+    /// Minimum long edge in pixels an embedded preview must have to be used
+    /// (0 accepts any size)
+    pub min_preview_size: u32,
+    /// Number of threads LibRaw may use to demosaic this image (0 keeps the
+    /// OpenMP default). Only takes effect when the crate is built with the
+    /// `openmp` feature, see [`parallel_processing_available`]. Use many
+    /// threads for single latency-sensitive conversions and 1 in batch
+    /// workers that already run one conversion per core.
+    pub num_threads: u32,
+    /// Maximum long edge of the output in pixels (0 = unbounded)
+    pub max_edge: u32,
+    /// Maximum output width in pixels (0 = unbounded)
+    pub target_width: u32,
+    /// Maximum output height in pixels (0 = unbounded)
+    pub target_height: u32,
+    /// Settings of every JPEG the call encodes. An embedded RAW preview
+    /// returned as-is keeps the camera's encoding.
+    pub encode: JpegEncodeOptions,
+    /// Return JPEG inputs that already fit the output size without decoding
+    /// and re-encoding them, see [`JpegPassthrough`]
+    pub jpeg_passthrough: JpegPassthrough,
+    /// Develop RAW files without LibRaw's demosaicing: every 2x2, 4x4 or
+    /// 8x8 cell of a Bayer sensor (3x3, 6x6 or 12x12 for X-Trans) is
+    /// averaged straight into one RGB pixel, white balanced and converted
+    /// to sRGB. Several times faster than `dcraw_process()` but without
+    /// interpolation or highlight recovery, so meant for thumbnails. Only
+    /// used when the binned image still covers the output size; other
+    /// sensors and larger outputs fall back to LibRaw.
+    pub draft_demosaic: bool,
+    /// LibRaw settings used when a RAW file is demosaiced, see
+    /// [`PreviewProfile`]
+    pub profile: PreviewProfile,
+    /// Fill the `target_width` x `target_height` box instead of fitting in
+    /// it: the image is scaled (never up) until it covers the box and its
+    /// center is cropped to it, as for square thumbnails. Needs both
+    /// dimensions and ignores `max_edge`. JPEG files only decode the
+    /// cropped region. Ignored for RAW files and pyramids.
+    pub crop_to_fill: bool,
+}
+
+impl PreviewOptions {
+    /// Creates options that prefer the embedded preview when its long edge
+    /// is at least `min_size` pixels
+    pub fn embedded_preview(min_size: u32) -> Self {
+        Self {
+            use_embedded_preview: true,
+            min_preview_size: min_size,
+            ..Default::default()
+        }
+    }
+
+    /// Creates options that scale the preview so its long edge is at most
+    /// `max_edge` pixels
+    pub fn fit_long_edge(max_edge: u32) -> Self {
+        Self {
+            max_edge,
+            ..Default::default()
+        }
+    }
+
+    /// Creates options that scale the preview to fit in a
+    /// `width` x `height` box
+    pub fn fit_box(width: u32, height: u32) -> Self {
+        Self {
+            target_width: width,
+            target_height: height,
+            ..Default::default()
+        }
+    }
+
+    /// Creates options that scale and center-crop the preview to fill a
+    /// `width` x `height` box, see [`crop_to_fill`](Self::crop_to_fill)
+    pub fn fill_box(width: u32, height: u32) -> Self {
+        Self {
+            target_width: width,
+            target_height: height,
+            crop_to_fill: true,
+            ..Default::default()
+        }
+    }
+}
+
+/// What the image functions do with a JPEG input that already fits the
+/// requested output size
+///
+/// A JPEG fits when the size bounds of [`PreviewOptions`] would not shrink
+/// it; with no bound set, every JPEG fits. Larger JPEGs, and every input
+/// with `Off`, are decoded at the smallest DCT scale covering the target
+/// and re-encoded. RAW files and pyramids are not affected.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{JpegPassthrough, PreviewOptions, process_image_bytes_to_vec_with_options};
+///
+/// let bytes = std::fs::read("upload.jpg").unwrap();
+/// let options = PreviewOptions {
+///     jpeg_passthrough: JpegPassthrough::StripMetadata,
+///     ..PreviewOptions::fit_long_edge(2048)
+/// };
+/// let (jpeg, _exif) = process_image_bytes_to_vec_with_options(&bytes, &options).unwrap();
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+pub enum JpegPassthrough {
+    /// Always decode and re-encode
+    #[default]
+    Off,
+    /// Return the input bytes untouched. Metadata, including the EXIF
+    /// orientation tag, is kept and `encode` does not apply.
+    Original,
+    /// Losslessly apply the EXIF orientation and drop all metadata markers
+    /// (EXIF, XMP, ICC profile, comments) without decoding the image data.
+    /// Partial edge blocks that cannot be flipped or rotated losslessly are
+    /// trimmed, so an oriented output may be up to 15 pixels smaller.
+    StripMetadata,
+}
+
+impl JpegPassthrough {
+    /// PREVIEW_PASSTHROUGH_* value of preview_options.h
+    fn native(self) -> i32 {
+        match self {
+            Self::Off => 0,
+            Self::Original => 1,
+            Self::StripMetadata => 2,
+        }
+    }
+}
+
+/// Trade-off between latency and fidelity of RAW development
+///
+/// Selects a coherent set of LibRaw processing settings for RAW files that
+/// are demosaiced; embedded previews and image files are not affected, and
+/// [`PreviewOptions::draft_demosaic`] only follows the color space of
+/// `Fast`. The demosaic algorithm only matters when the output is larger
+/// than LibRaw's half-size image, which skips demosaicing altogether.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, PreviewProfile, convert_raw_to_jpeg_with_options};
+///
+/// let options = PreviewOptions {
+///     profile: PreviewProfile::Quality,
+///     ..PreviewOptions::fit_long_edge(4096)
+/// };
+/// let exif = convert_raw_to_jpeg_with_options("photo.dng", "preview.jpg", &options);
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+pub enum PreviewProfile {
+    /// Stays in the camera color space (no camera matrix conversion),
+    /// skips DNG opcode list 3 and demosaics bilinearly. Colors are less
+    /// saturated than with the other profiles.
+    Fast,
+    /// sRGB through the camera matrix, DNG opcode lists 2 and 3 and
+    /// LibRaw's default AHD demosaic
+    #[default]
+    Balanced,
+    /// `Balanced` with DHT demosaicing, blended instead of clipped
+    /// highlights and light FBDD noise reduction
+    Quality,
+}
+
+impl PreviewProfile {
+    /// PREVIEW_PROFILE_* value of preview_options.h
+    fn native(self) -> i32 {
+        match self {
+            Self::Balanced => 0,
+            Self::Fast => 1,
+            Self::Quality => 2,
+        }
+    }
+}
+
+/// Chroma subsampling of encoded JPEGs
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+pub enum ChromaSubsampling {
+    /// No subsampling; largest files, sharpest color edges
+    #[default]
+    S444,
+    /// Chroma halved horizontally
+    S422,
+    /// Chroma halved horizontally and vertically; the usual choice for
+    /// thumbnails, markedly smaller than 4:4:4
+    S420,
+    /// Luma only, a grayscale JPEG
+    Gray,
+    /// Chroma halved vertically
+    S440,
+    /// Chroma quartered horizontally
+    S411,
+}
+
+impl ChromaSubsampling {
+    /// TurboJPEG TJSAMP_* value
+    fn native(self) -> i32 {
+        match self {
+            Self::S444 => 0,
+            Self::S422 => 1,
+            Self::S420 => 2,
+            Self::Gray => 3,
+            Self::S440 => 4,
+            Self::S411 => 5,
+        }
+    }
+}
+
+/// Forward DCT used by the JPEG encoder
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+pub enum DctMethod {
+    /// Fast integer DCT, slightly less accurate
+    #[default]
+    Fast,
+    /// Accurate integer DCT, slower
+    Accurate,
+}
+
+/// JPEG encoder settings
+///
+/// The default matches the historical output: quality 75, 4:4:4, baseline,
+/// fast DCT. `optimize_huffman` and `progressive` trade encode time for
+/// smaller files.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{ChromaSubsampling, JpegEncodeOptions, PreviewOptions};
+///
+/// let options = PreviewOptions {
+///     encode: JpegEncodeOptions {
+///         quality: 70,
+///         subsampling: ChromaSubsampling::S420,
+///         optimize_huffman: true,
+///         ..Default::default()
+///     },
+///     ..PreviewOptions::fit_long_edge(320)
+/// };
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct JpegEncodeOptions {
+    /// Quality from 1 to 100, higher is better (values above 100 are
+    /// clamped, 0 selects the default of 75)
+    pub quality: u8,
+    /// Chroma subsampling
+    pub subsampling: ChromaSubsampling,
+    /// Write a progressive JPEG; its Huffman tables are always optimized
+    pub progressive: bool,
+    /// Compute optimal Huffman tables for baseline JPEGs
+    pub optimize_huffman: bool,
+    /// Forward DCT
+    pub dct: DctMethod,
+}
+
+impl Default for JpegEncodeOptions {
+    fn default() -> Self {
+        Self {
+            quality: 75,
+            subsampling: ChromaSubsampling::S444,
+            progressive: false,
+            optimize_huffman: false,
+            dct: DctMethod::Fast,
+        }
+    }
+}
+
+/// Size of one level of a preview pyramid
+///
+/// The bounds have the same meaning as the output size fields of
+/// [`PreviewOptions`]; at least one must be non-zero.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewLevel, PreviewOptions, convert_raw_bytes_to_pyramid};
+///
+/// let bytes = std::fs::read("photo.cr2").expect("read RAW file");
+/// let levels = [2048, 1024, 256].map(PreviewLevel::fit_long_edge);
+/// let (pyramid, exif) =
+///     convert_raw_bytes_to_pyramid(&bytes, &levels, &PreviewOptions::default()).expect("convert");
+/// for level in &pyramid {
+///     println!("{}x{}: {} bytes", level.width, level.height, level.jpeg.len());
+/// }
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+pub struct PreviewLevel {
+    /// Maximum long edge in pixels (0 = unbounded)
+    pub max_edge: u32,
+    /// Maximum width in pixels (0 = unbounded)
+    pub target_width: u32,
+    /// Maximum height in pixels (0 = unbounded)
+    pub target_height: u32,
+}
+
+impl PreviewLevel {
+    /// Creates a level whose long edge is at most `max_edge` pixels
+    pub fn fit_long_edge(max_edge: u32) -> Self {
+        Self {
+            max_edge,
+            ..Default::default()
+        }
+    }
+
+    /// Creates a level that fits in a `width` x `height` box
+    pub fn fit_box(width: u32, height: u32) -> Self {
+        Self {
+            target_width: width,
+            target_height: height,
+            ..Default::default()
+        }
+    }
+
+    pub(crate) fn is_bounded(&self) -> bool {
+        self.max_edge > 0 || self.target_width > 0 || self.target_height > 0
+    }
+}
+
+/// One encoded level of a preview pyramid
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PyramidLevel {
+    /// JPEG bytes
+    pub jpeg: Vec<u8>,
+    /// Width in pixels
+    pub width: u32,
+    /// Height in pixels
+    pub height: u32,
+}
+
+/// Stage of a progressive conversion, in delivery order
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, ProgressiveStages, convert_raw_progressive};
+///
+/// let options = PreviewOptions::fit_long_edge(2048);
+/// convert_raw_progressive("photo.arw", &options, ProgressiveStages::all(), |frame| {
+///     println!("{:?}: {}x{}, {} bytes", frame.stage, frame.width, frame.height, frame.jpeg.len());
+///     true // Keep refining
+/// })
+/// .expect("convert");
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum PreviewStage {
+    /// The smallest embedded JPEG, or the embedded preview decoded at 1/8
+    /// scale when it is the only one; delivered as-is, without resizing
+    Thumbnail,
+    /// The embedded preview, scaled down to the output size of the options
+    /// and skipped when it is smaller than `min_preview_size`
+    Preview,
+    /// The RAW data developed with the options, like
+    /// [`convert_raw_to_jpeg_with_options`](crate::convert_raw_to_jpeg_with_options)
+    /// without `use_embedded_preview`
+    Render,
+}
+
+impl PreviewStage {
+    /// Native stage bit (PREVIEW_STAGE_* in libraw_wrapper.h)
+    pub(crate) fn native_bit(self) -> i32 {
+        match self {
+            Self::Thumbnail => 1,
+            Self::Preview => 2,
+            Self::Render => 4,
+        }
+    }
+
+    pub(crate) fn from_native(stage: i32) -> Option<Self> {
+        [Self::Thumbnail, Self::Preview, Self::Render]
+            .into_iter()
+            .find(|candidate| candidate.native_bit() == stage)
+    }
+}
+
+/// Stages a progressive conversion delivers
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct ProgressiveStages {
+    /// Deliver [`PreviewStage::Thumbnail`]
+    pub thumbnail: bool,
+    /// Deliver [`PreviewStage::Preview`]
+    pub preview: bool,
+    /// Deliver [`PreviewStage::Render`], which unpacks and demosaics the RAW
+    /// data and takes far longer than the embedded stages
+    pub render: bool,
+}
+
+impl Default for ProgressiveStages {
+    /// The two embedded stages, without the render
+    fn default() -> Self {
+        Self {
+            thumbnail: true,
+            preview: true,
+            render: false,
+        }
+    }
+}
+
+impl ProgressiveStages {
+    /// Every stage, ending with the render
+    pub fn all() -> Self {
+        Self {
+            render: true,
+            ..Default::default()
+        }
+    }
+
+    /// Native stage bits
+    pub(crate) fn native_bits(&self) -> i32 {
+        [
+            (self.thumbnail, PreviewStage::Thumbnail),
+            (self.preview, PreviewStage::Preview),
+            (self.render, PreviewStage::Render),
+        ]
+        .into_iter()
+        .filter(|(enabled, _)| *enabled)
+        .fold(0, |bits, (_, stage)| bits | stage.native_bit())
+    }
+}
+
+/// One stage delivered by a progressive conversion
+#[derive(Debug)]
+pub struct PreviewFrame<'a> {
+    /// Which stage this is
+    pub stage: PreviewStage,
+    /// JPEG bytes, borrowed from the native side for the duration of the
+    /// callback
+    pub jpeg: &'a [u8],
+    /// Width in pixels
+    pub width: u32,
+    /// Height in pixels
+    pub height: u32,
+    /// Metadata of the input; the output size is this stage's
+    pub exif: &'a ExifInfo,
+}
+
+/// Returns `true` if the crate was built with the `openmp` feature, i.e.
+/// [`PreviewOptions::num_threads`] controls parallel RAW processing
+pub fn parallel_processing_available() -> bool {
+    cfg!(raw_preview_rs_openmp)
+}
+
+/// Returns `true` if the native libraries were built with SIMD, i.e. the
+/// `simd` feature is on and `RAW_PREVIEW_RS_DISABLE_SIMD` was not set
+pub fn simd_enabled() -> bool {
+    cfg!(raw_preview_rs_simd)
+}
+
+/// Names of the native image decoders the crate was built with, from the
+/// `spng` (PNG), `webp` and `tiff` features
+///
+/// Formats without one, and files their decoder rejects, are decoded by
+/// stb_image.
+pub fn image_decoders() -> Vec<&'static str> {
+    [
+        ("spng", cfg!(feature = "spng")),
+        ("libwebp", cfg!(feature = "webp")),
+        ("libtiff", cfg!(feature = "tiff")),
+    ]
+    .into_iter()
+    .filter_map(|(name, enabled)| enabled.then_some(name))
+    .collect()
+}
+
+/// C-compatible preview options for interfacing with the native wrappers
+/// This structure must match the PreviewOptions struct in preview_options.h
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct NativePreviewOptions {
+    pub use_embedded_preview: i32,
+    pub min_preview_size: i32,
+    pub num_threads: i32,
+    pub max_edge: i32,
+    pub target_width: i32,
+    pub target_height: i32,
+    pub encode: NativeJpegEncodeOptions,
+    pub jpeg_passthrough: i32,
+    pub draft_demosaic: i32,
+    pub profile: i32,
+    pub crop_to_fill: i32,
+}
+
+/// C-compatible JPEG encoder settings
+/// This structure must match the JpegEncodeOptions struct in preview_options.h
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct NativeJpegEncodeOptions {
+    pub quality: i32,
+    pub subsampling: i32,
+    pub progressive: i32,
+    pub optimize_huffman: i32,
+    pub accurate_dct: i32,
+}
+
+impl From<&JpegEncodeOptions> for NativeJpegEncodeOptions {
+    fn from(encode: &JpegEncodeOptions) -> Self {
+        Self {
+            quality: encode.quality.min(100) as i32,
+            subsampling: encode.subsampling.native(),
+            progressive: encode.progressive as i32,
+            optimize_huffman: encode.optimize_huffman as i32,
+            accurate_dct: (encode.dct == DctMethod::Accurate) as i32,
+        }
+    }
+}
+
+impl From<&PreviewOptions> for NativePreviewOptions {
+    fn from(options: &PreviewOptions) -> Self {
+        Self {
+            use_embedded_preview: options.use_embedded_preview as i32,
+            min_preview_size: options.min_preview_size.min(i32::MAX as u32) as i32,
+            num_threads: options.num_threads.min(i32::MAX as u32) as i32,
+            max_edge: options.max_edge.min(i32::MAX as u32) as i32,
+            target_width: options.target_width.min(i32::MAX as u32) as i32,
+            target_height: options.target_height.min(i32::MAX as u32) as i32,
+            encode: NativeJpegEncodeOptions::from(&options.encode),
+            jpeg_passthrough: options.jpeg_passthrough.native(),
+            draft_demosaic: options.draft_demosaic as i32,
+            profile: options.profile.native(),
+            crop_to_fill: options.crop_to_fill as i32,
+        }
+    }
+}
+
+/// C-compatible pyramid level size
+/// This structure must match the PreviewLevel struct in preview_options.h
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct NativePreviewLevel {
+    pub max_edge: i32,
+    pub target_width: i32,
+    pub target_height: i32,
+}
+
+impl From<&PreviewLevel> for NativePreviewLevel {
+    fn from(level: &PreviewLevel) -> Self {
+        Self {
+            max_edge: level.max_edge.min(i32::MAX as u32) as i32,
+            target_width: level.target_width.min(i32::MAX as u32) as i32,
+            target_height: level.target_height.min(i32::MAX as u32) as i32,
+        }
+    }
+}
+
+/// C-compatible encoded pyramid level
+/// This structure must match the PreviewLevelOutput struct in preview_options.h
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct NativePreviewLevelOutput {
+    pub data: *mut u8,
+    pub size: usize,
+    pub width: i32,
+    pub height: i32,
+}
+
+impl NativePreviewLevelOutput {
+    pub(crate) fn empty() -> Self {
+        Self {
+            data: std::ptr::null_mut(),
+            size: 0,
+            width: 0,
+            height: 0,
+        }
+    }
+}
+
+/// Validates pyramid levels and converts them for the native wrappers
+pub(crate) fn native_pyramid_levels(
+    levels: &[PreviewLevel],
+) -> Result<Vec<NativePreviewLevel>, String> {
+    if levels.is_empty() {
+        return Err("At least one pyramid level is required".to_string());
+    }
+    if levels.len() > i32::MAX as usize {
+        return Err("Too many pyramid levels".to_string());
+    }
+    if let Some(index) = levels.iter().position(|level| !level.is_bounded()) {
+        return Err(format!(
+            "Pyramid level {} needs max_edge, target_width or target_height",
+            index
+        ));
+    }
+    Ok(levels.iter().map(NativePreviewLevel::from).collect())
+}
+
+/// Allocator passed to the native `*_into` functions (`PreviewAllocFn`)
+pub(crate) type NativeAllocFn =
+    unsafe extern "C" fn(user_data: *mut std::ffi::c_void, size: usize) -> *mut u8;
+
+/// Native allocator handing out the spare capacity of a `Vec<u8>`
+///
+/// `user_data` must point to the `Vec<u8>` receiving the JPEG. The vector is
+/// cleared and grown to `size` bytes of capacity, so TurboJPEG encodes
+/// straight into memory Rust owns; [`finish_vec_output`] sets the length.
+pub(crate) unsafe extern "C" fn vec_output_alloc(
+    user_data: *mut std::ffi::c_void,
+    size: usize,
+) -> *mut u8 {
+    let out = unsafe { &mut *(user_data as *mut Vec<u8>) };
+    out.clear();
+    // Never panic across the FFI boundary: report failure with a null pointer
+    if out.try_reserve_exact(size).is_err() {
+        return std::ptr::null_mut();
+    }
+    out.as_mut_ptr()
+}
+
+/// Sets the length of a vector filled through [`vec_output_alloc`]
+///
+/// # Safety
+/// The native call must have succeeded and written `size` bytes into `out`.
+pub(crate) unsafe fn finish_vec_output(out: &mut Vec<u8>, size: usize) -> Result<(), String> {
+    if size == 0 || size > out.capacity() {
+        out.clear();
+        return Err("No JPEG data returned".to_string());
+    }
+    unsafe { out.set_len(size) };
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_encode_options_conversion() {
+        let native = NativePreviewOptions::from(&PreviewOptions::default());
+        assert_eq!(native.encode.quality, 75);
+        assert_eq!(native.encode.subsampling, 0);
+        assert_eq!(native.encode.progressive, 0);
+        assert_eq!(native.encode.accurate_dct, 0);
+
+        let encode = JpegEncodeOptions {
+            quality: 200,
+            subsampling: ChromaSubsampling::S420,
+            progressive: true,
+            optimize_huffman: true,
+            dct: DctMethod::Accurate,
+        };
+        let native = NativeJpegEncodeOptions::from(&encode);
+        assert_eq!(native.quality, 100);
+        assert_eq!(native.subsampling, 2);
+        assert_eq!(native.progressive, 1);
+        assert_eq!(native.optimize_huffman, 1);
+        assert_eq!(native.accurate_dct, 1);
+    }
+
+    #[test]
+    fn test_vec_output_alloc() {
+        let mut out = vec![1u8, 2, 3];
+        let ptr = unsafe { vec_output_alloc(&mut out as *mut Vec<u8> as *mut _, 64) };
+        assert!(!ptr.is_null());
+        assert!(out.is_empty());
+        assert!(out.capacity() >= 64);
+        unsafe { ptr.write_bytes(0xAB, 10) };
+        unsafe { finish_vec_output(&mut out, 10) }.unwrap();
+        assert_eq!(out, vec![0xAB; 10]);
+        assert!(unsafe { finish_vec_output(&mut out, 1 << 20) }.is_err());
+        assert!(out.is_empty());
+    }
+
+    #[test]
+    fn test_default_disables_embedded_preview() {
+        let native = NativePreviewOptions::from(&PreviewOptions::default());
+        assert_eq!(native.use_embedded_preview, 0);
+        assert_eq!(native.min_preview_size, 0);
+    }
+
+    #[test]
+    fn test_embedded_preview_options() {
+        let native = NativePreviewOptions::from(&PreviewOptions::embedded_preview(1620));
+        assert_eq!(native.use_embedded_preview, 1);
+        assert_eq!(native.min_preview_size, 1620);
+        assert_eq!(native.num_threads, 0);
+    }
+
+    #[test]
+    fn test_num_threads_conversion() {
+        let options = PreviewOptions {
+            num_threads: 16,
+            ..Default::default()
+        };
+        assert_eq!(NativePreviewOptions::from(&options).num_threads, 16);
+    }
+
+    #[test]
+    fn test_target_size_conversion() {
+        let native = NativePreviewOptions::from(&PreviewOptions::default());
+        assert_eq!(
+            (native.max_edge, native.target_width, native.target_height),
+            (0, 0, 0)
+        );
+
+        let native = NativePreviewOptions::from(&PreviewOptions::fit_long_edge(2048));
+        assert_eq!(native.max_edge, 2048);
+
+        let native = NativePreviewOptions::from(&PreviewOptions::fit_box(256, u32::MAX));
+        assert_eq!(native.target_width, 256);
+        assert_eq!(native.target_height, i32::MAX);
+    }
+
+    #[test]
+    fn test_jpeg_passthrough_conversion() {
+        let native = NativePreviewOptions::from(&PreviewOptions::default());
+        assert_eq!(native.jpeg_passthrough, 0);
+
+        for (mode, value) in [
+            (JpegPassthrough::Original, 1),
+            (JpegPassthrough::StripMetadata, 2),
+        ] {
+            let options = PreviewOptions {
+                jpeg_passthrough: mode,
+                ..Default::default()
+            };
+            assert_eq!(NativePreviewOptions::from(&options).jpeg_passthrough, value);
+        }
+    }
+
+    #[test]
+    fn test_draft_demosaic_conversion() {
+        assert_eq!(
+            NativePreviewOptions::from(&PreviewOptions::default()).draft_demosaic,
+            0
+        );
+
+        let options = PreviewOptions {
+            draft_demosaic: true,
+            ..PreviewOptions::fit_long_edge(512)
+        };
+        assert_eq!(NativePreviewOptions::from(&options).draft_demosaic, 1);
+    }
+
+    #[test]
+    fn test_fill_box() {
+        let native = NativePreviewOptions::from(&PreviewOptions::fill_box(256, 256));
+        assert_eq!(
+            (
+                native.target_width,
+                native.target_height,
+                native.crop_to_fill
+            ),
+            (256, 256, 1)
+        );
+        assert_eq!(
+            NativePreviewOptions::from(&PreviewOptions::fit_box(256, 256)).crop_to_fill,
+            0
+        );
+    }
+
+    #[test]
+    fn test_image_decoders() {
+        let decoders = image_decoders();
+        assert_eq!(decoders.contains(&"spng"), cfg!(feature = "spng"));
+        assert_eq!(decoders.contains(&"libtiff"), cfg!(feature = "tiff"));
+    }
+
+    #[test]
+    fn test_profile_conversion() {
+        assert_eq!(
+            NativePreviewOptions::from(&PreviewOptions::default()).profile,
+            0
+        );
+
+        for (profile, value) in [
+            (PreviewProfile::Balanced, 0),
+            (PreviewProfile::Fast, 1),
+            (PreviewProfile::Quality, 2),
+        ] {
+            let options = PreviewOptions {
+                profile,
+                ..Default::default()
+            };
+            assert_eq!(NativePreviewOptions::from(&options).profile, value);
+        }
+    }
+
+    #[test]
+    fn test_native_pyramid_levels() {
+        assert!(native_pyramid_levels(&[]).is_err());
+        assert!(native_pyramid_levels(&[PreviewLevel::default()]).is_err());
+
+        let levels = [
+            PreviewLevel::fit_long_edge(1024),
+            PreviewLevel::fit_box(256, 256),
+        ];
+        let native = native_pyramid_levels(&levels).unwrap();
+        assert_eq!(native.len(), 2);
+        assert_eq!(native[0].max_edge, 1024);
+        assert_eq!(
+            (native[1].target_width, native[1].target_height),
+            (256, 256)
+        );
+    }
+
+    #[test]
+    fn test_progressive_stage_bits() {
+        assert_eq!(ProgressiveStages::default().native_bits(), 3);
+        assert_eq!(ProgressiveStages::all().native_bits(), 7);
+        for stage in [
+            PreviewStage::Thumbnail,
+            PreviewStage::Preview,
+            PreviewStage::Render,
+        ] {
+            assert_eq!(PreviewStage::from_native(stage.native_bit()), Some(stage));
+        }
+        assert_eq!(PreviewStage::from_native(3), None);
+    }
+}
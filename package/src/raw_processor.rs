@@ -4,17 +4,20 @@
 /// using the LibRaw library through a C++ wrapper, with comprehensive
 /// EXIF data extraction.
 use crate::exif_data::{ExifData, ExifInfo};
-use std::ffi::{CStr, CString};
+use crate::options::{
+    NativeAllocFn, NativePreviewLevel, NativePreviewLevelOutput, NativePreviewOptions,
+    PreviewFrame, PreviewLevel, PreviewOptions, PreviewStage, ProgressiveStages, PyramidLevel,
+    finish_vec_output, native_pyramid_levels, vec_output_alloc,
+};
+use std::any::Any;
+use std::ffi::{CStr, CString, c_void};
+use std::io::{self, Read, Seek, SeekFrom};
 use std::os::raw::c_char;
+use std::panic::{self, AssertUnwindSafe};
 use std::ptr;
 
 // Foreign function interface to our C++ wrapper
 unsafe extern "C" {
-    fn process_raw_to_jpeg(
-        input_path: *const c_char,
-        output_path: *const c_char,
-        exif_data: *mut ExifData,
-    ) -> i32;
     #[link_name = "process_raw_bytes_to_jpeg"]
     fn process_raw_bytes_to_jpeg_c(
         data: *const u8,
@@ -26,19 +29,346 @@ unsafe extern "C" {
     // free_buffer is provided by the jpeg wrapper and frees buffers allocated by the native side
     fn free_buffer(buffer: *mut u8);
 
-    #[link_name = "process_raw_bytes_to_jpeg_buffer"]
-    fn process_raw_bytes_to_jpeg_buffer_c(
+    fn process_raw_to_jpeg_with_options(
+        input_path: *const c_char,
+        output_path: *const c_char,
+        options: *const NativePreviewOptions,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    fn process_raw_bytes_to_jpeg_into(
         data: *const u8,
         size: usize,
-        out_buf: *mut *mut u8,
+        options: *const NativePreviewOptions,
+        alloc: NativeAllocFn,
+        user_data: *mut std::ffi::c_void,
         out_size: *mut usize,
         exif_data: *mut ExifData,
     ) -> i32;
+
+    fn process_raw_bytes_to_pyramid(
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        levels: *const NativePreviewLevel,
+        level_count: i32,
+        outputs: *mut NativePreviewLevelOutput,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    fn process_raw_stream_to_jpeg_into(
+        read: NativeReadFn,
+        read_user_data: *mut c_void,
+        size: u64,
+        options: *const NativePreviewOptions,
+        alloc: NativeAllocFn,
+        user_data: *mut c_void,
+        out_size: *mut usize,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    fn process_raw_progressive(
+        input_path: *const c_char,
+        options: *const NativePreviewOptions,
+        stages: i32,
+        callback: NativeStageFn,
+        user_data: *mut c_void,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    fn process_raw_bytes_progressive(
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        stages: i32,
+        callback: NativeStageFn,
+        user_data: *mut c_void,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    #[link_name = "extract_raw_metadata"]
+    fn extract_raw_metadata_c(input_path: *const c_char, exif_data: *mut ExifData) -> i32;
+    #[link_name = "extract_raw_metadata_from_bytes"]
+    fn extract_raw_metadata_from_bytes_c(
+        data: *const u8,
+        size: usize,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    #[link_name = "extract_raw_metadata_from_stream"]
+    fn extract_raw_metadata_from_stream_c(
+        read: NativeReadFn,
+        read_user_data: *mut c_void,
+        size: u64,
+        exif_data: *mut ExifData,
+    ) -> i32;
+
+    fn raw_preview_context_create() -> *mut NativeRawPreviewContext;
+    fn raw_preview_context_destroy(ctx: *mut NativeRawPreviewContext);
+    fn raw_preview_context_last_error(ctx: *const NativeRawPreviewContext) -> *const c_char;
+    fn raw_preview_context_process_file(
+        ctx: *mut NativeRawPreviewContext,
+        input_path: *const c_char,
+        output_path: *const c_char,
+        options: *const NativePreviewOptions,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_process_bytes(
+        ctx: *mut NativeRawPreviewContext,
+        data: *const u8,
+        size: usize,
+        output_path: *const c_char,
+        options: *const NativePreviewOptions,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_process_bytes_into(
+        ctx: *mut NativeRawPreviewContext,
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        alloc: NativeAllocFn,
+        user_data: *mut std::ffi::c_void,
+        out_size: *mut usize,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_extract_metadata(
+        ctx: *mut NativeRawPreviewContext,
+        input_path: *const c_char,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_extract_metadata_from_bytes(
+        ctx: *mut NativeRawPreviewContext,
+        data: *const u8,
+        size: usize,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_process_stream_into(
+        ctx: *mut NativeRawPreviewContext,
+        read: NativeReadFn,
+        read_user_data: *mut c_void,
+        size: u64,
+        options: *const NativePreviewOptions,
+        alloc: NativeAllocFn,
+        user_data: *mut c_void,
+        out_size: *mut usize,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_extract_metadata_from_stream(
+        ctx: *mut NativeRawPreviewContext,
+        read: NativeReadFn,
+        read_user_data: *mut c_void,
+        size: u64,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_process_bytes_to_pyramid(
+        ctx: *mut NativeRawPreviewContext,
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        levels: *const NativePreviewLevel,
+        level_count: i32,
+        outputs: *mut NativePreviewLevelOutput,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_process_file_progressive(
+        ctx: *mut NativeRawPreviewContext,
+        input_path: *const c_char,
+        options: *const NativePreviewOptions,
+        stages: i32,
+        callback: NativeStageFn,
+        user_data: *mut c_void,
+        exif_data: *mut ExifData,
+    ) -> i32;
+    fn raw_preview_context_process_bytes_progressive(
+        ctx: *mut NativeRawPreviewContext,
+        data: *const u8,
+        size: usize,
+        options: *const NativePreviewOptions,
+        stages: i32,
+        callback: NativeStageFn,
+        user_data: *mut c_void,
+        exif_data: *mut ExifData,
+    ) -> i32;
+}
+
+/// Opaque native processing context (RawPreviewContext in libraw_wrapper.h)
+#[repr(C)]
+struct NativeRawPreviewContext {
+    _private: [u8; 0],
 }
 
 /// Success code returned by the LibRaw wrapper
 const RW_SUCCESS: i32 = 0;
 
+/// Reader callback of the stream entry points (PreviewReadFn in libraw_wrapper.h)
+type NativeReadFn =
+    unsafe extern "C" fn(user_data: *mut c_void, offset: u64, buf: *mut u8, size: usize) -> i64;
+
+/// Stage callback of the progressive entry points (PreviewStageFn in libraw_wrapper.h)
+type NativeStageFn = unsafe extern "C" fn(
+    user_data: *mut c_void,
+    stage: i32,
+    jpeg: *const u8,
+    size: usize,
+    width: i32,
+    height: i32,
+    exif_data: *const ExifData,
+) -> i32;
+
+/// The Rust callback of a progressive conversion, driven by [`stage_sink_deliver`]
+struct StageSink<'a> {
+    callback: &'a mut dyn FnMut(PreviewFrame<'_>) -> bool,
+    /// Payload of a panic in the callback, resumed once the native call returns
+    panic: Option<Box<dyn Any + Send>>,
+}
+
+impl StageSink<'_> {
+    fn user_data(&mut self) -> *mut c_void {
+        self as *mut Self as *mut c_void
+    }
+
+    /// Turns the result of a native progressive call into the crate's result
+    fn finish(
+        self,
+        ret: i32,
+        exif_data: &ExifData,
+        error: impl FnOnce() -> String,
+    ) -> Result<ExifInfo, String> {
+        if let Some(payload) = self.panic {
+            panic::resume_unwind(payload);
+        }
+        if ret == RW_SUCCESS {
+            Ok(exif_info_from(exif_data))
+        } else {
+            Err(format!("LibRaw error {}: {}", ret, error()))
+        }
+    }
+}
+
+/// PreviewStageFn forwarding to a [`StageSink`]; a panic stops the
+/// remaining stages and is resumed by [`StageSink::finish`]
+unsafe extern "C" fn stage_sink_deliver(
+    user_data: *mut c_void,
+    stage: i32,
+    jpeg: *const u8,
+    size: usize,
+    width: i32,
+    height: i32,
+    exif_data: *const ExifData,
+) -> i32 {
+    let sink = unsafe { &mut *(user_data as *mut StageSink) };
+    let (Some(stage), false, false) = (
+        PreviewStage::from_native(stage),
+        jpeg.is_null(),
+        exif_data.is_null(),
+    ) else {
+        return 0;
+    };
+    let jpeg = unsafe { std::slice::from_raw_parts(jpeg, size) };
+    let exif = exif_info_from(unsafe { &*exif_data });
+    let frame = PreviewFrame {
+        stage,
+        jpeg,
+        width: width.max(0) as u32,
+        height: height.max(0) as u32,
+        exif: &exif,
+    };
+    match panic::catch_unwind(AssertUnwindSafe(|| (sink.callback)(frame))) {
+        Ok(true) => 0,
+        Ok(false) => 1,
+        Err(payload) => {
+            sink.panic = Some(payload);
+            1
+        }
+    }
+}
+
+/// A `Read + Seek` input served to the native stream entry points
+///
+/// LibRaw asks for ranges by offset; the reader is only seeked when a
+/// request does not continue where the previous one stopped.
+struct StreamSource<R> {
+    reader: R,
+    position: Option<u64>,
+    error: Option<String>,
+}
+
+impl<R: Read + Seek> StreamSource<R> {
+    /// Wraps `reader` and returns its size in bytes
+    fn new(mut reader: R) -> Result<(Self, u64), String> {
+        let size = reader
+            .seek(SeekFrom::End(0))
+            .map_err(|e| format!("Failed to seek input stream: {}", e))?;
+        let source = Self {
+            reader,
+            position: Some(size),
+            error: None,
+        };
+        Ok((source, size))
+    }
+
+    /// Fills `buf` from `offset`, short only at the end of the input
+    fn read_at(&mut self, offset: u64, buf: &mut [u8]) -> io::Result<usize> {
+        if self.position != Some(offset) {
+            self.position = None;
+            self.reader.seek(SeekFrom::Start(offset))?;
+        }
+        let mut filled = 0;
+        while filled < buf.len() {
+            match self.reader.read(&mut buf[filled..]) {
+                Ok(0) => break,
+                Ok(n) => filled += n,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(e) => {
+                    self.position = None;
+                    return Err(e);
+                }
+            }
+        }
+        self.position = Some(offset + filled as u64);
+        Ok(filled)
+    }
+
+    fn user_data(&mut self) -> *mut c_void {
+        self as *mut Self as *mut c_void
+    }
+
+    /// Formats a failed native call, preferring the reader's own error
+    fn error_message(&self, ret: i32, native_error: String) -> String {
+        match &self.error {
+            Some(read_error) => format!("LibRaw error {}: {}: {}", ret, native_error, read_error),
+            None => format!("LibRaw error {}: {}", ret, native_error),
+        }
+    }
+}
+
+/// PreviewReadFn forwarding to a [`StreamSource`]; I/O errors and panics
+/// are recorded in the source and reported to the native side as -1
+unsafe extern "C" fn stream_source_read<R: Read + Seek>(
+    user_data: *mut c_void,
+    offset: u64,
+    buf: *mut u8,
+    size: usize,
+) -> i64 {
+    let source = unsafe { &mut *(user_data as *mut StreamSource<R>) };
+    if size == 0 {
+        return 0;
+    }
+    let buf = unsafe { std::slice::from_raw_parts_mut(buf, size) };
+    match panic::catch_unwind(AssertUnwindSafe(|| source.read_at(offset, buf))) {
+        Ok(Ok(n)) => n as i64,
+        Ok(Err(e)) => {
+            source.error = Some(e.to_string());
+            -1
+        }
+        Err(_) => {
+            source.position = None;
+            source.error = Some("input reader panicked".to_string());
+            -1
+        }
+    }
+}
+
 /// Helper function to safely convert C char arrays to Rust strings
 fn safe_string_from_array(arr: &[c_char]) -> String {
     // Find the null terminator
@@ -58,6 +388,103 @@ fn safe_string_from_ptr(ptr: *const c_char) -> String {
     }
 }
 
+/// Creates a zero-initialised EXIF data structure for LibRaw to populate
+fn empty_exif_data() -> ExifData {
+    ExifData {
+        camera_make: [0; 64],
+        camera_model: [0; 64],
+        software: ptr::null(),
+        iso_speed: 0,
+        shutter: 0.0,
+        aperture: 0.0,
+        focal_length: 0.0,
+        raw_width: 0,
+        raw_height: 0,
+        output_width: 0,
+        output_height: 0,
+        colors: 0,
+        color_filter: 0,
+        cam_mul: [0.0; 4],
+        date_taken: ptr::null(),
+        lens: ptr::null(),
+        max_aperture: 0.0,
+        focal_length_35mm: 0,
+        description: ptr::null(),
+        artist: ptr::null(),
+    }
+}
+
+/// Extracts EXIF data from the C structure populated by LibRaw
+fn exif_info_from(exif_data: &ExifData) -> ExifInfo {
+    ExifInfo {
+        camera_make: safe_string_from_array(&exif_data.camera_make),
+        camera_model: safe_string_from_array(&exif_data.camera_model),
+        software: safe_string_from_ptr(exif_data.software),
+        iso_speed: exif_data.iso_speed,
+        shutter: exif_data.shutter,
+        aperture: exif_data.aperture,
+        focal_length: exif_data.focal_length,
+        raw_width: exif_data.raw_width,
+        raw_height: exif_data.raw_height,
+        output_width: exif_data.output_width,
+        output_height: exif_data.output_height,
+        colors: exif_data.colors,
+        color_filter: exif_data.color_filter,
+        cam_mul: exif_data.cam_mul,
+        date_taken: safe_string_from_ptr(exif_data.date_taken),
+        lens: safe_string_from_ptr(exif_data.lens),
+        max_aperture: exif_data.max_aperture,
+        focal_length_35mm: exif_data.focal_length_35mm,
+        description: safe_string_from_ptr(exif_data.description),
+        artist: safe_string_from_ptr(exif_data.artist),
+    }
+}
+
+/// Retrieves the detailed error message of the last failed LibRaw wrapper call
+fn last_error_message(fallback: &str) -> String {
+    error_message_from_ptr(unsafe { get_last_error() }, fallback)
+}
+
+/// Converts a native error message to a Rust string
+fn error_message_from_ptr(error_ptr: *const c_char, fallback: &str) -> String {
+    if error_ptr.is_null() {
+        fallback.to_string()
+    } else {
+        unsafe { CStr::from_ptr(error_ptr).to_string_lossy().into_owned() }
+    }
+}
+
+/// Copies a JPEG buffer returned by the native side into a Vec and frees it
+fn take_native_buffer(out_ptr: *mut u8, out_size: usize) -> Result<Vec<u8>, String> {
+    if out_ptr.is_null() || out_size == 0 {
+        return Err("No JPEG data returned".to_string());
+    }
+
+    let slice = unsafe { std::slice::from_raw_parts(out_ptr, out_size) };
+    let jpeg_vec = slice.to_vec();
+
+    // Free the native buffer (allocated from the buffer pool) using provided free_buffer
+    unsafe { free_buffer(out_ptr) };
+
+    Ok(jpeg_vec)
+}
+
+/// Copies the levels of a pyramid returned by the native side and frees them
+fn take_native_pyramid(outputs: &[NativePreviewLevelOutput]) -> Result<Vec<PyramidLevel>, String> {
+    // Take every buffer, even after a failure, so none of them leaks
+    let levels: Vec<Result<PyramidLevel, String>> = outputs
+        .iter()
+        .map(|output| {
+            take_native_buffer(output.data, output.size).map(|jpeg| PyramidLevel {
+                jpeg,
+                width: output.width.max(0) as u32,
+                height: output.height.max(0) as u32,
+            })
+        })
+        .collect();
+    levels.into_iter().collect()
+}
+
 /// Converts a RAW image file to JPEG format and extracts comprehensive EXIF data
 ///
 /// This function uses LibRaw to process RAW files from various camera manufacturers,
@@ -95,6 +522,31 @@ fn safe_string_from_ptr(ptr: *const c_char) -> String {
 /// - Pentax: PEF
 /// - And many more (see file_detector module for complete list)
 pub fn convert_raw_to_jpeg(input_path: &str, output_path: &str) -> Result<ExifInfo, String> {
+    convert_raw_to_jpeg_with_options(input_path, output_path, &PreviewOptions::default())
+}
+
+/// Converts a RAW image file to JPEG format using the given preview options
+///
+/// Behaves like [`convert_raw_to_jpeg`], but `options` can request the
+/// embedded preview fast path, which returns the camera-generated JPEG
+/// without demosaicing when it is at least `min_preview_size` pixels on its
+/// long edge.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{convert_raw_to_jpeg_with_options, PreviewOptions};
+///
+/// let options = PreviewOptions::embedded_preview(1620);
+/// match convert_raw_to_jpeg_with_options("photo.nef", "preview.jpg", &options) {
+///     Ok(exif) => println!("Preview: {}x{}", exif.output_width, exif.output_height),
+///     Err(e) => eprintln!("Conversion failed: {}", e),
+/// }
+/// ```
+pub fn convert_raw_to_jpeg_with_options(
+    input_path: &str,
+    output_path: &str,
+    options: &PreviewOptions,
+) -> Result<ExifInfo, String> {
     // Validate and convert input paths to C strings
     let input_cstring = CString::new(input_path)
         .map_err(|e| format!("Invalid input path '{}': {}", input_path, e))?;
@@ -102,103 +554,35 @@ pub fn convert_raw_to_jpeg(input_path: &str, output_path: &str) -> Result<ExifIn
         .map_err(|e| format!("Invalid output path '{}': {}", output_path, e))?;
 
     // Initialize EXIF data structure for LibRaw to populate
-    let mut exif_data = ExifData {
-        camera_make: [0; 64],
-        camera_model: [0; 64],
-        software: ptr::null(),
-        iso_speed: 0,
-        shutter: 0.0,
-        aperture: 0.0,
-        focal_length: 0.0,
-        raw_width: 0,
-        raw_height: 0,
-        output_width: 0,
-        output_height: 0,
-        colors: 0,
-        color_filter: 0,
-        cam_mul: [0.0; 4],
-        date_taken: ptr::null(),
-        lens: ptr::null(),
-        max_aperture: 0.0,
-        focal_length_35mm: 0,
-        description: ptr::null(),
-        artist: ptr::null(),
-    };
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
 
     // Call the C++ LibRaw wrapper function
     let result = unsafe {
-        process_raw_to_jpeg(
+        process_raw_to_jpeg_with_options(
             input_cstring.as_ptr(),
             output_cstring.as_ptr(),
+            &native_options,
             &mut exif_data,
         )
     };
 
     if result == RW_SUCCESS {
         // Successfully processed - extract EXIF data from the C structure
-        let exif_info = ExifInfo {
-            camera_make: safe_string_from_array(&exif_data.camera_make),
-            camera_model: safe_string_from_array(&exif_data.camera_model),
-            software: safe_string_from_ptr(exif_data.software),
-            iso_speed: exif_data.iso_speed,
-            shutter: exif_data.shutter,
-            aperture: exif_data.aperture,
-            focal_length: exif_data.focal_length,
-            raw_width: exif_data.raw_width,
-            raw_height: exif_data.raw_height,
-            output_width: exif_data.output_width,
-            output_height: exif_data.output_height,
-            colors: exif_data.colors,
-            color_filter: exif_data.color_filter,
-            cam_mul: exif_data.cam_mul,
-            date_taken: safe_string_from_ptr(exif_data.date_taken),
-            lens: safe_string_from_ptr(exif_data.lens),
-            max_aperture: exif_data.max_aperture,
-            focal_length_35mm: exif_data.focal_length_35mm,
-            description: safe_string_from_ptr(exif_data.description),
-            artist: safe_string_from_ptr(exif_data.artist),
-        };
-        Ok(exif_info)
+        Ok(exif_info_from(&exif_data))
     } else {
         // Processing failed - retrieve detailed error message from C++ wrapper
-        let error_msg = unsafe {
-            let error_ptr = get_last_error();
-            if !error_ptr.is_null() {
-                CStr::from_ptr(error_ptr).to_string_lossy().into_owned()
-            } else {
-                "Unknown LibRaw error".to_string()
-            }
-        };
+        let error_msg = last_error_message("Unknown LibRaw error");
         Err(format!("LibRaw Error {}: {}", result, error_msg))
     }
 }
+
 /// Accept RAW data as bytes and convert it to JPEG in-memory via the native FFI.
 /// The resulting JPEG preview is written to the provided `output_path`.
 pub fn convert_raw_bytes_to_jpeg(bytes: &[u8], output_path: &str) -> Result<ExifInfo, String> {
     let c_output = CString::new(output_path).map_err(|_| "Invalid output path")?;
 
-    let mut exif_data = ExifData {
-        camera_make: [0; 64],
-        camera_model: [0; 64],
-        software: ptr::null(),
-        iso_speed: 0,
-        shutter: 0.0,
-        aperture: 0.0,
-        focal_length: 0.0,
-        raw_width: 0,
-        raw_height: 0,
-        output_width: 0,
-        output_height: 0,
-        colors: 0,
-        color_filter: 0,
-        cam_mul: [0.0; 4],
-        date_taken: ptr::null(),
-        lens: ptr::null(),
-        max_aperture: 0.0,
-        focal_length_35mm: 0,
-        description: ptr::null(),
-        artist: ptr::null(),
-    };
+    let mut exif_data = empty_exif_data();
 
     let ret = unsafe {
         process_raw_bytes_to_jpeg_c(
@@ -209,127 +593,716 @@ pub fn convert_raw_bytes_to_jpeg(bytes: &[u8], output_path: &str) -> Result<Exif
         )
     };
     if ret == RW_SUCCESS {
-        let exif_info = ExifInfo {
-            camera_make: safe_string_from_array(&exif_data.camera_make),
-            camera_model: safe_string_from_array(&exif_data.camera_model),
-            software: safe_string_from_ptr(exif_data.software),
-            iso_speed: exif_data.iso_speed,
-            shutter: exif_data.shutter,
-            aperture: exif_data.aperture,
-            focal_length: exif_data.focal_length,
-            raw_width: exif_data.raw_width,
-            raw_height: exif_data.raw_height,
-            output_width: exif_data.output_width,
-            output_height: exif_data.output_height,
-            colors: exif_data.colors,
-            color_filter: exif_data.color_filter,
-            cam_mul: exif_data.cam_mul,
-            date_taken: safe_string_from_ptr(exif_data.date_taken),
-            lens: safe_string_from_ptr(exif_data.lens),
-            max_aperture: exif_data.max_aperture,
-            focal_length_35mm: exif_data.focal_length_35mm,
-            description: safe_string_from_ptr(exif_data.description),
-            artist: safe_string_from_ptr(exif_data.artist),
-        };
-        Ok(exif_info)
+        Ok(exif_info_from(&exif_data))
     } else {
-        let error_msg = unsafe {
-            let ptr = get_last_error();
-            if ptr.is_null() {
-                "Unknown LibRaw error".to_string()
-            } else {
-                CStr::from_ptr(ptr).to_string_lossy().into_owned()
-            }
-        };
+        let error_msg = last_error_message("Unknown LibRaw error");
         Err(format!("LibRaw Error {}: {}", ret, error_msg))
     }
 }
 
 /// Convert RAW bytes to JPEG in-memory and return JPEG bytes + ExifInfo
 pub fn convert_raw_bytes_to_vec(bytes: &[u8]) -> Result<(Vec<u8>, ExifInfo), String> {
-    let mut exif_data = ExifData {
-        camera_make: [0; 64],
-        camera_model: [0; 64],
-        software: ptr::null(),
-        iso_speed: 0,
-        shutter: 0.0,
-        aperture: 0.0,
-        focal_length: 0.0,
-        raw_width: 0,
-        raw_height: 0,
-        output_width: 0,
-        output_height: 0,
-        colors: 0,
-        color_filter: 0,
-        cam_mul: [0.0; 4],
-        date_taken: ptr::null(),
-        lens: ptr::null(),
-        max_aperture: 0.0,
-        focal_length_35mm: 0,
-        description: ptr::null(),
-        artist: ptr::null(),
+    convert_raw_bytes_to_vec_with_options(bytes, &PreviewOptions::default())
+}
+
+/// Convert RAW bytes to JPEG in-memory using the given preview options and
+/// return JPEG bytes + ExifInfo
+///
+/// With `PreviewOptions::embedded_preview`, the camera-generated JPEG is
+/// returned without demosaicing when it is large enough.
+pub fn convert_raw_bytes_to_vec_with_options(
+    bytes: &[u8],
+    options: &PreviewOptions,
+) -> Result<(Vec<u8>, ExifInfo), String> {
+    let mut jpeg_vec = Vec::new();
+    let exif = convert_raw_bytes_into(bytes, options, &mut jpeg_vec)?;
+    // The buffer was sized for the worst case; give the slack back
+    jpeg_vec.shrink_to_fit();
+    Ok((jpeg_vec, exif))
+}
+
+/// Convert RAW bytes to JPEG, encoding straight into `out`
+///
+/// TurboJPEG compresses directly into the vector's memory, so no
+/// intermediate JPEG buffer is allocated or copied. `out` is cleared first
+/// and its capacity is reused: passing the same vector for a series of
+/// conversions avoids reallocating it each time. Its capacity grows to
+/// TurboJPEG's worst-case size for the preview, which is larger than the
+/// JPEG finally written.
+///
+/// # Arguments
+/// * `bytes` - The RAW file contents
+/// * `options` - Preview generation options
+/// * `out` - Receives the JPEG bytes
+///
+/// # Returns
+/// * `Ok(ExifInfo)` - Conversion successful, returns extracted EXIF data
+/// * `Err(String)` - Conversion failed with error message
+pub fn convert_raw_bytes_into(
+    bytes: &[u8],
+    options: &PreviewOptions,
+    out: &mut Vec<u8>,
+) -> Result<ExifInfo, String> {
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
+    let mut out_size: usize = 0;
+    out.clear();
+
+    let ret = unsafe {
+        process_raw_bytes_to_jpeg_into(
+            bytes.as_ptr(),
+            bytes.len(),
+            &native_options,
+            vec_output_alloc,
+            out as *mut Vec<u8> as *mut std::ffi::c_void,
+            &mut out_size,
+            &mut exif_data,
+        )
     };
 
-    let mut out_ptr: *mut u8 = std::ptr::null_mut();
+    if ret != RW_SUCCESS {
+        out.clear();
+        let err = last_error_message("LibRaw unknown error");
+        return Err(format!("LibRaw error {}: {}", ret, err));
+    }
+
+    unsafe { finish_vec_output(out, out_size)? };
+    Ok(exif_info_from(&exif_data))
+}
+
+/// Reads the metadata of a RAW file without decoding it
+///
+/// Only the file headers are parsed: nothing is unpacked, demosaiced or
+/// encoded, so this runs at I/O speed and suits indexing large archives.
+/// `output_width`/`output_height` hold the full image size after
+/// orientation.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::extract_raw_metadata;
+///
+/// let exif = extract_raw_metadata("photo.cr2").expect("read metadata");
+/// println!("{} {} ISO {}", exif.camera_make, exif.camera_model, exif.iso_speed);
+/// ```
+pub fn extract_raw_metadata(input_path: &str) -> Result<ExifInfo, String> {
+    let input_cstring = CString::new(input_path)
+        .map_err(|e| format!("Invalid input path '{}': {}", input_path, e))?;
+    let mut exif_data = empty_exif_data();
+
+    let result = unsafe { extract_raw_metadata_c(input_cstring.as_ptr(), &mut exif_data) };
+    if result == RW_SUCCESS {
+        Ok(exif_info_from(&exif_data))
+    } else {
+        let error_msg = last_error_message("Unknown LibRaw error");
+        Err(format!("LibRaw Error {}: {}", result, error_msg))
+    }
+}
+
+/// Reads the metadata of RAW data in memory without decoding it, like
+/// [`extract_raw_metadata`]
+pub fn extract_raw_metadata_from_bytes(bytes: &[u8]) -> Result<ExifInfo, String> {
+    let mut exif_data = empty_exif_data();
+
+    let result =
+        unsafe { extract_raw_metadata_from_bytes_c(bytes.as_ptr(), bytes.len(), &mut exif_data) };
+    if result == RW_SUCCESS {
+        Ok(exif_info_from(&exif_data))
+    } else {
+        let error_msg = last_error_message("Unknown LibRaw error");
+        Err(format!("LibRaw Error {}: {}", result, error_msg))
+    }
+}
+
+/// Convert a RAW file read on demand from `reader` to JPEG, encoding
+/// straight into `out`
+///
+/// Nothing is read up front: LibRaw seeks to the ranges it needs and only
+/// those are read, so the conversion can start while the rest of a
+/// download is still in flight, and a [`Read`] + [`Seek`] adapter over
+/// ranged requests (HTTP, S3) fetches a fraction of the file when
+/// `PreviewOptions::use_embedded_preview` is set. Small reads are batched into
+/// 64 KiB requests; large ones are passed through. `reader` may be called
+/// from LibRaw's worker threads, one at a time, hence the `Send` bound.
+/// `out` is used as in [`convert_raw_bytes_into`].
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, convert_raw_reader_into};
+/// use std::io::BufReader;
+///
+/// let file = std::fs::File::open("photo.cr3").unwrap();
+/// let options = PreviewOptions::embedded_preview(1024);
+/// let mut jpeg = Vec::new();
+/// let exif = convert_raw_reader_into(BufReader::new(file), &options, &mut jpeg).unwrap();
+/// println!("{}: {} bytes", exif.camera_model, jpeg.len());
+/// ```
+pub fn convert_raw_reader_into<R: Read + Seek + Send>(
+    reader: R,
+    options: &PreviewOptions,
+    out: &mut Vec<u8>,
+) -> Result<ExifInfo, String> {
+    let (mut source, size) = StreamSource::new(reader)?;
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
     let mut out_size: usize = 0;
+    out.clear();
 
     let ret = unsafe {
-        process_raw_bytes_to_jpeg_buffer_c(
+        process_raw_stream_to_jpeg_into(
+            stream_source_read::<R>,
+            source.user_data(),
+            size,
+            &native_options,
+            vec_output_alloc,
+            out as *mut Vec<u8> as *mut c_void,
+            &mut out_size,
+            &mut exif_data,
+        )
+    };
+
+    if ret != RW_SUCCESS {
+        out.clear();
+        return Err(source.error_message(ret, last_error_message("LibRaw unknown error")));
+    }
+
+    unsafe { finish_vec_output(out, out_size)? };
+    Ok(exif_info_from(&exif_data))
+}
+
+/// Reads the metadata of a RAW file from `reader` without decoding it, like
+/// [`extract_raw_metadata`]
+///
+/// Only the header ranges are read, as in [`convert_raw_reader_into`].
+pub fn extract_raw_metadata_from_reader<R: Read + Seek + Send>(
+    reader: R,
+) -> Result<ExifInfo, String> {
+    let (mut source, size) = StreamSource::new(reader)?;
+    let mut exif_data = empty_exif_data();
+
+    let ret = unsafe {
+        extract_raw_metadata_from_stream_c(
+            stream_source_read::<R>,
+            source.user_data(),
+            size,
+            &mut exif_data,
+        )
+    };
+    if ret == RW_SUCCESS {
+        Ok(exif_info_from(&exif_data))
+    } else {
+        Err(source.error_message(ret, last_error_message("Unknown LibRaw error")))
+    }
+}
+
+/// Convert RAW bytes to a set of JPEG previews of different sizes
+///
+/// The RAW data is unpacked and demosaiced once (or the embedded preview is
+/// decoded once, with `PreviewOptions::embedded_preview`), at the size of the
+/// largest level. Each smaller level is resized from the next larger one and
+/// all levels are encoded in parallel. The output size fields of `options`
+/// are ignored; the returned levels are in the order of `levels`.
+pub fn convert_raw_bytes_to_pyramid(
+    bytes: &[u8],
+    levels: &[PreviewLevel],
+    options: &PreviewOptions,
+) -> Result<(Vec<PyramidLevel>, ExifInfo), String> {
+    let native_levels = native_pyramid_levels(levels)?;
+    let mut outputs = vec![NativePreviewLevelOutput::empty(); native_levels.len()];
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
+
+    let ret = unsafe {
+        process_raw_bytes_to_pyramid(
             bytes.as_ptr(),
             bytes.len(),
-            &mut out_ptr as *mut *mut u8,
-            &mut out_size as *mut usize,
+            &native_options,
+            native_levels.as_ptr(),
+            native_levels.len() as i32,
+            outputs.as_mut_ptr(),
             &mut exif_data,
         )
     };
 
     if ret != RW_SUCCESS {
-        let err = unsafe {
-            let p = get_last_error();
-            if p.is_null() {
-                "LibRaw unknown error".to_string()
-            } else {
-                CStr::from_ptr(p).to_string_lossy().into_owned()
+        let err = last_error_message("LibRaw unknown error");
+        return Err(format!("LibRaw error {}: {}", ret, err));
+    }
+
+    let pyramid = take_native_pyramid(&outputs)?;
+    Ok((pyramid, exif_info_from(&exif_data)))
+}
+
+/// Converts a RAW file progressively, delivering each stage as soon as it
+/// is ready
+///
+/// The file is opened once. The embedded stages are produced before any
+/// sensor data is unpacked, so the thumbnail typically arrives within a few
+/// milliseconds, followed by the embedded preview and, when requested, the
+/// demosaiced render. `on_stage` receives each [`PreviewFrame`] and returns
+/// `false` to skip the remaining stages, e.g. when the viewer moved on to
+/// another image. Stages the file has no embedded JPEG for are skipped;
+/// `use_embedded_preview` is ignored.
+///
+/// # Returns
+/// * `Ok(ExifInfo)` once the requested stages are delivered or `on_stage`
+///   stopped them; the output size is the last stage's
+/// * `Err(String)` if the file cannot be opened, the render stage fails or
+///   no stage could be delivered
+///
+/// A panic in `on_stage` is resumed after the native call returns.
+pub fn convert_raw_progressive<F>(
+    input_path: &str,
+    options: &PreviewOptions,
+    stages: ProgressiveStages,
+    mut on_stage: F,
+) -> Result<ExifInfo, String>
+where
+    F: FnMut(PreviewFrame<'_>) -> bool,
+{
+    let input_cstring = CString::new(input_path)
+        .map_err(|e| format!("Invalid input path '{}': {}", input_path, e))?;
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
+    let mut sink = StageSink {
+        callback: &mut on_stage,
+        panic: None,
+    };
+
+    let ret = unsafe {
+        process_raw_progressive(
+            input_cstring.as_ptr(),
+            &native_options,
+            stages.native_bits(),
+            stage_sink_deliver,
+            sink.user_data(),
+            &mut exif_data,
+        )
+    };
+    sink.finish(ret, &exif_data, || {
+        last_error_message("LibRaw unknown error")
+    })
+}
+
+/// Converts RAW bytes progressively, like [`convert_raw_progressive`]
+pub fn convert_raw_bytes_progressive<F>(
+    bytes: &[u8],
+    options: &PreviewOptions,
+    stages: ProgressiveStages,
+    mut on_stage: F,
+) -> Result<ExifInfo, String>
+where
+    F: FnMut(PreviewFrame<'_>) -> bool,
+{
+    let mut exif_data = empty_exif_data();
+    let native_options = NativePreviewOptions::from(options);
+    let mut sink = StageSink {
+        callback: &mut on_stage,
+        panic: None,
+    };
+
+    let ret = unsafe {
+        process_raw_bytes_progressive(
+            bytes.as_ptr(),
+            bytes.len(),
+            &native_options,
+            stages.native_bits(),
+            stage_sink_deliver,
+            sink.user_data(),
+            &mut exif_data,
+        )
+    };
+    sink.finish(ret, &exif_data, || {
+        last_error_message("LibRaw unknown error")
+    })
+}
+
+/// Reusable RAW processing context
+///
+/// Keeps a native LibRaw instance and TurboJPEG handles alive across
+/// conversions, so repeated calls do not reallocate them, and stores error
+/// messages per context instead of per thread. A context can be moved to
+/// another thread but not shared between threads; run one context per
+/// worker thread.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, RawPreviewContext};
+///
+/// let mut context = RawPreviewContext::new().expect("create context");
+/// for path in ["a.cr2", "b.nef"] {
+///     let bytes = std::fs::read(path).expect("read RAW file");
+///     match context.convert_bytes_to_vec(&bytes, &PreviewOptions::default()) {
+///         Ok((jpeg, exif)) => println!("{}: {} bytes from {}", path, jpeg.len(), exif.camera_model),
+///         Err(e) => eprintln!("{}: {}", path, e),
+///     }
+/// }
+/// ```
+pub struct RawPreviewContext {
+    handle: *mut NativeRawPreviewContext,
+}
+
+// The native context has no thread affinity; `&mut self` methods prevent concurrent use.
+unsafe impl Send for RawPreviewContext {}
+
+impl RawPreviewContext {
+    /// Creates a new processing context
+    pub fn new() -> Result<Self, String> {
+        let handle = unsafe { raw_preview_context_create() };
+        if handle.is_null() {
+            Err("Failed to create LibRaw processing context".to_string())
+        } else {
+            Ok(Self { handle })
+        }
+    }
+
+    /// Converts a RAW image file to JPEG, like [`convert_raw_to_jpeg_with_options`]
+    pub fn convert_file(
+        &mut self,
+        input_path: &str,
+        output_path: &str,
+        options: &PreviewOptions,
+    ) -> Result<ExifInfo, String> {
+        let input_cstring = CString::new(input_path)
+            .map_err(|e| format!("Invalid input path '{}': {}", input_path, e))?;
+        let output_cstring = CString::new(output_path)
+            .map_err(|e| format!("Invalid output path '{}': {}", output_path, e))?;
+
+        let mut exif_data = empty_exif_data();
+        let native_options = NativePreviewOptions::from(options);
+
+        let result = unsafe {
+            raw_preview_context_process_file(
+                self.handle,
+                input_cstring.as_ptr(),
+                output_cstring.as_ptr(),
+                &native_options,
+                &mut exif_data,
+            )
+        };
+
+        if result == RW_SUCCESS {
+            Ok(exif_info_from(&exif_data))
+        } else {
+            Err(format!("LibRaw Error {}: {}", result, self.last_error()))
+        }
+    }
+
+    /// Converts RAW bytes to JPEG and writes it to `output_path`
+    pub fn convert_bytes_to_jpeg(
+        &mut self,
+        bytes: &[u8],
+        output_path: &str,
+        options: &PreviewOptions,
+    ) -> Result<ExifInfo, String> {
+        let c_output = CString::new(output_path).map_err(|_| "Invalid output path")?;
+
+        let mut exif_data = empty_exif_data();
+        let native_options = NativePreviewOptions::from(options);
+
+        let ret = unsafe {
+            raw_preview_context_process_bytes(
+                self.handle,
+                bytes.as_ptr(),
+                bytes.len(),
+                c_output.as_ptr(),
+                &native_options,
+                &mut exif_data,
+            )
+        };
+
+        if ret == RW_SUCCESS {
+            Ok(exif_info_from(&exif_data))
+        } else {
+            Err(format!("LibRaw Error {}: {}", ret, self.last_error()))
+        }
+    }
+
+    /// Converts RAW bytes to JPEG in-memory, like [`convert_raw_bytes_to_vec_with_options`]
+    pub fn convert_bytes_to_vec(
+        &mut self,
+        bytes: &[u8],
+        options: &PreviewOptions,
+    ) -> Result<(Vec<u8>, ExifInfo), String> {
+        let mut jpeg_vec = Vec::new();
+        let exif = self.convert_bytes_into(bytes, options, &mut jpeg_vec)?;
+        jpeg_vec.shrink_to_fit();
+        Ok((jpeg_vec, exif))
+    }
+
+    /// Converts RAW bytes to JPEG straight into `out`, like [`convert_raw_bytes_into`]
+    pub fn convert_bytes_into(
+        &mut self,
+        bytes: &[u8],
+        options: &PreviewOptions,
+        out: &mut Vec<u8>,
+    ) -> Result<ExifInfo, String> {
+        out.clear();
+        let result = unsafe {
+            self.convert_bytes_with_alloc(
+                bytes,
+                &NativePreviewOptions::from(options),
+                vec_output_alloc,
+                out as *mut Vec<u8> as *mut c_void,
+            )
+        };
+        match result {
+            Ok((out_size, exif)) => {
+                unsafe { finish_vec_output(out, out_size)? };
+                Ok(exif)
             }
+            Err(e) => {
+                out.clear();
+                Err(e)
+            }
+        }
+    }
+
+    /// Converts RAW bytes to JPEG into the buffer returned by `alloc`
+    ///
+    /// Returns the number of JPEG bytes written to that buffer.
+    ///
+    /// # Safety
+    /// `alloc` must follow the `PreviewAllocFn` contract for `user_data`.
+    pub(crate) unsafe fn convert_bytes_with_alloc(
+        &mut self,
+        bytes: &[u8],
+        options: &NativePreviewOptions,
+        alloc: NativeAllocFn,
+        user_data: *mut c_void,
+    ) -> Result<(usize, ExifInfo), String> {
+        let mut exif_data = empty_exif_data();
+        let mut out_size: usize = 0;
+        let ret = unsafe {
+            raw_preview_context_process_bytes_into(
+                self.handle,
+                bytes.as_ptr(),
+                bytes.len(),
+                options,
+                alloc,
+                user_data,
+                &mut out_size,
+                &mut exif_data,
+            )
         };
-        return Err(format!("LibRaw error {}: {}", ret, err));
+
+        if ret != RW_SUCCESS {
+            return Err(format!("LibRaw error {}: {}", ret, self.last_error()));
+        }
+        Ok((out_size, exif_info_from(&exif_data)))
     }
 
-    if out_ptr.is_null() || out_size == 0 {
-        return Err("No JPEG data returned".to_string());
+    /// Reads the metadata of a RAW file, like [`extract_raw_metadata`]
+    pub fn extract_metadata(&mut self, input_path: &str) -> Result<ExifInfo, String> {
+        let input_cstring = CString::new(input_path)
+            .map_err(|e| format!("Invalid input path '{}': {}", input_path, e))?;
+        let mut exif_data = empty_exif_data();
+
+        let result = unsafe {
+            raw_preview_context_extract_metadata(
+                self.handle,
+                input_cstring.as_ptr(),
+                &mut exif_data,
+            )
+        };
+        if result == RW_SUCCESS {
+            Ok(exif_info_from(&exif_data))
+        } else {
+            Err(format!("LibRaw Error {}: {}", result, self.last_error()))
+        }
     }
 
-    let slice = unsafe { std::slice::from_raw_parts(out_ptr, out_size) };
-    let jpeg_vec = slice.to_vec();
+    /// Reads the metadata of RAW data in memory, like [`extract_raw_metadata_from_bytes`]
+    pub fn extract_metadata_from_bytes(&mut self, bytes: &[u8]) -> Result<ExifInfo, String> {
+        let mut exif_data = empty_exif_data();
 
-    // Free C-allocated buffer (allocated with new unsigned char[]) using provided free_buffer
-    unsafe { free_buffer(out_ptr) };
+        let result = unsafe {
+            raw_preview_context_extract_metadata_from_bytes(
+                self.handle,
+                bytes.as_ptr(),
+                bytes.len(),
+                &mut exif_data,
+            )
+        };
+        if result == RW_SUCCESS {
+            Ok(exif_info_from(&exif_data))
+        } else {
+            Err(format!("LibRaw Error {}: {}", result, self.last_error()))
+        }
+    }
 
-    // Convert ExifData
-    let exif_info = ExifInfo {
-        camera_make: safe_string_from_array(&exif_data.camera_make),
-        camera_model: safe_string_from_array(&exif_data.camera_model),
-        software: safe_string_from_ptr(exif_data.software),
-        iso_speed: exif_data.iso_speed,
-        shutter: exif_data.shutter,
-        aperture: exif_data.aperture,
-        focal_length: exif_data.focal_length,
-        raw_width: exif_data.raw_width,
-        raw_height: exif_data.raw_height,
-        output_width: exif_data.output_width,
-        output_height: exif_data.output_height,
-        colors: exif_data.colors,
-        color_filter: exif_data.color_filter,
-        cam_mul: exif_data.cam_mul,
-        date_taken: safe_string_from_ptr(exif_data.date_taken),
-        lens: safe_string_from_ptr(exif_data.lens),
-        max_aperture: exif_data.max_aperture,
-        focal_length_35mm: exif_data.focal_length_35mm,
-        description: safe_string_from_ptr(exif_data.description),
-        artist: safe_string_from_ptr(exif_data.artist),
-    };
+    /// Converts a RAW file read on demand to JPEG, like [`convert_raw_reader_into`]
+    pub fn convert_reader_into<R: Read + Seek + Send>(
+        &mut self,
+        reader: R,
+        options: &PreviewOptions,
+        out: &mut Vec<u8>,
+    ) -> Result<ExifInfo, String> {
+        let (mut source, size) = StreamSource::new(reader)?;
+        let mut exif_data = empty_exif_data();
+        let native_options = NativePreviewOptions::from(options);
+        let mut out_size: usize = 0;
+        out.clear();
+
+        let ret = unsafe {
+            raw_preview_context_process_stream_into(
+                self.handle,
+                stream_source_read::<R>,
+                source.user_data(),
+                size,
+                &native_options,
+                vec_output_alloc,
+                out as *mut Vec<u8> as *mut c_void,
+                &mut out_size,
+                &mut exif_data,
+            )
+        };
+
+        if ret != RW_SUCCESS {
+            out.clear();
+            return Err(source.error_message(ret, self.last_error()));
+        }
+
+        unsafe { finish_vec_output(out, out_size)? };
+        Ok(exif_info_from(&exif_data))
+    }
+
+    /// Reads the metadata of a RAW file from `reader`, like [`extract_raw_metadata_from_reader`]
+    pub fn extract_metadata_from_reader<R: Read + Seek + Send>(
+        &mut self,
+        reader: R,
+    ) -> Result<ExifInfo, String> {
+        let (mut source, size) = StreamSource::new(reader)?;
+        let mut exif_data = empty_exif_data();
 
-    Ok((jpeg_vec, exif_info))
+        let ret = unsafe {
+            raw_preview_context_extract_metadata_from_stream(
+                self.handle,
+                stream_source_read::<R>,
+                source.user_data(),
+                size,
+                &mut exif_data,
+            )
+        };
+        if ret == RW_SUCCESS {
+            Ok(exif_info_from(&exif_data))
+        } else {
+            Err(source.error_message(ret, self.last_error()))
+        }
+    }
+
+    /// Converts RAW bytes to a preview pyramid, like [`convert_raw_bytes_to_pyramid`]
+    pub fn convert_bytes_to_pyramid(
+        &mut self,
+        bytes: &[u8],
+        levels: &[PreviewLevel],
+        options: &PreviewOptions,
+    ) -> Result<(Vec<PyramidLevel>, ExifInfo), String> {
+        let native_levels = native_pyramid_levels(levels)?;
+        let mut outputs = vec![NativePreviewLevelOutput::empty(); native_levels.len()];
+        let mut exif_data = empty_exif_data();
+        let native_options = NativePreviewOptions::from(options);
+
+        let ret = unsafe {
+            raw_preview_context_process_bytes_to_pyramid(
+                self.handle,
+                bytes.as_ptr(),
+                bytes.len(),
+                &native_options,
+                native_levels.as_ptr(),
+                native_levels.len() as i32,
+                outputs.as_mut_ptr(),
+                &mut exif_data,
+            )
+        };
+
+        if ret != RW_SUCCESS {
+            return Err(format!("LibRaw error {}: {}", ret, self.last_error()));
+        }
+
+        let pyramid = take_native_pyramid(&outputs)?;
+        Ok((pyramid, exif_info_from(&exif_data)))
+    }
+
+    /// Converts a RAW file progressively, like [`convert_raw_progressive`]
+    pub fn convert_file_progressive<F>(
+        &mut self,
+        input_path: &str,
+        options: &PreviewOptions,
+        stages: ProgressiveStages,
+        mut on_stage: F,
+    ) -> Result<ExifInfo, String>
+    where
+        F: FnMut(PreviewFrame<'_>) -> bool,
+    {
+        let input_cstring = CString::new(input_path)
+            .map_err(|e| format!("Invalid input path '{}': {}", input_path, e))?;
+        let mut exif_data = empty_exif_data();
+        let native_options = NativePreviewOptions::from(options);
+        let mut sink = StageSink {
+            callback: &mut on_stage,
+            panic: None,
+        };
+
+        let ret = unsafe {
+            raw_preview_context_process_file_progressive(
+                self.handle,
+                input_cstring.as_ptr(),
+                &native_options,
+                stages.native_bits(),
+                stage_sink_deliver,
+                sink.user_data(),
+                &mut exif_data,
+            )
+        };
+        sink.finish(ret, &exif_data, || self.last_error())
+    }
+
+    /// Converts RAW bytes progressively, like [`convert_raw_progressive`]
+    pub fn convert_bytes_progressive<F>(
+        &mut self,
+        bytes: &[u8],
+        options: &PreviewOptions,
+        stages: ProgressiveStages,
+        mut on_stage: F,
+    ) -> Result<ExifInfo, String>
+    where
+        F: FnMut(PreviewFrame<'_>) -> bool,
+    {
+        let mut exif_data = empty_exif_data();
+        let native_options = NativePreviewOptions::from(options);
+        let mut sink = StageSink {
+            callback: &mut on_stage,
+            panic: None,
+        };
+
+        let ret = unsafe {
+            raw_preview_context_process_bytes_progressive(
+                self.handle,
+                bytes.as_ptr(),
+                bytes.len(),
+                &native_options,
+                stages.native_bits(),
+                stage_sink_deliver,
+                sink.user_data(),
+                &mut exif_data,
+            )
+        };
+        sink.finish(ret, &exif_data, || self.last_error())
+    }
+
+    /// Retrieves the error message of the last failed call on this context
+    fn last_error(&self) -> String {
+        error_message_from_ptr(
+            unsafe { raw_preview_context_last_error(self.handle) },
+            "Unknown LibRaw error",
+        )
+    }
+}
+
+impl Drop for RawPreviewContext {
+    fn drop(&mut self) {
+        unsafe { raw_preview_context_destroy(self.handle) };
+    }
 }
 
 #[cfg(test)]
@@ -348,4 +1321,151 @@ mod tests {
         let result = safe_string_from_ptr(ptr::null());
         assert_eq!(result, "");
     }
+
+    #[test]
+    fn test_take_native_buffer_null() {
+        let result = take_native_buffer(ptr::null_mut(), 0);
+        assert!(result.is_err());
+    }
+
+    #[test]
+    fn test_take_native_pyramid_missing_level() {
+        let outputs = [NativePreviewLevelOutput::empty()];
+        assert!(take_native_pyramid(&outputs).is_err());
+    }
+
+    #[test]
+    fn test_context_is_send() {
+        fn assert_send<T: Send>() {}
+        assert_send::<RawPreviewContext>();
+    }
+
+    #[test]
+    fn test_stream_source_reads_ranges() {
+        let data: Vec<u8> = (0..=255).collect();
+        let (mut source, size) = StreamSource::new(io::Cursor::new(data)).unwrap();
+        assert_eq!(size, 256);
+
+        let mut buf = [0u8; 16];
+        let n = unsafe {
+            stream_source_read::<io::Cursor<Vec<u8>>>(source.user_data(), 250, buf.as_mut_ptr(), 16)
+        };
+        assert_eq!(n, 6);
+        assert_eq!(&buf[..6], &[250, 251, 252, 253, 254, 255]);
+
+        let n = unsafe {
+            stream_source_read::<io::Cursor<Vec<u8>>>(source.user_data(), 10, buf.as_mut_ptr(), 4)
+        };
+        assert_eq!(n, 4);
+        assert_eq!(&buf[..4], &[10, 11, 12, 13]);
+        assert_eq!(source.position, Some(14));
+        assert!(source.error.is_none());
+    }
+
+    #[test]
+    fn test_stream_source_reports_errors() {
+        struct FailingReader;
+        impl Read for FailingReader {
+            fn read(&mut self, _buf: &mut [u8]) -> io::Result<usize> {
+                Err(io::Error::other("connection reset"))
+            }
+        }
+        impl Seek for FailingReader {
+            fn seek(&mut self, _pos: SeekFrom) -> io::Result<u64> {
+                Ok(1024)
+            }
+        }
+
+        let (mut source, _) = StreamSource::new(FailingReader).unwrap();
+        let mut buf = [0u8; 8];
+        let n = unsafe {
+            stream_source_read::<FailingReader>(source.user_data(), 0, buf.as_mut_ptr(), 8)
+        };
+        assert_eq!(n, -1);
+        assert!(source.position.is_none());
+        assert_eq!(
+            source.error_message(1, "Failed to open stream".to_string()),
+            "LibRaw error 1: Failed to open stream: connection reset"
+        );
+    }
+
+    #[test]
+    fn test_stage_sink_stops_and_captures_panics() {
+        let jpeg = [0xffu8, 0xd8, 0xff, 0xd9];
+        let exif_data = empty_exif_data();
+        let mut seen = Vec::new();
+        let mut callback = |frame: PreviewFrame<'_>| {
+            seen.push((frame.stage, frame.jpeg.len(), frame.width));
+            if frame.stage == PreviewStage::Render {
+                panic!("viewer closed");
+            }
+            frame.stage == PreviewStage::Thumbnail
+        };
+        let mut sink = StageSink {
+            callback: &mut callback,
+            panic: None,
+        };
+        let mut deliver = |stage: i32| unsafe {
+            stage_sink_deliver(
+                sink.user_data(),
+                stage,
+                jpeg.as_ptr(),
+                jpeg.len(),
+                160,
+                120,
+                &exif_data,
+            )
+        };
+        assert_eq!(deliver(1), 0);
+        assert_eq!(deliver(2), 1);
+        assert_eq!(deliver(4), 1);
+        assert!(sink.panic.is_some());
+        assert_eq!(
+            seen,
+            [
+                (PreviewStage::Thumbnail, 4, 160),
+                (PreviewStage::Preview, 4, 160),
+                (PreviewStage::Render, 4, 160)
+            ]
+        );
+    }
+
+    // Runs on the RAW files of the directory named by RAW_PREVIEW_TEST_CORPUS
+    // (skipped when unset): the preview stage must not repeat the thumbnail
+    #[test]
+    fn test_progressive_preview_larger_than_thumbnail() {
+        let Some(corpus) = std::env::var_os("RAW_PREVIEW_TEST_CORPUS") else {
+            return;
+        };
+        for entry in std::fs::read_dir(corpus).unwrap() {
+            let path = entry.unwrap().path();
+            if !path.to_str().is_some_and(crate::file_detector::is_raw_file) {
+                continue;
+            }
+            let bytes = std::fs::read(&path).unwrap();
+            let mut frames = Vec::new();
+            let _ = convert_raw_bytes_progressive(
+                &bytes,
+                &PreviewOptions::default(),
+                ProgressiveStages::default(),
+                |frame| {
+                    frames.push((frame.stage, frame.width * frame.height));
+                    true
+                },
+            );
+            if let [
+                (PreviewStage::Thumbnail, thumbnail),
+                (PreviewStage::Preview, preview),
+            ] = frames[..]
+            {
+                assert!(
+                    preview > thumbnail,
+                    "{}: preview of {} pixels, thumbnail of {}",
+                    path.display(),
+                    preview,
+                    thumbnail
+                );
+            }
+        }
+    }
 }
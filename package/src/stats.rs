@@ -0,0 +1,133 @@
+/// Per-stage timings of the native pipeline
+///
+/// Every conversion and metadata call records where its time and memory
+/// went in statistics kept per thread by the native code. Read them with
+/// [`last_pipeline_stats`] on the thread that made the call, right after it
+/// returns; [`process_batch`](crate::process_batch) attaches them to each
+/// [`BatchResult`](crate::BatchResult).
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, convert_raw_bytes_to_vec_with_options, last_pipeline_stats};
+///
+/// let bytes = std::fs::read("photo.nef").unwrap();
+/// let (_jpeg, exif) = convert_raw_bytes_to_vec_with_options(&bytes, &PreviewOptions::default()).unwrap();
+/// let stats = last_pipeline_stats();
+/// println!("{}: demosaic {:?}, encode {:?}, total {:?}", exif.camera_model,
+///          stats.demosaic, stats.encode, stats.total);
+/// ```
+use std::time::Duration;
+
+/// Where the time and memory of one native call went
+///
+/// Stages the call did not run are zero. Times are wall-clock; the encode
+/// time of a pyramid covers all its levels, which are encoded in parallel.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct PipelineStats {
+    /// Mapping the file and parsing headers (LibRaw `open_buffer`, EXIF and
+    /// JPEG header of images)
+    pub open: Duration,
+    /// LibRaw `unpack`: decoding the sensor data
+    pub unpack: Duration,
+    /// LibRaw `dcraw_process`, or the binning of
+    /// [`PreviewOptions::draft_demosaic`](crate::PreviewOptions::draft_demosaic):
+    /// demosaicing and color conversion. For conversions developed on the
+    /// GPU (see [`gpu`](crate::gpu)), the wait for the whole batch holding
+    /// the image, including its resize, orientation and encode
+    pub demosaic: Duration,
+    /// LibRaw `copy_mem_image`: conversion to an 8-bit RGB bitmap
+    pub make_image: Duration,
+    /// Extracting an embedded RAW preview, decoding a JPEG or other image
+    pub decode: Duration,
+    /// Area-average resizing to the requested output size
+    pub resize: Duration,
+    /// Applying the EXIF orientation
+    pub orient: Duration,
+    /// JPEG compression
+    pub encode: Duration,
+    /// Writing the output file or copying the JPEG to the caller
+    pub write: Duration,
+    /// Whole call, including the stages above
+    pub total: Duration,
+    /// Sum of the sizes of the image and JPEG buffers the call allocated
+    pub bytes_allocated: u64,
+    /// Size of the largest of those buffers
+    pub peak_buffer_bytes: u64,
+}
+
+/// C-compatible statistics filled by the native wrappers
+/// This structure must match the PipelineStats struct in pipeline_stats.h
+#[repr(C)]
+#[derive(Debug, Default)]
+pub(crate) struct NativePipelineStats {
+    pub open_ns: u64,
+    pub unpack_ns: u64,
+    pub demosaic_ns: u64,
+    pub make_image_ns: u64,
+    pub decode_ns: u64,
+    pub resize_ns: u64,
+    pub orient_ns: u64,
+    pub encode_ns: u64,
+    pub write_ns: u64,
+    pub total_ns: u64,
+    pub bytes_allocated: u64,
+    pub peak_buffer_bytes: u64,
+}
+
+impl From<&NativePipelineStats> for PipelineStats {
+    fn from(native: &NativePipelineStats) -> Self {
+        PipelineStats {
+            open: Duration::from_nanos(native.open_ns),
+            unpack: Duration::from_nanos(native.unpack_ns),
+            demosaic: Duration::from_nanos(native.demosaic_ns),
+            make_image: Duration::from_nanos(native.make_image_ns),
+            decode: Duration::from_nanos(native.decode_ns),
+            resize: Duration::from_nanos(native.resize_ns),
+            orient: Duration::from_nanos(native.orient_ns),
+            encode: Duration::from_nanos(native.encode_ns),
+            write: Duration::from_nanos(native.write_ns),
+            total: Duration::from_nanos(native.total_ns),
+            bytes_allocated: native.bytes_allocated,
+            peak_buffer_bytes: native.peak_buffer_bytes,
+        }
+    }
+}
+
+unsafe extern "C" {
+    fn get_last_pipeline_stats(stats: *mut NativePipelineStats);
+}
+
+/// Returns the statistics of the last native call made on this thread
+///
+/// Covers every conversion, pyramid and metadata function of the crate,
+/// RAW or image, with or without a [`RawPreviewContext`](crate::RawPreviewContext).
+/// All zero until the thread makes its first call.
+pub fn last_pipeline_stats() -> PipelineStats {
+    let mut native = NativePipelineStats::default();
+    unsafe { get_last_pipeline_stats(&mut native) };
+    PipelineStats::from(&native)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_native_stats_conversion() {
+        let native = NativePipelineStats {
+            unpack_ns: 1_500,
+            encode_ns: 2_000_000,
+            total_ns: 3_000_000_000,
+            bytes_allocated: 4096,
+            peak_buffer_bytes: 1024,
+            ..Default::default()
+        };
+        let stats = PipelineStats::from(&native);
+        assert_eq!(stats.unpack, Duration::from_nanos(1_500));
+        assert_eq!(stats.encode, Duration::from_millis(2));
+        assert_eq!(stats.total, Duration::from_secs(3));
+        assert_eq!(stats.open, Duration::ZERO);
+        assert_eq!(stats.bytes_allocated, 4096);
+        assert_eq!(stats.peak_buffer_bytes, 1024);
+    }
+}
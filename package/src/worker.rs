@@ -0,0 +1,1012 @@
+/// Out-of-process conversions
+///
+/// [`WorkerClient`] runs conversions in a separate `raw_preview_worker`
+/// process (built with the `worker` feature), so a malformed file that
+/// crashes LibRaw takes down the worker rather than the caller, without
+/// starting a process per file.
+///
+/// Requests travel through a ring of slots in a shared memory mapping. The
+/// client writes the input file into a free slot, the worker converts it on
+/// one of its threads, each keeping a warm [`RawPreviewContext`], and
+/// encodes the JPEG straight into the same slot, where [`WorkerOutput`]
+/// borrows it. Only slot numbers go over a socket, which also tells the
+/// client when the worker dies; the next request then starts a new one.
+///
+/// # Example
+/// ```no_run
+/// use raw_preview_rs::{PreviewOptions, WorkerClient, WorkerInput, WorkerOptions};
+/// use std::path::Path;
+///
+/// let mut worker = WorkerClient::spawn(WorkerOptions {
+///     threads: 4,
+///     cpus: vec![0, 1, 2, 3], // e.g. the cores of one NUMA node
+///     ..Default::default()
+/// })
+/// .expect("start worker");
+///
+/// let options = PreviewOptions {
+///     max_edge: 1024,
+///     ..Default::default()
+/// };
+/// let output = worker
+///     .convert(WorkerInput::Path(Path::new("photo.cr2")), &options)
+///     .expect("convert");
+/// std::fs::write("preview.jpg", output.jpeg).unwrap();
+/// ```
+use crate::cache::{decode_exif, encode_exif};
+use crate::exif_data::ExifInfo;
+use crate::file_detector::{detect_format, is_raw_file};
+use crate::image_processor::process_image_bytes_with_alloc;
+use crate::options::{NativePreviewOptions, PreviewOptions};
+use crate::or_tiff_image;
+use crate::raw_processor::RawPreviewContext;
+use std::ffi::c_void;
+use std::fs::File;
+use std::io::{self, Read, Write};
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::os::unix::net::UnixStream;
+use std::os::unix::process::CommandExt;
+use std::panic::{self, AssertUnwindSafe};
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command, Stdio};
+use std::sync::atomic::{Ordering, fence};
+use std::sync::{Arc, Mutex, mpsc};
+use std::time::Duration;
+
+const RING_MAGIC: [u8; 4] = *b"RPWK";
+const RING_VERSION: u32 = 1;
+const PAGE_SIZE: usize = 4096;
+const HEADER_SIZE: usize = PAGE_SIZE;
+// Room for the error message and serialized metadata of a slot
+const ERROR_CAPACITY: usize = 1024;
+const EXIF_CAPACITY: usize = 8192;
+// The JPEG starts at this alignment after the input
+const OUTPUT_ALIGN: usize = 64;
+
+// Descriptors the worker inherits: the shared mapping and its socket
+const SHM_FD: libc::c_int = 3;
+const SOCKET_FD: libc::c_int = 4;
+// Sent by the worker once it has mapped the ring
+const READY: u32 = u32::MAX;
+const HANDSHAKE_TIMEOUT: Duration = Duration::from_secs(10);
+
+const KIND_RAW: u32 = 1;
+const KIND_IMAGE: u32 = 2;
+
+/// Input of a worker conversion
+#[derive(Debug, Clone, Copy)]
+pub enum WorkerInput<'a> {
+    /// A file on disk, read straight into shared memory; RAW and standard
+    /// images are told apart by their content signature, or by extension
+    /// when it has none
+    Path(&'a Path),
+    /// RAW file contents
+    RawBytes(&'a [u8]),
+    /// Standard image file contents (JPEG, PNG, TIFF, ...)
+    ImageBytes(&'a [u8]),
+}
+
+/// Settings of a worker process
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct WorkerOptions {
+    /// The `raw_preview_worker` executable. Defaults to the
+    /// `RAW_PREVIEW_WORKER` environment variable, or `raw_preview_worker`
+    /// next to the current executable.
+    pub program: PathBuf,
+    /// Conversion threads of the worker, each with its own context (0 = 1)
+    pub threads: usize,
+    /// Requests that may be in flight at once (0 = twice `threads`)
+    pub slots: usize,
+    /// Bytes of shared memory per slot, holding the input file and the
+    /// JPEG's worst-case size together. Pages are only backed once used.
+    pub slot_size: usize,
+    /// CPUs the worker is pinned to (Linux only; empty = no pinning). Pin
+    /// it to the cores of one NUMA node so its memory stays local.
+    pub cpus: Vec<usize>,
+}
+
+impl Default for WorkerOptions {
+    fn default() -> Self {
+        Self {
+            program: default_program(),
+            threads: 1,
+            slots: 0,
+            slot_size: 256 * 1024 * 1024,
+            cpus: Vec::new(),
+        }
+    }
+}
+
+fn default_program() -> PathBuf {
+    if let Some(program) = std::env::var_os("RAW_PREVIEW_WORKER") {
+        return PathBuf::from(program);
+    }
+    std::env::current_exe()
+        .ok()
+        .and_then(|exe| exe.parent().map(|dir| dir.join("raw_preview_worker")))
+        .unwrap_or_else(|| PathBuf::from("raw_preview_worker"))
+}
+
+/// A converted preview, borrowed from the worker's shared memory
+#[derive(Debug)]
+pub struct WorkerOutput<'a> {
+    /// JPEG bytes
+    pub jpeg: &'a [u8],
+    /// Metadata of the input
+    pub exif: ExifInfo,
+}
+
+/// Start of the shared mapping
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct RingHeader {
+    magic: [u8; 4],
+    version: u32,
+    slot_count: u32,
+    threads: u32,
+    slot_size: u64,
+    // CARGO_PKG_VERSION, so a worker from another build is rejected
+    crate_version: [u8; 16],
+}
+
+/// Request and response of one slot, followed by its data area
+#[repr(C)]
+struct SlotHeader {
+    kind: u32,
+    // 0 on success; error holds the message otherwise
+    status: u32,
+    input_len: u64,
+    output_offset: u64,
+    output_len: u64,
+    error_len: u32,
+    exif_len: u32,
+    options: NativePreviewOptions,
+    error: [u8; ERROR_CAPACITY],
+    exif: [u8; EXIF_CAPACITY],
+}
+
+const SLOT_HEADER_SIZE: usize = align_up(std::mem::size_of::<SlotHeader>(), PAGE_SIZE);
+
+const fn align_up(value: usize, align: usize) -> usize {
+    value.div_ceil(align) * align
+}
+
+fn crate_version() -> [u8; 16] {
+    let mut version = [0u8; 16];
+    let bytes = env!("CARGO_PKG_VERSION").as_bytes();
+    let len = bytes.len().min(version.len());
+    version[..len].copy_from_slice(&bytes[..len]);
+    version
+}
+
+/// Position of the slots in the mapping
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct Layout {
+    slot_count: usize,
+    slot_size: usize,
+}
+
+impl Layout {
+    fn stride(&self) -> usize {
+        SLOT_HEADER_SIZE + self.slot_size
+    }
+
+    fn slot_offset(&self, slot: usize) -> usize {
+        HEADER_SIZE + slot * self.stride()
+    }
+
+    fn data_offset(&self, slot: usize) -> usize {
+        self.slot_offset(slot) + SLOT_HEADER_SIZE
+    }
+
+    fn total_size(&self) -> Option<usize> {
+        self.slot_count
+            .checked_mul(self.stride())?
+            .checked_add(HEADER_SIZE)
+    }
+}
+
+/// A shared read-write mapping of a whole file
+struct SharedMap {
+    ptr: *mut u8,
+    len: usize,
+    file: File,
+}
+
+// Slots are handed between threads and processes by the ring protocol, so
+// no two parties touch the same slot at once
+unsafe impl Send for SharedMap {}
+unsafe impl Sync for SharedMap {}
+
+impl SharedMap {
+    fn new(file: File, len: usize) -> io::Result<Self> {
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self {
+            ptr: ptr as *mut u8,
+            len,
+            file,
+        })
+    }
+
+    /// # Safety
+    /// The caller must own `slot` under the ring protocol, and `layout`
+    /// must fit in the mapping.
+    #[allow(clippy::mut_from_ref)]
+    unsafe fn slot(&self, layout: &Layout, slot: usize) -> (&mut SlotHeader, &mut [u8]) {
+        unsafe {
+            let header = &mut *(self.ptr.add(layout.slot_offset(slot)) as *mut SlotHeader);
+            let data = std::slice::from_raw_parts_mut(
+                self.ptr.add(layout.data_offset(slot)),
+                layout.slot_size,
+            );
+            (header, data)
+        }
+    }
+}
+
+impl Drop for SharedMap {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut c_void, self.len) };
+    }
+}
+
+/// Creates an anonymous file of len bytes to share with the worker
+fn create_shared_file(len: usize) -> io::Result<File> {
+    #[cfg(target_os = "linux")]
+    let file = {
+        let fd = unsafe { libc::memfd_create(c"raw_preview_worker".as_ptr(), libc::MFD_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        unsafe { File::from_raw_fd(fd) }
+    };
+    #[cfg(not(target_os = "linux"))]
+    let file = {
+        use std::sync::atomic::AtomicU64;
+        static NEXT: AtomicU64 = AtomicU64::new(0);
+        let path = std::env::temp_dir().join(format!(
+            "raw_preview_worker_{}_{}",
+            std::process::id(),
+            NEXT.fetch_add(1, Ordering::Relaxed)
+        ));
+        let file = std::fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(&path)?;
+        std::fs::remove_file(&path)?;
+        file
+    };
+    file.set_len(len as u64)?;
+    Ok(file)
+}
+
+/// Makes fd available as target in the child; called between fork and exec
+fn inherit_fd(fd: libc::c_int, target: libc::c_int) -> io::Result<()> {
+    if unsafe { libc::dup2(fd, target) } < 0 || unsafe { libc::fcntl(target, libc::F_SETFD, 0) } < 0
+    {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+#[cfg(target_os = "linux")]
+type CpuSet = libc::cpu_set_t;
+#[cfg(not(target_os = "linux"))]
+type CpuSet = ();
+
+#[cfg(target_os = "linux")]
+fn cpu_set(cpus: &[usize]) -> Result<Option<CpuSet>, String> {
+    if cpus.is_empty() {
+        return Ok(None);
+    }
+    let mut set: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+    for &cpu in cpus {
+        if cpu >= libc::CPU_SETSIZE as usize {
+            return Err(format!("CPU {} is out of range", cpu));
+        }
+        unsafe { libc::CPU_SET(cpu, &mut set) };
+    }
+    Ok(Some(set))
+}
+
+#[cfg(not(target_os = "linux"))]
+fn cpu_set(cpus: &[usize]) -> Result<Option<CpuSet>, String> {
+    if cpus.is_empty() {
+        Ok(None)
+    } else {
+        Err("Pinning the worker to CPUs is only supported on Linux".to_string())
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn pin_to(set: &CpuSet) -> io::Result<()> {
+    if unsafe { libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), set) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin_to(_set: &CpuSet) -> io::Result<()> {
+    Ok(())
+}
+
+/// Client side of a worker process
+///
+/// Owns the shared ring and the worker; dropping the client stops the
+/// worker, abandoning any conversion in progress.
+pub struct WorkerClient {
+    options: WorkerOptions,
+    layout: Layout,
+    map: SharedMap,
+    cpus: Option<CpuSet>,
+    process: Option<(Child, UnixStream)>,
+}
+
+impl WorkerClient {
+    /// Creates the shared ring and starts a worker process
+    pub fn spawn(options: WorkerOptions) -> Result<Self, String> {
+        let threads = options.threads.max(1);
+        let slots = if options.slots == 0 {
+            threads * 2
+        } else {
+            options.slots
+        };
+        let layout = Layout {
+            slot_count: slots,
+            slot_size: align_up(options.slot_size.max(PAGE_SIZE), PAGE_SIZE),
+        };
+        if slots > u32::MAX as usize / 2 {
+            return Err("Too many worker slots".to_string());
+        }
+        let len = layout
+            .total_size()
+            .ok_or_else(|| "Worker ring does not fit in memory".to_string())?;
+        let cpus = cpu_set(&options.cpus)?;
+
+        let file = create_shared_file(len)
+            .map_err(|e| format!("Failed to create worker shared memory: {}", e))?;
+        let map = SharedMap::new(file, len)
+            .map_err(|e| format!("Failed to map worker shared memory: {}", e))?;
+        let header = RingHeader {
+            magic: RING_MAGIC,
+            version: RING_VERSION,
+            slot_count: slots as u32,
+            threads: threads as u32,
+            slot_size: layout.slot_size as u64,
+            crate_version: crate_version(),
+        };
+        unsafe { std::ptr::write(map.ptr as *mut RingHeader, header) };
+
+        let mut client = Self {
+            options,
+            layout,
+            map,
+            cpus,
+            process: None,
+        };
+        client.start()?;
+        Ok(client)
+    }
+
+    /// Returns `true` if the worker process is running; a stopped worker is
+    /// restarted by the next request
+    pub fn is_running(&self) -> bool {
+        self.process.is_some()
+    }
+
+    /// Converts one input, like [`process_any_image_with_options`](crate::process_any_image_with_options)
+    /// for paths or the `*_bytes_to_vec_with_options` functions for bytes
+    ///
+    /// The JPEG stays in shared memory until the next call on the client.
+    pub fn convert(
+        &mut self,
+        input: WorkerInput<'_>,
+        options: &PreviewOptions,
+    ) -> Result<WorkerOutput<'_>, String> {
+        self.start()?;
+        self.submit(0, input, &NativePreviewOptions::from(options))?;
+        let slot = self.wait_any()?;
+        if slot != 0 {
+            return Err(self.fail("Worker answered for a request that was not sent"));
+        }
+        self.read_output(slot)
+    }
+
+    /// Converts a sequence of inputs, keeping every slot of the ring busy
+    ///
+    /// `on_result` receives the position of each input in `inputs` and its
+    /// result, in completion order; the JPEG it borrows is reused once it
+    /// returns. When the worker dies, every input it was converting fails
+    /// and a new worker takes the remaining ones.
+    pub fn convert_all<'i, I, F>(&mut self, inputs: I, options: &PreviewOptions, mut on_result: F)
+    where
+        I: IntoIterator<Item = WorkerInput<'i>>,
+        F: for<'o> FnMut(usize, Result<WorkerOutput<'o>, String>),
+    {
+        let native = NativePreviewOptions::from(options);
+        let mut inputs = inputs.into_iter().enumerate();
+        let mut in_flight: Vec<Option<usize>> = vec![None; self.layout.slot_count];
+        let mut exhausted = false;
+
+        loop {
+            while !exhausted {
+                let Some(slot) = in_flight.iter().position(Option::is_none) else {
+                    break;
+                };
+                let Some((index, input)) = inputs.next() else {
+                    exhausted = true;
+                    break;
+                };
+                match self
+                    .start()
+                    .and_then(|()| self.submit(slot, input, &native))
+                {
+                    Ok(()) => in_flight[slot] = Some(index),
+                    Err(e) => {
+                        // A worker that died before answering takes its
+                        // requests along; the next one never sees them
+                        if !self.is_running() {
+                            fail_all(&mut in_flight, &e, &mut on_result);
+                        }
+                        on_result(index, Err(e));
+                    }
+                }
+            }
+            if in_flight.iter().all(Option::is_none) {
+                return;
+            }
+
+            match self.wait_any() {
+                Ok(slot) => match in_flight.get_mut(slot).and_then(Option::take) {
+                    Some(index) => on_result(index, self.read_output(slot)),
+                    None => {
+                        let e = self.fail("Worker answered for a request that was not sent");
+                        fail_all(&mut in_flight, &e, &mut on_result);
+                    }
+                },
+                Err(e) => fail_all(&mut in_flight, &e, &mut on_result),
+            }
+        }
+    }
+
+    /// Starts the worker process unless it is running
+    fn start(&mut self) -> Result<(), String> {
+        if self.process.is_some() {
+            return Ok(());
+        }
+        let (mut ours, theirs) =
+            UnixStream::pair().map_err(|e| format!("Failed to create worker socket: {}", e))?;
+        let shm_fd = self.map.file.as_raw_fd();
+        let socket_fd = theirs.as_raw_fd();
+        let cpus = self.cpus;
+
+        let mut command = Command::new(&self.options.program);
+        command.stdin(Stdio::null()).stdout(Stdio::null());
+        unsafe {
+            command.pre_exec(move || {
+                // Move both descriptors out of the way first, in case one of
+                // them already is 3 or 4
+                let shm = libc::fcntl(shm_fd, libc::F_DUPFD, 10);
+                let socket = libc::fcntl(socket_fd, libc::F_DUPFD, 10);
+                if shm < 0 || socket < 0 {
+                    return Err(io::Error::last_os_error());
+                }
+                inherit_fd(shm, SHM_FD)?;
+                inherit_fd(socket, SOCKET_FD)?;
+                libc::close(shm);
+                libc::close(socket);
+                if let Some(set) = &cpus {
+                    pin_to(set)?;
+                }
+                Ok(())
+            });
+        }
+        let mut child = command.spawn().map_err(|e| {
+            format!(
+                "Failed to start worker '{}': {}",
+                self.options.program.display(),
+                e
+            )
+        })?;
+        drop(theirs);
+
+        let mut ready = [0u8; 4];
+        let handshake = ours
+            .set_read_timeout(Some(HANDSHAKE_TIMEOUT))
+            .and_then(|()| ours.read_exact(&mut ready))
+            .and_then(|()| ours.set_read_timeout(None));
+        if handshake.is_err() || u32::from_le_bytes(ready) != READY {
+            let _ = child.kill();
+            let status = child.wait();
+            return Err(format!(
+                "Worker '{}' did not start ({})",
+                self.options.program.display(),
+                status.map_or_else(|e| e.to_string(), |s| s.to_string())
+            ));
+        }
+        self.process = Some((child, ours));
+        Ok(())
+    }
+
+    /// Writes a request into a free slot and hands it to the worker
+    fn submit(
+        &mut self,
+        slot: usize,
+        input: WorkerInput<'_>,
+        options: &NativePreviewOptions,
+    ) -> Result<(), String> {
+        let (header, data) = unsafe { self.map.slot(&self.layout, slot) };
+        let too_large = |len: u64| {
+            format!(
+                "Input of {} bytes does not fit in a worker slot of {} bytes",
+                len,
+                data.len()
+            )
+        };
+
+        let (kind, len) = match input {
+            WorkerInput::Path(path) => {
+                let read_error =
+                    |e: io::Error| format!("Failed to read '{}': {}", path.display(), e);
+                let mut file = File::open(path).map_err(read_error)?;
+                let len = file.metadata().map_err(read_error)?.len();
+                if len > data.len() as u64 {
+                    return Err(too_large(len));
+                }
+                let bytes = &mut data[..len as usize];
+                file.read_exact(bytes).map_err(read_error)?;
+                let is_raw = match detect_format(bytes) {
+                    Some(format) => format.is_raw(),
+                    None => path
+                        .file_name()
+                        .and_then(|name| name.to_str())
+                        .is_some_and(is_raw_file),
+                };
+                (if is_raw { KIND_RAW } else { KIND_IMAGE }, len as usize)
+            }
+            WorkerInput::RawBytes(bytes) | WorkerInput::ImageBytes(bytes) => {
+                if bytes.len() > data.len() {
+                    return Err(too_large(bytes.len() as u64));
+                }
+                data[..bytes.len()].copy_from_slice(bytes);
+                let kind = if matches!(input, WorkerInput::RawBytes(_)) {
+                    KIND_RAW
+                } else {
+                    KIND_IMAGE
+                };
+                (kind, bytes.len())
+            }
+        };
+
+        header.kind = kind;
+        header.status = 0;
+        header.input_len = len as u64;
+        header.output_offset = 0;
+        header.output_len = 0;
+        header.error_len = 0;
+        header.exif_len = 0;
+        header.options = *options;
+
+        // Publish the slot before its number reaches the worker
+        fence(Ordering::Release);
+        let sent = match &mut self.process {
+            Some((_, socket)) => socket.write_all(&(slot as u32).to_le_bytes()),
+            None => Err(io::ErrorKind::NotConnected.into()),
+        };
+        sent.map_err(|_| self.worker_exited())
+    }
+
+    /// Waits for the worker to complete a request and returns its slot
+    fn wait_any(&mut self) -> Result<usize, String> {
+        let mut reply = [0u8; 4];
+        let read = match &mut self.process {
+            Some((_, socket)) => socket.read_exact(&mut reply),
+            None => Err(io::ErrorKind::NotConnected.into()),
+        };
+        if read.is_err() {
+            return Err(self.worker_exited());
+        }
+        fence(Ordering::Acquire);
+        let slot = u32::from_le_bytes(reply) as usize;
+        if slot >= self.layout.slot_count {
+            return Err(self.fail("Worker answered with an invalid slot"));
+        }
+        Ok(slot)
+    }
+
+    /// Reads the response of a completed slot, checking it against the slot bounds
+    fn read_output(&self, slot: usize) -> Result<WorkerOutput<'_>, String> {
+        let (header, data) = unsafe { self.map.slot(&self.layout, slot) };
+        if header.status != 0 {
+            let len = (header.error_len as usize).min(ERROR_CAPACITY);
+            return Err(String::from_utf8_lossy(&header.error[..len]).into_owned());
+        }
+
+        let offset = header.output_offset as usize;
+        let len = header.output_len as usize;
+        let exif_len = header.exif_len as usize;
+        let jpeg = offset
+            .checked_add(len)
+            .filter(|&end| len > 0 && end <= data.len())
+            .map(|end| &data[offset..end]);
+        let exif = (exif_len <= EXIF_CAPACITY)
+            .then(|| decode_exif(&header.exif[..exif_len]))
+            .flatten();
+        match (jpeg, exif) {
+            (Some(jpeg), Some(exif)) => Ok(WorkerOutput { jpeg, exif }),
+            _ => Err("Worker returned a malformed response".to_string()),
+        }
+    }
+
+    /// Stops the worker after a protocol error and returns the message
+    fn fail(&mut self, message: &str) -> String {
+        if let Some((mut child, _)) = self.process.take() {
+            let _ = child.kill();
+            let _ = child.wait();
+        }
+        message.to_string()
+    }
+
+    /// Reaps a worker whose socket closed and describes how it ended
+    fn worker_exited(&mut self) -> String {
+        match self.process.take() {
+            Some((mut child, socket)) => {
+                drop(socket);
+                let _ = child.kill();
+                match child.wait() {
+                    Ok(status) => format!("Worker process exited ({})", status),
+                    Err(e) => format!("Worker process exited ({})", e),
+                }
+            }
+            None => "Worker process is not running".to_string(),
+        }
+    }
+}
+
+fn fail_all<F>(in_flight: &mut [Option<usize>], error: &str, on_result: &mut F)
+where
+    F: for<'o> FnMut(usize, Result<WorkerOutput<'o>, String>),
+{
+    for index in in_flight.iter_mut().filter_map(Option::take) {
+        on_result(index, Err(error.to_string()));
+    }
+}
+
+impl Drop for WorkerClient {
+    fn drop(&mut self) {
+        if let Some((mut child, socket)) = self.process.take() {
+            drop(socket);
+            let _ = child.kill();
+            let _ = child.wait();
+        }
+    }
+}
+
+/// JPEG destination of a slot, for the native allocator
+struct OutputRegion {
+    ptr: *mut u8,
+    capacity: usize,
+    // Largest size the encoder asked for
+    requested: usize,
+}
+
+/// Native allocator handing out an [`OutputRegion`], if large enough
+unsafe extern "C" fn slot_output_alloc(user_data: *mut c_void, size: usize) -> *mut u8 {
+    let region = unsafe { &mut *(user_data as *mut OutputRegion) };
+    region.requested = region.requested.max(size);
+    if size > region.capacity {
+        std::ptr::null_mut()
+    } else {
+        region.ptr
+    }
+}
+
+/// Copies as much of message as fits into buffer and returns the length
+fn copy_message(buffer: &mut [u8], message: &str) -> u32 {
+    let mut len = message.len().min(buffer.len());
+    while !message.is_char_boundary(len) {
+        len -= 1;
+    }
+    buffer[..len].copy_from_slice(&message.as_bytes()[..len]);
+    len as u32
+}
+
+/// Entry point of the `raw_preview_worker` executable
+///
+/// Serves the ring it inherits from [`WorkerClient`] until the client goes
+/// away. Not meant to be called otherwise.
+pub fn serve() -> Result<(), String> {
+    let mut socket = unsafe { UnixStream::from_raw_fd(SOCKET_FD) };
+    let file = unsafe { File::from_raw_fd(SHM_FD) };
+    let len = file
+        .metadata()
+        .map_err(|e| format!("No shared memory from the client: {}", e))?
+        .len() as usize;
+    if len < HEADER_SIZE {
+        return Err("Shared memory too small".to_string());
+    }
+    let map =
+        SharedMap::new(file, len).map_err(|e| format!("Failed to map shared memory: {}", e))?;
+
+    let header = unsafe { std::ptr::read(map.ptr as *const RingHeader) };
+    if header.magic != RING_MAGIC
+        || header.version != RING_VERSION
+        || header.crate_version != crate_version()
+    {
+        return Err("The client was built from another version of raw_preview_rs".to_string());
+    }
+    let layout = Layout {
+        slot_count: header.slot_count as usize,
+        slot_size: header.slot_size as usize,
+    };
+    if layout.total_size().is_none_or(|size| size > len) {
+        return Err("Shared memory does not hold the announced slots".to_string());
+    }
+
+    let replies = Mutex::new(
+        socket
+            .try_clone()
+            .map_err(|e| format!("Failed to clone the socket: {}", e))?,
+    );
+    socket
+        .write_all(&READY.to_le_bytes())
+        .map_err(|e| format!("Failed to reach the client: {}", e))?;
+
+    let (sender, receiver) = mpsc::channel::<usize>();
+    let receiver = Arc::new(Mutex::new(receiver));
+    std::thread::scope(|scope| {
+        for _ in 0..header.threads.max(1) {
+            let receiver = Arc::clone(&receiver);
+            let (map, replies) = (&map, &replies);
+            scope.spawn(move || serve_requests(map, &layout, &receiver, replies));
+        }
+
+        let mut request = [0u8; 4];
+        while socket.read_exact(&mut request).is_ok() {
+            let slot = u32::from_le_bytes(request) as usize;
+            if slot >= layout.slot_count || sender.send(slot).is_err() {
+                break;
+            }
+        }
+        // Closing the channel lets the threads finish
+        drop(sender);
+    });
+    Ok(())
+}
+
+/// Conversion thread of the worker
+fn serve_requests(
+    map: &SharedMap,
+    layout: &Layout,
+    receiver: &Mutex<mpsc::Receiver<usize>>,
+    replies: &Mutex<UnixStream>,
+) {
+    let mut context: Option<Result<RawPreviewContext, String>> = None;
+    loop {
+        let Ok(slot) = receiver.lock().unwrap().recv() else {
+            return;
+        };
+        fence(Ordering::Acquire);
+        serve_slot(map, layout, slot, &mut context);
+        fence(Ordering::Release);
+        if replies
+            .lock()
+            .unwrap()
+            .write_all(&(slot as u32).to_le_bytes())
+            .is_err()
+        {
+            // The client is gone
+            std::process::exit(0);
+        }
+    }
+}
+
+/// Converts the request of one slot and writes the response next to it
+fn serve_slot(
+    map: &SharedMap,
+    layout: &Layout,
+    slot: usize,
+    context: &mut Option<Result<RawPreviewContext, String>>,
+) {
+    let (header, data) = unsafe { map.slot(layout, slot) };
+    let input_len = (header.input_len as usize).min(data.len());
+    let output_offset = align_up(input_len, OUTPUT_ALIGN).min(data.len());
+    let (input, output) = data.split_at_mut(output_offset);
+    let input = &input[..input_len];
+
+    let mut region = OutputRegion {
+        ptr: output.as_mut_ptr(),
+        capacity: output.len(),
+        requested: 0,
+    };
+    let region_ptr = &mut region as *mut OutputRegion as *mut c_void;
+    let options = header.options;
+    let kind = header.kind;
+    let result = panic::catch_unwind(AssertUnwindSafe(|| match kind {
+        KIND_RAW => or_tiff_image(
+            match context.get_or_insert_with(RawPreviewContext::new) {
+                Ok(context) => unsafe {
+                    context.convert_bytes_with_alloc(input, &options, slot_output_alloc, region_ptr)
+                },
+                Err(e) => Err(e.clone()),
+            },
+            || detect_format(input),
+            || unsafe {
+                process_image_bytes_with_alloc(input, &options, slot_output_alloc, region_ptr)
+            },
+        ),
+        KIND_IMAGE => unsafe {
+            process_image_bytes_with_alloc(input, &options, slot_output_alloc, region_ptr)
+        },
+        _ => Err("Unknown worker request".to_string()),
+    }))
+    .unwrap_or_else(|_| Err("Conversion panicked".to_string()));
+
+    let result = match result {
+        Ok((len, exif)) if len > 0 && len <= region.capacity => {
+            let exif = encode_exif(&exif);
+            if exif.len() <= EXIF_CAPACITY {
+                Ok((len, exif))
+            } else {
+                Err("Metadata too large for the worker response".to_string())
+            }
+        }
+        Ok(_) => Err("No JPEG data returned".to_string()),
+        Err(_) if region.requested > region.capacity => Err(format!(
+            "The JPEG may need {} bytes but the worker slot has {} left after the input",
+            region.requested, region.capacity
+        )),
+        Err(e) => Err(e),
+    };
+
+    match result {
+        Ok((len, exif)) => {
+            header.status = 0;
+            header.output_offset = output_offset as u64;
+            header.output_len = len as u64;
+            header.exif[..exif.len()].copy_from_slice(&exif);
+            header.exif_len = exif.len() as u32;
+        }
+        Err(e) => {
+            header.status = 1;
+            header.error_len = copy_message(&mut header.error, &e);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_layout() {
+        let layout = Layout {
+            slot_count: 3,
+            slot_size: 8 * PAGE_SIZE,
+        };
+        assert!(std::mem::size_of::<RingHeader>() <= HEADER_SIZE);
+        assert_eq!(layout.slot_offset(0), HEADER_SIZE);
+        assert_eq!(layout.data_offset(0) % PAGE_SIZE, 0);
+        assert_eq!(
+            layout.slot_offset(1),
+            layout.data_offset(0) + layout.slot_size
+        );
+        assert_eq!(layout.total_size(), Some(layout.slot_offset(3)));
+
+        let huge = Layout {
+            slot_count: usize::MAX / 2,
+            slot_size: 1 << 20,
+        };
+        assert_eq!(huge.total_size(), None);
+    }
+
+    #[test]
+    fn test_slot_output_alloc() {
+        let mut buffer = [0u8; 128];
+        let mut region = OutputRegion {
+            ptr: buffer.as_mut_ptr(),
+            capacity: buffer.len(),
+            requested: 0,
+        };
+        let user_data = &mut region as *mut OutputRegion as *mut c_void;
+        assert_eq!(
+            unsafe { slot_output_alloc(user_data, 64) },
+            buffer.as_mut_ptr()
+        );
+        assert!(unsafe { slot_output_alloc(user_data, 256) }.is_null());
+        assert_eq!(region.requested, 256);
+    }
+
+    #[test]
+    fn test_copy_message() {
+        let mut buffer = [0u8; 4];
+        assert_eq!(copy_message(&mut buffer, "ab"), 2);
+        // Truncated on a character boundary
+        assert_eq!(copy_message(&mut buffer, "abcé"), 3);
+        assert_eq!(&buffer[..3], b"abc");
+    }
+
+    #[test]
+    fn test_shared_map() {
+        let file = create_shared_file(2 * PAGE_SIZE).unwrap();
+        let map = SharedMap::new(file, 2 * PAGE_SIZE).unwrap();
+        unsafe { *map.ptr.add(PAGE_SIZE) = 7 };
+        assert_eq!(unsafe { *map.ptr.add(PAGE_SIZE) }, 7);
+    }
+
+    #[test]
+    fn test_spawn_missing_program() {
+        let result = WorkerClient::spawn(WorkerOptions {
+            program: PathBuf::from("/nonexistent/raw_preview_worker"),
+            slot_size: PAGE_SIZE,
+            ..Default::default()
+        });
+        assert!(result.err().unwrap().contains("Failed to start worker"));
+    }
+
+    #[test]
+    fn test_convert_all_survives_worker_exit() {
+        // Fake worker: the first instance takes one request and exits
+        // without answering, later ones echo every slot number back
+        let program =
+            std::env::temp_dir().join(format!("raw_preview_fake_worker_{}", std::process::id()));
+        let marker = program.with_extension("started");
+        let _ = std::fs::remove_file(&marker);
+        std::fs::write(
+            &program,
+            format!(
+                "#!/bin/sh\nprintf '\\377\\377\\377\\377' >&4\n\
+                 if [ -e '{0}' ]; then exec cat <&4 >&4; fi\n\
+                 touch '{0}'\nhead -c 4 <&4 >/dev/null\n",
+                marker.display()
+            ),
+        )
+        .unwrap();
+        std::fs::set_permissions(
+            &program,
+            std::os::unix::fs::PermissionsExt::from_mode(0o755),
+        )
+        .unwrap();
+
+        let (done, finished) = mpsc::channel();
+        let worker_program = program.clone();
+        std::thread::spawn(move || {
+            let mut worker = WorkerClient::spawn(WorkerOptions {
+                program: worker_program,
+                slots: 4,
+                slot_size: PAGE_SIZE,
+                ..Default::default()
+            })
+            .unwrap();
+            // The pause lets the first worker exit, so a submit notices it
+            // while the first requests are still in flight
+            let inputs = (0..8).map(|i| {
+                if i == 2 {
+                    std::thread::sleep(Duration::from_millis(200));
+                }
+                WorkerInput::ImageBytes(b"not an image")
+            });
+            let mut results = 0;
+            worker.convert_all(inputs, &PreviewOptions::default(), |_, _| results += 1);
+            done.send(results).unwrap();
+        });
+        let results = finished.recv_timeout(Duration::from_secs(30));
+        let _ = std::fs::remove_file(&program);
+        let _ = std::fs::remove_file(&marker);
+        assert_eq!(results, Ok(8));
+    }
+}